@@ -67,6 +67,8 @@ namespace CLRayTracer
 			virtual Common::Result generateContacts(Camera& cam,Common::Errata& err) = 0;
 			/**Generates contacts for rays and fills the contacts array*/
 			virtual Common::Result generateContacts(OpenCLUtils::CLBuffer& rays,OpenCLUtils::CLBuffer& contacts, const unsigned int rayCount, Common::Errata& err) = 0;
+			/**Generates contacts for the active rays of index list only (see StreamCompaction), and fills their entries of the contacts array*/
+			virtual Common::Result generateContacts(OpenCLUtils::CLBuffer& rays,OpenCLUtils::CLBuffer& activeRays,OpenCLUtils::CLBuffer& activeRayCount,OpenCLUtils::CLBuffer& contacts, const unsigned int maxActiveRays, Common::Errata& err) = 0;
 			/**Retrieves the buffer of contacts that were the result of generateContacts functions above*/
 			virtual const boost::shared_ptr<OpenCLUtils::CLBuffer> getPrimaryContacts() const = 0;
 			
@@ -43,6 +43,8 @@ namespace CLRayTracer
 	namespace Common
 	{
 		class BitonicSort;
+		class RaySorter;
+		class Reduction;
 	}
 
 	namespace OpenCLUtils
@@ -100,6 +102,19 @@ namespace CLRayTracer
 			* @return Result of the operation: Success or failure
 			*/
 			virtual Common::Result generateContacts(OpenCLUtils::CLBuffer& rays,OpenCLUtils::CLBuffer& contacts, const unsigned int rayCount, Common::Errata& err);
+
+			/**Generates contacts for the active rays of index list, and fills their entries of the contacts array
+			* @param rays The rays - A device memory buffer object that contains rays as struct Ray
+			* @param activeRays Device buffer of CL_UINT indices of the rays to trace, e.g. as compacted by StreamCompaction
+			* @param activeRayCount Device buffer of single CL_UINT - The number of indices in activeRays
+			* @param contact The target device memory - For each traced ray rays[i] the buffer will contain its contact
+			*                as contacts[i]. Contacts of the other rays are not modified
+			* @param maxActiveRays Upper bound of the number of active rays, by which the work items are launched - Work items
+			*                      beyond the device count exit at once, so the ray count may be passed without readback
+			* @param err Error info
+			* @return Result of the operation: Success or failure
+			*/
+			virtual Common::Result generateContacts(OpenCLUtils::CLBuffer& rays,OpenCLUtils::CLBuffer& activeRays,OpenCLUtils::CLBuffer& activeRayCount,OpenCLUtils::CLBuffer& contacts, const unsigned int maxActiveRays, Common::Errata& err);
 			
 			/***************************************
 			* Properties and utility functions
@@ -107,22 +122,88 @@ namespace CLRayTracer
 			/**Retrieves the buffer of contacts that were the result of generateContacts functions above*/
 			virtual const boost::shared_ptr<OpenCLUtils::CLBuffer> getPrimaryContacts() const { return _primaryContactsArray;}
 
+			/**Retrieves the device buffer, that contains bounding box of the centroids of the primitives as struct AABB.
+			* It is recomputed on device by construct(), together with the bounding box in the scene header
+			*/
+			const boost::shared_ptr<OpenCLUtils::CLBuffer> getCentroidBounds() const { return _centroidBounds;}
+
+			/**Enables persistent threads traversal for general rays: Instead of launching a work item per ray,
+			* just enough work-groups to fill the device are launched, and those fetch batches of rays from a global
+			* work queue until it drains. Usually pays off for incoherent rays (reflections, path tracing).
+			* Disabled by default.
+			* @param enable True to enable persistent threads traversal, false to use work item per ray
+			*/
+			void setPersistentThreadsTraversal(bool enable) { _usePersistentThreads = enable; }
+
+			/**Enables packet traversal for primary rays: Each work-group traces a packet of neighbouring camera rays
+			* with a single traversal stack in local memory, so BVH nodes are fetched once per work-group rather than once per ray.
+			* A node is visited if any ray of the packet hits it, so this pays off for coherent rays only.
+			* Disabled by default.
+			* @param enable True to enable packet traversal of primary rays
+			*/
+			void setPacketTraversal(bool enable) { _usePacketTraversal = enable; }
+
+			/**Enables top-of-tree cache for traversal of rays by work item: The top levels of the BVH are copied into local memory
+			* of each work-group, sized to leave room for several resident work-groups per compute unit. Pays off when traversal
+			* is bound by node fetches rather than by latency. Disabled by default. Takes effect at next construct().
+			* @param enable True to enable top-of-tree cache
+			*/
+			void setTopTreeCache(bool enable) { _useTopTreeCache = enable; }
+
+			/**Enables reordering of general rays before tracing: Rays are sorted by origin and direction octant, traced
+			* in sorted order, and the contacts are scattered back to the original ray indices. Improves coherence of large
+			* batches of incoherent rays, at the cost of sort. Disabled by default.
+			* @param enable True to enable ray reordering
+			*/
+			void setRayReordering(bool enable) { _reorderRays = enable; }
+
 		protected:
 			CL_UINT _mortonBufferItems;
 			CL_ULONG _deviceLocalMemory;
 			CL_UINT _bvhLeavesCount;
+			CL_UINT _topTreeMaxSize;
+			CL_UINT _topTreeSize;
+			bool _usePersistentThreads;
+			bool _usePacketTraversal;
+			bool _useTopTreeCache;
+			bool _reorderRays;
 			boost::shared_ptr<Common::BitonicSort> _bitonicSorter;
+			boost::shared_ptr<Common::RaySorter> _raySorter;
+			boost::shared_ptr<Common::Reduction> _reduction;
 			boost::shared_ptr<OpenCLUtils::CLBuffer> _bvhNodes;
 			boost::shared_ptr<OpenCLUtils::CLBuffer> _sortedMortonCodes;
 			boost::shared_ptr<OpenCLUtils::CLBuffer> _nodeVisitCounters;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _primitiveBounds;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _primitiveCentroids;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _centroidBounds;
 			boost::shared_ptr<OpenCLUtils::CLBuffer> _primaryContactsArray;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _sortedContactsArray;
 			boost::shared_ptr<OpenCLUtils::CLBuffer> _deviceCamera;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _rayQueueHead;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _topTreeNodes;
 			boost::shared_ptr<OpenCLUtils::CLProgram> _bvhProgram;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _primitiveBoundsKernel;
 			boost::shared_ptr<OpenCLUtils::CLKernel> _mortonCalcKernel;
 			boost::shared_ptr<OpenCLUtils::CLKernel> _radixTreeBuildKernel;
 			boost::shared_ptr<OpenCLUtils::CLKernel> _bbCalcKernel;
 			boost::shared_ptr<OpenCLUtils::CLKernel> _contactGenerateKernel;
 			boost::shared_ptr<OpenCLUtils::CLKernel> _contactGenerateKernel2;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _indexedContactGenerateKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _persistentContactGenerateKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _packetContactGenerateKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _topTreeBuildKernel;
+
+			/**Computes scene bounds into the scene header, and centroid bounds, on device - See construct*/
+			Common::Result computeSceneBounds(Common::Errata& err);
+
+			/**Traces rays in the order they are stored - See generateContacts*/
+			Common::Result traceRays(OpenCLUtils::CLBuffer& rays,OpenCLUtils::CLBuffer& contacts, const unsigned int rayCount, Common::Errata& err);
+
+			/**Generates contacts for rays with persistent threads kernel - See setPersistentThreadsTraversal*/
+			Common::Result generateContactsPersistent(OpenCLUtils::CLBuffer& rays,OpenCLUtils::CLBuffer& contacts, const unsigned int rayCount, Common::Errata& err);
+
+			/**Sets top-of-tree cache arguments of traversal kernel, starting at given argument index*/
+			Common::Result setTopTreeKernelArgs(OpenCLUtils::CLKernel& kernel, CL_UINT firstArgIndex, Common::Errata& err);
 		};
 	}
 }
@@ -40,6 +40,7 @@ namespace CLRayTracer
 	{
 		class CLProgram;
 		class CLKernel;
+		class CLBuffer;
 	}
 
 	namespace Common
@@ -57,29 +58,45 @@ namespace CLRayTracer
 			 */
 			Common::Result initialize(Common::Errata& err);
 
-			/**Computes prefix sun of device array
-			 * By default, this futnction assumes that the values are unsigned ints
+			/**Kinds of prefix sum: Inclusive sums include the item at the index, exclusive ones do not*/
+			enum ScanMode { Inclusive, Exclusive };
+
+			/**Types of the items: CL_UINT, or CL_UINT2 summed per component*/
+			enum ItemType { UIntItems, UInt2Items, ItemTypesCount };
+
+			/**Computes inclusive prefix sum of device array of unsigned ints
 			 * @param inputBuffer The input for the algorithm - Array of unsigned integers
 			 * @param outputBuffer The output of the algorithm - The prefix sum
-			 * @param size Number of items in the input array - Must be power of two
+			 * @param size Number of items in the input array
 			 * @param [out]err Error info, filled in case there is an error
 			 * @return Result, that indicates whether the operation succeeded or failed
 			 **/
 			Common::Result computePrefixSum(cl_mem inputBuffer,cl_mem outputBuffer,size_t size,Common::Errata& err);
 
+			/**Computes prefix sum of device array
+			 * The sum is computed by single kernel launch, which is enqueued without waiting for completion - Commands
+			 * enqueued afterwards, including blocking reads, see the result
+			 * @param inputBuffer The input for the algorithm
+			 * @param outputBuffer The output of the algorithm - The prefix sum. May be the same as the input
+			 * @param size Number of items in the input array
+			 * @param mode Inclusive or exclusive prefix sum
+			 * @param type Type of the items
+			 * @param [out]err Error info, filled in case there is an error
+			 * @return Result, that indicates whether the operation succeeded or failed
+			 **/
+			Common::Result computePrefixSum(cl_mem inputBuffer,cl_mem outputBuffer,size_t size,ScanMode mode,ItemType type,Common::Errata& err);
+
 		private:
-			Common::Result invokeGroupKernel(CL_UINT offset,CL_UINT length,Common::Errata& err);
-			Common::Result invokeGlobalKernel(CL_UINT offset,CL_UINT length,Common::Errata& err);
 			const OpenCLUtils::CLExecutionContext& _context;
-			boost::shared_ptr<OpenCLUtils::CLProgram> _prefixSumProgram;
-			boost::shared_ptr<OpenCLUtils::CLKernel> _groupKernel;
-			boost::shared_ptr<OpenCLUtils::CLKernel> _globalKernel;
-			CL_ULONG _deviceLocalMemory;
-			size_t _deviceProcessors;
-			size_t _deviceWavefront;
+			boost::shared_ptr<OpenCLUtils::CLProgram> _prefixSumPrograms[ItemTypesCount];
+			boost::shared_ptr<OpenCLUtils::CLKernel> _scanKernels[ItemTypesCount];
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _blockStatus;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _blockAggregates;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _blockPrefixes;
+			CL_UINT _blocksCapacity;
+			CL_UINT _epoch;
 			size_t _maxWorkgroupSize;
-			cl_mem _inputBuffer;
-			cl_mem _outputBuffer;
+			size_t _workgroupSize;
 		};
 	}
 }
@@ -0,0 +1,115 @@
+/**
+ * @file RadixSort.h
+ * @author  Timur Sizov <timorgizer@gmail.com>
+ * @version 0.6
+ *
+ * @section LICENSE
+ *
+ * Copyright (c) 2016 Timur Sizov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software 
+ * without restriction, including without limitation the rights to use, copy, modify, merge, 
+ * publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons 
+ * to whom the Software is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE 
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * @section DESCRIPTION
+ *
+ * class RadixSort - Host interface class to GPU implementation of LSD Radix Sort
+ *
+ *  @implNote Each pass sorts by a digit of RADIX_BITS bits: Every work group counts the digits of its block in local memory,
+ *            block histograms are scanned by PrefixSum, and every block is sorted stably in local memory before it is
+ *            scattered, so that writes to the output are coalesced per digit.
+ *            The approach follows: Satish, Harris, Garland - "Designing Efficient Sorting Algorithms for Manycore GPUs"
+ *
+ */
+
+#ifndef CL_RT_RADIXSORT
+#define CL_RT_RADIXSORT
+
+#include <boost\smart_ptr.hpp>
+#include <OpenCLUtils\CLInterface.h>
+#include <CLData\CLPortability.h>
+
+namespace CLRayTracer
+{
+	namespace OpenCLUtils
+	{
+		class CLProgram;
+		class CLKernel;
+		class CLBuffer;
+	}
+
+	namespace Common
+	{
+		class PrefixSum;
+
+		/** 
+		* class RadixSort Provides host interface for GPU implementation of LSD Radix Sort
+		* Unlike BitonicSort, any number of items can be sorted, and only the requested range of key bits is processed.
+		* The sort is stable: Items with equal keys keep their relative order
+		*/
+		class RadixSort
+		{
+		public:
+			/**Constructor
+			* @param context OpenCL execution context
+			* @param useKeyValue Indicates whether the sorted items are Key/Value pairs (CL_UINT2 or CL_ULONG2, key in x) or 
+			*                    single keys (CL_UINT or CL_ULONG)
+			* @param use64BitKeys Indicates whether the keys (and values) are 64 bit wide
+			*/
+			RadixSort(const OpenCLUtils::CLExecutionContext& context,const bool useKeyValue,const bool use64BitKeys = false);
+			
+			/**Initialize
+			* Performs initialization of a RadixSort instance. Must be called once per instance
+			* @param [out] err Error info, in case error occurred
+			* @return Result, that indicates whether the operation succeeded or failed
+			*/
+			Result initialize(Errata& err);
+			
+			/**Sorts the input array by all bits of the keys
+			* @param input Device pointer to array that shoud be sorted
+			* @param num_items Number of items in array to be sorted
+			* @param [out] err Error info, in case error occurred
+			* @return Result, that indicates whether the operation succeeded or failed
+			*/
+			Result sort(cl_mem input,size_t num_items,Errata& err);
+
+			/**Sorts the input array by range of key bits - Bits outside of the range are ignored
+			* Every RADIX_BITS bits of the range take one pass, e.g. 30 bit Morton codes are sorted with beginBit = 0 and endBit = 30
+			* @param input Device pointer to array that shoud be sorted
+			* @param num_items Number of items in array to be sorted
+			* @param beginBit Least significant key bit to sort by
+			* @param endBit The bit after the most significant key bit to sort by
+			* @param [out] err Error info, in case error occurred
+			* @return Result, that indicates whether the operation succeeded or failed
+			*/
+			Result sort(cl_mem input,size_t num_items,CL_UINT beginBit,CL_UINT endBit,Errata& err);
+
+		private:
+			Result launchKernel(OpenCLUtils::CLKernel& kernel,size_t blocksCount,Errata& err);
+			const OpenCLUtils::CLExecutionContext& _context;
+			boost::shared_ptr<Common::PrefixSum> _prefixSumCalculator;
+			boost::shared_ptr<OpenCLUtils::CLProgram> _sortingProgram;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _histogramKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _scatterKernel;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _temp;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _histogram;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _histogramScan;
+			size_t _maxWorkgroupSize;
+			size_t _blockSize;
+			bool _useKeyValue;
+			bool _use64BitKeys;
+		};
+	}
+}
+
+#endif //CL_RT_RADIXSORT
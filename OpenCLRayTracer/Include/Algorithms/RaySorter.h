@@ -0,0 +1,104 @@
+/**
+ * @file RaySorter.h
+ * @author  Timur Sizov <timorgizer@gmail.com>
+ * @version 0.6
+ *
+ * @section LICENSE
+ *
+ * Copyright (c) 2016 Timur Sizov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software 
+ * without restriction, including without limitation the rights to use, copy, modify, merge, 
+ * publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons 
+ * to whom the Software is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE 
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * @section DESCRIPTION
+ *
+ * class RaySorter - Host interface class for GPU reordering of ray batches by ray coherence,
+ * in order to improve the coherence of memory accesses and reduce SIMD divergence while tracing
+ * large batches of incoherent rays
+ * 
+ */
+
+#ifndef CL_RT_RAYSORTER
+#define CL_RT_RAYSORTER
+
+#include <boost\smart_ptr.hpp>
+#include <OpenCLUtils\CLInterface.h>
+#include <CLData\CLPortability.h>
+
+namespace CLRayTracer
+{
+	namespace OpenCLUtils
+	{
+		class CLProgram;
+		class CLKernel;
+		class CLBuffer;
+	}
+
+	namespace Common
+	{
+		class RadixSort;
+
+		/**class RaySorter - Reorders ray batches by coherence key: Quantized Morton code of ray origin, and direction octant
+		* Usage: reorder() the rays, trace getSortedRays() into a temporary contacts buffer, then restoreOrder() of the contacts
+		*/
+		class RaySorter
+		{
+		public:
+			/**constructor*/
+			RaySorter(const OpenCLUtils::CLExecutionContext& context);
+
+			/**Initializes the instance of RaySorter
+			 * @param [out]err Error info, filled in case there is an error
+			 * @return Result, that indicates whether the operation succeeded or failed
+			 */
+			Common::Result initialize(Common::Errata& err);
+
+			/**Sorts the rays by coherence key, and gathers them in sorted order to the buffer returned by getSortedRays()
+			 * @param rays Device array of rays (struct Ray)
+			 * @param rayCount Number of rays in the array
+			 * @param scene Device buffer that contains the scene - Its bounding box is used for origin quantization
+			 * @param [out]err Error info, filled in case there is an error
+			 * @return Result, that indicates whether the operation succeeded or failed
+			 **/
+			Common::Result reorder(cl_mem rays,CL_UINT rayCount,cl_mem scene,Common::Errata& err);
+
+			/**Scatters contacts of sorted rays back to the indices of the rays before reordering
+			 * @param sortedContacts Device array of contacts (struct Contact), as generated for getSortedRays()
+			 * @param contacts Device array of contacts, that will contain the contact of rays[i] at index i
+			 * @param rayCount Number of rays, as passed to the last call to reorder()
+			 * @param [out]err Error info, filled in case there is an error
+			 * @return Result, that indicates whether the operation succeeded or failed
+			 **/
+			Common::Result restoreOrder(cl_mem sortedContacts,cl_mem contacts,CL_UINT rayCount,Common::Errata& err);
+
+			/**Retrieves the rays, sorted by the last call to reorder()*/
+			const boost::shared_ptr<OpenCLUtils::CLBuffer> getSortedRays() const { return _sortedRays; }
+
+		private:
+			Common::Result launchKernel(OpenCLUtils::CLKernel& kernel,CL_UINT workItems,Common::Errata& err);
+			const OpenCLUtils::CLExecutionContext& _context;
+			boost::shared_ptr<Common::RadixSort> _radixSorter;
+			boost::shared_ptr<OpenCLUtils::CLProgram> _raySorterProgram;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _keysKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _gatherKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _scatterKernel;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _keys;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _sortedRays;
+			size_t _deviceProcessors;
+			size_t _deviceWavefront;
+		};
+	}
+}
+
+#endif //CL_RT_RAYSORTER
\ No newline at end of file
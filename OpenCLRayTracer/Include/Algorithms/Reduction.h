@@ -0,0 +1,97 @@
+/**
+ * @file Reduction.h
+ * @author  Timur Sizov <timorgizer@gmail.com>
+ * @version 0.6
+ *
+ * @section LICENSE
+ *
+ * Copyright (c) 2016 Timur Sizov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software 
+ * without restriction, including without limitation the rights to use, copy, modify, merge, 
+ * publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons 
+ * to whom the Software is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE 
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * @section DESCRIPTION
+ *
+ * class Reduction - Host interface class for GPU parallel reduction
+ * 
+ */
+#ifndef CL_RT_REDUCTION
+#define CL_RT_REDUCTION
+
+#include <boost\smart_ptr.hpp>
+#include <OpenCLUtils\CLInterface.h>
+#include <CLData\CLPortability.h>
+
+namespace CLRayTracer
+{
+	namespace OpenCLUtils
+	{
+		class CLProgram;
+		class CLKernel;
+		class CLBuffer;
+	}
+
+	namespace Common
+	{
+		/**class Reduction - Reduces device array to single value by associative operator: Bounds of boxes or points,
+		* sums and counts. The result is written to device memory, at any offset of any buffer, so it may be used
+		* by following kernels without readback - e.g. the bounds of the scene in the header of the scene buffer
+		*/
+		class Reduction
+		{
+		public:
+			/**constructor*/
+			Reduction(const OpenCLUtils::CLExecutionContext& context);
+
+			/**Initializes the instance of Reduction
+			 * @param [out]err Error info, filled in case there is an error
+			 * @return Result, that indicates whether the operation succeeded or failed
+			 */
+			Common::Result initialize(Common::Errata& err);
+
+			/**Reduction operators, by type of input items and of the result:
+			 * MinFloat4, MaxFloat4 - Per component minimum and maximum of CL_FLOAT4 items, e.g. bounds of points
+			 * MergeAABB - Union of struct AABB items
+			 * SumUInt, SumFloat - Sum of CL_UINT or CL_FLOAT items
+			 * CountNonZero - Number of nonzero CL_UINT items, as CL_UINT
+			 * The reduction of empty array is the identity of the operator - e.g. empty box for MergeAABB
+			 */
+			enum Operator { MinFloat4, MaxFloat4, MergeAABB, SumUInt, SumFloat, CountNonZero, OperatorsCount };
+
+			/**Reduces device array
+			 * The reduction is enqueued without waiting for completion - Commands enqueued afterwards,
+			 * including blocking reads, see the result
+			 * @param input Device array of items of the operator type
+			 * @param count Number of items in the array
+			 * @param op The operator
+			 * @param output Device buffer, that will contain the result
+			 * @param outputOffset Offset of the result in the output buffer, in bytes - Must be aligned to the result type
+			 * @param [out]err Error info, filled in case there is an error
+			 * @return Result, that indicates whether the operation succeeded or failed
+			 **/
+			Common::Result reduce(cl_mem input,CL_UINT count,Operator op,cl_mem output,CL_UINT outputOffset,Common::Errata& err);
+
+		private:
+			Common::Result launchKernel(Operator op,cl_mem input,CL_UINT count,cl_mem output,CL_UINT outputOffset,CL_UINT groups,Common::Errata& err);
+			const OpenCLUtils::CLExecutionContext& _context;
+			boost::shared_ptr<OpenCLUtils::CLProgram> _reductionPrograms[OperatorsCount];
+			boost::shared_ptr<OpenCLUtils::CLKernel> _reduceKernels[OperatorsCount];
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _partials;
+			size_t _maxWorkgroupSize;
+			size_t _workgroupSize;
+		};
+	}
+}
+
+#endif //CL_RT_REDUCTION
@@ -27,6 +27,7 @@
  *
  *  @implNote The GPU kernels were taken from this source: http://www.bealto.com/gpu-sorting_parallel-merge-local.html
  *            and the interface class was implemented according to the source above.
+ *            The choice of kernels and work group sizes is tuned per device on initialization, as in the source above.
  *
  */
 
@@ -63,6 +64,7 @@ namespace CLRayTracer
 			
 			/**Initialize
 			* Performs initialization of a BitonicSort instance. Must be called once per instance
+			* On first initialization for a device and item type, the sorting plan is tuned by timing sample sorts
 			* @param [out] err Error info, in case error occurred
 			* @return Result, that indicates whether the operation succeeded or failed
 			*/
@@ -75,13 +77,36 @@ namespace CLRayTracer
 			* @return Result, that indicates whether the operation succeeded or failed
 			*/
 			Result sort(cl_mem input,size_t num_items,Errata& err);
+
+			/**
+			* struct SortPlan - Kernels and work group sizes, that are used for sorting
+			*/
+			struct SortPlan
+			{
+				//Merge stages per launch of global memory kernel: 1 to 4 - Kernels B2 to B16
+				int globalStages;
+				size_t globalWorkgroupSize;
+				//Kernel that performs the last merge stages of each length in local memory: C2, C4, or none (-1)
+				int localKernel;
+				size_t localWorkgroupSize;
+				//Size of blocks that are sorted in local memory before the merges, or 0 for none
+				size_t blockSortSize;
+			};
+
+			/**Retrieves the plan used for sorting - Valid after initialization*/
+			const SortPlan& getPlan() const { return _plan; }
 		private:
+			Result tunePlan(Errata& err);
+			Result timePlan(const SortPlan& plan,cl_mem sample,cl_mem unsorted,size_t num_items,double& time,Errata& err);
+			Result runPlan(const SortPlan& plan,cl_mem input,size_t num_items,Errata& err);
+			Result launchKernel(OpenCLUtils::CLKernel& kernel,size_t globalThreads,size_t localThreads,Errata& err);
 			const OpenCLUtils::CLExecutionContext& _context;
 			boost::shared_ptr<OpenCLUtils::CLProgram> _sortingProgram;
 			boost::shared_array<boost::shared_ptr<OpenCLUtils::CLKernel> > _sortingKernels;
 			size_t _maxWorkgroupSize;
 			CL_ULONG _deviceLocalMemory;
 			bool _useKeyValue;
+			SortPlan _plan;
 		};
 	}
 }
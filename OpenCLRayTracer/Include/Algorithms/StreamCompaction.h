@@ -0,0 +1,115 @@
+/**
+ * @file StreamCompaction.h
+ * @author  Timur Sizov <timorgizer@gmail.com>
+ * @version 0.6
+ *
+ * @section LICENSE
+ *
+ * Copyright (c) 2016 Timur Sizov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software 
+ * without restriction, including without limitation the rights to use, copy, modify, merge, 
+ * publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons 
+ * to whom the Software is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE 
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * @section DESCRIPTION
+ *
+ * class StreamCompaction - Host interface class for GPU stream compaction: Builds dense lists of indices of the items
+ * that satisfy a predicate, e.g. the rays that are still active after a bounce
+ * 
+ */
+
+#ifndef CL_RT_STREAMCOMPACTION
+#define CL_RT_STREAMCOMPACTION
+
+#include <boost\smart_ptr.hpp>
+#include <OpenCLUtils\CLInterface.h>
+#include <CLData\CLPortability.h>
+
+namespace CLRayTracer
+{
+	namespace OpenCLUtils
+	{
+		class CLProgram;
+		class CLKernel;
+		class CLBuffer;
+	}
+
+	namespace Common
+	{
+		class PrefixSum;
+
+		/**class StreamCompaction - Compacts indices of the items that satisfy a predicate into a dense list:
+		* The items are flagged, the flags are scanned by PrefixSum, and the indices of the flagged items are scattered
+		* to the offsets. The number of the compacted items is written to device memory, so no readback is needed.
+		* Usage: compactActiveRays() of a ray buffer, then trace only the active rays by the overload of
+		* AccelerationStructureManager::generateContacts that takes the index list
+		*/
+		class StreamCompaction
+		{
+		public:
+			/**constructor*/
+			StreamCompaction(const OpenCLUtils::CLExecutionContext& context);
+
+			/**Initializes the instance of StreamCompaction
+			 * @param [out]err Error info, filled in case there is an error
+			 * @return Result, that indicates whether the operation succeeded or failed
+			 */
+			Common::Result initialize(Common::Errata& err);
+
+			/**Flags the active rays: Rays with nonempty parameter range (tMin < tMax). A ray is terminated by setting its
+			 * tMax to tMin or less
+			 * @param rays Device array of rays (struct Ray)
+			 * @param rayCount Number of rays in the array
+			 * @param flags Device array of CL_UINT flags, that will contain 1 for active rays, and 0 for the rest
+			 * @param [out]err Error info, filled in case there is an error
+			 * @return Result, that indicates whether the operation succeeded or failed
+			 **/
+			Common::Result flagActiveRays(cl_mem rays,CL_UINT rayCount,cl_mem flags,Common::Errata& err);
+
+			/**Compacts the indices of the flagged items
+			 * @param flags Device array of CL_UINT flags - 1 for the items to keep, 0 for the rest
+			 * @param count Number of flags
+			 * @param indices Device array of CL_UINT, at least count long, that will contain the indices of the flagged
+			 *                items in ascending order
+			 * @param compactedCount Device CL_UINT, that will contain the number of flagged items
+			 * @param [out]err Error info, filled in case there is an error
+			 * @return Result, that indicates whether the operation succeeded or failed
+			 **/
+			Common::Result compactIndices(cl_mem flags,CL_UINT count,cl_mem indices,cl_mem compactedCount,Common::Errata& err);
+
+			/**Compacts the indices of the active rays - See flagActiveRays and compactIndices
+			 * @param rays Device array of rays (struct Ray)
+			 * @param rayCount Number of rays in the array
+			 * @param indices Device array of CL_UINT, at least rayCount long, that will contain the indices of active rays
+			 * @param activeRayCount Device CL_UINT, that will contain the number of active rays
+			 * @param [out]err Error info, filled in case there is an error
+			 * @return Result, that indicates whether the operation succeeded or failed
+			 **/
+			Common::Result compactActiveRays(cl_mem rays,CL_UINT rayCount,cl_mem indices,cl_mem activeRayCount,Common::Errata& err);
+
+		private:
+			Common::Result launchKernel(OpenCLUtils::CLKernel& kernel,CL_UINT workItems,Common::Errata& err);
+			const OpenCLUtils::CLExecutionContext& _context;
+			boost::shared_ptr<Common::PrefixSum> _prefixSumCalculator;
+			boost::shared_ptr<OpenCLUtils::CLProgram> _compactionProgram;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _flagActiveRaysKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _scatterKernel;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _flags;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _offsets;
+			size_t _deviceProcessors;
+			size_t _deviceWavefront;
+		};
+	}
+}
+
+#endif //CL_RT_STREAMCOMPACTION
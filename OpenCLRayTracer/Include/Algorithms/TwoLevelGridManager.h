@@ -31,6 +31,9 @@
 #ifndef CL_RT_TWO_LEVEL_GRID_BUILDER_H
 #define CL_RT_TWO_LEVEL_GRID_BUILDER_H
 
+#include <map>
+#include <string>
+#include <vector>
 #include <Algorithms/AccelerationStructureManager.h>
 #include <CLData\AccelerationStructs\TwoLevelGridData.h>
 #include <boost\smart_ptr.hpp>
@@ -44,8 +47,8 @@ namespace CLRayTracer
 {
 	namespace Common
 	{
-		class BitonicSort;
 		class PrefixSum;
+		class RaySorter;
 	}
 
 	namespace OpenCLUtils
@@ -104,6 +107,19 @@ namespace CLRayTracer
 			* @return Result of the operation: Success or failure
 			*/
 			virtual Common::Result generateContacts(OpenCLUtils::CLBuffer& rays,OpenCLUtils::CLBuffer& contacts, const unsigned int rayCount, Common::Errata& err);
+
+			/**Generates contacts for the active rays of index list, and fills their entries of the contacts array
+			* @param rays The rays - A device memory buffer object that contains rays as struct Ray
+			* @param activeRays Device buffer of CL_UINT indices of the rays to trace, e.g. as compacted by StreamCompaction
+			* @param activeRayCount Device buffer of single CL_UINT - The number of indices in activeRays
+			* @param contact The target device memory - For each traced ray rays[i] the buffer will contain its contact
+			*                as contacts[i]. Contacts of the other rays are not modified
+			* @param maxActiveRays Upper bound of the number of active rays, by which the work items are launched - Work items
+			*                      beyond the device count exit at once, so the ray count may be passed without readback
+			* @param err Error info
+			* @return Result of the operation: Success or failure
+			*/
+			virtual Common::Result generateContacts(OpenCLUtils::CLBuffer& rays,OpenCLUtils::CLBuffer& activeRays,OpenCLUtils::CLBuffer& activeRayCount,OpenCLUtils::CLBuffer& contacts, const unsigned int maxActiveRays, Common::Errata& err);
 			
 			/***************************************
 			* Properties 
@@ -118,6 +134,70 @@ namespace CLRayTracer
 			inline CL_FLOAT getLeafDensity() const {return _leafDensity;}
 			/**Gets the device memory buffer for primary rays - result of generateContacts function*/
 			virtual const boost::shared_ptr<OpenCLUtils::CLBuffer> getPrimaryContacts() const {return _primaryContactsArray;}
+			/**Enables reordering of general rays by origin and direction octant before tracing - Disabled by default*/
+			inline void setRayReordering(bool enable) {_reorderRays = enable;}
+			/**Enables readback-free construction: Arrays are allocated from capacities based on counts of previous builds,
+			* counts stay on device, and construction kernels are not waited for. If a capacity overflows, the grid is
+			* rebuilt with readbacks, and capacities grow. Disabled by default.
+			* @param enable True to enable readback-free construction
+			* @param verify If true, construct() syncs once at its end to verify the capacities. Otherwise, the capacities are
+			*               verified at next construct(), and grid that overflowed them misses some of the primitives
+			*/
+			void setReadbackFreeConstruction(bool enable, bool verify = true);
+			/**Enables choice of leaf resolution per top level cell by local traversal cost estimate, from bounds of the cell's
+			* triangles, instead of from leaf density alone - Disabled by default*/
+			inline void setAdaptiveLeafResolution(bool enable) {_adaptiveLeafResolution = enable;}
+			/**Sets budget of leaf cells: Leaf resolutions are clamped to shares of the budget, proportional to pairs count of
+			* top level cells. Each nonempty top level cell gets at least one leaf cell. 0 for unlimited, which is the default*/
+			inline void setLeafCellsBudget(CL_UINT leafCells) {_leafCellsBudget = leafCells;}
+			/**Sets number of entries in per-ray mailbox of tested triangles, which skips repeated intersection tests of triangles that
+			* span several cells. Must be a power of two, 0 disables mailboxing - Default is 8. Takes effect at initialize(), as the
+			* mailbox size is a compile option of the kernels*/
+			inline void setMailboxSize(CL_UINT entries) {_mailboxSize = entries;}
+			/**Enables indexing of top level and leaf cells in Morton order instead of row-major order, so cells adjacent along
+			* any axis are mostly close in memory. Morton order is applied within bricks of up to 8x8x8 cells, that are in row-major
+			* order, and bricks are smaller for grids that they would pad by more than twice the cell count - Disabled by default.
+			* Takes effect at initialize(), as the cell order is a compile option of the kernels*/
+			inline void setMortonCellOrder(bool enable) {_mortonCellOrder = enable;}
+			/**Enables exact triangle-box overlap test in binning of triangles into top level cells. Otherwise, the triangles are binned into
+			* all cells overlapped by their bounding boxes - Disabled by default*/
+			inline void setExactTopLevelOverlap(bool enable) {_exactTopLevelOverlap = enable;}
+			/**Enables auto-tuning of the densities: At frame initialization of a scene that was not tuned before, the grid is built
+			* with candidate densities, and the densities of the lowest estimated traversal cost are kept for the scene. Disabled by default.
+			* @param enable True to enable auto-tuning
+			* @param sampleCamera If not NULL, the candidates of lowest estimated cost are also timed by tracing primary rays of this
+			*                     camera, and the fastest one is chosen
+			*/
+			void setDensityAutoTuning(bool enable, const Camera* sampleCamera = NULL);
+			/**Sets file in which tuned densities are persisted per scene hash, across runs. Densities already in file are loaded.
+			* @param path Path of the file
+			* @param err Error info
+			* @return Result of the operation: Success or failure
+			*/
+			Common::Result setDensityCacheFile(const std::string& path, Common::Errata& err);
+			/**Tunes the densities for the associated scene, regardless of the densities known for it - See setDensityAutoTuning
+			* @param err Error info
+			* @return Result of the operation: Success or failure
+			*/
+			Common::Result autoTuneDensities(Common::Errata& err);
+			/**Enables incremental updates of the grid by updateTriangles. Arrays of the grid are then allocated with slack space
+			* for the updated data, and the grid is always constructed with readbacks - Disabled by default.
+			* Takes effect at next construct().
+			*/
+			inline void setIncrementalUpdates(bool enable) {_incrementalUpdates = enable;}
+			/**Updates the constructed grid for triangles that have moved or changed, in the device scene data. Only the top level cells
+			* overlapped by the old or new bounds of the triangles are rebuilt, and their data is appended to the arrays. When the
+			* slack space runs out, the grid is compacted by construct(). Grid bounds remain those of the last frame initialization:
+			* Triangles moved beyond them are binned into the border cells, and are not hit outside the bounds.
+			* The grid must have been constructed with incremental updates enabled.
+			* @param changedRanges Ranges of changed triangles, by global triangle index - For each range, triangles in [x,y) have changed.
+			*                      Ranges may overlap - Each triangle is updated once
+			* @param err Error info
+			* @return Result of the operation: Success or failure
+			*/
+			Common::Result updateTriangles(const std::vector<CL_UINT2>& changedRanges, Common::Errata& err);
+			/**Gets the leaf occupancy histogram of the last build evaluated by auto-tuning: Number of leaf cells per count of primitives*/
+			inline const std::vector<CL_UINT>& getLeafOccupancyHistogram() const {return _leafOccupancyHistogram;}
 			
 			/***************************************
 			* Utility Functions
@@ -135,19 +215,58 @@ namespace CLRayTracer
 			
 		private:
 			void calculateGridData();
-			boost::shared_ptr<Common::BitonicSort> _bitonicSorter;
+			Common::Result prepareFrame(Common::Errata& err);
+			Common::Result estimateTraversalCost(CL_FLOAT& cost, Common::Errata& err);
+			Common::Result timeSampleTrace(CL_FLOAT& time, Common::Errata& err);
+			Common::Result saveTunedDensities(Common::Errata& err) const;
+			size_t getSceneHash();
+			Common::Result buildGrid(bool exactSizes,Common::Errata& err);
+			Common::Result launchKernel(OpenCLUtils::CLKernel& kernel, CL_UINT workItems, Common::Errata& err);
+			Common::Result storeBuildCount(CL_UINT lastIdx, CL_UINT countIdx, Common::Errata& err);
+			Common::Result readBuildCounts(Common::Errata& err);
+			Common::Result allocateGridArray(boost::shared_ptr<OpenCLUtils::CLBuffer>& buffer, CL_UINT elements, size_t elementSize, Common::Errata& err);
+			void reserveBuffer(boost::shared_ptr<OpenCLUtils::CLBuffer>& buffer, size_t size);
+			Common::Result reserveZeroedBuffer(boost::shared_ptr<OpenCLUtils::CLBuffer>& buffer, size_t size, Common::Errata& err);
+			bool capacitiesSuffice() const;
+			void growCapacities();
+			Common::Result prepareIncrementalUpdates(Common::Errata& err);
+			Common::Result computeProximity(Common::Errata& err);
+			Common::Result traceRays(OpenCLUtils::CLBuffer& rays,OpenCLUtils::CLBuffer& contacts, const unsigned int rayCount, Common::Errata& err);
 			boost::shared_ptr<Common::PrefixSum> _prefixSumCalculator;
+			boost::shared_ptr<Common::RaySorter> _raySorter;
+			bool _reorderRays;
+			bool _readbackFreeConstruction;
+			bool _verifyConstruction;
+			bool _pendingVerification;
+			bool _densityAutoTuning;
+			bool _adaptiveLeafResolution;
+			bool _exactTopLevelOverlap;
+			bool _incrementalUpdates;
+			bool _preparedForUpdates;
 			CL_FLOAT _topLevelDensity;
 			CL_FLOAT _leafDensity;
 			CL_UINT _numPrimitives;
-			CL_UINT _numPrimitivesPowOfTwo;
 			CL_UINT _pairsCount;
-			CL_UINT _pairsCountPowOfTwo;
 			CL_UINT _cellsCount;
 			CL_UINT _cellsCountPowOfTwo;
 			CL_UINT _leafCellsCount;
+			CL_UINT _leafCellsCountPowOfTwo;
 			CL_UINT _leafPairsCount;
-			CL_UINT _leafPairsCountPowOfTwo;
+			CL_UINT _pairsCapacity;
+			CL_UINT _leafCellsCapacity;
+			CL_UINT _leafPairsCapacity;
+			CL_UINT _leafCellsBudget;
+			CL_UINT _mailboxSize;
+			bool _mortonCellOrder;
+			CL_UINT _pairsTail;
+			CL_UINT _leafCellsTail;
+			CL_UINT _leafPairsTail;
+			size_t _sceneHash;
+			const char* _hashedSceneData;
+			std::map<size_t,CL_FLOAT2> _tunedDensities;
+			std::string _densityCacheFile;
+			std::vector<CL_UINT> _leafOccupancyHistogram;
+			boost::shared_ptr<struct Camera> _tuningCamera;
 			boost::shared_ptr<OpenCLUtils::CLBuffer> _counters;
 			boost::shared_ptr<OpenCLUtils::CLBuffer> _prefixSumOutput;
 			boost::shared_ptr<OpenCLUtils::CLBuffer> _pairsArray;
@@ -158,18 +277,45 @@ namespace CLRayTracer
 			boost::shared_ptr<OpenCLUtils::CLBuffer> _deviceCamera;
 			boost::shared_ptr<OpenCLUtils::CLBuffer> _leafCellRangesArray;
 			boost::shared_ptr<OpenCLUtils::CLBuffer> _primaryContactsArray;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _sortedContactsArray;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _buildCounts;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _triangleCellRanges;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _changedTriangles;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _changedFlags;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _affectedFlags;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _affectedCells;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _updateCellCounters;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _updateCellOffsets;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _updateLeafCounters;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _updateLeafOffsets;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _updateCounts;
+			boost::shared_ptr<OpenCLUtils::CLBuffer> _proximityScratch[2];
 			struct GridData _hostGrid;
 			boost::shared_ptr<OpenCLUtils::CLProgram> _tlgProgram;
-			boost::shared_ptr<OpenCLUtils::CLKernel> _prepareDataKernel;
-			boost::shared_ptr<OpenCLUtils::CLKernel> _writePairsKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _countCellPairsKernel;
 			boost::shared_ptr<OpenCLUtils::CLKernel> _writeCellRangesKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _writeLeafRangesKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _scatterCellPairsKernel;
 			boost::shared_ptr<OpenCLUtils::CLKernel> _countLeafCellsKernel;
 			boost::shared_ptr<OpenCLUtils::CLKernel> _updateTopLevelCellsWithLeafRangeKernel;
-			boost::shared_ptr<OpenCLUtils::CLKernel> _prepareLeafDataKernel;
-			boost::shared_ptr<OpenCLUtils::CLKernel> _writeLeafPairsKernel;
-			boost::shared_ptr<OpenCLUtils::CLKernel> _extractLeafCellsKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _countLeafPairsKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _scatterLeafPairsKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _storeBuildCountKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _storeTriangleCellRangesKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _markChangedTrianglesKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _collectAffectedCellsKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _countChangedTrianglePairsKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _reallocateAffectedCellsKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _scatterChangedTrianglePairsKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _rebuildAffectedCellsKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _countAppendedLeafPairsKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _writeAffectedLeafRangesKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _scatterAppendedLeafPairsKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _releaseAffectedCellsKernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _computeProximityKernel;
 			boost::shared_ptr<OpenCLUtils::CLKernel> _generateContactsKernel;
 			boost::shared_ptr<OpenCLUtils::CLKernel> _generateContacts2Kernel;
+			boost::shared_ptr<OpenCLUtils::CLKernel> _generateContactsIndexedKernel;
 		
 			size_t _maxWorkgroupSize;
 			size_t _processors;
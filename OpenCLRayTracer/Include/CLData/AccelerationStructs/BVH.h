@@ -42,50 +42,18 @@
 #include <CLData/AccelerationStructs/BVHData.h>
 #include <CLData/Primitives/Triangle.h>
 
-/** Expands a 10-bit integer into 30 bits by inserting 2 zeros after each bit.
-*  @param v Integer to expand
-*  @return The expanded integer
-*/
-inline CL_UINT expandBits(CL_UINT v)
-{
-    v = (v * 0x00010001u) & 0xFF0000FFu;
-    v = (v * 0x00000101u) & 0x0F00F00Fu;
-    v = (v * 0x00000011u) & 0xC30C30C3u;
-    v = (v * 0x00000005u) & 0x49249249u;
-    return v;
-}
-
-/** Calculates a 30-bit Morton code for the given 3D point located within the unit cube [0,1].
-*  @param x X coordinate of a point
-*  @param y Y coordinate of a point
-*  @param x X coordinate of a point
-*  @return The calculated Morton code of a point
-*/
-inline CL_UINT morton3D(CL_FLOAT x, CL_FLOAT y, CL_FLOAT z)
-{
-    x = min(max(x * 1024.0f, 0.0f), 1023.0f);
-    y = min(max(y * 1024.0f, 0.0f), 1023.0f);
-    z = min(max(z * 1024.0f, 0.0f), 1023.0f);
-    CL_UINT xx = expandBits((CL_UINT)x);
-    CL_UINT yy = expandBits((CL_UINT)y);
-    CL_UINT zz = expandBits((CL_UINT)z);
-    return xx * 4 + yy * 2 + zz;
-}
-
-/** Calculates Morton code for a primitive in the scene, and creates BVH tree node for it
-*  @param leavesBuffer Preallocated buffer that will contain the BVH
-*  @param mortonCodesToLeaves Key-Value pairs array, that will contain Morton code as key, and primitive index as value
-*  @param leafIndex Index of the primitive to process
+/** Calculates bounding box and centroid of a primitive in the scene - Those are reduced to the scene bounds
+*   and the centroid bounds, and used for Morton code of the primitive
+*  @param primitiveBounds Buffer that will contain the bounding boxes of the primitives
+*  @param centroids Buffer that will contain the centroids of the primitives
+*  @param primitiveIndex Index of the primitive to process
 *  @param scene Buffer that contains the scene
-*  @param sceneBB Scene bounding box
-*  @return 
 */
-inline void calculateMorton(CL_GLOBAL struct BVHNode* leavesBuffer, CL_GLOBAL CL_UINT2* mortonCodesToLeaves, 
-							CL_UINT leafIndex, CL_GLOBAL const char* scene)
+inline void calculatePrimitiveBounds(CL_GLOBAL struct AABB* primitiveBounds, CL_GLOBAL CL_FLOAT4* centroids, 
+									 CL_UINT primitiveIndex, CL_GLOBAL const char* scene)
 {
-	
 	CL_GLOBAL char* buffer;
-	CL_UINT3 triangleRef = getTriangleRefByIndex(scene,leafIndex);
+	CL_UINT3 triangleRef = getTriangleRefByIndex(scene,primitiveIndex);
 	
 	buffer = getModelAtIndex(triangleRef.x,scene);
 	buffer = getMeshAtIndex(triangleRef.y,buffer);
@@ -95,8 +63,7 @@ inline void calculateMorton(CL_GLOBAL struct BVHNode* leavesBuffer, CL_GLOBAL CL
 	VERTEX_TYPE vertex1 = getVertexAt(getIndexAt(baseIndex, buffer),buffer);
 	VERTEX_TYPE vertex2 = getVertexAt(getIndexAt(baseIndex + 1,buffer),buffer);
 	VERTEX_TYPE vertex3 = getVertexAt(getIndexAt(baseIndex + 2,buffer),buffer);
-	struct BVHNode result;
-	result.boundingBox = calculateTriangleAABB(vertex1,vertex2,vertex3);
+	primitiveBounds[primitiveIndex] = calculateTriangleAABB(vertex1,vertex2,vertex3);
 #ifdef _WIN32
 	vertex1.x=(vertex1.x + vertex2.x + vertex3.x)/3.0f;
 	vertex1.y=(vertex1.y + vertex2.y + vertex3.y)/3.0f;
@@ -106,12 +73,44 @@ inline void calculateMorton(CL_GLOBAL struct BVHNode* leavesBuffer, CL_GLOBAL CL
 	vertex1+= vertex3;
 	vertex1 = vertex1 / 3.0f;
 #endif
+	centroids[primitiveIndex] = (CL_FLOAT4)combineToVector(vertex1.x,vertex1.y,vertex1.z,0.0f);
+}
+
+/** Normalizes a centroid coordinate to [0-1] along an axis of the centroid bounding box
+*  @param axisMin Minimal centroid coordinate along the axis
+*  @param axisMax Maximal centroid coordinate along the axis
+*  @param value Centroid coordinate
+*  @return Normalized coordinate - 0 when all centroids share the coordinate, as in planar scenes
+*/
+inline float normalizeCentroid(float axisMin, float axisMax, float value)
+{
+	return axisMax > axisMin ? normalizeScale(axisMin,axisMax,value - axisMin) : 0.0f;
+}
+
+/** Calculates Morton code for a primitive in the scene, and creates BVH tree node for it
+*  @param leavesBuffer Preallocated buffer that will contain the BVH
+*  @param mortonCodesToLeaves Key-Value pairs array, that will contain Morton code as key, and primitive index as value
+*  @param leafIndex Index of the primitive to process
+*  @param scene Buffer that contains the scene
+*  @param primitiveBounds Bounding boxes of the primitives - See calculatePrimitiveBounds
+*  @param centroids Centroids of the primitives - See calculatePrimitiveBounds
+*  @param centroidBB Bounding box of the centroids of all primitives
+*  @return 
+*/
+inline void calculateMorton(CL_GLOBAL struct BVHNode* leavesBuffer, CL_GLOBAL CL_UINT2* mortonCodesToLeaves, 
+							CL_UINT leafIndex, CL_GLOBAL const char* scene, CL_GLOBAL const struct AABB* primitiveBounds,
+							CL_GLOBAL const CL_FLOAT4* centroids, CL_GLOBAL const struct AABB* centroidBB)
+{
+	CL_UINT3 triangleRef = getTriangleRefByIndex(scene,leafIndex);
+	struct BVHNode result;
+	result.boundingBox = primitiveBounds[leafIndex];
 		
-	//Normalize the centroid to scene AABB
-	struct AABB sceneBB = SCENE_HEADER(scene)->modelsBoundingBox;
-	vertex1 = (VERTEX_TYPE)combineToVector(normalizeScale(sceneBB.bounds[0].x,sceneBB.bounds[1].x,vertex1.x),
-										   normalizeScale(sceneBB.bounds[0].y,sceneBB.bounds[1].y,vertex1.y),
-										   normalizeScale(sceneBB.bounds[0].z,sceneBB.bounds[1].z,vertex1.z));
+	//Normalize the centroid to centroid AABB - It is tighter than the scene AABB, so the Morton codes
+	//use the whole range of the grid
+	CL_FLOAT4 centroid = centroids[leafIndex];
+	VERTEX_TYPE vertex1 = (VERTEX_TYPE)combineToVector(normalizeCentroid(centroidBB->bounds[0].x,centroidBB->bounds[1].x,centroid.x),
+										   normalizeCentroid(centroidBB->bounds[0].y,centroidBB->bounds[1].y,centroid.y),
+										   normalizeCentroid(centroidBB->bounds[0].z,centroidBB->bounds[1].z,centroid.z));
 	
 
 	//Calculate Morton Code and leaf
@@ -333,40 +332,98 @@ inline void mergeBoundingBox(CL_GLOBAL struct BVHNode* nodes,CL_UINT currentIdx)
 	nodes[currentIdx].boundingBox = merge3(nodes[child_A].boundingBox,nodes[child_B].boundingBox,nodes[currentIdx].boundingBox);
 }
 
+//Flag that marks traversal stack entries that refer to a slot of top-of-tree cache, rather than a node of the hierarchy
+#define TOP_TREE_SLOT_FLAG 0x80000000
+
+/** Fills a slot of top-of-tree cache - Copy of the top levels of the hierarchy, stored in breadth first order:
+*  The root is in slot 0, and the children of slot s are in slots 2s+1 and 2s+2. Slots below a leaf of the hierarchy
+*  contain a copy of that leaf, and are never visited by traversal.
+*  @param bvh Array that contains the hierarchy
+*  @param rootIdx Index of root of the hierarchy
+*  @param topTree Top-of-tree cache
+*  @param slot Slot of the cache to fill
+*/
+inline void fillTopTreeSlot(CL_GLOBAL struct BVHNode* bvh, CL_UINT rootIdx, CL_GLOBAL struct BVHNode* topTree, CL_UINT slot)
+{
+	//Bits of slot+1 below its highest set bit are the path from the root: 0 for child A, 1 for child B
+	CL_UINT path = slot + 1;
+	CL_INT depth = 0;
+	while ((path >> (depth + 1)) != 0)
+		depth++;
+
+	struct BVHNode node = bvh[rootIdx];
+	for (CL_INT level = depth - 1; level >= 0 && type(node) == INNER_NODE; level--)
+		node = bvh[((path >> level) & 1) ? childB(node) : childA(node)];
+	topTree[slot] = node;
+}
+
 /** Performs intersection query for a ray
+*  @implNote Only intersections within (ray.tMin,ray.tMax) are reported. Nodes whose bounding box is entered
+*            beyond ray.tMax, or beyond the closest hit found so far, are culled.
+*            Nodes in the top levels of the hierarchy are read from the top-of-tree cache - See fillTopTreeSlot.
 *  @param ray Ray to query
 *  @param bvh Array that contains the BV hierarchy
 *  @param rootIdx Index of root of the hierarchy
 *  @param scene Buffer that contains the scene
+*  @param topTree Top-of-tree cache, usually in local memory
+*  @param topTreeSize Number of slots in top-of-tree cache - Either 0 or 2^K-1 for K cached levels
 *  @return Contact data that contains ray parameter t at which closest intersection occurs, and intersection normal.
 *          In case no intersection found, the t parameter will be 0.
 */
 inline struct Contact bvh_generate_contact(struct Ray ray,
 								    CL_GLOBAL struct BVHNode* bvh, 
 									CL_UINT rootIdx,
-									const CL_GLOBAL char* scene)
+									const CL_GLOBAL char* scene,
+									CL_LOCAL const struct BVHNode* topTree,
+									CL_UINT topTreeSize)
 {
 	CL_UINT stack[32];
 	CL_UINT stackPointer = 0;
-	CL_UINT currentIdx = rootIdx;
+	CL_UINT currentIdx = topTreeSize > 0 ? TOP_TREE_SLOT_FLAG : rootIdx;
 	stack[stackPointer++]=UINT_MAX; //Push initial value
 	CL_FLOAT4 resContactData;
-	resContactData.w = FLT_MAX;
+	resContactData.w = ray.tMax; //Shrinks to the closest hit found so far
 	CL_UINT resMaterialIdx = 0;
+	const struct InverseRay invRay = prepareInverseRay(ray.origin,ray.direction);
 	do
     {
-		struct BVHNode node = bvh[currentIdx];
+		CL_UINT slot = UINT_MAX;
+		struct BVHNode node;
+		if (currentIdx & TOP_TREE_SLOT_FLAG)
+		{
+			slot = currentIdx & ~TOP_TREE_SLOT_FLAG;
+			node = topTree[slot];
+		}
+		else
+			node = bvh[currentIdx];
+
 		if (type(node) == INNER_NODE)
 		{
-			CL_UINT child_A_idx = childA(node);
-			CL_UINT child_B_idx = childB(node);
-			struct AABB child_A_box = bvh[child_A_idx].boundingBox;
-			struct AABB child_B_box = bvh[child_B_idx].boundingBox;
+			CL_UINT child_A_idx;
+			CL_UINT child_B_idx;
+			struct AABB child_A_box;
+			struct AABB child_B_box;
+			//Cache holds whole levels, so either both children are cached or none
+			if (slot != UINT_MAX && 2 * slot + 2 < topTreeSize)
+			{
+				child_A_idx = (2 * slot + 1) | TOP_TREE_SLOT_FLAG;
+				child_B_idx = (2 * slot + 2) | TOP_TREE_SLOT_FLAG;
+				child_A_box = topTree[2 * slot + 1].boundingBox;
+				child_B_box = topTree[2 * slot + 2].boundingBox;
+			}
+			else
+			{
+				child_A_idx = childA(node);
+				child_B_idx = childB(node);
+				child_A_box = bvh[child_A_idx].boundingBox;
+				child_B_box = bvh[child_B_idx].boundingBox;
+			}
 			
-			float tA = AABBIntersect(child_A_box,ray.origin,ray.direction);
-			float tB = AABBIntersect(child_B_box,ray.origin,ray.direction);
-			bool aValid = tA > 0 || isPointInside(child_A_box,ray.origin);
-			bool bValid = tB > 0 || isPointInside(child_B_box,ray.origin);
+			//Child is valid when the ray overlaps it within [tMin,closest hit)
+			CL_FLOAT2 tA = AABBIntersectInv(child_A_box,invRay);
+			CL_FLOAT2 tB = AABBIntersectInv(child_B_box,invRay);
+			bool aValid = (tA.x <= tA.y) & (tA.y >= ray.tMin) & (tA.x < resContactData.w);
+			bool bValid = (tB.x <= tB.y) & (tB.y >= ray.tMin) & (tB.x < resContactData.w);
 			
 			if (aValid && bValid)
 			{
@@ -388,8 +445,9 @@ inline struct Contact bvh_generate_contact(struct Ray ray,
 			CL_FLOAT4 contactData = triangleIntersect(
 									getVertexAt(getIndexAt(baseIndex,mesh),mesh),
 									getVertexAt(getIndexAt(baseIndex + 1,mesh),mesh),
-									getVertexAt(getIndexAt(baseIndex + 2,mesh),mesh),ray.origin,ray.direction);
-			if (contactData.w > 0 && contactData.w < resContactData.w)
+									getVertexAt(getIndexAt(baseIndex + 2,mesh),mesh),ray.origin,ray.direction,
+									ray.tMin,resContactData.w);
+			if (contactData.w > 0)
 			{
 				resContactData = contactData;
 				resMaterialIdx = MESH_HEADER(mesh)->materialIndex;	
@@ -401,7 +459,7 @@ inline struct Contact bvh_generate_contact(struct Ray ray,
 
 	struct Contact result;
 	result.normalAndintersectionDistance = resContactData;
-	if (result.contactDist == FLT_MAX)
+	if (result.contactDist == ray.tMax)
 		result.contactDist = 0;
 	result.materialIndex = resMaterialIdx;
 	return result;
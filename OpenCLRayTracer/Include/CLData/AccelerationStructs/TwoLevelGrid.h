@@ -43,6 +43,39 @@
 * General utility functions
 **************************************************************/
 
+//If nonzero, cells of both levels are indexed in bricked Morton order instead of row-major order, so cells adjacent along
+//any axis are mostly close in memory. Set by the compile options of TwoLevelGridManager
+#ifndef TLG_MORTON_ORDER
+#define TLG_MORTON_ORDER 0
+#endif
+//Bits of the largest edge of Morton order bricks - Cells are in Morton order within cubic bricks, and bricks are in row-major order
+#define TLG_MORTON_BRICK_BITS 3
+//Maximal ratio of length of array of cells in Morton order to the count of cells - Padding of the resolution to whole bricks
+//that exceeds it, selects smaller bricks, down to single cell bricks, which is row-major order
+#define TLG_MORTON_MAX_WASTE 2
+
+/* Calculates bits of the edge of Morton order bricks for given resolution: The largest edge, that fits into the resolution
+*  along every axis, and pads the resolution to whole bricks by no more than TLG_MORTON_MAX_WASTE times the cell count.
+*  0 bits, which are single cell bricks, give row-major order - So flat and elongated grids do not blow up the arrays
+*  @param rx X component of Grid resolution
+*  @param ry Y component of Grid resolution
+*  @param rz Z component of Grid resolution
+*  @return Bits of the brick edge
+*/
+inline CL_UINT getMortonBrickBits(CL_UINT rx, CL_UINT ry, CL_UINT rz)
+{
+	for (CL_UINT bits = TLG_MORTON_BRICK_BITS; bits > 0; bits--)
+	{
+		CL_UINT mask = (1u << bits) - 1;
+		if (mask >= rx || mask >= ry || mask >= rz)
+			continue;
+		CL_UINT padded = (((rx + mask) >> bits) * ((ry + mask) >> bits) * ((rz + mask) >> bits)) << (3 * bits);
+		if (padded <= TLG_MORTON_MAX_WASTE * rx * ry * rz)
+			return bits;
+	}
+	return 0;
+}
+
 /* Calculates linear cell index from X-Y-Z cell coordinates
 *  @param ix X index of the cell
 *  @param iy Y index of the cell
@@ -55,7 +88,14 @@
 inline CL_UINT getCellIndex(CL_UINT ix, CL_UINT iy, CL_UINT iz,
 					 CL_UINT rx, CL_UINT ry, CL_UINT rz)
 {
+#if TLG_MORTON_ORDER
+	CL_UINT bits = getMortonBrickBits(rx,ry,rz);
+	CL_UINT mask = (1u << bits) - 1;
+	CL_UINT brick = ((iz >> bits) * ((ry + mask) >> bits) + (iy >> bits)) * ((rx + mask) >> bits) + (ix >> bits);
+	return (brick << (3 * bits)) + mortonIndex3D(ix & mask,iy & mask,iz & mask);
+#else
 	return iz * rx * ry + iy * rx + ix;
+#endif
 }
 
 /* Calculates X-Y-Z cell coordinates from linear cell index
@@ -67,128 +107,187 @@ inline CL_UINT getCellIndex(CL_UINT ix, CL_UINT iy, CL_UINT iz,
 */
 inline CL_UINT3 getCellRefFromIndex(CL_UINT idx,CL_UINT rx, CL_UINT ry, CL_UINT rz)
 {
+#if TLG_MORTON_ORDER
+	CL_UINT bits = getMortonBrickBits(rx,ry,rz);
+	CL_UINT mask = (1u << bits) - 1;
+	CL_UINT bricksX = (rx + mask) >> bits;
+	CL_UINT bricksXY = bricksX * ((ry + mask) >> bits);
+	CL_UINT brick = idx >> (3 * bits);
+	CL_UINT inBrick = idx & ((1u << (3 * bits)) - 1);
+	CL_UINT bz = brick / bricksXY;
+	CL_UINT b = brick - bricksXY * bz;
+	return (CL_UINT3)combineToVector(((b % bricksX) << bits) | compactBits(inBrick),
+									 ((b / bricksX) << bits) | compactBits(inBrick >> 1),
+									 (bz << bits) | compactBits(inBrick >> 2));
+#else
 	CL_UINT a = (rx * ry);
 	CL_UINT z = idx / a; 
 	CL_UINT b = idx - a * z;
 	return (CL_UINT3)combineToVector(b%rx,b/rx,z);
+#endif
+}
+
+/* Calculates length of array of cells in given cell order - In Morton order, the array spans the resolution padded to
+*  whole bricks, and the indices of coordinates outside the resolution are gaps - See getMortonBrickBits
+*  @param rx X component of Grid resolution
+*  @param ry Y component of Grid resolution
+*  @param rz Z component of Grid resolution
+*  @param morton True for Morton order, false for row-major order
+*  @return Length of array of cells
+*/
+inline CL_UINT countCellsInOrder(CL_UINT rx, CL_UINT ry, CL_UINT rz, bool morton)
+{
+	if (rx * ry * rz == 0)
+		return 0;
+	if (!morton)
+		return rx * ry * rz;
+	CL_UINT bits = getMortonBrickBits(rx,ry,rz);
+	CL_UINT mask = (1u << bits) - 1;
+	return (((rx + mask) >> bits) * ((ry + mask) >> bits) * ((rz + mask) >> bits)) << (3 * bits);
+}
+
+/* Calculates length of array of cells in the cell order of the kernels - See TLG_MORTON_ORDER
+*  @param rx X component of Grid resolution
+*  @param ry Y component of Grid resolution
+*  @param rz Z component of Grid resolution
+*  @return Length of array of cells
+*/
+inline CL_UINT getCellCount(CL_UINT rx, CL_UINT ry, CL_UINT rz)
+{
+	return countCellsInOrder(rx,ry,rz,TLG_MORTON_ORDER != 0);
 }
 
 /*************************************************************
 * Grid Construction Functions
 **************************************************************/
 
-/* Counts how many grid cells does a triangle (Precisely, bounding box of a triangle) overlap
-*  @param v0 First vertex of a triangle
-*  @param v1 Second vertex of a triangle
-*  @param v2 Third vertex of atriangle
-*  @param grid The grid data
-*  @return Count of cells overlapped by triangle bounding box
+/* Writes the range of a cell in array of cell-primitive pairs that was binned by counting sort
+*  @param counters Array of pair counts per cell
+*  @param offsets Inclusive prefix sum of pair counts per cell
+*  @param ranges Output array of ranges - For each cell, the pairs in [x,y) belong to the cell
+*  @param idx Cell index
+*  @param pairsCapacity Capacity of pairs array - Pairs beyond it were not written, and are cut off the range
+*  @return
 */
-inline CL_UINT countOverlappingCells(VERTEX_TYPE v0,VERTEX_TYPE v1,VERTEX_TYPE v2,
-									 CL_CONSTANT struct GridData* grid)
+inline void writeCellRange(CL_GLOBAL const CL_UINT* counters,
+						   CL_GLOBAL const CL_UINT* offsets,
+						   CL_GLOBAL CL_UINT2* ranges,
+						   CL_UINT idx,
+						   CL_UINT pairsCapacity)
 {
-	CL_FLOAT3 lastIndices = (CL_FLOAT3)combineToVector((CL_FLOAT)(grid->resX-1),
-													   (CL_FLOAT)(grid->resY-1),
-													   (CL_FLOAT)(grid->resZ-1));
-
-	CL_FLOAT3 startCells = MIN3(FLOOR3((MIN3(v0,MIN3(v1,v2)) - (CL_FLOAT3)combineToVector(grid->box.bounds[0].x,grid->box.bounds[0].y,grid->box.bounds[0].z))/(CL_FLOAT3)combineToVector(grid->stepX,grid->stepY,grid->stepZ)),
-								lastIndices);
-	CL_FLOAT3 endCells = MIN3(FLOOR3((MAX3(v0,MAX3(v1,v2)) - (CL_FLOAT3)combineToVector(grid->box.bounds[0].x,grid->box.bounds[0].y,grid->box.bounds[0].z))/(CL_FLOAT3)combineToVector(grid->stepX,grid->stepY,grid->stepZ)),
-								lastIndices);
-	CL_FLOAT3 cells = (endCells - startCells) + 1.0f;
-	return cells.x * cells.y * cells.z;
+	CL_UINT2 range;
+	range.x = min(offsets[idx] - counters[idx],pairsCapacity);
+	range.y = min(offsets[idx],pairsCapacity);
+	ranges[idx] = range;
 }
 
-/* Counts how many grid cells does a triangle (Precisely, bounding box of a triangle) overlap, and fills result in counters array
-*  @param scene Scene
-*  @param triangleIndex Global index of a triangle in the scene
-*  @param grid The grid data
-*  @param The array of counters
-*  @return 
+/* Writes the beginning of the range of a leaf cell in leaf references array, that was binned by counting sort - 
+*  Leaf cell i owns the references in [leafRanges[i],leafRanges[i+1]), so one offset per leaf cell is stored
+*  @param offsets Inclusive prefix sum of reference counts per leaf cell
+*  @param leafRanges Output array of beginnings of ranges
+*  @param idx Leaf cell index - Up to the count of leaf cells, which writes the end of the last range
+*  @param referencesCapacity Capacity of leaf references array - References beyond it were not written, and are cut off the range
+*  @return
 */
-inline void prepareGridData(CL_GLOBAL const char* scene, 
-					 CL_UINT triangleIndex, 
-					 CL_CONSTANT struct GridData* grid,
-					 CL_GLOBAL CL_UINT* counters)
+inline void writeLeafRange(CL_GLOBAL const CL_UINT* offsets,
+						   CL_GLOBAL CL_UINT* leafRanges,
+						   CL_UINT idx,
+						   CL_UINT referencesCapacity)
 {
-	//Getting the references to the triangle
-	CL_UINT3 triangleRef = getTriangleRefByIndex(scene,triangleIndex);
-	CL_GLOBAL char* submesh = getMeshAtIndex(triangleRef.y,getModelAtIndex(triangleRef.x,scene));
-	
-	//Now as we have the vertices = Check how many cells does the triangle overlap
-	CL_UINT baseIndex = triangleRef.z * 3;
-	counters[triangleIndex] = countOverlappingCells(
-		 getVertexAt(getIndexAt(baseIndex,submesh),submesh),
-		 getVertexAt(getIndexAt(baseIndex + 1,submesh),submesh),
-		 getVertexAt(getIndexAt(baseIndex + 2,submesh),submesh),grid); 
+	leafRanges[idx] = idx > 0 ? min(offsets[idx - 1],referencesCapacity) : 0;
 }
 
-/* Creates and writes cell-primitive pair for specified triangle at specified index
-*  @param v0 First vertex of a triangle
-*  @param v1 Second vertex of a triangle
-*  @param v2 Third vertex of atriangle
+/* Calculates the range of top level cells overlapped by bounding box of a triangle - Clamped to the grid, as triangles
+*  updated after the grid bounds were calculated may extend beyond them
+*  @param v0 First vertex of the triangle
+*  @param v1 Second vertex of the triangle
+*  @param v2 Third vertex of the triangle
 *  @param grid The grid data
-*  @param firstPairIdx Index of the first pair related to the given triangle
-*  @param triangleIdx Index of given triangle
-*  @param pairsArray the target array to write pairs to
+*  @param [out] firstCell X-Y-Z coordinates of the first cell of the range
+*  @param [out] lastCell X-Y-Z coordinates of the last cell of the range - Inclusive
 *  @return
 */
-inline void writeOverlappingPairs(VERTEX_TYPE v0,VERTEX_TYPE v1,VERTEX_TYPE v2,
-								  CL_CONSTANT struct GridData* grid,
-								  CL_UINT firstPairIdx,
-						          CL_UINT triangleIdx,
-						          CL_GLOBAL CL_UINT2* pairsArray)
+inline void getTriangleCellRange(VERTEX_TYPE v0, VERTEX_TYPE v1, VERTEX_TYPE v2,
+								 CL_CONSTANT struct GridData* grid,
+								 CL_UINT3* firstCell,
+								 CL_UINT3* lastCell)
 {
-	
 	CL_FLOAT3 bboxOrigin = (CL_FLOAT3)combineToVector(grid->box.bounds[0].x,grid->box.bounds[0].y,grid->box.bounds[0].z);
 	CL_FLOAT3 gridStep = (CL_FLOAT3)combineToVector(grid->stepX,grid->stepY,grid->stepZ);
 	CL_UINT3 maxGridIdx = (CL_UINT3)combineToVector(grid->resX-1,grid->resY-1,grid->resZ-1);
 	//Calculate coordinates of first cell (The cell in which the min point located)
-	CL_UINT3 cell = MIN3(convert_uint3(FLOOR3((MIN3(v0,MIN3(v1,v2)) - bboxOrigin)/gridStep)),maxGridIdx);
+	*firstCell = MIN3(convert_uint3_sat(FLOOR3((MIN3(v0,MIN3(v1,v2)) - bboxOrigin)/gridStep)),maxGridIdx);
 	//Calculate extents - over how many cells the triangle BB spans?
-	CL_UINT3 cellExtents = MIN3(convert_uint3(FLOOR3((MAX3(v0,MAX3(v1,v2)) - bboxOrigin)/gridStep)),maxGridIdx);
-	
-	CL_UINT2 pair;
-	pair.y = triangleIdx;
-	CL_UINT cellCounter = 0;
-	//Filling the pairs
-	for (CL_UINT z = cell.z; z <= cellExtents.z; z++)
-		for (CL_UINT y = cell.y; y <= cellExtents.y; y++)
-			for (CL_UINT x = cell.x; x <= cellExtents.x; x++)
-			{
-				pair.x = getCellIndex(x,y,z,grid->resX,grid->resY,grid->resZ);
-				pairsArray[firstPairIdx + cellCounter] = pair;
-				cellCounter++;
-			}
+	*lastCell = MIN3(convert_uint3_sat(FLOOR3((MAX3(v0,MAX3(v1,v2)) - bboxOrigin)/gridStep)),maxGridIdx);
 }
 
-/* Creates and writes cell-primitive pair for specified triangle at specified index
+#ifndef _WIN32 //Binning functions use device atomics, and are not needed on host
+
+/* Bins a triangle into top level cells overlapped by its bounding box - Counting sort of cell-primitive pairs by cell.
+*  Counting pass increments the pair counter of each overlapped cell. Scatter pass writes a pair for each overlapped cell
+*  into the range of the cell, counting the counters back down to zero on the way.
 *  @param scene Scene
 *  @param triangleIndex Global index of a triangle in the scene
 *  @param grid The grid data
-*  @param Prefix Sum array of pair counts for each primitive
-*  @param Array of counts of pairs per each primitive
-*  @param pairsArray the target array to write pairs to
+*  @param cellCounters Array of pair counts per cell
+*  @param cellOffsets Inclusive prefix sum of pair counts per cell - Used by scatter pass only
+*  @param pairs The target array to write pairs to - Used by scatter pass only
+*  @param pairsCapacity Capacity of pairs array - Pairs beyond it are dropped
+*  @param scatter False for counting pass, true for scatter pass
+*  @param exactOverlap If true, the triangle is binned only into cells that it overlaps exactly, rather than into all 
+*                      cells overlapped by its bounding box. Must be the same for both passes
 *  @return
 */
-inline void writePairs(CL_GLOBAL const char* scene, 
-					 CL_UINT triangleIndex, 
-					 CL_CONSTANT struct GridData* grid,
-					 CL_GLOBAL CL_UINT* prefixSum,
-					 CL_GLOBAL CL_UINT* counters,
-					 CL_GLOBAL CL_UINT2* pairs)
+inline void binTriangleToCells(CL_GLOBAL const char* scene, 
+							   CL_UINT triangleIndex, 
+							   CL_CONSTANT struct GridData* grid,
+							   CL_GLOBAL CL_UINT* cellCounters,
+							   CL_GLOBAL const CL_UINT* cellOffsets,
+							   CL_GLOBAL CL_UINT2* pairs,
+							   CL_UINT pairsCapacity,
+							   bool scatter,
+							   bool exactOverlap)
 {
 	//Getting the references to the triangle
 	CL_UINT3 triangleRef = getTriangleRefByIndex(scene,triangleIndex);
 	CL_GLOBAL char* submesh = getMeshAtIndex(triangleRef.y,getModelAtIndex(triangleRef.x,scene));
-	CL_UINT myStart = prefixSum[triangleIndex] - counters[triangleIndex]; //The starting space in the pairs array;
-	//Prefix sum is the total so far, minus the quiantity of pairs per current triangle
-	writeOverlappingPairs(getVertexAt(getIndexAt(triangleRef.z * 3,submesh),submesh),
-									  getVertexAt(getIndexAt(triangleRef.z * 3 + 1,submesh),submesh),
-									  getVertexAt(getIndexAt(triangleRef.z * 3 + 2,submesh),submesh),
-									  grid,myStart,triangleIndex,pairs);
+	CL_UINT baseIndex = triangleRef.z * 3;
+	VERTEX_TYPE v0 = getVertexAt(getIndexAt(baseIndex,submesh),submesh);
+	VERTEX_TYPE v1 = getVertexAt(getIndexAt(baseIndex + 1,submesh),submesh);
+	VERTEX_TYPE v2 = getVertexAt(getIndexAt(baseIndex + 2,submesh),submesh);
+
+	CL_FLOAT3 bboxOrigin = (CL_FLOAT3)combineToVector(grid->box.bounds[0].x,grid->box.bounds[0].y,grid->box.bounds[0].z);
+	CL_FLOAT3 gridStep = (CL_FLOAT3)combineToVector(grid->stepX,grid->stepY,grid->stepZ);
+	CL_UINT3 cell, cellExtents;
+	getTriangleCellRange(v0,v1,v2,grid,&cell,&cellExtents);
+	
+	CL_UINT2 pair;
+	pair.y = triangleIndex;
+	CL_FLOAT3 cellHalfSize = gridStep * 0.5f;
+	for (CL_UINT z = cell.z; z <= cellExtents.z; z++)
+		for (CL_UINT y = cell.y; y <= cellExtents.y; y++)
+			for (CL_UINT x = cell.x; x <= cellExtents.x; x++)
+			{
+				if (exactOverlap)
+				{
+					CL_FLOAT3 cellCenter = bboxOrigin + (CL_FLOAT3)combineToVector((CL_FLOAT)x,(CL_FLOAT)y,(CL_FLOAT)z) * gridStep + cellHalfSize;
+					if (!AABBTriangleIntersect(cellCenter,cellHalfSize,v0,v1,v2))
+						continue;
+				}
+				pair.x = getCellIndex(x,y,z,grid->resX,grid->resY,grid->resZ);
+				if (scatter)
+				{
+					CL_UINT pairIdx = cellOffsets[pair.x] - atomic_dec(cellCounters + pair.x);
+					if (pairIdx < pairsCapacity)
+						pairs[pairIdx] = pair;
+				}
+				else
+					atomic_inc(cellCounters + pair.x);
+			}
 }
 
+#endif
+
 const CL_CONSTANT float oneThird = 1.0f / 3.0f;
 
 /* Calculates leaf cell resolution
@@ -204,24 +303,143 @@ inline CL_UINT3 calcLeafCellResolution(CL_UINT numOfPrims,CL_CONSTANT struct Gri
 	return convert_uint3(FLOOR3(cellExtents * a));
 }
 
+//Scales of the leaf resolution derived from leaf density, that are evaluated by adaptive leaf resolution
+#define ADAPTIVE_LEAF_CANDIDATES 5
+CL_CONSTANT const float adaptiveLeafScales[ADAPTIVE_LEAF_CANDIDATES] = {0.5f,0.7071f,1.0f,1.4142f,2.0f};
+//Relative costs of leaf cell step and ray-triangle intersection test, for adaptive leaf resolution
+#define ADAPTIVE_LEAF_COST_STEP 1.0f
+#define ADAPTIVE_LEAF_COST_INTERSECTION 4.0f
+//Maximal count of pairs of a top level cell, that are evaluated by adaptive leaf resolution - Larger cells are sampled
+#define ADAPTIVE_LEAF_SAMPLE_SIZE 64
+
+/* Chooses leaf resolution of a top level cell by local traversal cost estimate. Candidate resolutions are scaled from the
+*  resolution derived from leaf density, and the leaf pairs of each are counted from bounds of the cell's triangles, clipped to the cell.
+*  A ray crosses about (resX+resY+resZ)/3 leaf cells, testing the average count of pairs per leaf cell in each: Finer resolution
+*  lowers the occupancy, but adds steps, and duplicates the pairs of large triangles.
+*  Cells with more than ADAPTIVE_LEAF_SAMPLE_SIZE pairs are estimated from a sample of pairs evenly spaced over their range,
+*  so the work per cell is bounded also for the cells that hold most of the geometry.
+*  @param scene Scene
+*  @param pairs Top level cell-primitive pairs, sorted by cell
+*  @param rangeItem Range of the cell in pairs array
+*  @param grid Data about the Top Level Grid
+*  @param idx Top level cell index
+*  @param densityRes Leaf resolution derived from leaf density
+*  @return The chosen leaf resolution
+*/
+inline CL_UINT3 chooseAdaptiveLeafResolution(CL_GLOBAL const char* scene,
+											 CL_GLOBAL const CL_UINT2* pairs,
+											 CL_UINT2 rangeItem,
+											 CL_CONSTANT struct GridData* grid,
+											 CL_UINT idx,
+											 CL_UINT3 densityRes)
+{
+	CL_FLOAT3 gridStep = (CL_FLOAT3)combineToVector(grid->stepX,grid->stepY,grid->stepZ);
+	CL_UINT3 cellRef = getCellRefFromIndex(idx,grid->resX,grid->resY,grid->resZ);
+	CL_FLOAT3 cellOrigin = (CL_FLOAT3)combineToVector(grid->box.bounds[0].x + cellRef.x * gridStep.x,
+													  grid->box.bounds[0].y + cellRef.y * gridStep.y,
+													  grid->box.bounds[0].z + cellRef.z * gridStep.z);
+	CL_UINT3 candidates[ADAPTIVE_LEAF_CANDIDATES];
+	CL_FLOAT candidatePairs[ADAPTIVE_LEAF_CANDIDATES];
+	for (CL_UINT c = 0; c < ADAPTIVE_LEAF_CANDIDATES; c++)
+	{
+		candidates[c].x = max((CL_UINT)(densityRes.x * adaptiveLeafScales[c]),1u);
+		candidates[c].y = max((CL_UINT)(densityRes.y * adaptiveLeafScales[c]),1u);
+		candidates[c].z = max((CL_UINT)(densityRes.z * adaptiveLeafScales[c]),1u);
+		candidatePairs[c] = 0.0f;
+	}
+
+	CL_UINT pairsCount = rangeItem.y - rangeItem.x;
+	CL_UINT samples = min(pairsCount,(CL_UINT)ADAPTIVE_LEAF_SAMPLE_SIZE);
+	for (CL_UINT s = 0; s < samples; s++)
+	{
+		CL_UINT i = rangeItem.x + (CL_UINT)(((CL_ULONG)s * pairsCount) / samples);
+		CL_UINT3 triangleRef = getTriangleRefByIndex(scene,pairs[i].y);
+		CL_GLOBAL char* submesh = getMeshAtIndex(triangleRef.y,getModelAtIndex(triangleRef.x,scene));
+		CL_UINT baseIndex = triangleRef.z * 3;
+		VERTEX_TYPE v0 = getVertexAt(getIndexAt(baseIndex,submesh),submesh);
+		VERTEX_TYPE v1 = getVertexAt(getIndexAt(baseIndex + 1,submesh),submesh);
+		VERTEX_TYPE v2 = getVertexAt(getIndexAt(baseIndex + 2,submesh),submesh);
+		//Triangle bounds relatively to the cell, where the cell is [0,1] on each axis
+		CL_FLOAT3 lo = (MIN3(v0,MIN3(v1,v2)) - cellOrigin) / gridStep;
+		CL_FLOAT3 hi = (MAX3(v0,MAX3(v1,v2)) - cellOrigin) / gridStep;
+		for (CL_UINT c = 0; c < ADAPTIVE_LEAF_CANDIDATES; c++)
+		{
+			CL_UINT3 res = candidates[c];
+			CL_UINT spanX = min((CL_UINT)max(hi.x * res.x,0.0f),res.x - 1) - min((CL_UINT)max(lo.x * res.x,0.0f),res.x - 1) + 1;
+			CL_UINT spanY = min((CL_UINT)max(hi.y * res.y,0.0f),res.y - 1) - min((CL_UINT)max(lo.y * res.y,0.0f),res.y - 1) + 1;
+			CL_UINT spanZ = min((CL_UINT)max(hi.z * res.z,0.0f),res.z - 1) - min((CL_UINT)max(lo.z * res.z,0.0f),res.z - 1) + 1;
+			candidatePairs[c] += spanX * spanY * spanZ;
+		}
+	}
+
+	//Scaling the sampled counts to all pairs of the cell
+	CL_FLOAT sampleScale = (CL_FLOAT)pairsCount / max(samples,1u);
+
+	CL_UINT3 best = densityRes;
+	CL_FLOAT bestCost = FLT_MAX;
+	for (CL_UINT c = 0; c < ADAPTIVE_LEAF_CANDIDATES; c++)
+	{
+		CL_UINT3 res = candidates[c];
+		CL_FLOAT steps = (res.x + res.y + res.z) / 3.0f;
+		CL_FLOAT cost = steps * (ADAPTIVE_LEAF_COST_STEP + ADAPTIVE_LEAF_COST_INTERSECTION * candidatePairs[c] * sampleScale / (CL_FLOAT)(res.x * res.y * res.z));
+		if (cost < bestCost)
+		{
+			bestCost = cost;
+			best = res;
+		}
+	}
+	return best;
+}
+
+/* Scales leaf resolution down uniformly, to fit into leaf cells budget of a top level cell
+*  @param res Leaf resolution
+*  @param cellBudget Maximal count of leaf cells
+*  @return The clamped resolution - At least one leaf cell
+*/
+inline CL_UINT3 clampLeafResolution(CL_UINT3 res, CL_UINT cellBudget)
+{
+	CL_UINT leafCells = res.x * res.y * res.z;
+	if (leafCells <= cellBudget)
+		return res;
+	CL_FLOAT scale = pow((CL_FLOAT)cellBudget / leafCells,oneThird);
+	res.x = max((CL_UINT)(res.x * scale),1u);
+	res.y = max((CL_UINT)(res.y * scale),1u);
+	res.z = max((CL_UINT)(res.z * scale),1u);
+	return res;
+}
+
 /* Fills data for top level cell in two level grid
 *  @param range Leaf cell range
 *  @param leavesCount Leaf cell count per top level cell
 *  @param cells Top Level Cells array
 *  @param grid Data about the Top Level Grid
 *  @param idx Top level cell index
+*  @param scene Scene - Used by adaptive leaf resolution only
+*  @param pairs Top level cell-primitive pairs, sorted by cell - Used by adaptive leaf resolution only
+*  @param totalPairs Count of top level cell-primitive pairs
+*  @param adaptive If true, leaf resolution is chosen by chooseAdaptiveLeafResolution
+*  @param leafCellsBudget Budget of leaf cells for the grid, shared among top level cells by their count of pairs - 
+*                         Each nonempty cell gets at least one leaf cell. 0 for unlimited
 *  @return 
 */
-void fillTopLevelCell(CL_GLOBAL CL_UINT2* range, CL_GLOBAL CL_UINT* leavesCount, CL_GLOBAL struct TopLevelCell* cells,CL_CONSTANT struct GridData* grid, CL_UINT idx)
+void fillTopLevelCell(CL_GLOBAL CL_UINT2* range, CL_GLOBAL CL_UINT* leavesCount, CL_GLOBAL struct TopLevelCell* cells,CL_CONSTANT struct GridData* grid, CL_UINT idx,
+					  CL_GLOBAL const char* scene, CL_GLOBAL const CL_UINT2* pairs, CL_UINT totalPairs, bool adaptive, CL_UINT leafCellsBudget)
 {
 	CL_UINT2 rangeItem = range[idx];
 	CL_UINT3 res = calcLeafCellResolution(rangeItem.y - rangeItem.x,grid);
+	if (rangeItem.y > rangeItem.x)
+	{
+		if (adaptive)
+			res = chooseAdaptiveLeafResolution(scene,pairs,rangeItem,grid,idx,res);
+		if (leafCellsBudget > 0)
+			res = clampLeafResolution(res,max((CL_UINT)((CL_FLOAT)leafCellsBudget * (rangeItem.y - rangeItem.x) / max(totalPairs,1u)),1u));
+	}
 	struct TopLevelCell cell;
 	cell.resX = res.x;
 	cell.resY = res.y;
 	cell.resZ = res.z;
 	cells[idx] = cell;
-	leavesCount[idx] = res.x * res.y * res.z;
+	leavesCount[idx] = getCellCount(res.x,res.y,res.z);
 }
 
 /* Calculates number of leaf cells according to number of primitives 
@@ -238,102 +456,47 @@ inline CL_UINT countLeafCells(CL_UINT numOfPrims,CL_CONSTANT struct GridData* gr
 
 
 
-/**
-* Counts maximum LEAF pairs will be generated for each triangle.
-* Still a less precise test based on boundin box - To gain some speed at counting. When pairs will be 
-* generated, the precise method should be used
-* @param v0 First vertex of triangle
-* @param v1 Second vertex of triangle
-* @param v2 Third vertex of triangle
-* @param topLevelCellIdx Index of top level cell
-* @param grid Data about the grid
-* @return Maximal number of leaf cell-primitive pairs
-*/
-inline CL_UINT countOverlappingLeafCells(VERTEX_TYPE v0,VERTEX_TYPE v1,VERTEX_TYPE v2, 
-										 CL_GLOBAL struct TopLevelCell* topLevelCell,
-										 CL_UINT topLevelCellIdx, 
-										 CL_CONSTANT struct GridData* grid)
-{
-	struct AABB triangleAABB = calculateTriangleAABB(v0,v1,v2);
-
-	CL_FLOAT leafStepX = grid->stepX / topLevelCell->resX;
-	CL_FLOAT leafStepY = grid->stepY / topLevelCell->resY;
-	CL_FLOAT leafStepZ = grid->stepZ / topLevelCell->resZ;
-	CL_UINT3 topLevelCoordinates = getCellRefFromIndex(topLevelCellIdx,grid->resX,grid->resY,grid->resZ);
-	CL_FLOAT topBaseX = grid->box.bounds[0].x + topLevelCoordinates.x * grid->stepX;
-	CL_FLOAT topBaseY = grid->box.bounds[0].y + topLevelCoordinates.y * grid->stepY;
-	CL_FLOAT topBaseZ = grid->box.bounds[0].z + topLevelCoordinates.z * grid->stepZ;
-
-	CL_UINT relevantLeafCount = 0;
-	struct AABB leafCell;
-	for (CL_UINT z = 0; z < topLevelCell->resZ; z++)
-		for (CL_UINT y = 0; y < topLevelCell->resY; y++)
-			for (CL_UINT x = 0; x < topLevelCell->resX; x++)
-			{
-				leafCell.bounds[0].x = topBaseX + x * leafStepX; 
-				leafCell.bounds[0].y = topBaseY + y * leafStepY; 
-				leafCell.bounds[0].z = topBaseZ + z * leafStepZ; 
-				leafCell.bounds[1].x = leafCell.bounds[0].x + leafStepX;
-				leafCell.bounds[1].y = leafCell.bounds[0].y + leafStepY;
-				leafCell.bounds[1].z = leafCell.bounds[0].z + leafStepZ;
-				relevantLeafCount += (CL_UINT)AABBOverlaps(leafCell,triangleAABB);
-			}
-	return relevantLeafCount;
-}
+#ifndef _WIN32 //Binning functions use device atomics, and are not needed on host
 
 /**
-* Counts maximum LEAF pairs will be generated for each triangle.
-* Still a less precise test based on boundin box - To gain some speed at counting. When pairs will be 
-* generated, the precise method should be used
+* Bins a top level cell-primitive pair into the leaf cells of the top level cell that the primitive overlaps, using a precise
+* triangle-box test on the leaf cells overlapped by the triangle's bounding box only - Counting sort of leaf cell-primitive
+* pairs by leaf cell, with passes as in binTriangleToCells
 * @param scene Scene 
 * @param topLevelPairs Array of top level pairs
 * @param topLevelPairIdx Index of the processed top level pair
 * @param grid Data about the grid
-* @param array of top level cells
-* @return Maximal number of leaf cell-primitive pairs
+* @param topLevelCells Array of top level cells
+* @param leafCounters Array of pair counts per leaf cell
+* @param leafOffsets Inclusive prefix sum of pair counts per leaf cell - Used by scatter pass only
+* @param references Array for output: Triangle index per leaf pair, as traversal needs no leaf cell index - Used by scatter pass only
+* @param leafCellsCapacity Capacity of leaf cell arrays - Leaf cells beyond it are skipped
+* @param referencesCapacity Capacity of references array - Pairs beyond it are dropped
+* @param scatter False for counting pass, true for scatter pass
+* @return 
 */
-inline CL_UINT countLeafPairs(CL_GLOBAL const char* scene, 
-									 CL_GLOBAL CL_UINT2* topLevelPairs,
-									 CL_UINT topLevelPairIdx,
-									 CL_CONSTANT struct GridData* grid,
-									 CL_GLOBAL struct TopLevelCell* topLevelCells)
+inline void binPairToLeafCells(CL_GLOBAL const char* scene,
+							   CL_GLOBAL CL_UINT2* topLevelPairs,
+							   CL_UINT topLevelPairIdx,
+							   CL_CONSTANT struct GridData* grid,
+							   CL_GLOBAL struct TopLevelCell* topLevelCells,
+							   CL_GLOBAL CL_UINT* leafCounters,
+							   CL_GLOBAL const CL_UINT* leafOffsets,
+							   CL_GLOBAL CL_UINT* references,
+							   CL_UINT leafCellsCapacity,
+							   CL_UINT referencesCapacity,
+							   bool scatter)
 {
 	//Getting the references to the triangle
 	CL_UINT2 topLevelPair = topLevelPairs[topLevelPairIdx];
 	CL_UINT3 triangleRef = getTriangleRefByIndex(scene,topLevelPair.y);
 	CL_GLOBAL char* submesh = getMeshAtIndex(triangleRef.y,getModelAtIndex(triangleRef.x,scene));
-	
-	//Now as we have the vertices = Check how many leaf cells does the triangle overlap
 	CL_UINT baseIdx = triangleRef.z * 3;
-	return countOverlappingLeafCells(
-		 getVertexAt(getIndexAt(baseIdx,submesh),submesh),
-		 getVertexAt(getIndexAt(baseIdx + 1,submesh),submesh),
-		 getVertexAt(getIndexAt(baseIdx + 2,submesh),submesh),
-		 (topLevelCells + topLevelPair.x),
-		 topLevelPair.x,
-		 grid);
-}
+	VERTEX_TYPE v0 = getVertexAt(getIndexAt(baseIdx,submesh),submesh);
+	VERTEX_TYPE v1 = getVertexAt(getIndexAt(baseIdx + 1,submesh),submesh);
+	VERTEX_TYPE v2 = getVertexAt(getIndexAt(baseIdx + 2,submesh),submesh);
+	struct TopLevelCell topLevelCell = topLevelCells[topLevelPair.x];
 
-
-/**
-* Generates leaf cell - primitive pairs per primitive using a precise test
-* @param v0 First vertex of triangle
-* @param v1 Second vertex of triangle
-* @param v2 Third vertex of triangle
-* @param grid Data about the grid
-* @param topLevelCell Top level cell
-* @param Processed top level pair
-* @param startIndex the start index in output array, place to store the generated pairs
-* @param pairs Array for output
-* @return 
-*/
-inline void writeOverlappingLeafPairs(VERTEX_TYPE v0,VERTEX_TYPE v1,VERTEX_TYPE v2,
-									  CL_CONSTANT struct GridData* grid,
-									  struct TopLevelCell topLevelCell,
-									  CL_UINT2 topLevelPair,
-			                          CL_UINT startIndex,
-									  CL_GLOBAL CL_UINT2* pairs)
-{
 	CL_FLOAT leafStepX = grid->stepX / topLevelCell.resX;
 	CL_FLOAT leafStepY = grid->stepY / topLevelCell.resY;
 	CL_FLOAT leafStepZ = grid->stepZ / topLevelCell.resZ;
@@ -341,87 +504,338 @@ inline void writeOverlappingLeafPairs(VERTEX_TYPE v0,VERTEX_TYPE v1,VERTEX_TYPE
 	CL_FLOAT topBaseX = grid->box.bounds[0].x + topLevelCoordinates.x * grid->stepX;
 	CL_FLOAT topBaseY = grid->box.bounds[0].y + topLevelCoordinates.y * grid->stepY;
 	CL_FLOAT topBaseZ = grid->box.bounds[0].z + topLevelCoordinates.z * grid->stepZ;	
-	CL_UINT relevantLeafCount = 0;
 	CL_UINT2 pair;
 	pair.y = topLevelPair.y;
 	CL_FLOAT3 leafCellCenter,leafCellHalfSize;
 	leafCellHalfSize.x = leafStepX * 0.5f;
 	leafCellHalfSize.y = leafStepY * 0.5f;
 	leafCellHalfSize.z = leafStepZ * 0.5f;
-	for (CL_UINT z = 0; z < topLevelCell.resZ; z++)
-		for (CL_UINT y = 0; y < topLevelCell.resY; y++)
-			for (CL_UINT x = 0; x < topLevelCell.resX; x++)
+
+	//Range of leaf cells overlapped by triangle bounding box, clipped to the top level cell
+	CL_FLOAT3 triangleMin = MIN3(v0,MIN3(v1,v2));
+	CL_FLOAT3 triangleMax = MAX3(v0,MAX3(v1,v2));
+	CL_UINT firstX = min((CL_UINT)max((triangleMin.x - topBaseX) / leafStepX,0.0f),topLevelCell.resX - 1);
+	CL_UINT firstY = min((CL_UINT)max((triangleMin.y - topBaseY) / leafStepY,0.0f),topLevelCell.resY - 1);
+	CL_UINT firstZ = min((CL_UINT)max((triangleMin.z - topBaseZ) / leafStepZ,0.0f),topLevelCell.resZ - 1);
+	CL_UINT lastX = min((CL_UINT)max((triangleMax.x - topBaseX) / leafStepX,0.0f),topLevelCell.resX - 1);
+	CL_UINT lastY = min((CL_UINT)max((triangleMax.y - topBaseY) / leafStepY,0.0f),topLevelCell.resY - 1);
+	CL_UINT lastZ = min((CL_UINT)max((triangleMax.z - topBaseZ) / leafStepZ,0.0f),topLevelCell.resZ - 1);
+	for (CL_UINT z = firstZ; z <= lastZ && z < topLevelCell.resZ; z++)
+		for (CL_UINT y = firstY; y <= lastY && y < topLevelCell.resY; y++)
+			for (CL_UINT x = firstX; x <= lastX && x < topLevelCell.resX; x++)
 			{
 				leafCellCenter.x = topBaseX + x * leafStepX + leafCellHalfSize.x; 
 				leafCellCenter.y = topBaseY + y * leafStepY + leafCellHalfSize.y; 
 				leafCellCenter.z = topBaseZ + z * leafStepZ + leafCellHalfSize.z;	
-				if (AABBTriangleIntersect(leafCellCenter,leafCellHalfSize,v0,v1,v2))
+				pair.x = getCellIndex(x,y,z,topLevelCell.resX,topLevelCell.resY,topLevelCell.resZ) + topLevelCell.firstLeafIdx;
+				if (pair.x < leafCellsCapacity && AABBTriangleIntersect(leafCellCenter,leafCellHalfSize,v0,v1,v2))
 				{
-					pair.x = getCellIndex(x,y,z,topLevelCell.resX,topLevelCell.resY,topLevelCell.resZ) + topLevelCell.firstLeafIdx;
-					pairs[startIndex + relevantLeafCount] = pair;
-					relevantLeafCount++;
+					if (scatter)
+					{
+						CL_UINT pairIdx = leafOffsets[pair.x] - atomic_dec(leafCounters + pair.x);
+						if (pairIdx < referencesCapacity)
+							references[pairIdx] = pair.y;
+					}
+					else
+						atomic_inc(leafCounters + pair.x);
 				}
 			}
 }
 
-/**
-* Generates leaf cell - primitive pairs array
-* @param scene Scene 
-* @param topLevelPairs Array of top level pairs
-* @param topLevelCells array of top level cells
-* @param tlpIndex Index of the processed top level pair
-* @param grid Data about the grid
-* @param prefixSum Array that contains counts of leaf cells so far (Result of prefix-sum)
-* @param counters Array of counters of expected leaf-cell-primitive pairs
-* @param pairs Array for output
-* @return 
+/*************************************************************
+* Incremental Update Functions
+* Top level cells overlapped by old or new bounds of changed triangles are rebuilt, and their top level pairs,
+* leaf cells and leaf pairs are appended past the used parts of the arrays. The replaced data stays in place
+* as garbage, until the grid is rebuilt.
+**************************************************************/
+
+/* Collects top level cells of a cell range into the list of cells affected by update - Each cell is collected once
+*  @param cellRange Linear indices of the first and last cells of the range
+*  @param grid The grid data
+*  @param affectedFlags Flag per top level cell, that is set when the cell is collected
+*  @param affectedCells List of affected cells
+*  @param updateCounts Counts maintained during update - See UPDATE_AFFECTED_CELLS etc.
+*  @return
 */
-inline void writeLeafPairs(CL_GLOBAL const char* scene,
-						   CL_GLOBAL CL_UINT2* topLevelPairs,
-						   CL_GLOBAL struct TopLevelCell* topLevelCells,
-						   CL_UINT tlpIndex, 
-					       CL_CONSTANT struct GridData* grid,
-					       CL_GLOBAL CL_UINT* prefixSum,
-					       CL_GLOBAL CL_UINT* counters,
-					       CL_GLOBAL CL_UINT2* pairs)
+inline void collectAffectedCells(CL_UINT2 cellRange,
+								 CL_CONSTANT struct GridData* grid,
+								 CL_GLOBAL CL_UINT* affectedFlags,
+								 CL_GLOBAL CL_UINT* affectedCells,
+								 CL_GLOBAL CL_UINT* updateCounts)
 {
-	CL_UINT myStart = prefixSum[tlpIndex] - counters[tlpIndex]; //The starting space in the pairs array;
-	//Prefix sum is the total so far, minus the quiantity of pairs per current top level pair
-	CL_UINT2 topLevelPair = topLevelPairs[tlpIndex];
-	
-	CL_UINT3 triangleRef = getTriangleRefByIndex(scene,topLevelPair.y);
-	CL_GLOBAL char* submesh = getMeshAtIndex(triangleRef.y,getModelAtIndex(triangleRef.x,scene));
+	CL_UINT3 first = getCellRefFromIndex(cellRange.x,grid->resX,grid->resY,grid->resZ);
+	CL_UINT3 last = getCellRefFromIndex(cellRange.y,grid->resX,grid->resY,grid->resZ);
+	for (CL_UINT z = first.z; z <= last.z; z++)
+		for (CL_UINT y = first.y; y <= last.y; y++)
+			for (CL_UINT x = first.x; x <= last.x; x++)
+			{
+				CL_UINT cell = getCellIndex(x,y,z,grid->resX,grid->resY,grid->resZ);
+				if (0 == atomic_xchg(affectedFlags + cell,1))
+					affectedCells[atomic_inc(updateCounts + UPDATE_AFFECTED_CELLS)] = cell;
+			}
+}
+
+/* Allocates new range for top level pairs of an affected cell, past the used part of pairs array, and moves the pairs
+*  of unchanged triangles there. Pairs of changed triangles are scattered into the rest of the range by binTriangleToCells.
+*  @param cell Index of the affected cell
+*  @param changedFlags Flag per triangle, set for changed triangles
+*  @param cellCounters Counts of pairs of changed triangles per cell
+*  @param cellOffsets Output: End of the new range per cell, for scatter of the pairs of changed triangles
+*  @param cellRanges Ranges of top level cells in pairs array
+*  @param pairs Top level pairs array
+*  @param updateCounts Counts maintained during update - See UPDATE_PAIRS_TAIL etc.
+*  @param pairsCapacity Capacity of pairs array
+*  @return
+*/
+inline void reallocateAffectedCell(CL_UINT cell,
+								   CL_GLOBAL const CL_UINT* changedFlags,
+								   CL_GLOBAL const CL_UINT* cellCounters,
+								   CL_GLOBAL CL_UINT* cellOffsets,
+								   CL_GLOBAL CL_UINT2* cellRanges,
+								   CL_GLOBAL CL_UINT2* pairs,
+								   CL_GLOBAL CL_UINT* updateCounts,
+								   CL_UINT pairsCapacity)
+{
+	//Old range lies before the tail, so it's not overwritten by the appended data
+	CL_UINT2 oldRange = cellRanges[cell];
+	CL_UINT kept = 0;
+	for (CL_UINT i = oldRange.x; i < oldRange.y; i++)
+		if (0 == changedFlags[pairs[i].y])
+			kept++;
+	CL_UINT total = kept + cellCounters[cell];
+	CL_UINT first = atomic_add(updateCounts + UPDATE_PAIRS_TAIL,total);
+	if (first + total > pairsCapacity)
+		atomic_or(updateCounts + UPDATE_OVERFLOW,1);
+
+	CL_UINT next = first;
+	for (CL_UINT i = oldRange.x; i < oldRange.y; i++)
+	{
+		CL_UINT2 pair = pairs[i];
+		if (0 == changedFlags[pair.y])
+		{
+			if (next < pairsCapacity)
+				pairs[next] = pair;
+			next++;
+		}
+	}
+	cellOffsets[cell] = first + total;
+	CL_UINT2 range;
+	range.x = min(first,pairsCapacity);
+	range.y = min(first + total,pairsCapacity);
+	cellRanges[cell] = range;
+}
+
+/* Rebuilds data of an affected top level cell from its new range of pairs, and allocates its leaf cells past the
+*  used part of leaf cells array - With an extra leaf cell, that holds the end of the range of the last leaf
+*  @param cell Index of the affected cell
+*  @param cellRanges Ranges of top level cells in pairs array
+*  @param leafCounts Output: Leaf cell count per top level cell
+*  @param topLevelCells Top level cells array
+*  @param grid The grid data
+*  @param scene Scene
+*  @param pairs Top level pairs array
+*  @param totalPairs Count of top level pairs in the last build, for leaf cells budget
+*  @param adaptive If true, leaf resolution is chosen by chooseAdaptiveLeafResolution
+*  @param leafCellsBudget Budget of leaf cells - See fillTopLevelCell
+*  @param updateCounts Counts maintained during update - See UPDATE_LEAF_CELLS_TAIL etc.
+*  @param leafCellsCapacity Capacity of leaf cells array
+*  @return
+*/
+inline void rebuildAffectedCell(CL_UINT cell,
+								CL_GLOBAL CL_UINT2* cellRanges,
+								CL_GLOBAL CL_UINT* leafCounts,
+								CL_GLOBAL struct TopLevelCell* topLevelCells,
+								CL_CONSTANT struct GridData* grid,
+								CL_GLOBAL const char* scene,
+								CL_GLOBAL const CL_UINT2* pairs,
+								CL_UINT totalPairs,
+								bool adaptive,
+								CL_UINT leafCellsBudget,
+								CL_GLOBAL CL_UINT* updateCounts,
+								CL_UINT leafCellsCapacity)
+{
+	fillTopLevelCell(cellRanges,leafCounts,topLevelCells,grid,cell,scene,pairs,totalPairs,adaptive,leafCellsBudget);
+	struct TopLevelCell topLevelCell = topLevelCells[cell];
+	CL_UINT leaves = leafCounts[cell];
+	topLevelCell.firstLeafIdx = atomic_add(updateCounts + UPDATE_LEAF_CELLS_TAIL,leaves + 1);
+	if (topLevelCell.firstLeafIdx + leaves + 1 > leafCellsCapacity)
+	{
+		//Leaves don't fit - The cell is left empty, until the grid is rebuilt
+		atomic_or(updateCounts + UPDATE_OVERFLOW,1);
+		topLevelCell.resX = topLevelCell.resY = topLevelCell.resZ = 0;
+	}
+	topLevelCells[cell] = topLevelCell;
+}
+
+/* Writes ranges of the leaf cells of an affected top level cell, in a new range of leaf pairs that is allocated past
+*  the used part of leaf pairs array
+*  @param cell Index of the affected cell
+*  @param topLevelCells Top level cells array
+*  @param leafCounters Pair counts per leaf cell
+*  @param leafOffsets Output: Inclusive end of range per leaf cell, for scatter of leaf pairs
+*  @param leafRanges Beginnings of ranges of leaf cells in leaf references array - See writeLeafRange
+*  @param updateCounts Counts maintained during update - See UPDATE_LEAF_PAIRS_TAIL etc.
+*  @param leafPairsCapacity Capacity of leaf references array
+*  @return
+*/
+inline void writeAffectedLeafRanges(CL_UINT cell,
+									CL_GLOBAL const struct TopLevelCell* topLevelCells,
+									CL_GLOBAL const CL_UINT* leafCounters,
+									CL_GLOBAL CL_UINT* leafOffsets,
+									CL_GLOBAL CL_UINT* leafRanges,
+									CL_GLOBAL CL_UINT* updateCounts,
+									CL_UINT leafPairsCapacity)
+{
+	struct TopLevelCell topLevelCell = topLevelCells[cell];
+	CL_UINT leaves = getCellCount(topLevelCell.resX,topLevelCell.resY,topLevelCell.resZ);
+	CL_UINT total = 0;
+	for (CL_UINT i = 0; i < leaves; i++)
+		total += leafCounters[topLevelCell.firstLeafIdx + i];
+	CL_UINT offset = atomic_add(updateCounts + UPDATE_LEAF_PAIRS_TAIL,total);
+	if (offset + total > leafPairsCapacity)
+		atomic_or(updateCounts + UPDATE_OVERFLOW,1);
+	for (CL_UINT i = 0; i < leaves; i++)
+	{
+		CL_UINT leaf = topLevelCell.firstLeafIdx + i;
+		CL_UINT count = leafCounters[leaf];
+		leafRanges[leaf] = min(offset,leafPairsCapacity);
+		offset += count;
+		leafOffsets[leaf] = offset;
+	}
+	//End of the range of the last leaf
+	leafRanges[topLevelCell.firstLeafIdx + leaves] = min(offset,leafPairsCapacity);
+}
+
+#endif
+
+/*************************************************************
+* Empty Space Skipping Functions
+**************************************************************/
+
+//Proximities of empty cells are capped at this distance, in top level cells
+#define PROXIMITY_MAX_DISTANCE 8
+
+/* Calculates proximity of top level cell along one axis, from proximities along previous axes: Distance to the nearest
+*  occupied cell is separable, as maximum of the distances along the axes. Cells outside the grid count as empty.
+*  @param cells Top level cells - Occupancy is taken from them for first axis
+*  @param input Proximities along previous axes - Not used for first axis
+*  @param grid The grid data
+*  @param idx Top level cell index
+*  @param axis The axis - iX, iY or iZ, in this order
+*  @return Proximity of the cell along the axis and previous axes
+*/
+inline CL_UINT proximityAlongAxis(CL_GLOBAL const struct TopLevelCell* cells,
+								  CL_GLOBAL const CL_UINT* input,
+								  CL_CONSTANT struct GridData* grid,
+								  CL_UINT idx,
+								  CL_UINT axis)
+{
+	const int res[3] = {(int)grid->resX,(int)grid->resY,(int)grid->resZ};
+	CL_UINT3 ref = getCellRefFromIndex(idx,grid->resX,grid->resY,grid->resZ);
+	int coord[3] = {(int)ref.x,(int)ref.y,(int)ref.z};
+	//Gap in Morton order
+	if (coord[iX] >= res[iX] || coord[iY] >= res[iY] || coord[iZ] >= res[iZ])
+		return PROXIMITY_MAX_DISTANCE;
 
-	writeOverlappingLeafPairs(getVertexAt(getIndexAt(triangleRef.z * 3,submesh),submesh),
-						  getVertexAt(getIndexAt(triangleRef.z * 3 + 1,submesh),submesh),
-						  getVertexAt(getIndexAt(triangleRef.z * 3 + 2,submesh),submesh),
-						  grid,
-						  topLevelCells[topLevelPair.x],
-						  topLevelPair,
-						  myStart,pairs);
-	 
+	const int center = coord[axis];
+	CL_UINT proximity = PROXIMITY_MAX_DISTANCE;
+	for (int offset = 1 - PROXIMITY_MAX_DISTANCE; offset < PROXIMITY_MAX_DISTANCE; offset++)
+	{
+		if (center + offset < 0 || center + offset >= res[axis])
+			continue;
+		coord[axis] = center + offset;
+		CL_UINT neighbor = getCellIndex(coord[iX],coord[iY],coord[iZ],grid->resX,grid->resY,grid->resZ);
+		CL_UINT value = axis == iX ? (cells[neighbor].resX == 0 ? PROXIMITY_MAX_DISTANCE : 0) : input[neighbor];
+		proximity = min(proximity,max((CL_UINT)abs(offset),value));
+	}
+	return proximity;
 }
 
 /*************************************************************
 * Grid Traversal Functions
 **************************************************************/
 
+//Number of entries in the per-ray mailbox of triangles that were tested. Must be a power of two,
+//0 disables mailboxing. Set by the compile options of TwoLevelGridManager
+#ifndef TLG_MAILBOX_SIZE
+#define TLG_MAILBOX_SIZE 0
+#endif
+
+/**
+* struct TriangleMailbox - Direct mapped set of recently tested triangles of a ray, by global triangle index.
+* Triangles that span several leaf cells are then not tested again in each cell visited by the ray.
+*/
+struct TriangleMailbox
+{
+	CL_UINT ids[TLG_MAILBOX_SIZE > 0 ? TLG_MAILBOX_SIZE : 1];
+};
+
+/**
+* Empties the mailbox
+* @param mailbox The mailbox
+*/
+inline void mailboxClear(struct TriangleMailbox* mailbox)
+{
+#if TLG_MAILBOX_SIZE > 0
+	for (int i = 0; i < TLG_MAILBOX_SIZE; i++)
+		mailbox->ids[i] = UINT_MAX;
+#endif
+}
+
+/**
+* Checks whether triangle was tested by the ray
+* @param mailbox The mailbox
+* @param triangle Global index of the triangle
+* @return True if the triangle is in the mailbox
+*/
+inline bool mailboxContains(const struct TriangleMailbox* mailbox,CL_UINT triangle)
+{
+#if TLG_MAILBOX_SIZE > 0
+	return mailbox->ids[triangle & (TLG_MAILBOX_SIZE - 1)] == triangle;
+#else
+	return false;
+#endif
+}
+
+/**
+* Stores triangle in the mailbox, replacing the triangle that was mapped to the same entry
+* @param mailbox The mailbox
+* @param triangle Global index of the triangle
+*/
+inline void mailboxInsert(struct TriangleMailbox* mailbox,CL_UINT triangle)
+{
+#if TLG_MAILBOX_SIZE > 0
+	mailbox->ids[triangle & (TLG_MAILBOX_SIZE - 1)] = triangle;
+#endif
+}
+
 /**
 * Traverses leaf cells in a top level cell in a Two Level Grid
+* @implNote The leaf level DDA is derived from the DDA state of the top level, as the leaf cells subdivide
+*           the ray parameter increments of the top level cell evenly - No slab test is needed per cell
 * @param ray Ray to test for hit 
+* @param invRay Inverse direction and octant of the ray, precomputed once per ray
 * @param scene Buffer that contains the scene
 * @param topLevelCell Top level cell
 * @param cellBox Bounding box of top level cell
-* @param leavesArray leaf cells array - Represented as ranges in Reference array
-* @param pairsRefArray The cell-primitive reference array
-* @return Information about closest intersection of ray and primitive within top level cell
+* @param cellNext Ray parameter at which the ray exits the top level cell along each axis, from top level DDA
+* @param cellDt Ray parameter increments per top level cell along each axis, from top level DDA
+* @param leavesArray leaf cells array - Represented as beginnings of ranges in Reference array, see writeLeafRange
+* @param pairsRefArray The reference array - Triangle index per leaf cell-primitive pair
+* @param mailbox Triangles tested by the ray in previously visited cells, which are not tested again
+* @return Information about closest intersection of ray and primitive within (ray.tMin,ray.tMax) that was found
+*         in the top level cell - The hit may lie beyond the cell, if the ray exits the cell before it
 */
 struct Contact processTopLevelCell(const struct Ray ray,
+									const struct InverseRay invRay,
 									CL_GLOBAL const char* scene,
 									struct TopLevelCell topLevelCell,
 									struct AABB cellBox,
-									CL_GLOBAL CL_UINT2* leavesArray,
-									CL_GLOBAL CL_UINT2* pairsRefArray)
+									const float* cellNext,
+									const float* cellDt,
+									CL_GLOBAL const CL_UINT* leavesArray,
+									CL_GLOBAL const CL_UINT* pairsRefArray,
+									struct TriangleMailbox* mailbox)
 {
 
 	float 	next[3];
@@ -431,69 +845,37 @@ struct Contact processTopLevelCell(const struct Ray ray,
 	float dt[3];
 	
 	{
-		float tx_min, ty_min, tz_min;
-		float tx_max, ty_max, tz_max; 
+		const int res[3] = {(int)topLevelCell.resX,(int)topLevelCell.resY,(int)topLevelCell.resZ};
+		const float direction[3] = {ray.direction.x,ray.direction.y,ray.direction.z};
+		const float origin[3] = {ray.origin.x,ray.origin.y,ray.origin.z};
+		const float lower[3] = {cellBox.bounds[0].x,cellBox.bounds[0].y,cellBox.bounds[0].z};
+		const float upper[3] = {cellBox.bounds[1].x,cellBox.bounds[1].y,cellBox.bounds[1].z};
 
-		float a = 1.0f / ray.direction.x;
-		tx_min = ((a >= 0.0f ? cellBox.bounds[0].x : cellBox.bounds[1].x) - ray.origin.x) * a;
-		tx_max = ((a >= 0.0f ? cellBox.bounds[1].x : cellBox.bounds[0].x) - ray.origin.x) * a;
-	
-		a = 1.0f / ray.direction.y;
-		ty_min = ((a >= 0.0f ? cellBox.bounds[0].y : cellBox.bounds[1].y) - ray.origin.y) * a;
-		ty_max = ((a >= 0.0f ? cellBox.bounds[1].y : cellBox.bounds[0].y) - ray.origin.y) * a;
-	
-		a = 1.0 / ray.direction.z;
-		tz_min = ((a >= 0.0f ? cellBox.bounds[0].z : cellBox.bounds[1].z) - ray.origin.z) * a;
-		tz_max = ((a >= 0.0f ? cellBox.bounds[1].z : cellBox.bounds[0].z) - ray.origin.z) * a;
-	
-		CL_FLOAT3 p = isPointInside(cellBox,ray.origin) ? ray.origin : ray.origin + (ray.direction * min(tx_min,min(ty_min,tz_min))); 
-	
-		idx[iX] = clamp((p.x - cellBox.bounds[0].x) * (float)topLevelCell.resX / (cellBox.bounds[1].x - cellBox.bounds[0].x), 0.0f, (float)topLevelCell.resX - 1);
-		idx[iY] = clamp((p.y - cellBox.bounds[0].y) * (float)topLevelCell.resY / (cellBox.bounds[1].y - cellBox.bounds[0].y), 0.0f, (float)topLevelCell.resY - 1);
-		idx[iZ] = clamp((p.z - cellBox.bounds[0].z) * (float)topLevelCell.resZ / (cellBox.bounds[1].z - cellBox.bounds[0].z), 0.0f, (float)topLevelCell.resZ - 1);
+		//Ray parameter at which the ray enters the cell along each axis - Axes the ray is parallel to don't bound it
+		float cellNear[3];
+		for (int axis = 0; axis < 3; axis++)
+			cellNear[axis] = direction[axis] == 0.0f ? -FLT_MAX : cellNext[axis] - cellDt[axis];
+		float tEnter = max(max(cellNear[iX],max(cellNear[iY],cellNear[iZ])),0.0f);
 
-		// ray parameter increments per cell in the x, y, and z directions
-		dt[iX] = (tx_max - tx_min) / topLevelCell.resX;
-		dt[iY] = (ty_max - ty_min) / topLevelCell.resY;
-		dt[iZ] = (tz_max - tz_min) / topLevelCell.resZ;
-		
-		if (ray.direction.x > 0.0f) 
+		for (int axis = 0; axis < 3; axis++)
 		{
-			next[iX] = tx_min + (idx[iX] + 1) * dt[iX];
-			step[iX] = +1;
-			stop[iX] = topLevelCell.resX;
-		}
-		else 
-		{
-			next[iX] = ray.direction.x == 0.0f ? FLT_MAX : tx_min + (topLevelCell.resX - idx[iX]) * dt[iX];
-			step[iX] = -1;
-			stop[iX] = -1;
-		}
-
-		if (ray.direction.y > 0) 
-		{
-			next[iY] = ty_min + (idx[iY] + 1) * dt[iY];
-			step[iY] = +1;
-			stop[iY] = topLevelCell.resY;
-		}
-		else 
-		{
-			next[iY] = ray.direction.y == 0.0f ? FLT_MAX : ty_min + (topLevelCell.resY - idx[iY]) * dt[iY];
-			step[iY] = -1;
-			stop[iY] = -1;
-		}
-		
-		if (ray.direction.z > 0) 
-		{
-			next[iZ] = tz_min + (idx[iZ] + 1) * dt[iZ];
-			step[iZ] = +1;
-			stop[iZ] = topLevelCell.resZ;
-		}
-		else 
-		{
-			next[iZ] = ray.direction.z == 0.0f? FLT_MAX : tz_min + (topLevelCell.resZ - idx[iZ]) * dt[iZ];
-			step[iZ] = -1;
-			stop[iZ] = -1;
+			step[axis] = 1 - 2 * (int)invRay.sign[axis];
+			stop[axis] = invRay.sign[axis] ? -1 : res[axis];
+			if (direction[axis] == 0.0f)
+			{
+				//Leaf index along the axis is constant
+				idx[axis] = clamp((int)((origin[axis] - lower[axis]) * (float)res[axis] / (upper[axis] - lower[axis])), 0, res[axis] - 1);
+				dt[axis] = FLT_MAX;
+				next[axis] = FLT_MAX;
+			}
+			else
+			{
+				// ray parameter increments per leaf cell, and number of leaf cells crossed before entering the cell
+				dt[axis] = cellDt[axis] / (float)res[axis];
+				int crossed = clamp((int)((tEnter - cellNear[axis]) / dt[axis]), 0, res[axis] - 1);
+				idx[axis] = invRay.sign[axis] ? res[axis] - 1 - crossed : crossed;
+				next[axis] = cellNear[axis] + (crossed + 1) * dt[axis];
+			}
 		}
 	}
 	// traverse the grid
@@ -501,7 +883,7 @@ struct Contact processTopLevelCell(const struct Ray ray,
 	result.normalAndintersectionDistance.x = 0.0f;
 	result.normalAndintersectionDistance.y = 0.0f;
 	result.normalAndintersectionDistance.z = 0.0f;
-	result.normalAndintersectionDistance.w = FLT_MAX;
+	result.normalAndintersectionDistance.w = ray.tMax;
 	bool contactFound = false;
 
 	while (true) 
@@ -515,53 +897,69 @@ struct Contact processTopLevelCell(const struct Ray ray,
 
 		int leafIndex = getCellIndex(idx[iX],idx[iY],idx[iZ],
 			topLevelCell.resX,topLevelCell.resY,topLevelCell.resZ) + topLevelCell.firstLeafIdx;
-		CL_UINT2 leafRange = leavesArray[leafIndex];
-		for (;leafRange.x < leafRange.y; leafRange.x++)
+		CL_UINT leafEnd = leavesArray[leafIndex + 1];
+		for (CL_UINT ref = leavesArray[leafIndex]; ref < leafEnd; ref++)
 		{
-			CL_UINT3 triangleRef = getTriangleRefByIndex(scene,pairsRefArray[leafRange.x].y);
+			CL_UINT triangle = pairsRefArray[ref];
+			if (mailboxContains(mailbox,triangle))
+				continue;
+			CL_UINT3 triangleRef = getTriangleRefByIndex(scene,triangle);
 			CL_GLOBAL char* submesh = getModelAtIndex(triangleRef.x,scene);
 			submesh = getMeshAtIndex(triangleRef.y,submesh);
 			CL_FLOAT4 newContact = triangleIntersect(getVertexAt(getIndexAt(triangleRef.z * 3,submesh),submesh),
 													 getVertexAt(getIndexAt(triangleRef.z * 3 + 1,submesh),submesh),
 													 getVertexAt(getIndexAt(triangleRef.z * 3 + 2,submesh),submesh),
-													 ray.origin,ray.direction);
-			if (newContact.w > 0 && newContact.w < result.contactDist)
+													 ray.origin,ray.direction,ray.tMin,result.contactDist);
+			if (newContact.w > 0)
 			{
 				contactFound = true;
 				result.normalAndintersectionDistance = newContact;
 				result.materialIndex = MESH_HEADER(submesh)->materialIndex;
 			}
+			//Ray segment is only shortened by the traversal - Tested triangle can't yield closer hit in later cells
+			mailboxInsert(mailbox,triangle);
 		}
 
-		if (contactFound)
-			return result;
+		//Next leaf is entered beyond the closest hit, or beyond the end of ray segment
+		if (minimal >= result.contactDist)
+			return contactFound ? result : NO_CONTACT;
 
 		next[axis] += dt[axis];
 		idx[axis] += step[axis];
 								
 		if (idx[axis] == stop[axis])
-			return NO_CONTACT;
+			return contactFound ? result : NO_CONTACT;
 	}
 }
 
 /**
 * Traverses Two Level Grid
+* @implNote Only intersections within (ray.tMin,ray.tMax) are reported. Hit is accepted once traversal reaches the
+*           cell that contains it: The closest hit so far shortens the ray segment, and traversal stops at the
+*           first cell that contains the end of the segment
 * @param ray Ray to test for hit 
 * @param scene Buffer that contains the scene
 * @param gridData data about the grid
 * @param topLevelCells Array of top level cells
-* @param leavesArray leaf cells array - Represented as ranges in Reference array
-* @param pairsRefArray The cell-primitive reference array
+* @param leavesArray leaf cells array - Represented as beginnings of ranges in Reference array, see writeLeafRange
+* @param pairsRefArray The reference array - Triangle index per leaf cell-primitive pair
 * @return Information about closest intersection of ray and primitive within the grid
 */
 struct Contact tlg_generate_contact(const struct Ray ray,
 									CL_GLOBAL const char* scene,
 									CL_CONSTANT struct GridData* gridData,
 									CL_GLOBAL struct TopLevelCell* topLevelCells,
-									CL_GLOBAL CL_UINT2* leavesArray,
-									CL_GLOBAL CL_UINT2* pairsRefArray)
+									CL_GLOBAL const CL_UINT* leavesArray,
+									CL_GLOBAL const CL_UINT* pairsRefArray)
 {
 	
+	const struct InverseRay invRay = prepareInverseRay(ray.origin,ray.direction);
+	struct TriangleMailbox mailbox;
+	mailboxClear(&mailbox);
+	//Ray segment that is shortened by the closest hit so far
+	struct Ray bounded = ray;
+	struct Contact closest = NO_CONTACT;
+
 	//Calculating the entry and exit t values for each axis
 	float dt[3];
 	int idx[3];
@@ -573,22 +971,20 @@ struct Contact tlg_generate_contact(const struct Ray ray,
 		float tx_min, ty_min, tz_min;
 		float tx_max, ty_max, tz_max; 
 
-		float a = 1.0f / ray.direction.x;
-		tx_min = ((a >= 0.0f ? gridData->box.bounds[0].x : gridData->box.bounds[1].x) - ray.origin.x) * a;
-		tx_max = ((a >= 0.0f ? gridData->box.bounds[1].x : gridData->box.bounds[0].x) - ray.origin.x) * a;
-	
-		a = 1.0f / ray.direction.y;
-		ty_min = ((a >= 0.0f ? gridData->box.bounds[0].y : gridData->box.bounds[1].y) - ray.origin.y) * a;
-		ty_max = ((a >= 0.0f ? gridData->box.bounds[1].y : gridData->box.bounds[0].y) - ray.origin.y) * a;
-	
-		a = 1.0 / ray.direction.z;
-		tz_min = ((a >= 0.0f ? gridData->box.bounds[0].z : gridData->box.bounds[1].z) - ray.origin.z) * a;
-		tz_max = ((a >= 0.0f ? gridData->box.bounds[1].z : gridData->box.bounds[0].z) - ray.origin.z) * a;
+		//Near and far planes are selected by precomputed ray octant
+		CL_FLOAT3 tNear = slabEntry(gridData->box,invRay);
+		CL_FLOAT3 tFar = slabExit(gridData->box,invRay);
+		tx_min = tNear.x; ty_min = tNear.y; tz_min = tNear.z;
+		tx_max = tFar.x; ty_max = tFar.y; tz_max = tFar.z;
 	
 		float t0 = min(tx_min,min(ty_min,tz_min));
 		
 		if (t0 > max(tx_max,max(ty_max,tz_max)))
 			return NO_CONTACT;
+
+		//The grid is entered beyond the end of ray segment, or exited before its beginning
+		if (max(tx_min,max(ty_min,tz_min)) > ray.tMax || min(tx_max,min(ty_max,tz_max)) < ray.tMin)
+			return NO_CONTACT;
 	
 		//Calculating the coordinates of the cell at which traversal begins
 		CL_FLOAT3 p = isPointInside(gridData->box,ray.origin) ? ray.origin : ray.origin + (ray.direction * t0); 
@@ -603,44 +999,18 @@ struct Contact tlg_generate_contact(const struct Ray ray,
 		dt[iY] = (ty_max - ty_min) / gridData->resY;
 		dt[iZ] = (tz_max - tz_min) / gridData->resZ;
 	
-		if (ray.direction.x > 0.0f) 
-		{
-			next[iX] = tx_min + (idx[iX] + 1) * dt[iX];
-			step[iX] = +1;
-			stop[iX] = gridData->resX;
-		}
-		else 
-		{
-			next[iX] = ray.direction.x == 0.0f ? FLT_MAX : tx_min + (gridData->resX - idx[iX]) * dt[iX];
-			step[iX] = -1;
-			stop[iX] = -1;
-		}
+		//Stepping direction is derived from precomputed ray octant
+		step[iX] = 1 - 2 * (int)invRay.sign[iX];
+		stop[iX] = invRay.sign[iX] ? -1 : (int)gridData->resX;
+		next[iX] = ray.direction.x == 0.0f ? FLT_MAX : tx_min + (invRay.sign[iX] ? gridData->resX - idx[iX] : idx[iX] + 1) * dt[iX];
 
-		if (ray.direction.y > 0) 
-		{
-			next[iY] = ty_min + (idx[iY] + 1) * dt[iY];
-			step[iY] = +1;
-			stop[iY] = gridData->resY;
-		}
-		else 
-		{
-			next[iY] = ray.direction.y == 0.0f ? FLT_MAX : ty_min + (gridData->resY - idx[iY]) * dt[iY];
-			step[iY] = -1;
-			stop[iY] = -1;
-		}
-		
-		if (ray.direction.z > 0) 
-		{
-			next[iZ] = tz_min + (idx[iZ] + 1) * dt[iZ];
-			step[iZ] = +1;
-			stop[iZ] = gridData->resZ;
-		}
-		else 
-		{
-			next[iZ] = ray.direction.z == 0.0f? FLT_MAX : tz_min + (gridData->resZ - idx[iZ]) * dt[iZ];
-			step[iZ] = -1;
-			stop[iZ] = -1;
-		}
+		step[iY] = 1 - 2 * (int)invRay.sign[iY];
+		stop[iY] = invRay.sign[iY] ? -1 : (int)gridData->resY;
+		next[iY] = ray.direction.y == 0.0f ? FLT_MAX : ty_min + (invRay.sign[iY] ? gridData->resY - idx[iY] : idx[iY] + 1) * dt[iY];
+
+		step[iZ] = 1 - 2 * (int)invRay.sign[iZ];
+		stop[iZ] = invRay.sign[iZ] ? -1 : (int)gridData->resZ;
+		next[iZ] = ray.direction.z == 0.0f ? FLT_MAX : tz_min + (invRay.sign[iZ] ? gridData->resZ - idx[iZ] : idx[iZ] + 1) * dt[iZ];
 	}
 	
 	// traverse the grid
@@ -654,6 +1024,38 @@ struct Contact tlg_generate_contact(const struct Ray ray,
 		while(minimal != next[axis])
 			axis++;
 
+		if (cell.resX == 0 && cell.proximityDistance > 1)
+		{
+			//Skipping empty space: The cells within radius along every axis are empty, so the ray moves to the first cell
+			//past the cube of these cells. It leaves the cube at tExit, crossing radius+1 boundaries on the exit axis - The first
+			//axis to reach tExit, as in cell stepping below. Other axes cross the boundaries before tExit only, so ties are
+			//stepped by the following iterations. Axes the ray is parallel to are not stepped
+			int radius = cell.proximityDistance - 1;
+			float tExit = FLT_MAX;
+			int exitAxis = -1;
+			for (int a = 0; a < 3; a++)
+			{
+				if (next[a] != FLT_MAX && next[a] + radius * dt[a] < tExit)
+				{
+					tExit = next[a] + radius * dt[a];
+					exitAxis = a;
+				}
+			}
+			if (exitAxis < 0 || tExit >= bounded.tMax)
+				return closest;
+			for (int a = 0; a < 3; a++)
+			{
+				if (next[a] == FLT_MAX)
+					continue;
+				int crossed = (a == exitAxis) ? radius + 1 : clamp((int)ceil((tExit - next[a]) / dt[a]),0,radius);
+				next[a] += crossed * dt[a];
+				idx[a] += crossed * step[a];
+				if ((idx[a] - stop[a]) * step[a] >= 0)
+					return closest;
+			}
+			continue;
+		}
+
 		if (!(cell.resX == 0 || cell.resY == 0 || cell.resZ == 0))
 		{
 			//Process the cell
@@ -664,16 +1066,23 @@ struct Contact tlg_generate_contact(const struct Ray ray,
 			cellBox.bounds[1].x = cellBox.bounds[0].x + gridData->stepX;
 			cellBox.bounds[1].y = cellBox.bounds[0].y +	gridData->stepY;
 			cellBox.bounds[1].z = cellBox.bounds[0].z +	gridData->stepZ;
-			struct Contact result = processTopLevelCell(ray,scene,cell,cellBox,leavesArray,pairsRefArray);
+			struct Contact result = processTopLevelCell(bounded,invRay,scene,cell,cellBox,next,dt,leavesArray,pairsRefArray,&mailbox);
 			if (result.contactDist > 0.0f)
-				return result;
+			{
+				closest = result;
+				bounded.tMax = result.contactDist;
+			}
 		}
 
+		//Next cell is entered beyond the closest hit, or beyond the end of ray segment
+		if (minimal >= bounded.tMax)
+			return closest;
+
 		next[axis] += dt[axis];
 		idx[axis] += step[axis];
 								
 		if (idx[axis] == stop[axis])
-			return NO_CONTACT;
+			return closest;
 	}
 }
 
@@ -34,7 +34,8 @@
 #include <CLData/Primitives/AABB.h>
 
 /*
-* struct TopLevelCell - Represents a top level cell in Two Level Grid
+* struct TopLevelCell - Represents a top level cell in Two Level Grid. Empty cell has zero resolution,
+* and its leaf index holds its proximity - See proximityDistance
 */
 struct TopLevelCell
 {
@@ -44,6 +45,10 @@ struct TopLevelCell
 	CL_UINT firstLeafIdx;
 } ALIGNED(16);
 
+//Macro for easy access to proximity of empty cell: Distance in cells to the nearest occupied cell, along the axis
+//of largest distance - All the cells closer than that along every axis are empty
+#define proximityDistance firstLeafIdx
+
 /*
 * struct GridData - Contains general data about Two Level Grid
 */
@@ -60,6 +65,25 @@ struct GridData
 	struct AABB box;
 } ALIGNED(16);
 
+/*
+* Indices of counts that are calculated on device during grid construction
+*/
+#define BUILD_COUNT_PAIRS 0
+#define BUILD_COUNT_LEAF_CELLS 1
+#define BUILD_COUNT_LEAF_PAIRS 2
+#define BUILD_COUNTS 3
+
+/*
+* Indices of counts that are maintained on device during incremental grid update: Count of affected top level cells,
+* and the ends of used parts of top level pairs, leaf cells and leaf pairs arrays - Updated data is appended there
+*/
+#define UPDATE_AFFECTED_CELLS 0
+#define UPDATE_PAIRS_TAIL 1
+#define UPDATE_LEAF_CELLS_TAIL 2
+#define UPDATE_LEAF_PAIRS_TAIL 3
+#define UPDATE_OVERFLOW 4
+#define UPDATE_COUNTS 5
+
 /*
 * Macros for axis indexes
 */
@@ -383,6 +383,23 @@ inline CL_UINT3 convert_uint3(CL_FLOAT3 value)
 	return result;
 }
 
+inline CL_UINT convert_uint_sat(CL_FLOAT value)
+{
+	//NaN and negative values saturate to 0
+	if (!(value > 0.0f))
+		return 0;
+	return value >= 4294967295.0f ? 0xFFFFFFFF : (CL_UINT)value;
+}
+
+inline CL_UINT3 convert_uint3_sat(CL_FLOAT3 value)
+{
+	CL_UINT3 result;
+	result.x = convert_uint_sat(value.x);
+	result.y = convert_uint_sat(value.y);
+	result.z = convert_uint_sat(value.z);
+	return result;
+}
+
 inline CL_FLOAT3 convert_float3(CL_UINT3 value)
 {
 	CL_FLOAT3 result;
@@ -78,14 +78,24 @@ inline float FOVDistFromAngle(float angle,float resx,float resy)
 
 /**
 * struct Ray - Contains information about given ray
+* @implNote Only intersections with ray parameter t in the open range (tMin,tMax) are reported.
+*           tMin should be non-negative. Primary rays use [0,FLT_MAX], while bounded queries
+*           (e.g. shadow rays) should set tMax to the distance of the query, which allows traversal
+*           to terminate early.
 */
 struct Ray
 {
 	CL_UINT idx;
 	CL_FLOAT3 origin;
 	CL_FLOAT3 direction;
+	CL_FLOAT tMin;
+	CL_FLOAT tMax;
 }ALIGNED(16);
 
+//Default range of ray parameter t for unbounded rays
+#define RAY_DEFAULT_TMIN 0.0f
+#define RAY_DEFAULT_TMAX FLT_MAX
+
 /**
 * Generates ray according to camera settings and pixel index
 * @param camera The camera data 
@@ -102,9 +112,44 @@ inline struct Ray generateRay(CL_CONSTANT struct Camera* camera,CL_UINT pixelInd
 											   camera->FOVDistance)));
 	ray.origin = camPosition_const(*camera);
 	ray.idx = pixelIndex;
+	ray.tMin = RAY_DEFAULT_TMIN;
+	ray.tMax = RAY_DEFAULT_TMAX;
 	return ray;
 }
 
+//Side of square pixel tile that is traced by consecutive work items - 8x8 tile covers a 64 wide wavefront
+#define CAMERA_TILE_SIZE 8
+
+/**
+* Calculates the number of work items that cover the image with whole pixel tiles - See tiledPixelIndex
+* @param resX Horizontal camera resolution
+* @param resY Vertical camera resolution
+* @return Number of work items to launch for camera rays
+*/
+inline CL_UINT tiledPixelCount(CL_UINT resX,CL_UINT resY)
+{
+	return ((resX + CAMERA_TILE_SIZE - 1) / CAMERA_TILE_SIZE) * ((resY + CAMERA_TILE_SIZE - 1) / CAMERA_TILE_SIZE) * CAMERA_TILE_SIZE * CAMERA_TILE_SIZE;
+}
+
+/**
+* Maps work item index to pixel index, such that consecutive work items cover square tiles of the image,
+* in Morton order within the tile. Rays of SIMD group are then spatially compact, and follow similar paths
+* through acceleration structure.
+* @param camera The camera data 
+* @param workItemIdx Index of the work item
+* @return Index of pixel for the work item, or UINT_MAX if work item falls outside the image (in edge tiles)
+*/
+inline CL_UINT tiledPixelIndex(CL_CONSTANT struct Camera* camera,CL_UINT workItemIdx)
+{
+	CL_UINT tileIdx = workItemIdx / (CAMERA_TILE_SIZE * CAMERA_TILE_SIZE);
+	CL_UINT inTileIdx = workItemIdx % (CAMERA_TILE_SIZE * CAMERA_TILE_SIZE);
+	CL_UINT tilesX = (camera->resX + CAMERA_TILE_SIZE - 1) / CAMERA_TILE_SIZE;
+	//De-interleaving 3 bit Morton code coordinates within the tile
+	CL_UINT x = (tileIdx % tilesX) * CAMERA_TILE_SIZE + ((inTileIdx & 1) | ((inTileIdx >> 1) & 2) | ((inTileIdx >> 2) & 4));
+	CL_UINT y = (tileIdx / tilesX) * CAMERA_TILE_SIZE + (((inTileIdx >> 1) & 1) | ((inTileIdx >> 2) & 2) | ((inTileIdx >> 3) & 4));
+	return (x < camera->resX && y < camera->resY) ? y * camera->resX + x : UINT_MAX;
+}
+
 
 /**
 * struct Contact - Contains data about ray/object hit
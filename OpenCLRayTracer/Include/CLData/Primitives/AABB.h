@@ -169,6 +169,75 @@ inline CL_FLOAT2 findTRange(const REF(struct AABB) aabb,CL_FLOAT3 ro,CL_FLOAT3 r
 	return result;
 }
 
+/**
+*  struct InverseRay - Ray data that is computed once per ray, and reused by all box tests along its traversal:
+*  reciprocal of direction, and direction sign per axis (octant), that selects near and far box planes
+*/
+struct InverseRay
+{
+	CL_FLOAT3 origin;
+	CL_FLOAT3 invDirection;
+	/**Index of near bound per axis: 1 if direction is negative along the axis, otherwise 0. Far bound is at 1-sign*/
+	CL_UINT sign[3];
+};
+
+/**
+* Prepares ray data for repeated box tests
+* @param ro Ray Origin
+* @param rd Ray Direction
+* @return Precomputed inverse direction and octant of the ray
+*/
+inline struct InverseRay prepareInverseRay(CL_FLOAT3 ro,CL_FLOAT3 rd)
+{
+	struct InverseRay result;
+	result.origin = ro;
+	result.invDirection = (CL_FLOAT3)combineToVector(INV_DIR_X(rd),INV_DIR_Y(rd),INV_DIR_Z(rd));
+	result.sign[0] = result.invDirection.x < 0.0f;
+	result.sign[1] = result.invDirection.y < 0.0f;
+	result.sign[2] = result.invDirection.z < 0.0f;
+	return result;
+}
+
+/**
+* Calculates ray parameter t at which the ray crosses the near plane of each slab of the box
+* @param aabb The box
+* @param r Precomputed ray data
+* @return Entry values of ray parameter t for X,Y and Z slabs
+*/
+inline CL_FLOAT3 slabEntry(const REF(struct AABB) aabb,const REF(struct InverseRay) r)
+{
+	CL_FLOAT3 nearPlanes = (CL_FLOAT3)combineToVector(aabb.bounds[r.sign[0]].x,aabb.bounds[r.sign[1]].y,aabb.bounds[r.sign[2]].z);
+	return (nearPlanes - r.origin) * r.invDirection;
+}
+
+/**
+* Calculates ray parameter t at which the ray crosses the far plane of each slab of the box
+* @param aabb The box
+* @param r Precomputed ray data
+* @return Exit values of ray parameter t for X,Y and Z slabs
+*/
+inline CL_FLOAT3 slabExit(const REF(struct AABB) aabb,const REF(struct InverseRay) r)
+{
+	CL_FLOAT3 farPlanes = (CL_FLOAT3)combineToVector(aabb.bounds[1-r.sign[0]].x,aabb.bounds[1-r.sign[1]].y,aabb.bounds[1-r.sign[2]].z);
+	return (farPlanes - r.origin) * r.invDirection;
+}
+
+/**
+* Finds entry and exit values of ray parameter t using precomputed ray data - Branch free version of findTRange
+* @param aabb The box to intersect
+* @param r Precomputed ray data
+* @return Entry (x) and exit (y) values of ray parameter t. The ray misses the box whenever x > y
+*/
+inline CL_FLOAT2 AABBIntersectInv(const REF(struct AABB) aabb,const REF(struct InverseRay) r)
+{
+	CL_FLOAT3 tNear = slabEntry(aabb,r);
+	CL_FLOAT3 tFar = slabExit(aabb,r);
+	CL_FLOAT2 result;
+	result.x = max(tNear.x,max(tNear.y,tNear.z));
+	result.y = min(tFar.x,min(tFar.y,tFar.z));
+	return result;
+}
+
 /**
 * Determines whether a point is inside AABB
 * @param aabb The box to test
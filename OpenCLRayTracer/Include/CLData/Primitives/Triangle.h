@@ -60,10 +60,12 @@ struct Triangle
 * @param vert2 Third vertex of triangle
 * @param orig Ray Origin
 * @param dir Ray Direction
+* @param tMin Lower bound of ray parameter t - Intersections at t <= tMin are rejected
+* @param tMax Upper bound of ray parameter t - Intersections at t >= tMax are rejected
 * @return In case ray intersects the triangle: Contact normal (x,y,x) and ray parameter t (w) at which the intersection occur.
-*         In case there is no intersection w component of the result will be 0.
+*         In case there is no intersection within (tMin,tMax) w component of the result will be 0.
 */
-inline CL_FLOAT4 triangleIntersect(VERTEX_TYPE vert0,VERTEX_TYPE vert1, VERTEX_TYPE vert2, CL_FLOAT3 orig, CL_FLOAT3 dir)
+inline CL_FLOAT4 triangleIntersect(VERTEX_TYPE vert0,VERTEX_TYPE vert1, VERTEX_TYPE vert2, CL_FLOAT3 orig, CL_FLOAT3 dir, CL_FLOAT tMin, CL_FLOAT tMax)
 {
    CL_FLOAT3 edge1, edge2, tvec, pvec, qvec;
    float det,inv_det;
@@ -100,7 +102,11 @@ inline CL_FLOAT4 triangleIntersect(VERTEX_TYPE vert0,VERTEX_TYPE vert1, VERTEX_T
    flag&= (v >= 0.0f);
 
    /* calculate t, ray intersects triangle */
-   float t = dot(edge2, qvec) * inv_det * flag; //The flag cancels out t if one of the conditions failed
+   float t = dot(edge2, qvec) * inv_det;
+   /* reject intersections outside of the ray segment */
+   flag&= (t > tMin);
+   flag&= (t < tMax);
+   t = flag ? t : 0.0f; //Cancels out t if one of the conditions failed
    CL_FLOAT3 normal = normalize(cross(edge1,edge2));  
    initVector4(result,normal.x,normal.y,normal.z,t);
    return result;
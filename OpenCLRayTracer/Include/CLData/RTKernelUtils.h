@@ -91,6 +91,63 @@ inline CL_ULONG packIntsToLong(CL_UINT a,CL_UINT b)
 	return (((CL_ULONG)(a)) << 32) | ((b) & 0xffffffffL); 
 }
 
+//Morton codes - Used for BVH construction, for ray reordering, and for cell indexing of Two Level Grid
+
+/** Expands a 10-bit integer into 30 bits by inserting 2 zeros after each bit.
+*  @param v Integer to expand
+*  @return The expanded integer
+*/
+inline CL_UINT expandBits(CL_UINT v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+/** Compacts every third bit of an integer into a 10-bit integer - Inverse of expandBits.
+*  @param v Integer to compact
+*  @return The compacted integer
+*/
+inline CL_UINT compactBits(CL_UINT v)
+{
+    v &= 0x09249249u;
+    v = (v ^ (v >> 2)) & 0x030C30C3u;
+    v = (v ^ (v >> 4)) & 0x0300F00Fu;
+    v = (v ^ (v >> 8)) & 0xFF0000FFu;
+    v = (v ^ (v >> 16)) & 0x000003FFu;
+    return v;
+}
+
+/** Calculates a 30-bit Morton code of integer 3D coordinates, with X in the lowest bit
+*  @param x X coordinate - 10 bits
+*  @param y Y coordinate - 10 bits
+*  @param z Z coordinate - 10 bits
+*  @return The calculated Morton code
+*/
+inline CL_UINT mortonIndex3D(CL_UINT x, CL_UINT y, CL_UINT z)
+{
+    return expandBits(x) | (expandBits(y) << 1) | (expandBits(z) << 2);
+}
+
+/** Calculates a 30-bit Morton code for the given 3D point located within the unit cube [0,1].
+*  @param x X coordinate of a point
+*  @param y Y coordinate of a point
+*  @param x X coordinate of a point
+*  @return The calculated Morton code of a point
+*/
+inline CL_UINT morton3D(CL_FLOAT x, CL_FLOAT y, CL_FLOAT z)
+{
+    x = min(max(x * 1024.0f, 0.0f), 1023.0f);
+    y = min(max(y * 1024.0f, 0.0f), 1023.0f);
+    z = min(max(z * 1024.0f, 0.0f), 1023.0f);
+    CL_UINT xx = expandBits((CL_UINT)x);
+    CL_UINT yy = expandBits((CL_UINT)y);
+    CL_UINT zz = expandBits((CL_UINT)z);
+    return xx * 4 + yy * 2 + zz;
+}
+
 //64-value stack / Array
 #define UINT_STACK_64  {\
 		UINT_MAX,UINT_MAX,UINT_MAX,UINT_MAX,UINT_MAX,UINT_MAX,UINT_MAX,UINT_MAX,\
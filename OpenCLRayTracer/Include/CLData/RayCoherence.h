@@ -0,0 +1,73 @@
+/**
+ * @file RayCoherence.h
+ * @author  Timur Sizov <timorgizer@gmail.com>
+ * @version 0.6
+ *
+ * @section LICENSE
+ *
+ * Copyright (c) 2016 Timur Sizov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software 
+ * without restriction, including without limitation the rights to use, copy, modify, merge, 
+ * publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons 
+ * to whom the Software is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE 
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * @section DESCRIPTION
+ *
+ * Functions for computing ray coherence keys - Rays with close keys originate from nearby
+ * locations, and travel in the same direction octant, and thus tend to traverse the same
+ * parts of acceleration structure.
+ *
+ */
+
+/** \addtogroup g1 Ray Tracing Implementation Utilities 
+ *  @{
+ */
+
+/** \addtogroup g12 General Helper Structures 
+ *  @{
+ */
+
+#ifndef CL_RT_RAYCOHERENCE
+#define CL_RT_RAYCOHERENCE
+
+#include <CLData\RTKernelUtils.h>
+#include <CLData\CLStructs.h>
+#include <CLData\Primitives\AABB.h>
+
+//Number of bits of the key that hold quantized origin. The 3 bits above hold the direction octant
+#define RAY_KEY_ORIGIN_BITS 28
+//Number of significant bits of the key
+#define RAY_KEY_BITS (RAY_KEY_ORIGIN_BITS + 3)
+//Direction octant of a ray - Bit per axis, set when direction is negative along the axis
+#define rayOctant(dir) ((((dir).x < 0.0f) << 2) | (((dir).y < 0.0f) << 1) | ((dir).z < 0.0f))
+
+/**
+* Calculates coherence key of a ray: Direction octant in bits 28-30, and Morton code of ray origin
+* quantized relative to the scene bounding box in bits 0-27. The top bit is always clear, so that keys
+* never collide with UINT_MAX, which is used for padding of sorted arrays
+* @param ray The ray
+* @param sceneBox Bounding box of the scene - Origins outside of the box are clamped to its boundary
+* @return Coherence key of the ray
+*/
+inline CL_UINT rayCoherenceKey(const REF(struct Ray) ray,const REF(struct AABB) sceneBox)
+{
+	CL_UINT morton = morton3D(normalizeScale(sceneBox.bounds[0].x,sceneBox.bounds[1].x,ray.origin.x - sceneBox.bounds[0].x),
+							  normalizeScale(sceneBox.bounds[0].y,sceneBox.bounds[1].y,ray.origin.y - sceneBox.bounds[0].y),
+							  normalizeScale(sceneBox.bounds[0].z,sceneBox.bounds[1].z,ray.origin.z - sceneBox.bounds[0].z));
+	return (rayOctant(ray.direction) << RAY_KEY_ORIGIN_BITS) | (morton >> (30 - RAY_KEY_ORIGIN_BITS));
+}
+
+#endif //CL_RT_RAYCOHERENCE
+
+/** @}*/
+/** @}*/
\ No newline at end of file
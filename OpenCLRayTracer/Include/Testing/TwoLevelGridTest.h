@@ -186,15 +186,15 @@ namespace CLRayTracer
 			 * Export grid data to file 
 			 * @param cells Top Level Grid cells
 			 * @param cellCount Number of cells in cells array
-			 * @param leafRanges Ranges in the leaf array
+			 * @param leafRanges Beginnings of ranges in the reference array - Leaf i owns [leafRanges[i],leafRanges[i+1])
 			 * @param leafRangesCount Number of items in leafRanges array
-			 * @param refPairs Leaf cell-primitive pairs
-			 * @param refPairsCount Number of items in refPairs array 
+			 * @param refs Triangle index per leaf cell-primitive pair
+			 * @param refsCount Number of items in refs array 
 			 * @return
 			*/
 			inline void exportToFile(TopLevelCell* cells, CL_UINT cellCount,
-									 CL_UINT2* leafRanges, CL_UINT leafRangesCount,
-									 CL_UINT2* refPairs, CL_UINT refPairsCount)
+									 CL_UINT* leafRanges, CL_UINT leafRangesCount,
+									 CL_UINT* refs, CL_UINT refsCount)
 			{
 				time_t time;
 				::time(&time);
@@ -206,12 +206,12 @@ namespace CLRayTracer
 					o << "Cell: " << i << " resX: " << cells[i].resX << " resY: " << cells[i].resY << " resZ: " << cells[i].resZ << " first Leaf: " <<cells[i].firstLeafIdx << std::endl;
 				
 				o << "--------------Leaf ranges----------------- " << std::endl;
-				for(int i = 0; i < leafRangesCount; i++)
-					o << "Leaf: " << i << " First ref idx: " << leafRanges[i].x << " Last ref idx: " << leafRanges[i].y << std::endl;
+				for(int i = 0; i + 1 < leafRangesCount; i++)
+					o << "Leaf: " << i << " First ref idx: " << leafRanges[i] << " Last ref idx: " << leafRanges[i + 1] << std::endl;
 
 				o << "-------------Reference Array----------" << std::endl;
-				for(int i = 0; i < refPairsCount; i++)
-					o << "Ref pair: " << i << " Leaf Cell idx: " << refPairs[i].x << " Primitive Idx: " << refPairs[i].y << std::endl;
+				for(int i = 0; i < refsCount; i++)
+					o << "Ref: " << i << " Primitive Idx: " << refs[i] << std::endl;
 
 				o.close();
 			}
@@ -39,14 +39,30 @@
 #include "CLData\AccelerationStructs\BVHData.h"
 
 #pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics : enable
+#pragma OPENCL EXTENSION cl_khr_local_int32_base_atomics : enable
+
+//Size of traversal stack, shared by a packet of rays - Packets of deeper trees fall back to traversal per ray
+#define PACKET_STACK_SIZE 64
+
+/***************************************************
+* 0. Calculate bounding box and centroid of each primitive
+*    - Reduced to scene and centroid bounds by host
+****************************************************/
+__kernel void computePrimitiveBounds(__global const char* scene,__global struct AABB* primitiveBounds,__global float4* centroids)
+{
+	if(get_global_id(0) < SCENE_HEADER(scene)->totalNumberOfTriangles) 
+		calculatePrimitiveBounds(primitiveBounds,centroids,get_global_id(0),scene);
+}
 
 /***************************************************
 * 1. Calculate Morton code for each primitive
 ****************************************************/
-__kernel void calculateMortonCodes(__global struct BVHNode* leavesBuffer,__global uint2* mortonBuffer, __global const char* scene)
+__kernel void calculateMortonCodes(__global struct BVHNode* leavesBuffer,__global uint2* mortonBuffer, __global const char* scene,
+								   __global const struct AABB* primitiveBounds,__global const float4* centroids,
+								   __global const struct AABB* centroidBounds)
 {
 	if(get_global_id(0) < SCENE_HEADER(scene)->totalNumberOfTriangles) 
-		calculateMorton(leavesBuffer,mortonBuffer,get_global_id(0),scene);
+		calculateMorton(leavesBuffer,mortonBuffer,get_global_id(0),scene,primitiveBounds,centroids,centroidBounds);
 }
 
 /***************************************************
@@ -78,6 +94,14 @@ __kernel void computeBoundingBoxes(__global struct BVHNode* nodeBuffer,__global
 	}
 }
 
+//Copies top-of-tree cache into local memory - Called by all work items of the group before traversal
+inline void loadTopTree(const __global struct BVHNode* topTreeNodes, __local struct BVHNode* topTree, uint topTreeSize)
+{
+	event_t copyEvent = async_work_group_copy((__local uint4*)topTree,(const __global uint4*)topTreeNodes,
+											  topTreeSize * (sizeof(struct BVHNode) / sizeof(uint4)),0);
+	wait_group_events(1,&copyEvent);
+}
+
 /***************************************************************
 * 4. Generating the contacts for primary rays
 ***************************************************************/
@@ -85,14 +109,19 @@ __kernel void generateContacts(__constant struct Camera* camera,
 							      __global struct BVHNode* bvh, 
 							      uint rootIdx,
 							      const __global char* scene,
-							      __global struct Contact* output
+							      __global struct Contact* output,
+							      const __global struct BVHNode* topTreeNodes,
+							      __local struct BVHNode* topTree,
+							      uint topTreeSize
 								 )
 {
-		if (get_global_id(0) < (camera->resX * camera->resY))
+		loadTopTree(topTreeNodes,topTree,topTreeSize);
+		const uint pixelIdx = tiledPixelIndex(camera,get_global_id(0));
+		if (pixelIdx != UINT_MAX)
 		{
-			struct Ray r = generateRay(camera,get_global_id(0));
-			struct Contact c = bvh_generate_contact(r,bvh,rootIdx,scene);
-			c.pixelIndex = get_global_id(0);
+			struct Ray r = generateRay(camera,pixelIdx);
+			struct Contact c = bvh_generate_contact(r,bvh,rootIdx,scene,topTree,topTreeSize);
+			c.pixelIndex = pixelIdx;
 			output[c.pixelIndex] = c;
 		}
 }
@@ -105,14 +134,230 @@ __kernel void generateContacts2(__global struct Ray* rays,
 							   __global struct BVHNode* bvh, 
 							   uint rootIdx,
 							   const __global char* scene,
-							   __global struct Contact* output)
+							   __global struct Contact* output,
+							   const __global struct BVHNode* topTreeNodes,
+							   __local struct BVHNode* topTree,
+							   uint topTreeSize)
 {
+		loadTopTree(topTreeNodes,topTree,topTreeSize);
 		uint idx = get_global_id(0);
 		if (idx < rayCount)
 		{
-			struct Contact c = bvh_generate_contact(rays[idx],bvh,rootIdx,scene);
+			struct Contact c = bvh_generate_contact(rays[idx],bvh,rootIdx,scene,topTree,topTreeSize);
 			c.pixelIndex = idx;
 			output[c.pixelIndex] = c;
 		}
 }
 
+/***************************************************************
+* 5a. Generating the contacts for active rays of index list
+*     Work item per list entry - The count is read on device
+***************************************************************/
+__kernel void generateContactsIndexed(__global struct Ray* rays,
+							   const __global uint* activeRays,
+							   const __global uint* activeRayCount,
+							   __global struct BVHNode* bvh, 
+							   uint rootIdx,
+							   const __global char* scene,
+							   __global struct Contact* output,
+							   const __global struct BVHNode* topTreeNodes,
+							   __local struct BVHNode* topTree,
+							   uint topTreeSize)
+{
+		loadTopTree(topTreeNodes,topTree,topTreeSize);
+		uint idx = get_global_id(0);
+		if (idx < *activeRayCount)
+		{
+			uint rayIdx = activeRays[idx];
+			struct Contact c = bvh_generate_contact(rays[rayIdx],bvh,rootIdx,scene,topTree,topTreeSize);
+			c.pixelIndex = rayIdx;
+			output[c.pixelIndex] = c;
+		}
+}
+
+/***************************************************************
+* 6. Generating the contacts for general rays - Persistent threads
+*    Launched with just enough work-groups to fill the device.
+*    Each work-group repeatedly fetches the next batch of ray
+*    indices from a global queue head, until the queue drains,
+*    so groups that finish early take over remaining work
+***************************************************************/
+__kernel void generateContactsPersistent(__global struct Ray* rays,
+							   uint rayCount,
+							   __global struct BVHNode* bvh, 
+							   uint rootIdx,
+							   const __global char* scene,
+							   __global struct Contact* output,
+							   __global volatile uint* rayQueueHead,
+							   const __global struct BVHNode* topTreeNodes,
+							   __local struct BVHNode* topTree,
+							   uint topTreeSize)
+{
+		__local uint batchStart;
+		uint myBatchStart;
+		loadTopTree(topTreeNodes,topTree,topTreeSize);
+		do
+		{
+			//Fetch next batch for the entire work-group
+			if (get_local_id(0) == 0)
+				batchStart = atomic_add(rayQueueHead,(uint)get_local_size(0));
+			barrier(CLK_LOCAL_MEM_FENCE);
+			myBatchStart = batchStart;
+			barrier(CLK_LOCAL_MEM_FENCE); //Everyone has read the batch before it is overwritten
+
+			uint idx = myBatchStart + get_local_id(0);
+			if (idx < rayCount)
+			{
+				struct Contact c = bvh_generate_contact(rays[idx],bvh,rootIdx,scene,topTree,topTreeSize);
+				c.pixelIndex = idx;
+				output[c.pixelIndex] = c;
+			}
+		}
+		while (myBatchStart + get_local_size(0) < rayCount);
+}
+
+/***************************************************************
+* 7. Generating the contacts for primary rays - Packet traversal
+*    Work-group traces a packet of neighbouring camera rays,
+*    sharing a single traversal stack in local memory. Each node
+*    is fetched once per work-group, and a child is visited
+*    whenever at least one active ray of the packet hits it.
+*    If the stack overflows, the rays are traced one by one
+***************************************************************/
+__kernel void generateContactsPacket(__constant struct Camera* camera,
+							      __global struct BVHNode* bvh, 
+							      uint rootIdx,
+							      const __global char* scene,
+							      __global struct Contact* output
+								 )
+{
+		__local uint stack[PACKET_STACK_SIZE];
+		__local uint stackPointer;
+		__local uint stackOverflow;
+		__local uint currentIdx;
+		__local struct BVHNode sharedNode;
+		__local struct AABB sharedChildBoxes[2];
+		__local volatile uint visitA;
+		__local volatile uint visitB;
+
+		const uint localIdx = get_local_id(0);
+		const uint pixelIdx = tiledPixelIndex(camera,get_global_id(0));
+		const bool active = pixelIdx != UINT_MAX;
+
+		struct Ray ray = generateRay(camera,active ? pixelIdx : 0);
+		const struct InverseRay invRay = prepareInverseRay(ray.origin,ray.direction);
+		CL_FLOAT4 resContactData = (CL_FLOAT4)(0.0f,0.0f,0.0f,ray.tMax);
+		CL_UINT resMaterialIdx = 0;
+
+		if (localIdx == 0)
+		{
+			stackPointer = 0;
+			stackOverflow = 0;
+			stack[stackPointer++] = UINT_MAX; //Push initial value
+			currentIdx = rootIdx;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		while (currentIdx != UINT_MAX)
+		{
+			//Fetch the node once for the whole packet
+			if (localIdx == 0)
+			{
+				sharedNode = bvh[currentIdx];
+				visitA = visitB = 0;
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
+			struct BVHNode node = sharedNode;
+
+			if (type(node) == INNER_NODE)
+			{
+				if (localIdx < 2)
+					sharedChildBoxes[localIdx] = bvh[localIdx == 0 ? childA(node) : childB(node)].boundingBox;
+				barrier(CLK_LOCAL_MEM_FENCE);
+
+				struct AABB child_A_box = sharedChildBoxes[0];
+				struct AABB child_B_box = sharedChildBoxes[1];
+				CL_FLOAT2 tA = AABBIntersectInv(child_A_box,invRay);
+				CL_FLOAT2 tB = AABBIntersectInv(child_B_box,invRay);
+				if (active && tA.x <= tA.y && tA.y >= ray.tMin && tA.x < resContactData.w)
+					atomic_or(&visitA,1);
+				if (active && tB.x <= tB.y && tB.y >= ray.tMin && tB.x < resContactData.w)
+					atomic_or(&visitB,1);
+				barrier(CLK_LOCAL_MEM_FENCE);
+
+				if (localIdx == 0)
+				{
+					if (visitA && visitB)
+					{
+						//Full stack - The packet is abandoned, and its rays are traced one by one below
+						if (stackPointer == PACKET_STACK_SIZE)
+						{
+							stackOverflow = 1;
+							currentIdx = UINT_MAX;
+						}
+						else
+						{
+							currentIdx = childA(node);
+							stack[stackPointer++] = childB(node); // push
+						}
+					}
+					else if (visitA)
+						currentIdx = childA(node);
+					else if (visitB)
+						currentIdx = childB(node);
+					else
+						currentIdx = stack[--stackPointer];
+				}
+			}
+			else
+			{
+				if (active)
+				{
+					CL_GLOBAL char* mesh = getMeshAtIndex(submeshIndex(node),getModelAtIndex(modelIndex(node),scene));
+					CL_UINT baseIndex = triangleIndex(node) * 3;
+					CL_FLOAT4 contactData = triangleIntersect(
+											getVertexAt(getIndexAt(baseIndex,mesh),mesh),
+											getVertexAt(getIndexAt(baseIndex + 1,mesh),mesh),
+											getVertexAt(getIndexAt(baseIndex + 2,mesh),mesh),ray.origin,ray.direction,
+											ray.tMin,resContactData.w);
+					if (contactData.w > 0)
+					{
+						resContactData = contactData;
+						resMaterialIdx = MESH_HEADER(mesh)->materialIndex;	
+					}
+				}
+				if (localIdx == 0)
+					currentIdx = stack[--stackPointer];
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
+
+		if (active)
+		{
+			struct Contact c;
+			if (stackOverflow)
+				c = bvh_generate_contact(ray,bvh,rootIdx,scene,0,0);
+			else
+			{
+				c.normalAndintersectionDistance = resContactData;
+				if (c.contactDist == ray.tMax)
+					c.contactDist = 0;
+				c.materialIndex = resMaterialIdx;
+			}
+			c.pixelIndex = pixelIdx;
+			output[c.pixelIndex] = c;
+		}
+}
+
+/***************************************************************
+* 8. Filling top-of-tree cache - Work item per slot
+***************************************************************/
+__kernel void buildTopTree(__global struct BVHNode* bvh,
+						   uint rootIdx,
+						   __global struct BVHNode* topTreeNodes,
+						   uint topTreeSize)
+{
+		if (get_global_id(0) < topTreeSize)
+			fillTopTreeSlot(bvh,rootIdx,topTreeNodes,get_global_id(0));
+}
+
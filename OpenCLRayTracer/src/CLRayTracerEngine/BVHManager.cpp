@@ -34,7 +34,10 @@
  */
 
 #include <bitset>
+#include <cstddef>
 #include <Algorithms\Sorting.h>
+#include <Algorithms\RaySorter.h>
+#include <Algorithms\Reduction.h>
 #include <Algorithms\BVHManager.h>
 #include <CLData\AccelerationStructs\BVH.h>
 #include <CLData\AccelerationStructs\BVHData.h>
@@ -55,6 +58,13 @@ using namespace CLRayTracer::AccelerationStructures;
 /**String that contains the source of the kernels*/
 extern const char* BVHKernelSource;
 
+/**Number of persistent work-groups launched per compute unit - Enough to hide memory latency of traversal*/
+#define PERSISTENT_GROUPS_PER_PROCESSOR 8
+
+/**Number of work-groups per compute unit that the top-of-tree cache leaves local memory for - Traversal is latency bound,
+* so each work-group gets only this share of local memory for its copy of the cache*/
+#define TOP_TREE_GROUPS_PER_PROCESSOR 8
+
 /**Constructor*/
 BVHManager::BVHManager(const CLExecutionContext& context,const Scene& scene):AccelerationStructureManager(context,scene)
 {
@@ -62,11 +72,23 @@ BVHManager::BVHManager(const CLExecutionContext& context,const Scene& scene):Acc
 	_mortonBufferItems = 0;
 	_deviceLocalMemory = 0;
 	_bvhLeavesCount = 0;
+	_topTreeMaxSize = 0;
+	_topTreeSize = 0;
+	_usePersistentThreads = false;
+	_usePacketTraversal = false;
+	_useTopTreeCache = false;
+	_reorderRays = false;
+	_raySorter.reset(new RaySorter(context));
+	_reduction.reset(new Reduction(context));
 	//Default memory allocation = For 20000 triangles, for single-ray per pixel 512x512 resolution
 	_bvhNodes.reset(new CLBuffer(context,39999 * sizeof(struct BVHNode),CLBufferFlags::CLBufferAccess::ReadWrite));
 	_sortedMortonCodes.reset(new CLBuffer(context,largestPowerOfTwo(20000*sizeof(CL_UINT2)),CLBufferFlags::CLBufferAccess::ReadWrite));
 	_nodeVisitCounters.reset(new CLBuffer(context,39999 * sizeof(CL_UINT),CLBufferFlags::CLBufferAccess::ReadWrite));
+	_primitiveBounds.reset(new CLBuffer(context,20000 * sizeof(struct AABB),CLBufferFlags::CLBufferAccess::ReadWrite));
+	_primitiveCentroids.reset(new CLBuffer(context,20000 * sizeof(CL_FLOAT4),CLBufferFlags::CLBufferAccess::ReadWrite));
+	_centroidBounds.reset(new CLBuffer(context,sizeof(struct AABB),CLBufferFlags::CLBufferAccess::ReadWrite));
 	_primaryContactsArray.reset(new CLBuffer(context,512*512*sizeof(struct Contact),CLBufferFlags::CLBufferAccess::ReadWrite));
+	_rayQueueHead.reset(new CLBuffer(context,sizeof(CL_UINT),CLBufferFlags::CLBufferAccess::ReadWrite));
 }
 
 /**Performs main initialization of the BVH structure.
@@ -76,10 +98,16 @@ BVHManager::BVHManager(const CLExecutionContext& context,const Scene& scene):Acc
 */
 Result BVHManager::initialize(Errata& err)
 {
-	//Initialize sorter
+	//Initialize sorters
 	if (Success != _bitonicSorter->initialize(err))
 		return Error;
 
+	if (Success != _raySorter->initialize(err))
+		return Error;
+
+	if (Success != _reduction->initialize(err))
+		return Error;
+
 	//Compiling of the kernels
 	//Create and compile CL program
 	_bvhProgram.reset(new CLProgram(_context));
@@ -87,6 +115,10 @@ Result BVHManager::initialize(Errata& err)
 		return Error;
 
 	CLKernel *k = NULL;
+	if (Success != _bvhProgram->getKernel("computePrimitiveBounds",k,err))
+		return Error;
+	_primitiveBoundsKernel.reset(k);
+
 	if (Success != _bvhProgram->getKernel("calculateMortonCodes",k,err))
 		return Error;
 	_mortonCalcKernel.reset(k);
@@ -107,10 +139,32 @@ Result BVHManager::initialize(Errata& err)
 		return Error;
 	_contactGenerateKernel2.reset(k);
 
+	if (Success != _bvhProgram->getKernel("generateContactsIndexed",k,err))
+		return Error;
+	_indexedContactGenerateKernel.reset(k);
+
+	if (Success != _bvhProgram->getKernel("generateContactsPersistent",k,err))
+		return Error;
+	_persistentContactGenerateKernel.reset(k);
+
+	if (Success != _bvhProgram->getKernel("generateContactsPacket",k,err))
+		return Error;
+	_packetContactGenerateKernel.reset(k);
+
+	if (Success != _bvhProgram->getKernel("buildTopTree",k,err))
+		return Error;
+	_topTreeBuildKernel.reset(k);
 
 	if(Success != _context.getDevice().getMemoryInfo().getLocalMemSize(_deviceLocalMemory,err))
 		return Error;
 
+	//Top-of-tree cache holds as many whole levels of the tree as fit into the share of local memory of a work-group
+	CL_ULONG topTreeMemory = _deviceLocalMemory / TOP_TREE_GROUPS_PER_PROCESSOR;
+	_topTreeMaxSize = 0;
+	while ((_topTreeMaxSize * 2 + 1) * sizeof(struct BVHNode) <= topTreeMemory)
+		_topTreeMaxSize = _topTreeMaxSize * 2 + 1;
+	_topTreeNodes.reset(new CLBuffer(_context,max(_topTreeMaxSize,1) * sizeof(struct BVHNode),CLBufferFlags::ReadWrite));
+
 	return Success;
 }
 
@@ -134,6 +188,8 @@ Result  BVHManager::initializeFrame(Errata& err)
 	_bvhNodes->resize(bvhNodesBufSize);
 	_sortedMortonCodes->resize(_mortonBufferItems * sizeof(CL_UINT2));
 	_nodeVisitCounters->resize(_bvhLeavesCount * sizeof(CL_UINT));
+	_primitiveBounds->resize(_bvhLeavesCount * sizeof(struct AABB));
+	_primitiveCentroids->resize(_bvhLeavesCount * sizeof(CL_FLOAT4));
 
 	//Filling the buffer with the defaut values of UINT_MAX
 	
@@ -155,10 +211,15 @@ Result  BVHManager::initializeFrame(Errata& err)
 */
 Result BVHManager::construct(Common::Errata& err)
 {
+	//0. Scene and centroid bounds - Computed from the geometry on device, so the rebuild follows geometry
+	//that was changed on device, without readback
+	if (Success != computeSceneBounds(err))
+		return Error;
 
 	try
 	{
-		SET_KERNEL_ARGS((*_mortonCalcKernel),_bvhNodes->getCLMem(),_sortedMortonCodes->getCLMem(),_scene.getDeviceSceneData());
+		SET_KERNEL_ARGS((*_mortonCalcKernel),_bvhNodes->getCLMem(),_sortedMortonCodes->getCLMem(),_scene.getDeviceSceneData(),
+			_primitiveBounds->getCLMem(),_primitiveCentroids->getCLMem(),_centroidBounds->getCLMem());
 		SET_KERNEL_ARGS((*_radixTreeBuildKernel),_bvhNodes->getCLMem(),_sortedMortonCodes->getCLMem(),_bvhLeavesCount);
 		SET_KERNEL_ARGS((*_bbCalcKernel),_bvhNodes->getCLMem(),_nodeVisitCounters->getCLMem(), _bvhLeavesCount);
 	}
@@ -224,6 +285,94 @@ Result BVHManager::construct(Common::Errata& err)
 	if (Success != evt.wait(err))
 		return Error;
 
+	//4. Fill top-of-tree cache, if enabled - No more levels than the tree has nodes for
+	_topTreeSize = _useTopTreeCache ? _topTreeMaxSize : 0;
+	while (_topTreeSize > 2 * _bvhLeavesCount - 1)
+		_topTreeSize >>= 1;
+	if (0 == _topTreeSize)
+		return Success;
+
+	try
+	{
+		SET_KERNEL_ARGS((*_topTreeBuildKernel),_bvhNodes->getCLMem(),_bvhLeavesCount,_topTreeNodes->getCLMem(),_topTreeSize);
+	}
+	catch (CLInterfaceException e)
+	{
+		err = Errata(e);
+		return Error;
+	}
+
+	worksize = closestMultipleTo(_topTreeSize,warp);
+	CLKernelWorkDimension globalDim_TopTree(1,worksize);
+	CLKernelWorkDimension localDim_TopTree(1,warp);
+	CLKernelExecuteParams topTreeKernelExecParams(&globalDim_TopTree,&localDim_TopTree,&evt);
+	//Execute kernel
+	if (Success != _context.enqueueKernel((*_topTreeBuildKernel),topTreeKernelExecParams,err))
+		return Error;
+
+	//Flush and make sure that calculation is over before returning control
+	if (Success != _context.flushQueue(err))
+		return Error;
+
+	if (Success != evt.wait(err))
+		return Error;
+
+	return Success;
+}
+
+/**Computes bounding boxes and centroids of the primitives, and reduces them to the bounding box of the scene, which is
+* stored in the header of device scene buffer, and to the bounding box of the centroids
+* @param err Error info
+* @return Result of the operation: Success or failure
+*/
+Result BVHManager::computeSceneBounds(Errata& err)
+{
+	try
+	{
+		SET_KERNEL_ARGS((*_primitiveBoundsKernel),_scene.getDeviceSceneData(),_primitiveBounds->getCLMem(),_primitiveCentroids->getCLMem());
+	}
+	catch (CLInterfaceException e)
+	{
+		err = Errata(e);
+		return Error;
+	}
+
+	size_t processors, warp;
+	if (Success != _context.getMaximalLaunchExecParams(*_primitiveBoundsKernel,processors,warp,err))
+		return Error;
+
+	CLKernelWorkDimension globalDim(1,closestMultipleTo(_bvhLeavesCount,warp));
+	CLKernelWorkDimension localDim(1,warp);
+	CLKernelExecuteParams execParams(&globalDim,&localDim,NULL);
+	if (Success != _context.enqueueKernel((*_primitiveBoundsKernel),execParams,err))
+		return Error;
+
+	//The queue is in order, so the reductions see the bounds of the primitives
+	CL_UINT sceneBoundsOffset = (CL_UINT)offsetof(struct SceneHeader,modelsBoundingBox);
+	if (Success != _reduction->reduce(_primitiveBounds->getCLMem(),_bvhLeavesCount,Reduction::MergeAABB,_scene.getDeviceSceneData(),sceneBoundsOffset,err))
+		return Error;
+
+	if (Success != _reduction->reduce(_primitiveCentroids->getCLMem(),_bvhLeavesCount,Reduction::MinFloat4,_centroidBounds->getCLMem(),0,err))
+		return Error;
+
+	return _reduction->reduce(_primitiveCentroids->getCLMem(),_bvhLeavesCount,Reduction::MaxFloat4,_centroidBounds->getCLMem(),sizeof(CL_FLOAT4),err);
+}
+
+/**Sets arguments of top-of-tree cache for traversal kernel: Global cache, local memory to copy it into, and its size
+* @param kernel Traversal kernel
+* @param firstArgIndex Index of the first of the three arguments
+* @param err Error info
+* @return Result of the operation: Success or failure
+*/
+Result BVHManager::setTopTreeKernelArgs(OpenCLUtils::CLKernel& kernel, CL_UINT firstArgIndex, Common::Errata& err)
+{
+	CLKernelArgument localBufferArg((CL_UINT)(max(_topTreeSize,1) * sizeof(struct BVHNode)));
+	if (Success != kernel.setKernelArgument(_topTreeNodes->getCLMem(),firstArgIndex,err))
+		return Error;
+	if (Success != kernel.setKernelArgument(localBufferArg,firstArgIndex + 1,err))
+		return Error;
+	if (Success != kernel.setKernelArgument(_topTreeSize,firstArgIndex + 2,err))
+		return Error;
 	return Success;
 }
 
@@ -243,15 +392,18 @@ Result BVHManager::generateContacts(Camera& cam,Errata& err)
 	else
 		_primaryContactsArray.reset(new CLBuffer(_context,contactBufSize,CLBufferFlags::ReadWrite));
 	
-	//Getting the launch parameters
+	//Choosing between ray per work item and packet per work-group
+	CLKernel& contactKernel = _usePacketTraversal ? *_packetContactGenerateKernel : *_contactGenerateKernel;
+
+	//Getting the launch parameters - In packet mode, the work-group size is the packet size
 	size_t processors, warp;
-	if (Success != _context.getMaximalLaunchExecParams(*_contactGenerateKernel,processors,warp,err))
+	if (Success != _context.getMaximalLaunchExecParams(contactKernel,processors,warp,err))
 		return Error;
 
 	//Setting kernel args
 	try
 	{
-		SET_KERNEL_ARGS((*_contactGenerateKernel),_deviceCamera->getCLMem(),_bvhNodes->getCLMem(),_bvhLeavesCount,_scene.getDeviceSceneData(),_primaryContactsArray->getCLMem());
+		SET_KERNEL_ARGS(contactKernel,_deviceCamera->getCLMem(),_bvhNodes->getCLMem(),_bvhLeavesCount,_scene.getDeviceSceneData(),_primaryContactsArray->getCLMem());
 	}
 	catch (CLInterfaceException e)
 	{
@@ -259,15 +411,19 @@ Result BVHManager::generateContacts(Camera& cam,Errata& err)
 		return Error;
 	}
 
+	//Packet traversal shares node fetches through local memory by itself
+	if (!_usePacketTraversal && Success != setTopTreeKernelArgs(contactKernel,5,err))
+		return Error;
+
 	CLEvent evt;
 	evt.reset();
-	cl_uint totalWorkItems = closestMultipleTo(cam.resX * cam.resY,warp);
+	cl_uint totalWorkItems = closestMultipleTo(tiledPixelCount(cam.resX,cam.resY),warp);
 	CLKernelWorkDimension globalDim(1,totalWorkItems);
 	CLKernelWorkDimension localDim(1,warp);
 	CLKernelExecuteParams contactsKernelExecParams(&globalDim,&localDim,&evt);
 
 	//Execute kernel
-	if (Success != _context.enqueueKernel((*_contactGenerateKernel),contactsKernelExecParams,err))
+	if (Success != _context.enqueueKernel(contactKernel,contactsKernelExecParams,err))
 		return Error;
 
 	//Flush and make sure that calculation is over before returning control
@@ -291,6 +447,96 @@ Result BVHManager::generateContacts(Camera& cam,Errata& err)
 */
 Result BVHManager::generateContacts(OpenCLUtils::CLBuffer& rays,OpenCLUtils::CLBuffer& contacts, const unsigned int rayCount, Common::Errata& err)
 {
+	if (!_reorderRays)
+		return traceRays(rays,contacts,rayCount,err);
+	//Nothing to reorder or trace in empty batch
+	if (0 == rayCount)
+		return Success;
+
+	//Tracing the rays in coherent order, then restoring the order of the contacts
+	if (Success != _raySorter->reorder(rays.getCLMem(),rayCount,_scene.getDeviceSceneData(),err))
+		return Error;
+
+	size_t contactBufSize = rayCount * sizeof(struct Contact);
+	if (_sortedContactsArray)
+		_sortedContactsArray->resize(contactBufSize);
+	else
+		_sortedContactsArray.reset(new CLBuffer(_context,contactBufSize,CLBufferFlags::ReadWrite));
+
+	if (Success != traceRays(*_raySorter->getSortedRays(),*_sortedContactsArray,rayCount,err))
+		return Error;
+
+	return _raySorter->restoreOrder(_sortedContactsArray->getCLMem(),contacts.getCLMem(),rayCount,err);
+}
+
+/**Generates contacts for the active rays of index list, and fills their entries of the contacts array
+* @param rays The rays - A device memory buffer object that contains rays as struct Ray
+* @param activeRays Device buffer of CL_UINT indices of the rays to trace, e.g. as compacted by StreamCompaction
+* @param activeRayCount Device buffer of single CL_UINT - The number of indices in activeRays
+* @param contact The target device memory - For each traced ray rays[i] the buffer will contain its contact
+*                as contacts[i]. Contacts of the other rays are not modified
+* @param maxActiveRays Upper bound of the number of active rays, by which the work items are launched
+* @param err Error info
+* @return Result of the operation: Success or failure
+*/
+Result BVHManager::generateContacts(OpenCLUtils::CLBuffer& rays,OpenCLUtils::CLBuffer& activeRays,OpenCLUtils::CLBuffer& activeRayCount,OpenCLUtils::CLBuffer& contacts, const unsigned int maxActiveRays, Common::Errata& err)
+{
+	if (maxActiveRays == 0)
+		return Success;
+
+	//Setting kernel args
+	try
+	{
+		SET_KERNEL_ARGS((*_indexedContactGenerateKernel),rays.getCLMem(),activeRays.getCLMem(),activeRayCount.getCLMem(),
+			_bvhNodes->getCLMem(),_bvhLeavesCount,_scene.getDeviceSceneData(),contacts.getCLMem());
+	}
+	catch (CLInterfaceException e)
+	{
+		err = Errata(e);
+		return Error;
+	}
+
+	if (Success != setTopTreeKernelArgs(*_indexedContactGenerateKernel,7,err))
+		return Error;
+
+	//Getting the launch parameters
+	size_t processors, warp;
+	if (Success != _context.getMaximalLaunchExecParams(*_indexedContactGenerateKernel,processors,warp,err))
+		return Error;
+
+	CLEvent evt;
+	evt.reset();
+	cl_uint totalWorkItems = closestMultipleTo(maxActiveRays,warp);
+	CLKernelWorkDimension globalDim(1,totalWorkItems);
+	CLKernelWorkDimension localDim(1,warp);
+	CLKernelExecuteParams contactsKernelExecParams(&globalDim,&localDim,&evt);
+
+	//Execute kernel
+	if (Success != _context.enqueueKernel((*_indexedContactGenerateKernel),contactsKernelExecParams,err))
+		return Error;
+
+	//Flush and make sure that calculation is over before returning control
+	if (Success != _context.flushQueue(err))
+		return Error;
+
+	if (Success != evt.wait(err))
+		return Error;
+
+	return Success;
+}
+
+/**Traces the rays in the order they are stored, and fills the contacts array - See generateContacts
+* @param rays The rays to be traced - A device memory buffer object that contains rays as struct Ray
+* @param contact The target device memory that will contain the result
+* @param rayCount The number of rays to trace
+* @param err Error info
+* @return Result of the operation: Success or failure
+*/
+Result BVHManager::traceRays(OpenCLUtils::CLBuffer& rays,OpenCLUtils::CLBuffer& contacts, const unsigned int rayCount, Common::Errata& err)
+{
+	if (_usePersistentThreads)
+		return generateContactsPersistent(rays,contacts,rayCount,err);
+
 	//Setting kernel args
 	try
 	{
@@ -302,6 +548,9 @@ Result BVHManager::generateContacts(OpenCLUtils::CLBuffer& rays,OpenCLUtils::CLB
 		return Error;
 	}
 
+	if (Success != setTopTreeKernelArgs(*_contactGenerateKernel2,6,err))
+		return Error;
+
 	//Getting the launch parameters
 	size_t processors, warp;
 	if (Success != _context.getMaximalLaunchExecParams(*_contactGenerateKernel2,processors,warp,err))
@@ -327,4 +576,58 @@ Result BVHManager::generateContacts(OpenCLUtils::CLBuffer& rays,OpenCLUtils::CLB
 
 	return Success;
 }
-			
\ No newline at end of file
+
+/**Generates contacts for rays and fills the contacts array, using persistent threads:
+* Launches just enough work-groups to fill the device, which fetch batches of rays from a global queue until it drains
+* @param rays The rays to be traced - A device memory buffer object that contains rays as struct Ray
+* @param contact The target device memory that will contain the result - As in generateContacts
+* @param rayCount The number of rays to trace
+* @param err Error info
+* @return Result of the operation: Success or failure
+*/
+Result BVHManager::generateContactsPersistent(OpenCLUtils::CLBuffer& rays,OpenCLUtils::CLBuffer& contacts, const unsigned int rayCount, Common::Errata& err)
+{
+	//Resetting the queue head
+	CL_UINT queueHead = 0;
+	if (Success != _context.enqueueFillBuffer(_rayQueueHead->getCLMem(),&queueHead,sizeof(CL_UINT),sizeof(CL_UINT),err))
+		return Error;
+
+	//Setting kernel args
+	try
+	{
+		SET_KERNEL_ARGS((*_persistentContactGenerateKernel),rays.getCLMem(),rayCount,_bvhNodes->getCLMem(),_bvhLeavesCount,_scene.getDeviceSceneData(),contacts.getCLMem(),_rayQueueHead->getCLMem());
+	}
+	catch (CLInterfaceException e)
+	{
+		err = Errata(e);
+		return Error;
+	}
+
+	if (Success != setTopTreeKernelArgs(*_persistentContactGenerateKernel,7,err))
+		return Error;
+
+	//Getting the launch parameters - Enough work-groups to fill the device, but no more than there are rays
+	size_t processors, warp;
+	if (Success != _context.getMaximalLaunchExecParams(*_persistentContactGenerateKernel,processors,warp,err))
+		return Error;
+
+	CLEvent evt;
+	evt.reset();
+	cl_uint totalWorkItems = min(processors * PERSISTENT_GROUPS_PER_PROCESSOR * warp,(size_t)closestMultipleTo(rayCount,warp));
+	CLKernelWorkDimension globalDim(1,totalWorkItems);
+	CLKernelWorkDimension localDim(1,warp);
+	CLKernelExecuteParams contactsKernelExecParams(&globalDim,&localDim,&evt);
+
+	//Execute kernel
+	if (Success != _context.enqueueKernel((*_persistentContactGenerateKernel),contactsKernelExecParams,err))
+		return Error;
+
+	//Flush and make sure that calculation is over before returning control
+	if (Success != _context.flushQueue(err))
+		return Error;
+
+	if (Success != evt.wait(err))
+		return Error;
+
+	return Success;
+}
@@ -27,11 +27,18 @@
  *
  *  @implNote The GPU kernels were taken from this source: http://www.bealto.com/gpu-sorting_parallel-merge-local.html
  *            and the interface class was implemented according to the source above.
+ *            The choice of kernels and work group sizes is tuned per device on initialization, as in the source above.
  *
  */
 
 #include <list>
+#include <map>
+#include <float.h>
+#include <vector>
+#include <sstream>
+#include <Windows.h>
 #include <boost\algorithm\string\replace.hpp>
+#include <OpenCLUtils\CLBuffer.h>
 #include <OpenCLUtils\CLExecutionContext.h>
 #include <Algorithms\Sorting.h>
 #include <CLData\RTKernelUtils.h>
@@ -50,6 +57,7 @@ enum Kernels {
   PARALLEL_BITONIC_B16_KERNEL,
   PARALLEL_BITONIC_C2_KERNEL,
   PARALLEL_BITONIC_C4_KERNEL,
+  PARALLEL_BITONIC_LOCAL_OPTIM_KERNEL,
   NB_KERNELS
 };
 
@@ -60,14 +68,27 @@ const char * KernelNames[NB_KERNELS+1] = {
   "ParallelBitonic_B16",
   "ParallelBitonic_C2",
   "ParallelBitonic_C4",
+  "ParallelBitonic_Local_Optim",
   0 };
 
-// Allowed "Bx" kernels (bit mask)
-#define ALLOWB (2+4+8)
+//No local memory kernel in the plan
+#define NO_KERNEL -1
+//Number of items sorted for timing of the plans
+#define TUNING_ITEMS (1 << 18)
+//Number of timed sorts per plan - The fastest one counts
+#define TUNING_RUNS 3
+//Smallest work group size that is timed
+#define TUNING_MIN_WORKGROUP_SIZE 32
+
+//Plan that is used when tuning fails: B2/B4/B8 kernels with up to 256 work items, as in the source
+const BitonicSort::SortPlan DefaultPlan = { 3, 256, NO_KERNEL, 0, 0 };
+
+//Tuned plans of this process, by device and item type - Tuning runs once, for the first sorter of the kind
+static std::map<std::string,BitonicSort::SortPlan> TunedPlans;
 
 /**Constructor*/
 BitonicSort::BitonicSort(const CLExecutionContext& context,const bool useKeyValue):
-	_context(context),_deviceLocalMemory(0),_maxWorkgroupSize(0),_useKeyValue(useKeyValue)
+	_context(context),_deviceLocalMemory(0),_maxWorkgroupSize(0),_useKeyValue(useKeyValue),_plan(DefaultPlan)
 {
 	_sortingKernels.reset(new boost::shared_ptr<CLKernel>[NB_KERNELS]);
 }
@@ -76,6 +97,7 @@ BitonicSort::BitonicSort(const CLExecutionContext& context,const bool useKeyValu
 
 /**Initialize
 * Performs initialization of a BitonicSort instance. Must be called once per instance
+* On first initialization for a device and item type, the sorting plan is tuned by timing sample sorts
 * @param [out] err Error info, in case error occurred
 * @return Result, that indicates whether the operation succeeded or failed
 */
@@ -105,6 +127,20 @@ Result BitonicSort::initialize(Errata& err)
 
 	if(Success != _context.getDevice().getMemoryInfo().getLocalMemSize(_deviceLocalMemory,err))
 		return Error;
+
+	string deviceName;
+	if (Success != _context.getDevice().getDeviceName(deviceName,err))
+		return Error;
+	string planKey = deviceName + (_useKeyValue ? " - Key/Value" : " - Key");
+	std::map<std::string,SortPlan>::const_iterator tuned = TunedPlans.find(planKey);
+	if (tuned != TunedPlans.end())
+	{
+		_plan = tuned->second;
+		return Success;
+	}
+	if (Success != tunePlan(err))
+		return Error;
+	TunedPlans[planKey] = _plan;
 	
 	return Success;
 }
@@ -117,76 +153,255 @@ Result BitonicSort::initialize(Errata& err)
 */
 Result BitonicSort::sort(cl_mem input,size_t num_items,Errata& err)
 {
-	for (int length=1;length<num_items;length<<=1)
+	return runPlan(_plan,input,num_items,err);
+}
+
+/**Tunes the sorting plan for the device: Times sorts of random sample with candidate plans, one plan member
+* at a time - First global memory kernels, then local memory kernel for the last merge stages, and then block sort.
+* Plans that fail to launch (e.g. work group is too large for the kernel), or give unsorted output are skipped.
+* @param [out] err Error info, in case error occurred
+* @return Result, that indicates whether the operation succeeded or failed
+*/
+Result BitonicSort::tunePlan(Errata& err)
+{
+	size_t itemSize = _useKeyValue ? sizeof(KV_TYPE) : sizeof(CL_UINT);
+	std::vector<CL_UINT> sampleData(TUNING_ITEMS * (_useKeyValue ? 2 : 1));
+	for (size_t i = 0; i < sampleData.size(); i++)
+		sampleData[i] = (CL_UINT)((rand() << 16) ^ rand());
+	CLBuffer unsorted(_context,TUNING_ITEMS * itemSize,&sampleData[0],CLBufferFlags::ReadWrite);
+	CLBuffer sample(_context,TUNING_ITEMS * itemSize,CLBufferFlags::ReadWrite);
+
+	std::vector<size_t> workgroupSizes;
+	for (size_t wg = TUNING_MIN_WORKGROUP_SIZE; wg <= _maxWorkgroupSize; wg <<= 1)
+		workgroupSizes.push_back(wg);
+
+	SortPlan best = DefaultPlan;
+	double bestTime;
+	Errata planErr;
+	if (Success != timePlan(best,sample.getCLMem(),unsorted.getCLMem(),TUNING_ITEMS,bestTime,planErr))
+		bestTime = DBL_MAX;
+
+	//1. Global memory kernels
+	SortPlan candidate = best;
+	for (int stages = 1; stages <= 4; stages++)
+		for (size_t i = 0; i < workgroupSizes.size(); i++)
+		{
+			double time;
+			candidate.globalStages = stages;
+			candidate.globalWorkgroupSize = workgroupSizes[i];
+			if (Success == timePlan(candidate,sample.getCLMem(),unsorted.getCLMem(),TUNING_ITEMS,time,planErr) && time < bestTime)
+			{
+				bestTime = time;
+				best = candidate;
+			}
+		}
+
+	//2. Local memory kernel for the last merge stages - C2 keeps 2 items per work item, and C4 keeps 4
+	candidate = best;
+	for (int kernel = PARALLEL_BITONIC_C2_KERNEL; kernel <= PARALLEL_BITONIC_C4_KERNEL; kernel++)
+		for (size_t i = 0; i < workgroupSizes.size(); i++)
+		{
+			double time;
+			size_t itemsPerWorkItem = (kernel == PARALLEL_BITONIC_C2_KERNEL) ? 2 : 4;
+			if (workgroupSizes[i] * itemsPerWorkItem * itemSize > _deviceLocalMemory)
+				break;
+			candidate.localKernel = kernel;
+			candidate.localWorkgroupSize = workgroupSizes[i];
+			if (Success == timePlan(candidate,sample.getCLMem(),unsorted.getCLMem(),TUNING_ITEMS,time,planErr) && time < bestTime)
+			{
+				bestTime = time;
+				best = candidate;
+			}
+		}
+
+	//3. Block sort in local memory
+	candidate = best;
+	for (size_t i = 0; i < workgroupSizes.size(); i++)
+	{
+		double time;
+		if (workgroupSizes[i] * itemSize > _deviceLocalMemory)
+			break;
+		candidate.blockSortSize = workgroupSizes[i];
+		if (Success == timePlan(candidate,sample.getCLMem(),unsorted.getCLMem(),TUNING_ITEMS,time,planErr) && time < bestTime)
+		{
+			bestTime = time;
+			best = candidate;
+		}
+	}
+
+	_plan = best;
+	return Success;
+}
+
+/**Times sorting of sample with given plan, and verifies the result
+* @param plan The plan
+* @param sample Device buffer, to which the unsorted items are copied for sorting
+* @param unsorted Device buffer of unsorted items
+* @param num_items Number of items in the buffers - Must be power of two
+* @param [out] time Time of fastest of the sorts, in performance counter ticks
+* @param [out] err Error info, in case error occurred
+* @return Result, that indicates whether the operation succeeded and sorted the sample
+*/
+Result BitonicSort::timePlan(const SortPlan& plan,cl_mem sample,cl_mem unsorted,size_t num_items,double& time,Errata& err)
+{
+	size_t itemSize = _useKeyValue ? sizeof(KV_TYPE) : sizeof(CL_UINT);
+	time = DBL_MAX;
+	for (int i = 0; i < TUNING_RUNS; i++)
+	{
+		if (Success != _context.enqueueCopyBuffer(unsorted,sample,num_items * itemSize,err))
+			return Error;
+		LARGE_INTEGER start, end;
+		QueryPerformanceCounter(&start);
+		if (Success != runPlan(plan,sample,num_items,err))
+			return Error;
+		QueryPerformanceCounter(&end);
+		time = min(time,(double)(end.QuadPart - start.QuadPart));
+	}
+
+	//Keys are the first component of each item
+	size_t stride = _useKeyValue ? 2 : 1;
+	std::vector<CL_UINT> sorted(num_items * stride);
+	if (Success != _context.enqueueReadBuffer(sample,&sorted[0],num_items * itemSize,err))
+		return Error;
+	for (size_t i = 1; i < num_items; i++)
+		if (sorted[(i - 1) * stride] > sorted[i * stride])
+		{
+			FILL_ERRATA(err,"Sorting plan gave unsorted output");
+			return Error;
+		}
+	return Success;
+}
+
+/**Sorts the input array with given plan
+* @param plan The plan
+* @param input Device pointer to array that shoud be sorted
+* @param num_items Number of items in array to be sorted - Must be power of two
+* @param [out] err Error info, in case error occurred
+* @return Result, that indicates whether the operation succeeded or failed
+*/
+Result BitonicSort::runPlan(const SortPlan& plan,cl_mem input,size_t num_items,Errata& err)
+{
+	size_t itemSize = _useKeyValue ? sizeof(KV_TYPE) : sizeof(CL_UINT);
+	int length = 1;
+
+	//Sorted sequences up to block size are made in local memory, at once
+	if (plan.blockSortSize > 1 && num_items > 1)
+	{
+		size_t wg = min(plan.blockSortSize,num_items);
+		CLKernelArgument aux((cl_uint)(wg * itemSize));
+		CLKernel& kernel = *_sortingKernels[PARALLEL_BITONIC_LOCAL_OPTIM_KERNEL];
+		try
+		{
+			SET_KERNEL_ARGS(kernel,input,input,aux);
+		}
+		catch(CLInterfaceException e)
+		{
+			err = Errata(e);
+			return Error;
+		}
+		if (Success != launchKernel(kernel,num_items,wg,err))
+			return Error;
+		length = (int)wg;
+	}
+
+	for (;length<num_items;length<<=1)
     {
       int inc = length;
+      int dir = length<<1;
       while (inc > 0)
       {
+        int kid = NO_KERNEL;
         int ninc = 0;
-        int kid;
-#if (ALLOWB & 16)  // Allow B16
-        if (inc >= 8 && ninc == 0)
-        {
-          kid = PARALLEL_BITONIC_B16_KERNEL;
-          ninc = 4;
-        }
-#endif
-#if (ALLOWB & 8)  // Allow B8
-        if (inc >= 4 && ninc == 0)
+        size_t nThreads = 0;
+        size_t wg = 0;
+        cl_uint localMemory = 0;
+
+        //The last merge stages of the length run in local memory, once the compared items are in same work group
+        if (plan.localKernel == PARALLEL_BITONIC_C2_KERNEL)
         {
-          kid = PARALLEL_BITONIC_B8_KERNEL;
-          ninc = 3;
+          nThreads = num_items >> 1;
+          wg = min(plan.localWorkgroupSize,nThreads);
+          if ((size_t)inc <= wg)
+          {
+            kid = PARALLEL_BITONIC_C2_KERNEL;
+            localMemory = (cl_uint)(2 * wg * itemSize);
+          }
         }
-#endif
-#if (ALLOWB & 4)  // Allow B4
-        if (inc >= 2 && ninc == 0)
+        else if (plan.localKernel == PARALLEL_BITONIC_C4_KERNEL && inc >= 2)
         {
-          kid = PARALLEL_BITONIC_B4_KERNEL;
-          ninc = 2;
+          nThreads = num_items >> 2;
+          wg = min(plan.localWorkgroupSize,nThreads);
+          if ((size_t)inc <= 2 * wg)
+          {
+            kid = PARALLEL_BITONIC_C4_KERNEL;
+            localMemory = (cl_uint)(4 * wg * itemSize);
+          }
         }
-#endif
-        // Always allow B2
-        if (ninc == 0)
+
+        if (kid == NO_KERNEL)
         {
-          kid = PARALLEL_BITONIC_B2_KERNEL;
+          //Global memory kernel with as many stages as allowed - Kernel with N stages requires INC >= 2^(N-1)
           ninc = 1;
+          while (ninc < plan.globalStages && (inc >> ninc) > 0)
+            ninc++;
+          kid = PARALLEL_BITONIC_B2_KERNEL + ninc - 1;
+          nThreads = num_items >> ninc;
+          wg = min(plan.globalWorkgroupSize,nThreads);
         }
-        int nThreads = num_items >> ninc;
-		int wg = _maxWorkgroupSize;//c->getMaxWorkgroupSize(targetDevice,kid);
-        wg = min(wg,256);
-        wg = min(wg,nThreads);
- 
+
 		CLKernel& kernel =*_sortingKernels[kid];
 		try
 		{
-			SET_KERNEL_ARGS(kernel,input,inc,length<<1);
+			if (localMemory > 0)
+			{
+				CLKernelArgument aux(localMemory);
+				SET_KERNEL_ARGS(kernel,input,inc,dir,aux);
+			}
+			else
+			{
+				SET_KERNEL_ARGS(kernel,input,inc,dir);
+			}
 		}
 		catch(CLInterfaceException e)
 		{
 			err = Errata(e);
 			return Error;
 		}
-		
-		CLEvent evt;
-		CLKernelWorkDimension globalDim(1,nThreads);
-		CLKernelWorkDimension localDim(1,wg);
-		CLKernelExecuteParams sortingKernelExecParams(&globalDim,&localDim,&evt);
-		
-		//Execute kernel
-		if (Success != _context.enqueueKernel(kernel,sortingKernelExecParams,err))
-			return Error;
-		
-		//Flush and make sure that sorting is over before returning control
-		if (Success != _context.flushQueue(err))
-			return Error;
-		
-		if (Success != evt.wait(err))
+
+		if (Success != launchKernel(kernel,nThreads,wg,err))
 			return Error;
-        inc >>= ninc;
+
+		//Local memory kernels complete all the stages of the length
+        inc = (localMemory > 0) ? 0 : (inc >> ninc);
       }
     }
 	return Success;
 }
 
-   
+/**Launches one of the sorting kernels, and waits for completion
+* @param kernel The kernel to launch - Its arguments must be already set
+* @param globalThreads Number of work items
+* @param localThreads Work group size
+* @param [out] err Error info, in case error occurred
+* @return Result, that indicates whether the operation succeeded or failed
+*/
+Result BitonicSort::launchKernel(CLKernel& kernel,size_t globalThreads,size_t localThreads,Errata& err)
+{
+	CLEvent evt;
+	CLKernelWorkDimension globalDim(1,globalThreads);
+	CLKernelWorkDimension localDim(1,localThreads);
+	CLKernelExecuteParams sortingKernelExecParams(&globalDim,&localDim,&evt);
+	
+	//Execute kernel
+	if (Success != _context.enqueueKernel(kernel,sortingKernelExecParams,err))
+		return Error;
+	
+	//Flush and make sure that sorting is over before returning control
+	if (Success != _context.flushQueue(err))
+		return Error;
+	
+	if (Success != evt.wait(err))
+		return Error;
 
+	return Success;
+}
@@ -40,14 +40,30 @@ const char* BVHKernelSource =
 "#include \"CLData\\AccelerationStructs\\BVHData.h\"\n"
 "\n"
 "#pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics : enable\n"
+"#pragma OPENCL EXTENSION cl_khr_local_int32_base_atomics : enable\n"
+"\n"
+"//Size of traversal stack, shared by a packet of rays - Packets of deeper trees fall back to traversal per ray\n"
+"#define PACKET_STACK_SIZE 64\n"
+"\n"
+"/***************************************************\n"
+"* 0. Calculate bounding box and centroid of each primitive\n"
+"*    - Reduced to scene and centroid bounds by host\n"
+"****************************************************/\n"
+"__kernel void computePrimitiveBounds(__global const char* scene,__global struct AABB* primitiveBounds,__global float4* centroids)\n"
+"{\n"
+"	if(get_global_id(0) < SCENE_HEADER(scene)->totalNumberOfTriangles) \n"
+"		calculatePrimitiveBounds(primitiveBounds,centroids,get_global_id(0),scene);\n"
+"}\n"
 "\n"
 "/***************************************************\n"
 "* 1. Calculate Morton code for each primitive\n"
 "****************************************************/\n"
-"__kernel void calculateMortonCodes(__global struct BVHNode* leavesBuffer,__global uint2* mortonBuffer, __global const char* scene)\n"
+"__kernel void calculateMortonCodes(__global struct BVHNode* leavesBuffer,__global uint2* mortonBuffer, __global const char* scene,\n"
+"								   __global const struct AABB* primitiveBounds,__global const float4* centroids,\n"
+"								   __global const struct AABB* centroidBounds)\n"
 "{\n"
 "	if(get_global_id(0) < SCENE_HEADER(scene)->totalNumberOfTriangles) \n"
-"		calculateMorton(leavesBuffer,mortonBuffer,get_global_id(0),scene);\n"
+"		calculateMorton(leavesBuffer,mortonBuffer,get_global_id(0),scene,primitiveBounds,centroids,centroidBounds);\n"
 "}\n"
 "\n"
 "/***************************************************\n"
@@ -79,6 +95,14 @@ const char* BVHKernelSource =
 "	}\n"
 "}\n"
 "\n"
+"//Copies top-of-tree cache into local memory - Called by all work items of the group before traversal\n"
+"inline void loadTopTree(const __global struct BVHNode* topTreeNodes, __local struct BVHNode* topTree, uint topTreeSize)\n"
+"{\n"
+"	event_t copyEvent = async_work_group_copy((__local uint4*)topTree,(const __global uint4*)topTreeNodes,\n"
+"											  topTreeSize * (sizeof(struct BVHNode) / sizeof(uint4)),0);\n"
+"	wait_group_events(1,&copyEvent);\n"
+"}\n"
+"\n"
 "/***************************************************************\n"
 "* 4. Generating the contacts for primary rays\n"
 "***************************************************************/\n"
@@ -86,14 +110,19 @@ const char* BVHKernelSource =
 "							      __global struct BVHNode* bvh, \n"
 "							      uint rootIdx,\n"
 "							      const __global char* scene,\n"
-"							      __global struct Contact* output\n"
+"							      __global struct Contact* output,\n"
+"							      const __global struct BVHNode* topTreeNodes,\n"
+"							      __local struct BVHNode* topTree,\n"
+"							      uint topTreeSize\n"
 "								 )\n"
 "{\n"
-"		if (get_global_id(0) < (camera->resX * camera->resY))\n"
+"		loadTopTree(topTreeNodes,topTree,topTreeSize);\n"
+"		const uint pixelIdx = tiledPixelIndex(camera,get_global_id(0));\n"
+"		if (pixelIdx != UINT_MAX)\n"
 "		{\n"
-"			struct Ray r = generateRay(camera,get_global_id(0));\n"
-"			struct Contact c = bvh_generate_contact(r,bvh,rootIdx,scene);\n"
-"			c.pixelIndex = get_global_id(0);\n"
+"			struct Ray r = generateRay(camera,pixelIdx);\n"
+"			struct Contact c = bvh_generate_contact(r,bvh,rootIdx,scene,topTree,topTreeSize);\n"
+"			c.pixelIndex = pixelIdx;\n"
 "			output[c.pixelIndex] = c;\n"
 "		}\n"
 "}\n"
@@ -106,15 +135,231 @@ const char* BVHKernelSource =
 "							   __global struct BVHNode* bvh, \n"
 "							   uint rootIdx,\n"
 "							   const __global char* scene,\n"
-"							   __global struct Contact* output)\n"
+"							   __global struct Contact* output,\n"
+"							   const __global struct BVHNode* topTreeNodes,\n"
+"							   __local struct BVHNode* topTree,\n"
+"							   uint topTreeSize)\n"
 "{\n"
+"		loadTopTree(topTreeNodes,topTree,topTreeSize);\n"
 "		uint idx = get_global_id(0);\n"
 "		if (idx < rayCount)\n"
 "		{\n"
-"			struct Contact c = bvh_generate_contact(rays[idx],bvh,rootIdx,scene);\n"
+"			struct Contact c = bvh_generate_contact(rays[idx],bvh,rootIdx,scene,topTree,topTreeSize);\n"
 "			c.pixelIndex = idx;\n"
 "			output[c.pixelIndex] = c;\n"
 "		}\n"
 "}\n"
 "\n"
+"/***************************************************************\n"
+"* 5a. Generating the contacts for active rays of index list\n"
+"*     Work item per list entry - The count is read on device\n"
+"***************************************************************/\n"
+"__kernel void generateContactsIndexed(__global struct Ray* rays,\n"
+"							   const __global uint* activeRays,\n"
+"							   const __global uint* activeRayCount,\n"
+"							   __global struct BVHNode* bvh, \n"
+"							   uint rootIdx,\n"
+"							   const __global char* scene,\n"
+"							   __global struct Contact* output,\n"
+"							   const __global struct BVHNode* topTreeNodes,\n"
+"							   __local struct BVHNode* topTree,\n"
+"							   uint topTreeSize)\n"
+"{\n"
+"		loadTopTree(topTreeNodes,topTree,topTreeSize);\n"
+"		uint idx = get_global_id(0);\n"
+"		if (idx < *activeRayCount)\n"
+"		{\n"
+"			uint rayIdx = activeRays[idx];\n"
+"			struct Contact c = bvh_generate_contact(rays[rayIdx],bvh,rootIdx,scene,topTree,topTreeSize);\n"
+"			c.pixelIndex = rayIdx;\n"
+"			output[c.pixelIndex] = c;\n"
+"		}\n"
+"}\n"
+"\n"
+"/***************************************************************\n"
+"* 6. Generating the contacts for general rays - Persistent threads\n"
+"*    Launched with just enough work-groups to fill the device.\n"
+"*    Each work-group repeatedly fetches the next batch of ray\n"
+"*    indices from a global queue head, until the queue drains,\n"
+"*    so groups that finish early take over remaining work\n"
+"***************************************************************/\n"
+"__kernel void generateContactsPersistent(__global struct Ray* rays,\n"
+"							   uint rayCount,\n"
+"							   __global struct BVHNode* bvh, \n"
+"							   uint rootIdx,\n"
+"							   const __global char* scene,\n"
+"							   __global struct Contact* output,\n"
+"							   __global volatile uint* rayQueueHead,\n"
+"							   const __global struct BVHNode* topTreeNodes,\n"
+"							   __local struct BVHNode* topTree,\n"
+"							   uint topTreeSize)\n"
+"{\n"
+"		__local uint batchStart;\n"
+"		uint myBatchStart;\n"
+"		loadTopTree(topTreeNodes,topTree,topTreeSize);\n"
+"		do\n"
+"		{\n"
+"			//Fetch next batch for the entire work-group\n"
+"			if (get_local_id(0) == 0)\n"
+"				batchStart = atomic_add(rayQueueHead,(uint)get_local_size(0));\n"
+"			barrier(CLK_LOCAL_MEM_FENCE);\n"
+"			myBatchStart = batchStart;\n"
+"			barrier(CLK_LOCAL_MEM_FENCE); //Everyone has read the batch before it is overwritten\n"
+"\n"
+"			uint idx = myBatchStart + get_local_id(0);\n"
+"			if (idx < rayCount)\n"
+"			{\n"
+"				struct Contact c = bvh_generate_contact(rays[idx],bvh,rootIdx,scene,topTree,topTreeSize);\n"
+"				c.pixelIndex = idx;\n"
+"				output[c.pixelIndex] = c;\n"
+"			}\n"
+"		}\n"
+"		while (myBatchStart + get_local_size(0) < rayCount);\n"
+"}\n"
+"\n"
+"/***************************************************************\n"
+"* 7. Generating the contacts for primary rays - Packet traversal\n"
+"*    Work-group traces a packet of neighbouring camera rays,\n"
+"*    sharing a single traversal stack in local memory. Each node\n"
+"*    is fetched once per work-group, and a child is visited\n"
+"*    whenever at least one active ray of the packet hits it.\n"
+"*    If the stack overflows, the rays are traced one by one\n"
+"***************************************************************/\n"
+"__kernel void generateContactsPacket(__constant struct Camera* camera,\n"
+"							      __global struct BVHNode* bvh, \n"
+"							      uint rootIdx,\n"
+"							      const __global char* scene,\n"
+"							      __global struct Contact* output\n"
+"								 )\n"
+"{\n"
+"		__local uint stack[PACKET_STACK_SIZE];\n"
+"		__local uint stackPointer;\n"
+"		__local uint stackOverflow;\n"
+"		__local uint currentIdx;\n"
+"		__local struct BVHNode sharedNode;\n"
+"		__local struct AABB sharedChildBoxes[2];\n"
+"		__local volatile uint visitA;\n"
+"		__local volatile uint visitB;\n"
+"\n"
+"		const uint localIdx = get_local_id(0);\n"
+"		const uint pixelIdx = tiledPixelIndex(camera,get_global_id(0));\n"
+"		const bool active = pixelIdx != UINT_MAX;\n"
+"\n"
+"		struct Ray ray = generateRay(camera,active ? pixelIdx : 0);\n"
+"		const struct InverseRay invRay = prepareInverseRay(ray.origin,ray.direction);\n"
+"		CL_FLOAT4 resContactData = (CL_FLOAT4)(0.0f,0.0f,0.0f,ray.tMax);\n"
+"		CL_UINT resMaterialIdx = 0;\n"
+"\n"
+"		if (localIdx == 0)\n"
+"		{\n"
+"			stackPointer = 0;\n"
+"			stackOverflow = 0;\n"
+"			stack[stackPointer++] = UINT_MAX; //Push initial value\n"
+"			currentIdx = rootIdx;\n"
+"		}\n"
+"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+"\n"
+"		while (currentIdx != UINT_MAX)\n"
+"		{\n"
+"			//Fetch the node once for the whole packet\n"
+"			if (localIdx == 0)\n"
+"			{\n"
+"				sharedNode = bvh[currentIdx];\n"
+"				visitA = visitB = 0;\n"
+"			}\n"
+"			barrier(CLK_LOCAL_MEM_FENCE);\n"
+"			struct BVHNode node = sharedNode;\n"
+"\n"
+"			if (type(node) == INNER_NODE)\n"
+"			{\n"
+"				if (localIdx < 2)\n"
+"					sharedChildBoxes[localIdx] = bvh[localIdx == 0 ? childA(node) : childB(node)].boundingBox;\n"
+"				barrier(CLK_LOCAL_MEM_FENCE);\n"
+"\n"
+"				struct AABB child_A_box = sharedChildBoxes[0];\n"
+"				struct AABB child_B_box = sharedChildBoxes[1];\n"
+"				CL_FLOAT2 tA = AABBIntersectInv(child_A_box,invRay);\n"
+"				CL_FLOAT2 tB = AABBIntersectInv(child_B_box,invRay);\n"
+"				if (active && tA.x <= tA.y && tA.y >= ray.tMin && tA.x < resContactData.w)\n"
+"					atomic_or(&visitA,1);\n"
+"				if (active && tB.x <= tB.y && tB.y >= ray.tMin && tB.x < resContactData.w)\n"
+"					atomic_or(&visitB,1);\n"
+"				barrier(CLK_LOCAL_MEM_FENCE);\n"
+"\n"
+"				if (localIdx == 0)\n"
+"				{\n"
+"					if (visitA && visitB)\n"
+"					{\n"
+"						//Full stack - The packet is abandoned, and its rays are traced one by one below\n"
+"						if (stackPointer == PACKET_STACK_SIZE)\n"
+"						{\n"
+"							stackOverflow = 1;\n"
+"							currentIdx = UINT_MAX;\n"
+"						}\n"
+"						else\n"
+"						{\n"
+"							currentIdx = childA(node);\n"
+"							stack[stackPointer++] = childB(node); // push\n"
+"						}\n"
+"					}\n"
+"					else if (visitA)\n"
+"						currentIdx = childA(node);\n"
+"					else if (visitB)\n"
+"						currentIdx = childB(node);\n"
+"					else\n"
+"						currentIdx = stack[--stackPointer];\n"
+"				}\n"
+"			}\n"
+"			else\n"
+"			{\n"
+"				if (active)\n"
+"				{\n"
+"					CL_GLOBAL char* mesh = getMeshAtIndex(submeshIndex(node),getModelAtIndex(modelIndex(node),scene));\n"
+"					CL_UINT baseIndex = triangleIndex(node) * 3;\n"
+"					CL_FLOAT4 contactData = triangleIntersect(\n"
+"											getVertexAt(getIndexAt(baseIndex,mesh),mesh),\n"
+"											getVertexAt(getIndexAt(baseIndex + 1,mesh),mesh),\n"
+"											getVertexAt(getIndexAt(baseIndex + 2,mesh),mesh),ray.origin,ray.direction,\n"
+"											ray.tMin,resContactData.w);\n"
+"					if (contactData.w > 0)\n"
+"					{\n"
+"						resContactData = contactData;\n"
+"						resMaterialIdx = MESH_HEADER(mesh)->materialIndex;	\n"
+"					}\n"
+"				}\n"
+"				if (localIdx == 0)\n"
+"					currentIdx = stack[--stackPointer];\n"
+"			}\n"
+"			barrier(CLK_LOCAL_MEM_FENCE);\n"
+"		}\n"
+"\n"
+"		if (active)\n"
+"		{\n"
+"			struct Contact c;\n"
+"			if (stackOverflow)\n"
+"				c = bvh_generate_contact(ray,bvh,rootIdx,scene,0,0);\n"
+"			else\n"
+"			{\n"
+"				c.normalAndintersectionDistance = resContactData;\n"
+"				if (c.contactDist == ray.tMax)\n"
+"					c.contactDist = 0;\n"
+"				c.materialIndex = resMaterialIdx;\n"
+"			}\n"
+"			c.pixelIndex = pixelIdx;\n"
+"			output[c.pixelIndex] = c;\n"
+"		}\n"
+"}\n"
+"\n"
+"/***************************************************************\n"
+"* 8. Filling top-of-tree cache - Work item per slot\n"
+"***************************************************************/\n"
+"__kernel void buildTopTree(__global struct BVHNode* bvh,\n"
+"						   uint rootIdx,\n"
+"						   __global struct BVHNode* topTreeNodes,\n"
+"						   uint topTreeSize)\n"
+"{\n"
+"		if (get_global_id(0) < topTreeSize)\n"
+"			fillTopTreeSlot(bvh,rootIdx,topTreeNodes,get_global_id(0));\n"
+"}\n"
+"\n"
 ;
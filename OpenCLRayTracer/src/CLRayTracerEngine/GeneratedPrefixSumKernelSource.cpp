@@ -1,110 +1,159 @@
 const char* PrefixSumKernelSource = 
-"/**********************************************************************\n"
-"Copyright 2015 Advanced Micro Devices, Inc. All rights reserved.\n"
+"/**\n"
+" * @file PrefixSumKernels.cl\n"
+" * @author  Timur Sizov <timorgizer@gmail.com>\n"
+" * @version 0.6\n"
+" *\n"
+" * @section LICENSE\n"
+" *\n"
+" * Copyright (c) 2016 Timur Sizov\n"
+" *\n"
+" * Permission is hereby granted, free of charge, to any person obtaining a copy of this\n"
+" * software and associated documentation files (the \"Software\"), to deal in the Software \n"
+" * without restriction, including without limitation the rights to use, copy, modify, merge, \n"
+" * publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons \n"
+" * to whom the Software is furnished to do so, subject to the following conditions:\n"
+" * The above copyright notice and this permission notice shall be included in all copies or \n"
+" * substantial portions of the Software.\n"
+" *\n"
+" * THE SOFTWARE IS PROVIDED \"AS IS\", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, \n"
+" * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE \n"
+" * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, \n"
+" * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, \n"
+" * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.\n"
+" *\n"
+" * @section DESCRIPTION\n"
+" *\n"
+" * Kernel of single pass Prefix Sum (chained scan with decoupled look-back) - Host interface class: PrefixSum\n"
+" * See: Merrill, Garland - \"Single-pass Parallel Prefix Scan with Decoupled Look-back\", 2016\n"
+" * The following defines are given by the host: SCAN_WORKGROUP_SIZE - Work group size, power of two,\n"
+" * SCAN_UINT2 - Items are uint2, summed per component. Otherwise items are uint\n"
+" */\n"
 "\n"
-"Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:\n"
+"#ifdef SCAN_UINT2\n"
+"typedef uint2 data_t;\n"
+"#else\n"
+"typedef uint data_t;\n"
+"#endif\n"
 "\n"
-"	Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.\n"
-"	Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or\n"
-" other materials provided with the distribution.\n"
+"//Items per work item - Each work item sums consecutive items sequentially\n"
+"#define SCAN_ITEMS_PER_THREAD 4\n"
+"#define SCAN_BLOCK_SIZE (SCAN_WORKGROUP_SIZE * SCAN_ITEMS_PER_THREAD)\n"
 "\n"
-"THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS \"AS IS\" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED\n"
-" WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY\n"
-" DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS\n"
-" OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING\n"
-" NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.\n"
-"********************************************************************/\n"
+"//Block status is kept in low bits of status flag, and the epoch of the scan in the rest of the bits\n"
+"#define STATUS_BITS 2\n"
+"//Sum of the block items is available\n"
+"#define STATUS_AGGREGATE 1\n"
+"//Sum of all items up to the block, inclusive, is available\n"
+"#define STATUS_PREFIX 2\n"
 "\n"
-"/*\n"
-" * Work-efficient compute implementation of scan, one thread per 2 elements\n"
-" * O(log(n)) stepas and O(n) adds using shared memory\n"
-" * Uses a balanced tree algorithm. See Belloch, 1990 \"Prefix Sums\n"
-" * and Their Applications\"\n"
-" * @param output	output data \n"
-" * @param input		input data\n"
-" * @param block		local memory used in the kernel\n"
-" * @param length	lenght of the input data\n"
-" * @param idxOffset	offset between two consecutive index.\n"
-" */\n"
-"__kernel \n"
-"void group_prefixSum(__global uint * output,\n"
-"					 __global uint * input,\n"
-"					 const int idxOffset,\n"
-"					  const int size,\n"
-"					 __local  uint * block) {\n"
-"	int localId = get_local_id(0);\n"
-"	int localSize = get_local_size(0);\n"
-"	int globalIdx = get_group_id(0);\n"
+"/**\n"
+"* Computes prefix sum of an array of any size, in single pass: Each block of items is scanned in local memory,\n"
+"* and the sum of preceding blocks is accumulated from their published aggregates, looking back until a block\n"
+"* with published prefix is found.\n"
+"* @param input Input array\n"
+"* @param output Output array - May be the same as input\n"
+"* @param size Number of items in the array\n"
+"* @param exclusive Nonzero for exclusive prefix sum, zero for inclusive\n"
+"* @param status Element 0 - Counter of started blocks, which is zeroed by the last block. Elements 1 to blocks count -\n"
+"*               Status flags of the blocks. Flags of previous epochs count as not set, so they need no clearing\n"
+"* @param aggregates Sums of items of the blocks\n"
+"* @param prefixes Inclusive prefix sums of the blocks\n"
+"* @param epoch Epoch of this scan - Must differ from the epochs of the flags of previous scans\n"
+"*/\n"
+"__kernel void chainedScan(__global const data_t* input,\n"
+"						  __global data_t* output,\n"
+"						  const uint size,\n"
+"						  const uint exclusive,\n"
+"						  volatile __global uint* status,\n"
+"						  volatile __global data_t* aggregates,\n"
+"						  volatile __global data_t* prefixes,\n"
+"						  const uint epoch)\n"
+"{\n"
+"	__local data_t scratch[SCAN_WORKGROUP_SIZE];\n"
+"	__local uint blockIdx;\n"
+"	__local data_t blockPrefix;\n"
+"	uint lid = get_local_id(0);\n"
+"	uint blocksCount = (size + SCAN_BLOCK_SIZE - 1) / SCAN_BLOCK_SIZE;\n"
 "\n"
-"	// Cache the computational window in shared memory\n"
-"	globalIdx = (idxOffset *(2 *(globalIdx*localSize + localId) +1)) - 1;\n"
-"	if(globalIdx < size)             { block[2*localId]     = input[globalIdx];				}\n"
-"    if(globalIdx + idxOffset < size) { block[2*localId + 1] = input[globalIdx + idxOffset];	}\n"
+"	//Blocks are numbered by order of start, rather than by group id, so that the blocks that a block waits for\n"
+"	//have been started already, and progress\n"
+"	if (lid == 0)\n"
+"	{\n"
+"		blockIdx = atomic_inc(&status[0]);\n"
+"		if (blockIdx == blocksCount - 1)\n"
+"			atomic_xchg(&status[0],0);\n"
+"	}\n"
+"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+"	uint block = blockIdx;\n"
 "\n"
-"	// Build up tree \n"
-"	int offset = 1;\n"
-"	for(int l = size>>1; l > 0; l >>= 1)\n"
+"	//1. Sequential sum of the items of the work item\n"
+"	data_t items[SCAN_ITEMS_PER_THREAD];\n"
+"	data_t threadSum = (data_t)(0);\n"
+"	uint first = block * SCAN_BLOCK_SIZE + lid * SCAN_ITEMS_PER_THREAD;\n"
+"	for (uint i = 0; i < SCAN_ITEMS_PER_THREAD; i++)\n"
 "	{\n"
-"	  barrier(CLK_LOCAL_MEM_FENCE);\n"
-"	  if(localId < l) {\n"
-"            int ai = offset*(2*localId + 1) - 1;\n"
-"            int bi = offset*(2*localId + 2) - 1;\n"
-"            block[bi] += block[ai];\n"
-"         }\n"
-"         offset <<= 1;\n"
+"		items[i] = (first + i < size) ? input[first + i] : (data_t)(0);\n"
+"		threadSum += items[i];\n"
 "	}\n"
-"		 \n"
-"	if (size > 2)\n"
+"\n"
+"	//2. Scan of work item sums in local memory\n"
+"	scratch[lid] = threadSum;\n"
+"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+"	for (uint offset = 1; offset < SCAN_WORKGROUP_SIZE; offset <<= 1)\n"
 "	{\n"
-"		if(offset < size) { offset <<= 1; }\n"
+"		data_t addend = lid >= offset ? scratch[lid - offset] : (data_t)(0);\n"
+"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+"		scratch[lid] += addend;\n"
+"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+"	}\n"
+"	data_t threadPrefix = scratch[lid] - threadSum;\n"
 "\n"
-"		// Build down tree\n"
-"		int maxThread = offset>>1;\n"
-"		for(int d = 0; d < maxThread; d<<=1)\n"
+"	//3. Decoupled look-back for the sum of preceding blocks\n"
+"	if (lid == 0)\n"
+"	{\n"
+"		data_t aggregate = scratch[SCAN_WORKGROUP_SIZE - 1];\n"
+"		data_t prefix = (data_t)(0);\n"
+"		if (block > 0)\n"
 "		{\n"
-"			d += 1;\n"
-"			offset >>=1;\n"
-"			barrier(CLK_LOCAL_MEM_FENCE);\n"
+"			aggregates[block] = aggregate;\n"
+"			write_mem_fence(CLK_GLOBAL_MEM_FENCE);\n"
+"			atomic_xchg(&status[block + 1],(epoch << STATUS_BITS) | STATUS_AGGREGATE);\n"
 "\n"
-"			if(localId < d) {\n"
-"				int ai = offset*(localId + 1) - 1;\n"
-"				int bi = ai + (offset>>1);\n"
-"				block[bi] += block[ai];\n"
+"			uint predecessor = block - 1;\n"
+"			while (true)\n"
+"			{\n"
+"				uint flag = atomic_or(&status[predecessor + 1],0);\n"
+"				//Spin until the predecessor publishes its aggregate\n"
+"				if ((flag >> STATUS_BITS) != epoch)\n"
+"					continue;\n"
+"				read_mem_fence(CLK_GLOBAL_MEM_FENCE);\n"
+"				if ((flag & STATUS_PREFIX) != 0)\n"
+"				{\n"
+"					prefix += prefixes[predecessor];\n"
+"					break;\n"
+"				}\n"
+"				prefix += aggregates[predecessor];\n"
+"				predecessor--;\n"
 "			}\n"
 "		}\n"
+"		prefixes[block] = prefix + aggregate;\n"
+"		write_mem_fence(CLK_GLOBAL_MEM_FENCE);\n"
+"		atomic_xchg(&status[block + 1],(epoch << STATUS_BITS) | STATUS_PREFIX);\n"
+"		blockPrefix = prefix;\n"
 "	}\n"
 "	barrier(CLK_LOCAL_MEM_FENCE);\n"
-"	\n"
-"    // write the results back to global memory\n"
-"    if(globalIdx < size)           { output[globalIdx]             = block[2*localId];		}\n"
-"    if(globalIdx+idxOffset < size) { output[globalIdx + idxOffset] = block[2*localId + 1];	}\n"
-"}\n"
-"\n"
-"/*\n"
-" * Work-efficient compute implementation of scan, one thread per 2 elements\n"
-" * O(log(n)) stepas and O(n) adds using shared memory\n"
-" * Uses a balanced tree algorithm. See Belloch, 1990 \"Prefix Sums\n"
-" * and Their Applications\"\n"
-" * @param buffer	input/output data \n"
-" * @param offset	Multiple of Offset positions are already updated by group_prefixSum kernel\n"
-" * @param length	lenght of the input data\n"
-" */\n"
-"__kernel\n"
-"void global_prefixSum(__global uint * buffer,\n"
-"                      const int offset,\n"
-"					  const int size) {\n"
-"	int localSize = get_local_size(0);\n"
-"    int groupIdx  = get_group_id(0);\n"
-"\n"
-"	int sortedLocalBlocks = offset / localSize;		// sorted groups per block\n"
-"	// Map the gids to unsorted local blocks.\n"
-"	int gidToUnsortedBlocks = groupIdx + (groupIdx / ((offset<<1) - sortedLocalBlocks) +1) * sortedLocalBlocks;\n"
 "\n"
-"	// Get the corresponding global index\n"
-"    int globalIdx = (gidToUnsortedBlocks*localSize + get_local_id(0));\n"
-"	if(((globalIdx+1) % offset != 0) && (globalIdx < size))\n"
-"		buffer[globalIdx] += buffer[globalIdx - (globalIdx%offset + 1)];\n"
+"	//4. Output of the items of the work item\n"
+"	data_t sum = blockPrefix + threadPrefix;\n"
+"	for (uint i = 0; i < SCAN_ITEMS_PER_THREAD; i++)\n"
+"		if (first + i < size)\n"
+"		{\n"
+"			if (exclusive)\n"
+"				output[first + i] = sum;\n"
+"			sum += items[i];\n"
+"			if (!exclusive)\n"
+"				output[first + i] = sum;\n"
+"		}\n"
 "}\n"
-"\n"
-"\n"
 ;
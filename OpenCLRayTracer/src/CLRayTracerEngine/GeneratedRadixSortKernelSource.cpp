@@ -0,0 +1,162 @@
+const char* RadixSortKernelSource = 
+"/**\n"
+" * @file RadixSortKernels.cl\n"
+" * @author  Timur Sizov <timorgizer@gmail.com>\n"
+" * @version 0.6\n"
+" *\n"
+" * @section LICENSE\n"
+" *\n"
+" * Copyright (c) 2016 Timur Sizov\n"
+" *\n"
+" * Permission is hereby granted, free of charge, to any person obtaining a copy of this\n"
+" * software and associated documentation files (the \"Software\"), to deal in the Software \n"
+" * without restriction, including without limitation the rights to use, copy, modify, merge, \n"
+" * publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons \n"
+" * to whom the Software is furnished to do so, subject to the following conditions:\n"
+" * The above copyright notice and this permission notice shall be included in all copies or \n"
+" * substantial portions of the Software.\n"
+" *\n"
+" * THE SOFTWARE IS PROVIDED \"AS IS\", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, \n"
+" * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE \n"
+" * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, \n"
+" * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, \n"
+" * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.\n"
+" *\n"
+" * @section DESCRIPTION\n"
+" *\n"
+" * Kernels of LSD Radix Sort - Host interface class: RadixSort\n"
+" * The following defines are prepended to the source by the host:\n"
+" * RADIX_BITS - Bits of key sorted per pass, RADIX_BLOCK_SIZE - Work group size, which is the number of items per block,\n"
+" * CONFIG_USE_VALUE - Items are key/value pairs, CONFIG_64BIT_KEYS - Keys and values are 64 bit wide\n"
+" */\n"
+"\n"
+"#ifdef CONFIG_64BIT_KEYS\n"
+"#ifdef CONFIG_USE_VALUE\n"
+"typedef ulong2 data_t;\n"
+"#else\n"
+"typedef ulong data_t;\n"
+"#endif\n"
+"#else\n"
+"#ifdef CONFIG_USE_VALUE\n"
+"typedef uint2 data_t;\n"
+"#else\n"
+"typedef uint data_t;\n"
+"#endif\n"
+"#endif\n"
+"\n"
+"#ifdef CONFIG_USE_VALUE\n"
+"#define getKey(a) ((a).x)\n"
+"#else\n"
+"#define getKey(a) (a)\n"
+"#endif\n"
+"\n"
+"#define RADIX (1 << RADIX_BITS)\n"
+"\n"
+"//Extracts digit of the key for current pass\n"
+"#define getDigit(a,shift,digitBits) ((uint)((getKey(a) >> (shift)) & ((1 << (digitBits)) - 1)))\n"
+"\n"
+"/**\n"
+"* Computes exclusive prefix sum of values of all work items in work group\n"
+"* @param value Value of current work item\n"
+"* @param scratch Local memory array of RADIX_BLOCK_SIZE items\n"
+"* @param [out] total Sum of values of all work items\n"
+"* @return Sum of values of work items with lower local index\n"
+"*/\n"
+"inline uint workGroupExclusiveScan(uint value,__local uint* scratch,uint* total)\n"
+"{\n"
+"	uint lid = get_local_id(0);\n"
+"	scratch[lid] = value;\n"
+"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+"	for (uint offset = 1; offset < RADIX_BLOCK_SIZE; offset <<= 1)\n"
+"	{\n"
+"		uint addend = lid >= offset ? scratch[lid - offset] : 0;\n"
+"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+"		scratch[lid] += addend;\n"
+"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+"	}\n"
+"	*total = scratch[RADIX_BLOCK_SIZE - 1];\n"
+"	uint result = scratch[lid] - value;\n"
+"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+"	return result;\n"
+"}\n"
+"\n"
+"/*****************************************************\n"
+" * 1. Counts digits of every block in local memory\n"
+" *    The counts are stored digit major: histogram[digit * blocksCount + block],\n"
+" *    so that prefix sum of the histogram gives the output offset of each digit of each block\n"
+" ******************************************************/\n"
+"__kernel void radixHistogram(__global const data_t* input,\n"
+"							 const uint count,\n"
+"							 const uint shift,\n"
+"							 const uint digitBits,\n"
+"							 __global uint* histogram,\n"
+"							 const uint blocksCount)\n"
+"{\n"
+"	__local uint localHistogram[RADIX];\n"
+"	uint lid = get_local_id(0);\n"
+"	uint gid = get_global_id(0);\n"
+"	uint block = get_group_id(0);\n"
+"\n"
+"	if (lid < RADIX)\n"
+"		localHistogram[lid] = 0;\n"
+"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+"\n"
+"	if (gid < count)\n"
+"		atomic_inc(&localHistogram[getDigit(input[gid],shift,digitBits)]);\n"
+"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+"\n"
+"	if (lid < RADIX)\n"
+"		histogram[lid * blocksCount + block] = localHistogram[lid];\n"
+"}\n"
+"\n"
+"/*****************************************************\n"
+" * 2. Sorts every block by digit in local memory, and scatters it to the output\n"
+" *    histogramScan is the exclusive prefix sum of the histogram\n"
+" ******************************************************/\n"
+"__kernel void radixScatter(__global const data_t* input,\n"
+"						   __global data_t* output,\n"
+"						   const uint count,\n"
+"						   const uint shift,\n"
+"						   const uint digitBits,\n"
+"						   __global const uint* histogramScan,\n"
+"						   const uint blocksCount)\n"
+"{\n"
+"	__local data_t items[RADIX_BLOCK_SIZE];\n"
+"	__local uint digits[RADIX_BLOCK_SIZE];\n"
+"	__local uint scratch[RADIX_BLOCK_SIZE];\n"
+"	__local uint digitStart[RADIX];\n"
+"	uint lid = get_local_id(0);\n"
+"	uint gid = get_global_id(0);\n"
+"	uint block = get_group_id(0);\n"
+"	uint blockCount = min(count - block * RADIX_BLOCK_SIZE,(uint)RADIX_BLOCK_SIZE);\n"
+"\n"
+"	//Items beyond the input get the highest digit, so stable sort keeps them at the end of the block\n"
+"	data_t item = gid < count ? input[gid] : (data_t)(0);\n"
+"	uint digit = gid < count ? getDigit(item,shift,digitBits) : (1 << digitBits) - 1;\n"
+"\n"
+"	//Stable local sort of the block, by split on each bit of the digit\n"
+"	for (uint bit = 0; bit < digitBits; bit++)\n"
+"	{\n"
+"		uint isZero = ((digit >> bit) & 1) ^ 1;\n"
+"		uint zerosCount;\n"
+"		uint zerosBefore = workGroupExclusiveScan(isZero,scratch,&zerosCount);\n"
+"		uint position = isZero ? zerosBefore : zerosCount + lid - zerosBefore;\n"
+"		items[position] = item;\n"
+"		digits[position] = digit;\n"
+"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+"		item = items[lid];\n"
+"		digit = digits[lid];\n"
+"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+"	}\n"
+"\n"
+"	//Digits are now consecutive in the block - Find the start of each one\n"
+"	if (lid == 0 || digits[lid - 1] != digit)\n"
+"		digitStart[digit] = lid;\n"
+"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+"\n"
+"	if (lid < blockCount)\n"
+"	{\n"
+"		output[histogramScan[digit * blocksCount + block] + lid - digitStart[digit]] = item;\n"
+"	}\n"
+"}\n"
+;
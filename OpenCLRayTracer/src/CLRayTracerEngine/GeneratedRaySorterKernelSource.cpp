@@ -0,0 +1,92 @@
+const char* RaySorterKernelSource = 
+"/**\n"
+" * @file RaySorterKernels.cl\n"
+" * @author  Timur Sizov <timorgizer@gmail.com>\n"
+" * @version 0.6\n"
+" *\n"
+" * @section LICENSE\n"
+" *\n"
+" * Copyright (c) 2016 Timur Sizov\n"
+" *\n"
+" * Permission is hereby granted, free of charge, to any person obtaining a copy of this\n"
+" * software and associated documentation files (the \"Software\"), to deal in the Software \n"
+" * without restriction, including without limitation the rights to use, copy, modify, merge, \n"
+" * publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons \n"
+" * to whom the Software is furnished to do so, subject to the following conditions:\n"
+" * The above copyright notice and this permission notice shall be included in all copies or \n"
+" * substantial portions of the Software.\n"
+" *\n"
+" * THE SOFTWARE IS PROVIDED \"AS IS\", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, \n"
+" * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE \n"
+" * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, \n"
+" * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, \n"
+" * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.\n"
+" *\n"
+" * @section DESCRIPTION\n"
+" *\n"
+" * Kernel functions for reordering of ray batches by ray coherence key.\n"
+" * \n"
+" * The rays are assigned keys, the key-index pairs are sorted, rays are gathered in sorted order\n"
+" * for tracing, and the resulting contacts are scattered back to original ray indices.\n"
+" * Key calculation is contained in file: RayCoherence.h\n"
+" */\n"
+"\n"
+"#include \"CLData\\CLStructs.h\"\n"
+"#include \"CLData\\SceneBufferParser.h\"\n"
+"#include \"CLData\\RayCoherence.h\"\n"
+"\n"
+"/*****************************************************\n"
+" * 1. Calculates coherence key for each ray\n"
+" *    Items beyond ray count are padded with UINT_MAX\n"
+" ******************************************************/\n"
+"__kernel void calculateRayKeys(CL_GLOBAL const struct Ray* rays,\n"
+"							   uint rayCount,\n"
+"							   CL_GLOBAL const char* scene,\n"
+"							   CL_GLOBAL CL_UINT2* keys,\n"
+"							   uint keysCount)\n"
+"{\n"
+"	uint idx = get_global_id(0);\n"
+"	if (idx < keysCount)\n"
+"	{\n"
+"		CL_UINT2 keyValue = (CL_UINT2)(UINT_MAX,UINT_MAX);\n"
+"		if (idx < rayCount)\n"
+"		{\n"
+"			struct AABB sceneBox = SCENE_HEADER(scene)->modelsBoundingBox;\n"
+"			struct Ray ray = rays[idx];\n"
+"			keyValue.x = rayCoherenceKey(ray,sceneBox);\n"
+"			keyValue.y = idx;\n"
+"		}\n"
+"		keys[idx] = keyValue;\n"
+"	}\n"
+"}\n"
+"\n"
+"/*****************************************************\n"
+" * 2. Gathers rays in sorted order\n"
+" ******************************************************/\n"
+"__kernel void gatherRays(CL_GLOBAL const struct Ray* rays,\n"
+"						 CL_GLOBAL const CL_UINT2* sortedKeys,\n"
+"						 uint rayCount,\n"
+"						 CL_GLOBAL struct Ray* sortedRays)\n"
+"{\n"
+"	uint idx = get_global_id(0);\n"
+"	if (idx < rayCount)\n"
+"		sortedRays[idx] = rays[sortedKeys[idx].y];\n"
+"}\n"
+"\n"
+"/*****************************************************\n"
+" * 3. Scatters contacts back to original ray indices\n"
+" ******************************************************/\n"
+"__kernel void scatterContacts(CL_GLOBAL const struct Contact* sortedContacts,\n"
+"							  CL_GLOBAL const CL_UINT2* sortedKeys,\n"
+"							  uint rayCount,\n"
+"							  CL_GLOBAL struct Contact* contacts)\n"
+"{\n"
+"	uint idx = get_global_id(0);\n"
+"	if (idx < rayCount)\n"
+"	{\n"
+"		struct Contact c = sortedContacts[idx];\n"
+"		c.pixelIndex = sortedKeys[idx].y;\n"
+"		contacts[c.pixelIndex] = c;\n"
+"	}\n"
+"}\n"
+;
@@ -0,0 +1,119 @@
+const char* ReductionKernelSource = 
+"/**\n"
+" * @file ReductionKernels.cl\n"
+" * @author  Timur Sizov <timorgizer@gmail.com>\n"
+" * @version 0.6\n"
+" *\n"
+" * @section LICENSE\n"
+" *\n"
+" * Copyright (c) 2016 Timur Sizov\n"
+" *\n"
+" * Permission is hereby granted, free of charge, to any person obtaining a copy of this\n"
+" * software and associated documentation files (the \"Software\"), to deal in the Software \n"
+" * without restriction, including without limitation the rights to use, copy, modify, merge, \n"
+" * publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons \n"
+" * to whom the Software is furnished to do so, subject to the following conditions:\n"
+" * The above copyright notice and this permission notice shall be included in all copies or \n"
+" * substantial portions of the Software.\n"
+" *\n"
+" * THE SOFTWARE IS PROVIDED \"AS IS\", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, \n"
+" * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE \n"
+" * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, \n"
+" * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, \n"
+" * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.\n"
+" *\n"
+" * @section DESCRIPTION\n"
+" *\n"
+" * Kernel of parallel reduction - Host interface class: Reduction\n"
+" * The following defines are given by the host: REDUCE_WORKGROUP_SIZE - Work group size, power of two,\n"
+" * and one of the operators: REDUCE_MIN_FLOAT4, REDUCE_MAX_FLOAT4, REDUCE_MERGE_AABB, REDUCE_SUM_UINT,\n"
+" * REDUCE_SUM_FLOAT, REDUCE_COUNT_NONZERO - See Reduction::Operator\n"
+" * \n"
+" */\n"
+"#include \"CLData\\Primitives\\AABB.h\"\n"
+"\n"
+"#if defined(REDUCE_MIN_FLOAT4)\n"
+"typedef float4 input_t;\n"
+"typedef float4 data_t;\n"
+"#define IDENTITY ((float4)(FLT_MAX))\n"
+"#define LOAD(item) (item)\n"
+"#define COMBINE(a,b) min(a,b)\n"
+"#elif defined(REDUCE_MAX_FLOAT4)\n"
+"typedef float4 input_t;\n"
+"typedef float4 data_t;\n"
+"#define IDENTITY ((float4)(-FLT_MAX))\n"
+"#define LOAD(item) (item)\n"
+"#define COMBINE(a,b) max(a,b)\n"
+"#elif defined(REDUCE_MERGE_AABB)\n"
+"typedef struct AABB input_t;\n"
+"typedef struct AABB data_t;\n"
+"#define IDENTITY emptyAABB()\n"
+"#define LOAD(item) (item)\n"
+"#define COMBINE(a,b) merge(a,b)\n"
+"#elif defined(REDUCE_SUM_UINT)\n"
+"typedef uint input_t;\n"
+"typedef uint data_t;\n"
+"#define IDENTITY 0\n"
+"#define LOAD(item) (item)\n"
+"#define COMBINE(a,b) ((a) + (b))\n"
+"#elif defined(REDUCE_SUM_FLOAT)\n"
+"typedef float input_t;\n"
+"typedef float data_t;\n"
+"#define IDENTITY 0.0f\n"
+"#define LOAD(item) (item)\n"
+"#define COMBINE(a,b) ((a) + (b))\n"
+"#elif defined(REDUCE_COUNT_NONZERO)\n"
+"typedef uint input_t;\n"
+"typedef uint data_t;\n"
+"#define IDENTITY 0\n"
+"#define LOAD(item) ((item) != 0 ? 1 : 0)\n"
+"#define COMBINE(a,b) ((a) + (b))\n"
+"#endif\n"
+"\n"
+"/**\n"
+"* Empty box - The identity of box union\n"
+"* @return Box with min bounds at FLT_MAX and max bounds at -FLT_MAX\n"
+"*/\n"
+"inline struct AABB emptyAABB()\n"
+"{\n"
+"	struct AABB result;\n"
+"	result.bounds[0] = (float4)(FLT_MAX);\n"
+"	result.bounds[1] = (float4)(-FLT_MAX);\n"
+"	return result;\n"
+"}\n"
+"\n"
+"/**\n"
+"* Reduces an array of any size: Each work item accumulates the items strided by the global size, which keeps\n"
+"* the reads coalesced, then the work group reduces the accumulated values in local memory\n"
+"* @param input Input array\n"
+"* @param count Number of items in the array\n"
+"* @param output Output buffer - Result of the work group is stored at index of the group\n"
+"* @param outputOffset Offset of the results in the output buffer, in bytes\n"
+"*/\n"
+"__kernel void reduce(__global const input_t* input,\n"
+"					 const uint count,\n"
+"					 __global char* output,\n"
+"					 const uint outputOffset)\n"
+"{\n"
+"	__local data_t scratch[REDUCE_WORKGROUP_SIZE];\n"
+"	uint lid = get_local_id(0);\n"
+"\n"
+"	//1. Sequential reduction of the items of the work item\n"
+"	data_t acc = IDENTITY;\n"
+"	for (uint i = get_global_id(0); i < count; i += get_global_size(0))\n"
+"		acc = COMBINE(acc,LOAD(input[i]));\n"
+"	scratch[lid] = acc;\n"
+"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+"\n"
+"	//2. Tree reduction in local memory\n"
+"	for (uint stride = REDUCE_WORKGROUP_SIZE >> 1; stride > 0; stride >>= 1)\n"
+"	{\n"
+"		if (lid < stride)\n"
+"			scratch[lid] = COMBINE(scratch[lid],scratch[lid + stride]);\n"
+"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+"	}\n"
+"\n"
+"	if (lid == 0)\n"
+"		((__global data_t*)(output + outputOffset))[get_group_id(0)] = scratch[0];\n"
+"}\n"
+;
@@ -200,7 +200,8 @@ const char* OpenCLKernelSource =
 "  // Loop on sorted sequence length\n"
 "  for (int length=1;length<wg;length<<=1)\n"
 "  {\n"
-"    bool direction = ((i & (length<<1)) != 0); // direction of sort: 0=asc, 1=desc\n"
+"    // direction of sort: 0=asc, 1=desc - by global index, so that blocks alternate for the following global merges\n"
+"    bool direction = (((offset + i) & (length<<1)) != 0);\n"
 "    // Loop on comparison distance (between keys)\n"
 "    for (int inc=length;inc>0;inc>>=1)\n"
 "    {\n"
@@ -505,8 +506,8 @@ const char* OpenCLKernelSource =
 "  for (int k=0;k<4;k++) aux[(i+k*inc) & wgBits] = x[k];\n"
 "  barrier(CLK_LOCAL_MEM_FENCE);\n"
 "\n"
-"  // Internal iterations, local input and output\n"
-"  for ( ;inc>1;inc>>=2)\n"
+"  // Internal iterations, local input and output - The first one follows the stages done above\n"
+"  for (inc>>=2;inc>1;inc>>=2)\n"
 "  {\n"
 "    low = t & (inc - 1); // low order bits (below INC)\n"
 "    i = ((t - low) << 2) + low; // insert 00 at position INC\n"
@@ -0,0 +1,68 @@
+const char* StreamCompactionKernelSource = 
+"/**\n"
+" * @file StreamCompactionKernels.cl\n"
+" * @author  Timur Sizov <timorgizer@gmail.com>\n"
+" * @version 0.6\n"
+" *\n"
+" * @section LICENSE\n"
+" *\n"
+" * Copyright (c) 2016 Timur Sizov\n"
+" *\n"
+" * Permission is hereby granted, free of charge, to any person obtaining a copy of this\n"
+" * software and associated documentation files (the \"Software\"), to deal in the Software \n"
+" * without restriction, including without limitation the rights to use, copy, modify, merge, \n"
+" * publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons \n"
+" * to whom the Software is furnished to do so, subject to the following conditions:\n"
+" * The above copyright notice and this permission notice shall be included in all copies or \n"
+" * substantial portions of the Software.\n"
+" *\n"
+" * THE SOFTWARE IS PROVIDED \"AS IS\", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, \n"
+" * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE \n"
+" * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, \n"
+" * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, \n"
+" * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.\n"
+" *\n"
+" * @section DESCRIPTION\n"
+" *\n"
+" * Kernel functions for stream compaction: Items are flagged by a predicate, the flags are scanned by PrefixSum,\n"
+" * and the indices of the flagged items are scattered to a dense list.\n"
+" * \n"
+" */\n"
+"\n"
+"#include \"CLData\\CLStructs.h\"\n"
+"\n"
+"/*****************************************************\n"
+" * 1. Flags the rays with nonempty parameter range\n"
+" ******************************************************/\n"
+"__kernel void flagActiveRays(CL_GLOBAL const struct Ray* rays,\n"
+"							 uint rayCount,\n"
+"							 CL_GLOBAL CL_UINT* flags)\n"
+"{\n"
+"	uint idx = get_global_id(0);\n"
+"	if (idx < rayCount)\n"
+"		flags[idx] = (rays[idx].tMin < rays[idx].tMax) ? 1 : 0;\n"
+"}\n"
+"\n"
+"/*****************************************************\n"
+" * 2. Scatters indices of flagged items to their offsets\n"
+" *    - The exclusive prefix sum of the flags.\n"
+" *    The last item writes the number of flagged items\n"
+" ******************************************************/\n"
+"__kernel void scatterFlaggedIndices(CL_GLOBAL const CL_UINT* flags,\n"
+"									CL_GLOBAL const CL_UINT* offsets,\n"
+"									uint count,\n"
+"									CL_GLOBAL CL_UINT* indices,\n"
+"									CL_GLOBAL CL_UINT* compactedCount)\n"
+"{\n"
+"	uint idx = get_global_id(0);\n"
+"	if (idx < count)\n"
+"	{\n"
+"		CL_UINT flag = flags[idx];\n"
+"		CL_UINT offset = offsets[idx];\n"
+"		if (flag)\n"
+"			indices[offset] = idx;\n"
+"		if (idx == count - 1)\n"
+"			*compactedCount = offset + flag;\n"
+"	}\n"
+"}\n"
+;
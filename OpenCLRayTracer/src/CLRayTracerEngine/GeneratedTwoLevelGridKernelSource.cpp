@@ -39,204 +39,175 @@ const char* TwoLevelGridKernelSource =
 "\n"
 "\n"
 " /*****************************************************\n"
-" * 1. Counts top level pairs\n"
+" * 1. Counts top level pairs per cell\n"
 " ******************************************************/\n"
-"__kernel void prepareDataKernel(CL_GLOBAL char* scene, \n"
+"__kernel void countCellPairsKernel(CL_GLOBAL char* scene, \n"
 "						  CL_CONSTANT struct GridData* grid,\n"
-"						  CL_GLOBAL CL_UINT* counters)\n"
+"						  CL_GLOBAL CL_UINT* counters,\n"
+"						  CL_UINT exactOverlap)\n"
 "{\n"
 "	uint currentIdx = get_global_id(0);\n"
-"	uint tris = SCENE_HEADER(scene)->totalNumberOfTriangles-1;\n"
+"	uint tris = SCENE_HEADER(scene)->totalNumberOfTriangles;\n"
 "	if (currentIdx < tris)\n"
-"		prepareGridData(scene,currentIdx,grid,counters);\n"
+"		binTriangleToCells(scene,currentIdx,grid,counters,counters,0,0,false,exactOverlap != 0);\n"
 "}\n"
 "\n"
 "/*****************************************************\n"
-" * 2. Generates top level pairs\n"
+" * 2. Writes top level cell ranges from counts and their\n"
+" *    prefix sum. Ranges array has an extra empty range\n"
+" *    past the last cell\n"
 " ******************************************************/\n"
-"__kernel void writePairsKernel(CL_GLOBAL char* scene, \n"
-"					     CL_CONSTANT struct GridData* grid,\n"
-"					     CL_GLOBAL CL_UINT* prefixSum,\n"
-"					     CL_GLOBAL CL_UINT* counters,\n"
-"					     CL_GLOBAL CL_UINT2* pairs)\n"
+"__kernel void writeCellRangesKernel(CL_GLOBAL CL_UINT* counters,\n"
+"									CL_GLOBAL CL_UINT* prefixSum,\n"
+"									CL_GLOBAL CL_UINT2* cellRanges,\n"
+"									CL_UINT cellsCount,\n"
+"									CL_UINT pairsCapacity)\n"
 "{\n"
 "	uint currentIdx = get_global_id(0);\n"
-"	uint tris = SCENE_HEADER(scene)->totalNumberOfTriangles-1;\n"
-"	if (currentIdx < tris)\n"
-"		writePairs(scene,currentIdx,grid,prefixSum,counters,pairs);\n"
+"	if (currentIdx < cellsCount)\n"
+"		writeCellRange(counters,prefixSum,cellRanges,currentIdx,pairsCapacity);\n"
+"	else if (currentIdx == cellsCount)\n"
+"		cellRanges[currentIdx] = (CL_UINT2)(0,0);\n"
 "}\n"
 "\n"
 "/*****************************************************\n"
-" * 3. Extracts ranges in sorted pairs array\n"
+" * 3. Scatters top level pairs into cell ranges\n"
 " ******************************************************/\n"
-"__kernel void extractCellRangesKernel(CL_GLOBAL CL_UINT2* sortedPairs,\n"
-"						         CL_UINT sortedPairsCount,\n"
-"						         CL_GLOBAL CL_UINT2* cellRanges,\n"
-"								 CL_LOCAL CL_UINT2* localBuf,\n"
-"						         CL_UINT workingBlock)\n"
+"__kernel void scatterCellPairsKernel(CL_GLOBAL char* scene, \n"
+"					     CL_CONSTANT struct GridData* grid,\n"
+"					     CL_GLOBAL CL_UINT* prefixSum,\n"
+"					     CL_GLOBAL CL_UINT* counters,\n"
+"					     CL_GLOBAL CL_UINT2* pairs,\n"
+"						 CL_UINT pairsCapacity,\n"
+"						 CL_UINT exactOverlap)\n"
 "{\n"
-"	const uint batchSize = workingBlock;\n"
-"	const uint batches = ceil((float)sortedPairsCount / (float)batchSize);\n"
-"	\n"
-"	uint maxGlobalIdx = sortedPairsCount - 1;\n"
-"	uint currentLocalIdx = get_global_id(0);\n"
-"	uint nextLocalIdx;\n"
-"	long currentGlobalIdx;\n"
-"	uint nextGlobalIdx;\n"
-"	for(int i = 0; i < batches; i++)\n"
-"	{\n"
-"		//load pairs to shared memory\n"
-"		nextLocalIdx = currentLocalIdx + 1;\n"
-"		currentGlobalIdx = i * workingBlock + currentLocalIdx;\n"
-"		nextGlobalIdx = currentGlobalIdx + 1;\n"
-"		if (currentGlobalIdx <= maxGlobalIdx)\n"
-"		{\n"
-"			localBuf[currentLocalIdx] = sortedPairs[currentGlobalIdx];\n"
-"			if (currentLocalIdx == workingBlock - 1 && nextGlobalIdx <=maxGlobalIdx) //Last thread writes additional\n"
-"				localBuf[nextLocalIdx] = sortedPairs[nextGlobalIdx];\n"
-"		}\n"
-"		//Synchronize the local memory\n"
-"		barrier(CLK_LOCAL_MEM_FENCE);\n"
-"		if (currentGlobalIdx <= maxGlobalIdx && currentLocalIdx < batchSize)\n"
-"		{\n"
-"			uint right = localBuf[nextLocalIdx].x;\n"
-"			uint thisOne = localBuf[currentLocalIdx].x;\n"
-"			if (right > thisOne)\n"
-"			{ \n"
-"				cellRanges[thisOne].y = nextGlobalIdx;\n"
-"				cellRanges[right].x = nextGlobalIdx;\n"
-"			}\n"
-"		}\n"
-"	}\n"
-"\n"
-"	//Post-processing for last index - Closing last pair\n"
-"	if (currentGlobalIdx == maxGlobalIdx)\n"
-"	{\n"
-"		cellRanges[sortedPairs[currentGlobalIdx].x].y = currentGlobalIdx;\n"
-"	}\n"
+"	uint currentIdx = get_global_id(0);\n"
+"	uint tris = SCENE_HEADER(scene)->totalNumberOfTriangles;\n"
+"	if (currentIdx < tris)\n"
+"		binTriangleToCells(scene,currentIdx,grid,counters,prefixSum,pairs,pairsCapacity,true,exactOverlap != 0);\n"
 "}\n"
 "\n"
 "/*****************************************************\n"
 " * 4. Counts leaf cells\n"
+" *    Counts are stored per top level cell in leafCounts\n"
 " ******************************************************/\n"
-"__kernel void countLeavesAndFillCellKernel(CL_GLOBAL CL_UINT2* range, CL_GLOBAL CL_UINT* counters,\n"
-" CL_GLOBAL struct TopLevelCell* cells, CL_UINT cellsCount,CL_CONSTANT struct GridData* grid)\n"
+"__kernel void countLeavesAndFillCellKernel(CL_GLOBAL CL_UINT2* range, CL_GLOBAL CL_UINT* leafCounts,\n"
+" CL_GLOBAL struct TopLevelCell* cells, CL_UINT cellsCount,CL_CONSTANT struct GridData* grid,\n"
+" CL_GLOBAL const char* scene, CL_GLOBAL const CL_UINT2* pairs, CL_GLOBAL const CL_UINT* buildCounts,\n"
+" CL_UINT adaptive, CL_UINT leafCellsBudget)\n"
 "{\n"
 "	if (get_global_id(0) < cellsCount)\n"
-"		fillTopLevelCell(range,counters,cells,grid,get_global_id(0));\n"
+"		fillTopLevelCell(range,leafCounts,cells,grid,get_global_id(0),\n"
+"						 scene,pairs,buildCounts[BUILD_COUNT_PAIRS],adaptive != 0,leafCellsBudget);\n"
 "}\n"
 "\n"
 "\n"
 "/*****************************************************\n"
 " * 5. Update top leaf cell with beginning of its range\n"
+" *    Cells whose leaves do not fit into leaf capacity\n"
+" *    are redirected to the empty range past the capacity\n"
 " ******************************************************/\n"
 "__kernel void updateTopLevelCellsWithLeafRange(CL_GLOBAL struct TopLevelCell* topLevelCells,\n"
 "											   CL_GLOBAL CL_UINT* leafCountsPerCell,\n"
-"											   CL_UINT cellCount)\n"
+"											   CL_UINT cellCount,\n"
+"											   CL_UINT leafCellsCapacity)\n"
 "{\n"
 "	CL_UINT idx = get_global_id(0);\n"
-"	if (idx > 0)\n"
-"		topLevelCells[idx].firstLeafIdx = leafCountsPerCell[idx-1];\n"
+"	if (idx < cellCount)\n"
+"	{\n"
+"		struct TopLevelCell cell = topLevelCells[idx];\n"
+"		cell.firstLeafIdx = idx > 0 ? leafCountsPerCell[idx-1] : 0;\n"
+"		if (cell.firstLeafIdx + getCellCount(cell.resX,cell.resY,cell.resZ) > leafCellsCapacity)\n"
+"		{\n"
+"			cell.resX = cell.resY = cell.resZ = 1;\n"
+"			cell.firstLeafIdx = leafCellsCapacity;\n"
+"		}\n"
+"		topLevelCells[idx] = cell;\n"
+"	}\n"
 "}\n"
 "\n"
 "/*****************************************************\n"
-" * 6. Count leaf pairs\n"
+" * 6. Count leaf pairs per leaf cell\n"
 " ******************************************************/\n"
-"__kernel void prepareGridDataForLeaves(CL_GLOBAL const char* scene, \n"
+"__kernel void countLeafPairsKernel(CL_GLOBAL const char* scene, \n"
 "									   CL_GLOBAL CL_UINT2* topLevelPairs,\n"
-"									   CL_UINT topLevelPairsCount,\n"
+"									   CL_UINT topLevelPairsCapacity,\n"
 "									   CL_CONSTANT struct GridData* grid,\n"
 "									   CL_GLOBAL struct TopLevelCell* topLevelCells,\n"
-"									   CL_GLOBAL CL_UINT* counters)\n"
+"									   CL_GLOBAL CL_UINT* counters,\n"
+"									   CL_GLOBAL CL_UINT* buildCounts,\n"
+"									   CL_UINT leafCellsCapacity)\n"
 "{\n"
 "	CL_UINT idx = get_global_id(0); \n"
-"	if (idx < topLevelPairsCount)\n"
-"		counters[idx] = countLeafPairs(scene,topLevelPairs,idx,grid,topLevelCells);\n"
-"	else\n"
-"		counters[idx] = 0;\n"
+"	if (idx < min(buildCounts[BUILD_COUNT_PAIRS],topLevelPairsCapacity))\n"
+"		binPairToLeafCells(scene,topLevelPairs,idx,grid,topLevelCells,counters,counters,0,leafCellsCapacity,0,false);\n"
 "}\n"
 "\n"
 "\n"
 "/*****************************************************\n"
-" * 7. Write leaf pairs\n"
+" * 6a. Writes beginnings of leaf cell ranges from prefix\n"
+" *     sum of counts - Up to the count of leaf cells, and\n"
+" *     past the empty leaf cell past the last cell\n"
+" ******************************************************/\n"
+"__kernel void writeLeafRangesKernel(CL_GLOBAL CL_UINT* prefixSum,\n"
+"									CL_GLOBAL CL_UINT* leafRanges,\n"
+"									CL_UINT leafCellsCount,\n"
+"									CL_UINT referencesCapacity)\n"
+"{\n"
+"	uint currentIdx = get_global_id(0);\n"
+"	if (currentIdx <= leafCellsCount + 1)\n"
+"		writeLeafRange(prefixSum,leafRanges,currentIdx,referencesCapacity);\n"
+"}\n"
+"\n"
+"/*****************************************************\n"
+" * 7. Scatter leaf pairs into leaf cell ranges\n"
+" *    Only triangle index of a pair is stored\n"
 " ******************************************************/\n"
-"__kernel void writeLeafPairsKernel(CL_GLOBAL const char* scene,\n"
+"__kernel void scatterLeafPairsKernel(CL_GLOBAL const char* scene,\n"
 "						   CL_GLOBAL CL_UINT2* topLevelPairs,\n"
 "						   CL_GLOBAL struct TopLevelCell* topLevelCells,\n"
 "					       CL_CONSTANT struct GridData* grid,\n"
 "					       CL_GLOBAL CL_UINT* prefixSum,\n"
 "					       CL_GLOBAL CL_UINT* counters,\n"
-"					       CL_GLOBAL CL_UINT2* pairs,\n"
-"						   CL_UINT pairCount)\n"
+"					       CL_GLOBAL CL_UINT* pairs,\n"
+"						   CL_UINT topLevelPairsCapacity,\n"
+"						   CL_GLOBAL CL_UINT* buildCounts,\n"
+"						   CL_UINT leafCellsCapacity,\n"
+"						   CL_UINT pairsCapacity)\n"
 "{\n"
 "	uint idx = get_global_id(0);\n"
-"	if(idx < pairCount)\n"
-"		writeLeafPairs(scene,topLevelPairs,topLevelCells,idx,grid,prefixSum,counters,pairs);\n"
+"	if(idx < min(buildCounts[BUILD_COUNT_PAIRS],topLevelPairsCapacity))\n"
+"		binPairToLeafCells(scene,topLevelPairs,idx,grid,topLevelCells,counters,prefixSum,pairs,leafCellsCapacity,pairsCapacity,true);\n"
 "}\n"
 "\n"
 "/*****************************************************\n"
-" * 8. Extract ranges for leaf cells\n"
+" * 7a. Store a count calculated on device - The last\n"
+" *     element of inclusive prefix sum\n"
 " ******************************************************/\n"
-"__kernel void extractLeafCellsKernel(CL_GLOBAL CL_UINT2* sortedLeafPairs,\n"
-"						   CL_UINT sortedLeafPairsCount,\n"
-"						   CL_GLOBAL CL_UINT2* leafCellRanges,\n"
-"						   CL_LOCAL CL_UINT2* localBuf)\n"
+"__kernel void storeBuildCountKernel(CL_GLOBAL CL_UINT* prefixSum,\n"
+"									CL_UINT lastIdx,\n"
+"									CL_GLOBAL CL_UINT* buildCounts,\n"
+"									CL_UINT countIdx)\n"
 "{\n"
-"	const uint batchSize = get_local_size(0);\n"
-"	const uint batches = ceil((float)get_global_size(0) / (float)batchSize);\n"
-"	\n"
-"	uint maxGlobalIdx = sortedLeafPairsCount - 1;\n"
-"	uint currentLocalIdx = get_global_id(0);\n"
-"	uint nextLocalIdx;\n"
-"	long currentGlobalIdx;\n"
-"	uint nextGlobalIdx;\n"
-"	for(int i = 0; i < batches; i++)\n"
-"	{\n"
-"		//load pairs to shared memory\n"
-"		nextLocalIdx = currentLocalIdx + 1;\n"
-"		currentGlobalIdx = i * batchSize + currentLocalIdx;\n"
-"		nextGlobalIdx = currentGlobalIdx + 1;\n"
-"		if (currentGlobalIdx <= maxGlobalIdx)\n"
-"		{\n"
-"			localBuf[currentLocalIdx] = sortedLeafPairs[currentGlobalIdx];\n"
-"			if (currentLocalIdx == batchSize - 1 && nextGlobalIdx <=maxGlobalIdx) //Last thread writes additional\n"
-"				localBuf[nextLocalIdx] = sortedLeafPairs[nextGlobalIdx];\n"
-"		}\n"
-"		//Synchronize the local memory\n"
-"		barrier(CLK_LOCAL_MEM_FENCE);\n"
-"		if (currentGlobalIdx <= maxGlobalIdx && currentLocalIdx < batchSize)\n"
-"		{\n"
-"			uint right = localBuf[nextLocalIdx].x;\n"
-"			uint thisOne = localBuf[currentLocalIdx].x;\n"
-"			if (right > thisOne)\n"
-"			{ \n"
-"				leafCellRanges[thisOne].y = nextGlobalIdx;\n"
-"				leafCellRanges[right].x = nextGlobalIdx;\n"
-"			}\n"
-"		}\n"
-"	}\n"
-"\n"
-"	//Post-processing for last index - Closing last pair\n"
-"	if (currentGlobalIdx == maxGlobalIdx)\n"
-"		leafCellRanges[sortedLeafPairs[currentGlobalIdx].x].y = currentGlobalIdx;\n"
+"	if (get_global_id(0) == 0)\n"
+"		buildCounts[countIdx] = prefixSum[lastIdx];\n"
 "}\n"
 "\n"
 "\n"
 "/*****************************************************\n"
-" * 9. Generate contacts for viewing rays\n"
+" * 8. Generate contacts for viewing rays\n"
 " ******************************************************/\n"
 "__kernel __attribute__((work_group_size_hint(1, 1, 64)))\n"
 " void generateContactsKernel(CL_CONSTANT struct Camera* camera,\n"
 "									 CL_GLOBAL char* scene,\n"
 "									 CL_CONSTANT struct GridData* gridData,\n"
 "									 CL_GLOBAL struct TopLevelCell* topLevelCells,\n"
-"									 CL_GLOBAL CL_UINT2* leavesArray,\n"
-"									 CL_GLOBAL CL_UINT2* pairsRefArray,\n"
+"									 CL_GLOBAL CL_UINT* leavesArray,\n"
+"									 CL_GLOBAL CL_UINT* pairsRefArray,\n"
 "									 CL_GLOBAL struct Contact* output)\n"
 "{\n"
-"	const CL_UINT maxRays = camera->resX * camera->resY;\n"
-"	const CL_UINT myIdx = get_global_id(0);\n"
-"	if (myIdx < maxRays)\n"
+"	const CL_UINT myIdx = tiledPixelIndex(camera,get_global_id(0));\n"
+"	if (myIdx != UINT_MAX)\n"
 "	{\n"
 "			const struct Ray ray = generateRay(camera,myIdx);\n"
 "			struct Contact result = tlg_generate_contact(ray,scene,gridData,topLevelCells,leavesArray,pairsRefArray);\n"
@@ -254,8 +225,8 @@ const char* TwoLevelGridKernelSource =
 "									 CL_GLOBAL char* scene,\n"
 "									 CL_CONSTANT struct GridData* gridData,\n"
 "									 CL_GLOBAL struct TopLevelCell* topLevelCells,\n"
-"									 CL_GLOBAL CL_UINT2* leavesArray,\n"
-"									 CL_GLOBAL CL_UINT2* pairsRefArray,\n"
+"									 CL_GLOBAL CL_UINT* leavesArray,\n"
+"									 CL_GLOBAL CL_UINT* pairsRefArray,\n"
 "									 CL_GLOBAL struct Contact* output)\n"
 "{\n"
 "	const CL_UINT myIdx = get_global_id(0);\n"
@@ -267,17 +238,259 @@ const char* TwoLevelGridKernelSource =
 "	} \n"
 "}\n"
 "\n"
+"/*****************************************************\n"
+" * 9a. Generate contacts for active rays of index list\n"
+" *     - The count is read on device\n"
+" ******************************************************/\n"
+"__kernel __attribute__((work_group_size_hint(1, 1, 64)))\n"
+" void generateContactsIndexedKernel(CL_GLOBAL struct Ray* rays,\n"
+"									 CL_GLOBAL const CL_UINT* activeRays,\n"
+"									 CL_GLOBAL const CL_UINT* activeRayCount,\n"
+"									 CL_GLOBAL char* scene,\n"
+"									 CL_CONSTANT struct GridData* gridData,\n"
+"									 CL_GLOBAL struct TopLevelCell* topLevelCells,\n"
+"									 CL_GLOBAL CL_UINT* leavesArray,\n"
+"									 CL_GLOBAL CL_UINT* pairsRefArray,\n"
+"									 CL_GLOBAL struct Contact* output)\n"
+"{\n"
+"	if (get_global_id(0) < *activeRayCount)\n"
+"	{\n"
+"		const CL_UINT rayIdx = activeRays[get_global_id(0)];\n"
+"		struct Contact result = tlg_generate_contact(rays[rayIdx],scene,gridData,topLevelCells,leavesArray,pairsRefArray);\n"
+"		result.pixelIndex = rayIdx;\n"
+"		output[rayIdx] = result;\n"
+"	} \n"
+"}\n"
 "\n"
 "\n"
+"/*****************************************************\n"
+" * Incremental update\n"
+" * 10. Store the range of top level cells overlapped\n"
+" *     by each triangle, after full build\n"
+" ******************************************************/\n"
+"__kernel void storeTriangleCellRangesKernel(CL_GLOBAL const char* scene,\n"
+"											CL_CONSTANT struct GridData* grid,\n"
+"											CL_GLOBAL CL_UINT2* triangleCellRanges)\n"
+"{\n"
+"	CL_UINT idx = get_global_id(0);\n"
+"	if (idx < SCENE_HEADER(scene)->totalNumberOfTriangles)\n"
+"	{\n"
+"		CL_UINT3 triangleRef = getTriangleRefByIndex(scene,idx);\n"
+"		CL_GLOBAL char* submesh = getMeshAtIndex(triangleRef.y,getModelAtIndex(triangleRef.x,scene));\n"
+"		CL_UINT baseIndex = triangleRef.z * 3;\n"
+"		CL_UINT3 first, last;\n"
+"		getTriangleCellRange(getVertexAt(getIndexAt(baseIndex,submesh),submesh),\n"
+"							 getVertexAt(getIndexAt(baseIndex + 1,submesh),submesh),\n"
+"							 getVertexAt(getIndexAt(baseIndex + 2,submesh),submesh),\n"
+"							 grid,&first,&last);\n"
+"		triangleCellRanges[idx] = (CL_UINT2)(getCellIndex(first.x,first.y,first.z,grid->resX,grid->resY,grid->resZ),\n"
+"											 getCellIndex(last.x,last.y,last.z,grid->resX,grid->resY,grid->resZ));\n"
+"	}\n"
+"}\n"
 "\n"
+"/*****************************************************\n"
+" * 11. Set or clear flags of changed triangles\n"
+" ******************************************************/\n"
+"__kernel void markChangedTrianglesKernel(CL_GLOBAL const CL_UINT* changedTriangles,\n"
+"										 CL_UINT changedCount,\n"
+"										 CL_GLOBAL CL_UINT* changedFlags,\n"
+"										 CL_UINT value)\n"
+"{\n"
+"	CL_UINT idx = get_global_id(0);\n"
+"	if (idx < changedCount)\n"
+"		changedFlags[changedTriangles[idx]] = value;\n"
+"}\n"
 "\n"
+"/*****************************************************\n"
+" * 12. Collect top level cells overlapped by old and\n"
+" *     new bounds of changed triangles\n"
+" ******************************************************/\n"
+"__kernel void collectAffectedCellsKernel(CL_GLOBAL const char* scene,\n"
+"										 CL_CONSTANT struct GridData* grid,\n"
+"										 CL_GLOBAL const CL_UINT* changedTriangles,\n"
+"										 CL_UINT changedCount,\n"
+"										 CL_GLOBAL CL_UINT2* triangleCellRanges,\n"
+"										 CL_GLOBAL CL_UINT* affectedFlags,\n"
+"										 CL_GLOBAL CL_UINT* affectedCells,\n"
+"										 CL_GLOBAL CL_UINT* updateCounts)\n"
+"{\n"
+"	CL_UINT idx = get_global_id(0);\n"
+"	if (idx < changedCount)\n"
+"	{\n"
+"		CL_UINT triangle = changedTriangles[idx];\n"
+"		collectAffectedCells(triangleCellRanges[triangle],grid,affectedFlags,affectedCells,updateCounts);\n"
+"		CL_UINT3 triangleRef = getTriangleRefByIndex(scene,triangle);\n"
+"		CL_GLOBAL char* submesh = getMeshAtIndex(triangleRef.y,getModelAtIndex(triangleRef.x,scene));\n"
+"		CL_UINT baseIndex = triangleRef.z * 3;\n"
+"		CL_UINT3 first, last;\n"
+"		getTriangleCellRange(getVertexAt(getIndexAt(baseIndex,submesh),submesh),\n"
+"							 getVertexAt(getIndexAt(baseIndex + 1,submesh),submesh),\n"
+"							 getVertexAt(getIndexAt(baseIndex + 2,submesh),submesh),\n"
+"							 grid,&first,&last);\n"
+"		CL_UINT2 newRange = (CL_UINT2)(getCellIndex(first.x,first.y,first.z,grid->resX,grid->resY,grid->resZ),\n"
+"									   getCellIndex(last.x,last.y,last.z,grid->resX,grid->resY,grid->resZ));\n"
+"		collectAffectedCells(newRange,grid,affectedFlags,affectedCells,updateCounts);\n"
+"		triangleCellRanges[triangle] = newRange;\n"
+"	}\n"
+"}\n"
 "\n"
+"/*****************************************************\n"
+" * 13. Count top level pairs of changed triangles\n"
+" ******************************************************/\n"
+"__kernel void countChangedTrianglePairsKernel(CL_GLOBAL const char* scene,\n"
+"											  CL_CONSTANT struct GridData* grid,\n"
+"											  CL_GLOBAL const CL_UINT* changedTriangles,\n"
+"											  CL_UINT changedCount,\n"
+"											  CL_GLOBAL CL_UINT* counters,\n"
+"											  CL_UINT exactOverlap)\n"
+"{\n"
+"	CL_UINT idx = get_global_id(0);\n"
+"	if (idx < changedCount)\n"
+"		binTriangleToCells(scene,changedTriangles[idx],grid,counters,counters,0,0,false,exactOverlap != 0);\n"
+"}\n"
 "\n"
+"/*****************************************************\n"
+" * 14. Allocate new pair ranges for affected cells\n"
+" ******************************************************/\n"
+"__kernel void reallocateAffectedCellsKernel(CL_GLOBAL const CL_UINT* affectedCells,\n"
+"											CL_GLOBAL CL_UINT* updateCounts,\n"
+"											CL_GLOBAL const CL_UINT* changedFlags,\n"
+"											CL_GLOBAL const CL_UINT* counters,\n"
+"											CL_GLOBAL CL_UINT* offsets,\n"
+"											CL_GLOBAL CL_UINT2* cellRanges,\n"
+"											CL_GLOBAL CL_UINT2* pairs,\n"
+"											CL_UINT pairsCapacity)\n"
+"{\n"
+"	CL_UINT idx = get_global_id(0);\n"
+"	if (idx < updateCounts[UPDATE_AFFECTED_CELLS])\n"
+"		reallocateAffectedCell(affectedCells[idx],changedFlags,counters,offsets,cellRanges,pairs,updateCounts,pairsCapacity);\n"
+"}\n"
 "\n"
+"/*****************************************************\n"
+" * 15. Scatter top level pairs of changed triangles\n"
+" ******************************************************/\n"
+"__kernel void scatterChangedTrianglePairsKernel(CL_GLOBAL const char* scene,\n"
+"												CL_CONSTANT struct GridData* grid,\n"
+"												CL_GLOBAL const CL_UINT* changedTriangles,\n"
+"												CL_UINT changedCount,\n"
+"												CL_GLOBAL CL_UINT* offsets,\n"
+"												CL_GLOBAL CL_UINT* counters,\n"
+"												CL_GLOBAL CL_UINT2* pairs,\n"
+"												CL_UINT pairsCapacity,\n"
+"												CL_UINT exactOverlap)\n"
+"{\n"
+"	CL_UINT idx = get_global_id(0);\n"
+"	if (idx < changedCount)\n"
+"		binTriangleToCells(scene,changedTriangles[idx],grid,counters,offsets,pairs,pairsCapacity,true,exactOverlap != 0);\n"
+"}\n"
 "\n"
+"/*****************************************************\n"
+" * 16. Rebuild affected top level cells, and allocate\n"
+" *     their leaf cells\n"
+" ******************************************************/\n"
+"__kernel void rebuildAffectedCellsKernel(CL_GLOBAL const CL_UINT* affectedCells,\n"
+"										 CL_GLOBAL CL_UINT* updateCounts,\n"
+"										 CL_GLOBAL CL_UINT2* cellRanges,\n"
+"										 CL_GLOBAL CL_UINT* leafCounts,\n"
+"										 CL_GLOBAL struct TopLevelCell* topLevelCells,\n"
+"										 CL_CONSTANT struct GridData* grid,\n"
+"										 CL_GLOBAL const char* scene,\n"
+"										 CL_GLOBAL const CL_UINT2* pairs,\n"
+"										 CL_GLOBAL const CL_UINT* buildCounts,\n"
+"										 CL_UINT adaptive,\n"
+"										 CL_UINT leafCellsBudget,\n"
+"										 CL_UINT leafCellsCapacity)\n"
+"{\n"
+"	CL_UINT idx = get_global_id(0);\n"
+"	if (idx < updateCounts[UPDATE_AFFECTED_CELLS])\n"
+"		rebuildAffectedCell(affectedCells[idx],cellRanges,leafCounts,topLevelCells,grid,scene,pairs,\n"
+"							buildCounts[BUILD_COUNT_PAIRS],adaptive != 0,leafCellsBudget,updateCounts,leafCellsCapacity);\n"
+"}\n"
 "\n"
+"/*****************************************************\n"
+" * 17. Count leaf pairs of appended top level pairs\n"
+" ******************************************************/\n"
+"__kernel void countAppendedLeafPairsKernel(CL_GLOBAL const char* scene,\n"
+"										   CL_GLOBAL CL_UINT2* topLevelPairs,\n"
+"										   CL_UINT firstPair,\n"
+"										   CL_UINT pairsEnd,\n"
+"										   CL_CONSTANT struct GridData* grid,\n"
+"										   CL_GLOBAL struct TopLevelCell* topLevelCells,\n"
+"										   CL_GLOBAL CL_UINT* counters,\n"
+"										   CL_UINT leafCellsCapacity)\n"
+"{\n"
+"	CL_UINT idx = firstPair + get_global_id(0);\n"
+"	if (idx < pairsEnd)\n"
+"		binPairToLeafCells(scene,topLevelPairs,idx,grid,topLevelCells,counters,counters,0,leafCellsCapacity,0,false);\n"
+"}\n"
 "\n"
+"/*****************************************************\n"
+" * 18. Write leaf ranges of affected cells\n"
+" ******************************************************/\n"
+"__kernel void writeAffectedLeafRangesKernel(CL_GLOBAL const CL_UINT* affectedCells,\n"
+"											CL_GLOBAL CL_UINT* updateCounts,\n"
+"											CL_GLOBAL const struct TopLevelCell* topLevelCells,\n"
+"											CL_GLOBAL const CL_UINT* counters,\n"
+"											CL_GLOBAL CL_UINT* offsets,\n"
+"											CL_GLOBAL CL_UINT* leafRanges,\n"
+"											CL_UINT leafPairsCapacity)\n"
+"{\n"
+"	CL_UINT idx = get_global_id(0);\n"
+"	if (idx < updateCounts[UPDATE_AFFECTED_CELLS])\n"
+"		writeAffectedLeafRanges(affectedCells[idx],topLevelCells,counters,offsets,leafRanges,updateCounts,leafPairsCapacity);\n"
+"}\n"
 "\n"
+"/*****************************************************\n"
+" * 19. Scatter leaf pairs of appended top level pairs\n"
+" ******************************************************/\n"
+"__kernel void scatterAppendedLeafPairsKernel(CL_GLOBAL const char* scene,\n"
+"											 CL_GLOBAL CL_UINT2* topLevelPairs,\n"
+"											 CL_UINT firstPair,\n"
+"											 CL_UINT pairsEnd,\n"
+"											 CL_GLOBAL struct TopLevelCell* topLevelCells,\n"
+"											 CL_CONSTANT struct GridData* grid,\n"
+"											 CL_GLOBAL CL_UINT* offsets,\n"
+"											 CL_GLOBAL CL_UINT* counters,\n"
+"											 CL_GLOBAL CL_UINT* pairs,\n"
+"											 CL_UINT leafCellsCapacity,\n"
+"											 CL_UINT pairsCapacity)\n"
+"{\n"
+"	CL_UINT idx = firstPair + get_global_id(0);\n"
+"	if (idx < pairsEnd)\n"
+"		binPairToLeafCells(scene,topLevelPairs,idx,grid,topLevelCells,counters,offsets,pairs,leafCellsCapacity,pairsCapacity,true);\n"
+"}\n"
 "\n"
+"/*****************************************************\n"
+" * 20. Clear flags of affected cells\n"
+" ******************************************************/\n"
+"__kernel void releaseAffectedCellsKernel(CL_GLOBAL const CL_UINT* affectedCells,\n"
+"										 CL_GLOBAL const CL_UINT* updateCounts,\n"
+"										 CL_GLOBAL CL_UINT* affectedFlags)\n"
+"{\n"
+"	CL_UINT idx = get_global_id(0);\n"
+"	if (idx < updateCounts[UPDATE_AFFECTED_CELLS])\n"
+"		affectedFlags[affectedCells[idx]] = 0;\n"
+"}\n"
 "\n"
+"/*****************************************************\n"
+" * 21. Calculate proximities of empty top level cells\n"
+" *     along an axis - Run for X, Y and Z in this order.\n"
+" *     Last axis stores the proximities in the cells\n"
+" ******************************************************/\n"
+"__kernel void computeProximityKernel(CL_GLOBAL struct TopLevelCell* topLevelCells,\n"
+"									 CL_GLOBAL const CL_UINT* input,\n"
+"									 CL_GLOBAL CL_UINT* output,\n"
+"									 CL_CONSTANT struct GridData* grid,\n"
+"									 CL_UINT cellCount,\n"
+"									 CL_UINT axis)\n"
+"{\n"
+"	CL_UINT idx = get_global_id(0);\n"
+"	if (idx >= cellCount)\n"
+"		return;\n"
+"	CL_UINT proximity = proximityAlongAxis(topLevelCells,input,grid,idx,axis);\n"
+"	if (axis != iZ)\n"
+"		output[idx] = proximity;\n"
+"	else if (topLevelCells[idx].resX == 0)\n"
+"		topLevelCells[idx].proximityDistance = proximity;\n"
+"}\n"
 ;
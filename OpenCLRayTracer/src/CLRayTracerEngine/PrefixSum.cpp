@@ -25,14 +25,16 @@
  *
  * class PrefixSum - Implementation of Host interface class to GPU implementation of Prefix Sum algorithm.
  *
- * @implnotes This class uses kernels from examples included in AMD OpenCL SDK, and implemented according to that example.
- *            Known bug: This class failed to work on Intel graphic cards for undetermined reason -
- *                       Despite of that it compiles fine and run without runtime errors, it gives incorrect results.
+ * @implnotes Single pass chained scan with decoupled look-back: Merrill, Garland - "Single-pass Parallel Prefix Scan
+ *            with Decoupled Look-back", 2016. Blocks wait for the blocks that started before them, which are assumed to
+ *            progress while waiting, as on all GPUs that run the blocks in order of start.
  * 
  */
 
+#include <sstream>
 #include <Algorithms\PrefixSum.h>
 #include <OpenCLUtils\CLExecutionContext.h>
+#include <OpenCLUtils\CLBuffer.h>
 #include <CLData/RTKernelUtils.h>
 
 using namespace std;
@@ -42,13 +44,20 @@ using namespace CLRayTracer::Common;
 /**String that contains the kernel source*/
 extern const char * PrefixSumKernelSource;
 
+//Maximal work group size of the scan - Each work item scans 4 items
+#define SCAN_MAX_WORKGROUP_SIZE 256
+//Bits of block status flags, that hold the status - The rest hold the epoch
+#define SCAN_STATUS_BITS 2
+//The epoch after which block status flags are cleared, since the epoch does not fit the flags anymore
+#define SCAN_MAX_EPOCH ((1U << (32 - SCAN_STATUS_BITS)) - 1)
+
 /**Constructor*/
 PrefixSum::PrefixSum(const CLExecutionContext& context):_context(context)
 {
-	_deviceLocalMemory = 0;
-	_deviceProcessors = 0;
-	_deviceWavefront = 0;
+	_blocksCapacity = 0;
+	_epoch = 0;
 	_maxWorkgroupSize = 0;
+	_workgroupSize = 0;
 }
 
 /**Initializes the instance of PrefixSum wrapper
@@ -57,157 +66,105 @@ PrefixSum::PrefixSum(const CLExecutionContext& context):_context(context)
  */
 Result PrefixSum::initialize(Errata& err)
 {
-	//Create and compile CL program
-	_prefixSumProgram.reset(new CLProgram(_context));
-	if (Success != _prefixSumProgram->compile(PrefixSumKernelSource,err))
-		return Error;
-
-	CLKernel *k = NULL;
-	if (Success != _prefixSumProgram->getKernel("global_prefixSum",k,err))
-		return Error;
-	_globalKernel.reset(k);
-
-	if (Success != _prefixSumProgram->getKernel("group_prefixSum",k,err))
-		return Error;
-	_groupKernel.reset(k);
-
-	if(Success != _context.getDevice().getMemoryInfo().getLocalMemSize(_deviceLocalMemory,err))
+	if (Success != _context.getDevice().getWorkGroupDimensions().getMaxWorkGroupSize(_maxWorkgroupSize,err))
 		return Error;
+	_workgroupSize = largestPowerOfTwo(min(_maxWorkgroupSize,(size_t)SCAN_MAX_WORKGROUP_SIZE));
 
-	if (Success != _context.getMaximalLaunchExecParams(*_groupKernel,_deviceProcessors,_deviceWavefront,err))
-		return Error;
+	//Create and compile CL program per item type
+	for (int type = 0; type < ItemTypesCount; type++)
+	{
+		stringstream options;
+		options << "-D SCAN_WORKGROUP_SIZE=" << _workgroupSize;
+		if (type == UInt2Items)
+			options << " -D SCAN_UINT2";
+		_prefixSumPrograms[type].reset(new CLProgram(_context));
+		if (Success != _prefixSumPrograms[type]->compile(PrefixSumKernelSource,options.str(),err))
+			return Error;
+
+		CLKernel *k = NULL;
+		if (Success != _prefixSumPrograms[type]->getKernel("chainedScan",k,err))
+			return Error;
+		_scanKernels[type].reset(k);
+	}
 
-	if (Success != _context.getDevice().getWorkGroupDimensions().getMaxWorkGroupSize(_maxWorkgroupSize,err))
-		return Error;
 	return Success;
 }
 
-
-/**Computes prefix sun of device array
-* By default, this futnction assumes that the values are unsigned ints
+/**Computes inclusive prefix sum of device array of unsigned ints
 * @param inputBuffer The input for the algorithm - Array of unsigned integers
 * @param outputBuffer The output of the algorithm - The prefix sum
-* @param size Number of items in the input array - Must be power of two
+* @param size Number of items in the input array
 * @param [out]err Error info, filled in case there is an error
 * @return Result, that indicates whether the operation succeeded or failed
 **/
 Result PrefixSum::computePrefixSum(cl_mem inputBuffer,cl_mem outputBuffer,size_t size,Errata& err)
 {
-	if (!isPowerOfTwo(size))
-	{
-		FILL_ERRATA(err,"Input size must be adjusted to power of 2");
-		return Error;
-	}
-
-	//Verify that local memory is available
-	size_t localDataSize = _maxWorkgroupSize << 1;   // Each thread work on 2 elements
-	cl_ulong neededLocalMemory = localDataSize * sizeof(CL_INT);
-	if(neededLocalMemory > _deviceLocalMemory)
-    {
-		FILL_ERRATA(err,"Insufficient Local Memory");
-		return Error;
-	}
-
-	
-	_outputBuffer = outputBuffer;
-	_inputBuffer = inputBuffer;
-	
-	for(size_t offset = 1; offset<size; offset *= localDataSize)
-    {
-		
-        if ((size/offset) > 1)  // Need atlest 2 element for process the kernel
-        {
-			if (Success != invokeGroupKernel(offset,size,err))
-				return Error;
-        }
-
-        // Call global_kernel for update all elements
-        if(offset > 1)
-        {
-           	if (Success != invokeGlobalKernel(offset,size,err))
-				return Error;
-        }
-    }
-
-	return Success;
+	return computePrefixSum(inputBuffer,outputBuffer,size,Inclusive,UIntItems,err);
 }
 
-Result PrefixSum::invokeGroupKernel(CL_UINT offset,CL_UINT length,Errata& err)
-{
-	size_t dataSize = length/offset;
-	size_t localThreads = _maxWorkgroupSize;
-    size_t globalThreads = (dataSize+1) >> 1;    // Actual threads needed
-    // Set global thread size multiple of local thread size.
-    globalThreads = ((globalThreads + localThreads - 1) / localThreads) *
-                    localThreads;
-
-	//Setting kernel arguments
-	CLKernelArgument outputBufferArg = _outputBuffer;
-	CLKernelArgument inputBufferArg = (offset>1) ? _outputBuffer  : _inputBuffer;
-	CL_UINT localMemSize = (localThreads*sizeof(CL_UINT)) << 1;
-	CLKernelArgument localMemArg(localMemSize);
-	CLKernelArgument offsetArg = offset;
-	CLKernelArgument lengthArg = length;
-
-	if (Success != _groupKernel->setKernelArgument(outputBufferArg,0,err))
-		return Error;
-	if (Success != _groupKernel->setKernelArgument(inputBufferArg,1,err))
-		return Error;
-	if (Success != _groupKernel->setKernelArgument(offsetArg,2,err))
-		return Error;
-	if (Success != _groupKernel->setKernelArgument(lengthArg,3,err))
-		return Error;
-	if (Success != _groupKernel->setKernelArgument(localMemArg,4,err))
-		return Error;
-
-	CLEvent evt;
-	CLKernelWorkDimension localDim(1,_maxWorkgroupSize);
-	CLKernelWorkDimension globalDim(1,globalThreads);
-	CLKernelExecuteParams groupKernelExecParams(&globalDim,&localDim,&evt);
-
-	if(Success != _context.enqueueKernel(*_groupKernel,groupKernelExecParams,err))
-		return Error;
-	if (Success != _context.flushQueue(err))
-		return Error;
-	if (Success != evt.wait(err))
-		return Error;
-
-	return Success;
-}
-
-Result PrefixSum::invokeGlobalKernel(CL_UINT offset,CL_UINT length,Errata& err)
+/**Computes prefix sum of device array
+* The sum is computed by single kernel launch, which is enqueued without waiting for completion - Commands
+* enqueued afterwards, including blocking reads, see the result
+* @param inputBuffer The input for the algorithm
+* @param outputBuffer The output of the algorithm - The prefix sum. May be the same as the input
+* @param size Number of items in the input array
+* @param mode Inclusive or exclusive prefix sum
+* @param type Type of the items
+* @param [out]err Error info, filled in case there is an error
+* @return Result, that indicates whether the operation succeeded or failed
+**/
+Result PrefixSum::computePrefixSum(cl_mem inputBuffer,cl_mem outputBuffer,size_t size,ScanMode mode,ItemType type,Errata& err)
 {
-	size_t localThreads = _maxWorkgroupSize;
-    size_t localDataSize = localThreads << 1;   // Each thread work on 2 elements
+	if (size == 0)
+		return Success;
 
-    // Set number of threads needed for global_kernel.
-    size_t globalThreads = length - offset;
-    globalThreads -= (globalThreads / (offset * localDataSize)) * offset;
+	size_t blockSize = _workgroupSize * 4;
+	CL_UINT blocksCount = (CL_UINT)((size + blockSize - 1) / blockSize);
 
-    // Set global thread size multiple of local thread size.
-    globalThreads = ((globalThreads + localThreads - 1) / localThreads) *
-                    localThreads;
+	//Block status flags are kept between scans: Flags of earlier epochs are ignored, so they are cleared only
+	//when the buffers grow, or epochs run out
+	if (blocksCount > _blocksCapacity || _epoch == SCAN_MAX_EPOCH)
+	{
+		_blocksCapacity = max(blocksCount,_blocksCapacity);
+		if (_blockStatus)
+		{
+			_blockStatus->resize((_blocksCapacity + 1) * sizeof(CL_UINT));
+			_blockAggregates->resize(_blocksCapacity * sizeof(CL_UINT2));
+			_blockPrefixes->resize(_blocksCapacity * sizeof(CL_UINT2));
+		}
+		else
+		{
+			_blockStatus.reset(new CLBuffer(_context,(_blocksCapacity + 1) * sizeof(CL_UINT),CLBufferFlags::ReadWrite));
+			_blockAggregates.reset(new CLBuffer(_context,_blocksCapacity * sizeof(CL_UINT2),CLBufferFlags::ReadWrite));
+			_blockPrefixes.reset(new CLBuffer(_context,_blocksCapacity * sizeof(CL_UINT2),CLBufferFlags::ReadWrite));
+		}
+		CL_UINT zero = 0;
+		if (Success != _context.enqueueFillBuffer(_blockStatus->getCLMem(),&zero,(_blocksCapacity + 1) * sizeof(CL_UINT),sizeof(CL_UINT),err))
+			return Error;
+		_epoch = 0;
+	}
+	_epoch++;
 
-	CLKernelArgument outputBufferArg = _outputBuffer;
-	CLKernelArgument offsetArg = offset;
-	CLKernelArgument lengthArg = length;
-	if (Success != _globalKernel->setKernelArgument(outputBufferArg,0,err))
-		return Error;
-	if (Success != _globalKernel->setKernelArgument(offsetArg,1,err))
-		return Error;
-	if (Success != _globalKernel->setKernelArgument(lengthArg,2,err))
+	CLKernel& kernel = *_scanKernels[type];
+	CL_UINT itemsCount = (CL_UINT)size;
+	CL_UINT exclusive = (mode == Exclusive) ? 1 : 0;
+	try
+	{
+		SET_KERNEL_ARGS(kernel,inputBuffer,outputBuffer,itemsCount,exclusive,_blockStatus->getCLMem(),
+			_blockAggregates->getCLMem(),_blockPrefixes->getCLMem(),_epoch);
+	}
+	catch (CLInterfaceException e)
+	{
+		err = Errata(e);
 		return Error;
+	}
 
-	CLEvent evt;
-	CLKernelWorkDimension localDim(1,_maxWorkgroupSize);
-	CLKernelWorkDimension globalDim(1,globalThreads);
-	CLKernelExecuteParams globalKernelExecParams(&globalDim,&localDim,&evt);
-	if(Success != _context.enqueueKernel(*_globalKernel,globalKernelExecParams,err))
-		return Error;
-	if (Success != _context.flushQueue(err))
-		return Error;
-	if (Success != evt.wait(err))
+	CLKernelWorkDimension localDim(1,_workgroupSize);
+	CLKernelWorkDimension globalDim(1,blocksCount * _workgroupSize);
+	CLKernelExecuteParams execParams(&globalDim,&localDim,NULL);
+	if (Success != _context.enqueueKernel(kernel,execParams,err))
 		return Error;
 
-	return Success;
-}
\ No newline at end of file
+	//The queue is in order, so no wait is needed before following commands
+	return _context.flushQueue(err);
+}
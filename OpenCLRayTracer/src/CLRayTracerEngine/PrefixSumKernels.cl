@@ -1,108 +1,157 @@
-/**********************************************************************
-Copyright 2015 Advanced Micro Devices, Inc. All rights reserved.
+/**
+ * @file PrefixSumKernels.cl
+ * @author  Timur Sizov <timorgizer@gmail.com>
+ * @version 0.6
+ *
+ * @section LICENSE
+ *
+ * Copyright (c) 2016 Timur Sizov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software 
+ * without restriction, including without limitation the rights to use, copy, modify, merge, 
+ * publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons 
+ * to whom the Software is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE 
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * @section DESCRIPTION
+ *
+ * Kernel of single pass Prefix Sum (chained scan with decoupled look-back) - Host interface class: PrefixSum
+ * See: Merrill, Garland - "Single-pass Parallel Prefix Scan with Decoupled Look-back", 2016
+ * The following defines are given by the host: SCAN_WORKGROUP_SIZE - Work group size, power of two,
+ * SCAN_UINT2 - Items are uint2, summed per component. Otherwise items are uint
+ */
 
-Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+#ifdef SCAN_UINT2
+typedef uint2 data_t;
+#else
+typedef uint data_t;
+#endif
 
-	Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
-	Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or
- other materials provided with the distribution.
+//Items per work item - Each work item sums consecutive items sequentially
+#define SCAN_ITEMS_PER_THREAD 4
+#define SCAN_BLOCK_SIZE (SCAN_WORKGROUP_SIZE * SCAN_ITEMS_PER_THREAD)
 
-THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
- WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
- DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
- OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
- NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
-********************************************************************/
+//Block status is kept in low bits of status flag, and the epoch of the scan in the rest of the bits
+#define STATUS_BITS 2
+//Sum of the block items is available
+#define STATUS_AGGREGATE 1
+//Sum of all items up to the block, inclusive, is available
+#define STATUS_PREFIX 2
 
-/*
- * Work-efficient compute implementation of scan, one thread per 2 elements
- * O(log(n)) stepas and O(n) adds using shared memory
- * Uses a balanced tree algorithm. See Belloch, 1990 "Prefix Sums
- * and Their Applications"
- * @param output	output data 
- * @param input		input data
- * @param block		local memory used in the kernel
- * @param length	lenght of the input data
- * @param idxOffset	offset between two consecutive index.
- */
-__kernel 
-void group_prefixSum(__global uint * output,
-					 __global uint * input,
-					 const int idxOffset,
-					  const int size,
-					 __local  uint * block) {
-	int localId = get_local_id(0);
-	int localSize = get_local_size(0);
-	int globalIdx = get_group_id(0);
+/**
+* Computes prefix sum of an array of any size, in single pass: Each block of items is scanned in local memory,
+* and the sum of preceding blocks is accumulated from their published aggregates, looking back until a block
+* with published prefix is found.
+* @param input Input array
+* @param output Output array - May be the same as input
+* @param size Number of items in the array
+* @param exclusive Nonzero for exclusive prefix sum, zero for inclusive
+* @param status Element 0 - Counter of started blocks, which is zeroed by the last block. Elements 1 to blocks count -
+*               Status flags of the blocks. Flags of previous epochs count as not set, so they need no clearing
+* @param aggregates Sums of items of the blocks
+* @param prefixes Inclusive prefix sums of the blocks
+* @param epoch Epoch of this scan - Must differ from the epochs of the flags of previous scans
+*/
+__kernel void chainedScan(__global const data_t* input,
+						  __global data_t* output,
+						  const uint size,
+						  const uint exclusive,
+						  volatile __global uint* status,
+						  volatile __global data_t* aggregates,
+						  volatile __global data_t* prefixes,
+						  const uint epoch)
+{
+	__local data_t scratch[SCAN_WORKGROUP_SIZE];
+	__local uint blockIdx;
+	__local data_t blockPrefix;
+	uint lid = get_local_id(0);
+	uint blocksCount = (size + SCAN_BLOCK_SIZE - 1) / SCAN_BLOCK_SIZE;
 
-	// Cache the computational window in shared memory
-	globalIdx = (idxOffset *(2 *(globalIdx*localSize + localId) +1)) - 1;
-	if(globalIdx < size)             { block[2*localId]     = input[globalIdx];				}
-    if(globalIdx + idxOffset < size) { block[2*localId + 1] = input[globalIdx + idxOffset];	}
+	//Blocks are numbered by order of start, rather than by group id, so that the blocks that a block waits for
+	//have been started already, and progress
+	if (lid == 0)
+	{
+		blockIdx = atomic_inc(&status[0]);
+		if (blockIdx == blocksCount - 1)
+			atomic_xchg(&status[0],0);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	uint block = blockIdx;
 
-	// Build up tree 
-	int offset = 1;
-	for(int l = size>>1; l > 0; l >>= 1)
+	//1. Sequential sum of the items of the work item
+	data_t items[SCAN_ITEMS_PER_THREAD];
+	data_t threadSum = (data_t)(0);
+	uint first = block * SCAN_BLOCK_SIZE + lid * SCAN_ITEMS_PER_THREAD;
+	for (uint i = 0; i < SCAN_ITEMS_PER_THREAD; i++)
 	{
-	  barrier(CLK_LOCAL_MEM_FENCE);
-	  if(localId < l) {
-            int ai = offset*(2*localId + 1) - 1;
-            int bi = offset*(2*localId + 2) - 1;
-            block[bi] += block[ai];
-         }
-         offset <<= 1;
+		items[i] = (first + i < size) ? input[first + i] : (data_t)(0);
+		threadSum += items[i];
 	}
-		 
-	if (size > 2)
+
+	//2. Scan of work item sums in local memory
+	scratch[lid] = threadSum;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint offset = 1; offset < SCAN_WORKGROUP_SIZE; offset <<= 1)
 	{
-		if(offset < size) { offset <<= 1; }
+		data_t addend = lid >= offset ? scratch[lid - offset] : (data_t)(0);
+		barrier(CLK_LOCAL_MEM_FENCE);
+		scratch[lid] += addend;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	data_t threadPrefix = scratch[lid] - threadSum;
 
-		// Build down tree
-		int maxThread = offset>>1;
-		for(int d = 0; d < maxThread; d<<=1)
+	//3. Decoupled look-back for the sum of preceding blocks
+	if (lid == 0)
+	{
+		data_t aggregate = scratch[SCAN_WORKGROUP_SIZE - 1];
+		data_t prefix = (data_t)(0);
+		if (block > 0)
 		{
-			d += 1;
-			offset >>=1;
-			barrier(CLK_LOCAL_MEM_FENCE);
+			aggregates[block] = aggregate;
+			write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+			atomic_xchg(&status[block + 1],(epoch << STATUS_BITS) | STATUS_AGGREGATE);
 
-			if(localId < d) {
-				int ai = offset*(localId + 1) - 1;
-				int bi = ai + (offset>>1);
-				block[bi] += block[ai];
+			uint predecessor = block - 1;
+			while (true)
+			{
+				uint flag = atomic_or(&status[predecessor + 1],0);
+				//Spin until the predecessor publishes its aggregate
+				if ((flag >> STATUS_BITS) != epoch)
+					continue;
+				read_mem_fence(CLK_GLOBAL_MEM_FENCE);
+				if ((flag & STATUS_PREFIX) != 0)
+				{
+					prefix += prefixes[predecessor];
+					break;
+				}
+				prefix += aggregates[predecessor];
+				predecessor--;
 			}
 		}
+		prefixes[block] = prefix + aggregate;
+		write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+		atomic_xchg(&status[block + 1],(epoch << STATUS_BITS) | STATUS_PREFIX);
+		blockPrefix = prefix;
 	}
 	barrier(CLK_LOCAL_MEM_FENCE);
-	
-    // write the results back to global memory
-    if(globalIdx < size)           { output[globalIdx]             = block[2*localId];		}
-    if(globalIdx+idxOffset < size) { output[globalIdx + idxOffset] = block[2*localId + 1];	}
-}
-
-/*
- * Work-efficient compute implementation of scan, one thread per 2 elements
- * O(log(n)) stepas and O(n) adds using shared memory
- * Uses a balanced tree algorithm. See Belloch, 1990 "Prefix Sums
- * and Their Applications"
- * @param buffer	input/output data 
- * @param offset	Multiple of Offset positions are already updated by group_prefixSum kernel
- * @param length	lenght of the input data
- */
-__kernel
-void global_prefixSum(__global uint * buffer,
-                      const int offset,
-					  const int size) {
-	int localSize = get_local_size(0);
-    int groupIdx  = get_group_id(0);
-
-	int sortedLocalBlocks = offset / localSize;		// sorted groups per block
-	// Map the gids to unsorted local blocks.
-	int gidToUnsortedBlocks = groupIdx + (groupIdx / ((offset<<1) - sortedLocalBlocks) +1) * sortedLocalBlocks;
 
-	// Get the corresponding global index
-    int globalIdx = (gidToUnsortedBlocks*localSize + get_local_id(0));
-	if(((globalIdx+1) % offset != 0) && (globalIdx < size))
-		buffer[globalIdx] += buffer[globalIdx - (globalIdx%offset + 1)];
+	//4. Output of the items of the work item
+	data_t sum = blockPrefix + threadPrefix;
+	for (uint i = 0; i < SCAN_ITEMS_PER_THREAD; i++)
+		if (first + i < size)
+		{
+			if (exclusive)
+				output[first + i] = sum;
+			sum += items[i];
+			if (!exclusive)
+				output[first + i] = sum;
+		}
 }
-
-
@@ -0,0 +1,227 @@
+/**
+ * @file RadixSort.cpp
+ * @author  Timur Sizov <timorgizer@gmail.com>
+ * @version 0.6
+ *
+ * @section LICENSE
+ *
+ * Copyright (c) 2016 Timur Sizov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software 
+ * without restriction, including without limitation the rights to use, copy, modify, merge, 
+ * publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons 
+ * to whom the Software is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE 
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * @section DESCRIPTION
+ *
+ * class RadixSort - The implementation file - Host interface class to GPU implementation of LSD Radix Sort
+ *
+ */
+
+#include <sstream>
+#include <algorithm>
+#include <Algorithms\RadixSort.h>
+#include <Algorithms\PrefixSum.h>
+#include <OpenCLUtils\CLExecutionContext.h>
+#include <OpenCLUtils\CLBuffer.h>
+#include <CLData\RTKernelUtils.h>
+
+using namespace std;
+using namespace CLRayTracer::OpenCLUtils;
+using namespace CLRayTracer::Common;
+
+/**String that contains the kernel source*/
+extern const char * RadixSortKernelSource;
+
+//Bits of key sorted per pass - 16 digits fit local histograms, and keep split passes of local sort short
+#define RADIX_BITS 4
+#define RADIX (1 << RADIX_BITS)
+//Maximal number of items per block - Larger blocks give less histogram entries to scan, and longer coalesced writes
+#define RADIX_MAX_BLOCK_SIZE 256
+
+/**Constructor*/
+RadixSort::RadixSort(const CLExecutionContext& context,const bool useKeyValue,const bool use64BitKeys):
+	_context(context),_maxWorkgroupSize(0),_blockSize(0),_useKeyValue(useKeyValue),_use64BitKeys(use64BitKeys)
+{
+	_prefixSumCalculator.reset(new PrefixSum(context));
+}
+
+/**Initialize
+* Performs initialization of a RadixSort instance. Must be called once per instance
+* @param [out] err Error info, in case error occurred
+* @return Result, that indicates whether the operation succeeded or failed
+*/
+Result RadixSort::initialize(Errata& err)
+{
+	if (Success != _prefixSumCalculator->initialize(err))
+		return Error;
+
+	if (Success != _context.getDevice().getWorkGroupDimensions().getMaxWorkGroupSize(_maxWorkgroupSize,err))
+		return Error;
+
+	//Block size is the work group size - Must be power of two for the local scan, and hold a histogram entry per work item
+	_blockSize = largestPowerOfTwo(min(_maxWorkgroupSize,(size_t)RADIX_MAX_BLOCK_SIZE));
+	if (_blockSize < RADIX)
+	{
+		FILL_ERRATA(err,"Device work group size is too small for radix sort: " << _maxWorkgroupSize);
+		return Error;
+	}
+
+	//Adjust kernel code according to parameters
+	stringstream fullKernelCode;
+	if (_useKeyValue)
+		fullKernelCode << "#define CONFIG_USE_VALUE" << endl;
+	if (_use64BitKeys)
+		fullKernelCode << "#define CONFIG_64BIT_KEYS" << endl;
+	fullKernelCode << "#define RADIX_BITS " << RADIX_BITS << endl;
+	fullKernelCode << "#define RADIX_BLOCK_SIZE " << _blockSize << endl;
+	fullKernelCode << RadixSortKernelSource;
+
+	//Create and compile CL program
+	_sortingProgram.reset(new CLProgram(_context));
+	if (Success != _sortingProgram->compile(fullKernelCode.str(),err))
+		return Error;
+
+	CLKernel *k = NULL;
+	if (Success != _sortingProgram->getKernel("radixHistogram",k,err))
+		return Error;
+	_histogramKernel.reset(k);
+
+	if (Success != _sortingProgram->getKernel("radixScatter",k,err))
+		return Error;
+	_scatterKernel.reset(k);
+
+	return Success;
+}
+
+/**Sorts the input array by all bits of the keys
+* @param input Device pointer to array that shoud be sorted
+* @param num_items Number of items in array to be sorted
+* @param [out] err Error info, in case error occurred
+* @return Result, that indicates whether the operation succeeded or failed
+*/
+Result RadixSort::sort(cl_mem input,size_t num_items,Errata& err)
+{
+	return sort(input,num_items,0,_use64BitKeys ? 64 : 32,err);
+}
+
+/**Sorts the input array by range of key bits - Bits outside of the range are ignored
+* @param input Device pointer to array that shoud be sorted
+* @param num_items Number of items in array to be sorted
+* @param beginBit Least significant key bit to sort by
+* @param endBit The bit after the most significant key bit to sort by
+* @param [out] err Error info, in case error occurred
+* @return Result, that indicates whether the operation succeeded or failed
+*/
+Result RadixSort::sort(cl_mem input,size_t num_items,CL_UINT beginBit,CL_UINT endBit,Errata& err)
+{
+	if (endBit > (_use64BitKeys ? 64U : 32U) || beginBit >= endBit)
+	{
+		FILL_ERRATA(err,"Invalid range of key bits for radix sort: " << beginBit << " - " << endBit);
+		return Error;
+	}
+	if (num_items < 2)
+		return Success;
+
+	size_t itemSize = (_use64BitKeys ? sizeof(CL_ULONG) : sizeof(CL_UINT)) * (_useKeyValue ? 2 : 1);
+	CL_UINT count = (CL_UINT)num_items;
+	CL_UINT blocksCount = (CL_UINT)((num_items + _blockSize - 1) / _blockSize);
+	CL_UINT histogramSize = blocksCount * RADIX;
+
+	//Buffers are allocated on first use, and grow with input
+	if (_temp)
+	{
+		_temp->resize(num_items * itemSize);
+		_histogram->resize(histogramSize * sizeof(CL_UINT));
+		_histogramScan->resize(histogramSize * sizeof(CL_UINT));
+	}
+	else
+	{
+		_temp.reset(new CLBuffer(_context,num_items * itemSize,CLBufferFlags::ReadWrite));
+		_histogram.reset(new CLBuffer(_context,histogramSize * sizeof(CL_UINT),CLBufferFlags::ReadWrite));
+		_histogramScan.reset(new CLBuffer(_context,histogramSize * sizeof(CL_UINT),CLBufferFlags::ReadWrite));
+	}
+
+	//Each pass sorts stably by next digit, from input to temporary buffer and back
+	cl_mem source = input;
+	cl_mem destination = _temp->getCLMem();
+	for (CL_UINT shift = beginBit; shift < endBit; shift += RADIX_BITS)
+	{
+		CL_UINT digitBits = min(endBit - shift,(CL_UINT)RADIX_BITS);
+
+		//1. Count digits per block
+		try
+		{
+			SET_KERNEL_ARGS((*_histogramKernel),source,count,shift,digitBits,_histogram->getCLMem(),blocksCount);
+		}
+		catch (CLInterfaceException e)
+		{
+			err = Errata(e);
+			return Error;
+		}
+		if (Success != launchKernel(*_histogramKernel,blocksCount,err))
+			return Error;
+
+		//2. Scan the histogram for output offsets of the digits of each block
+		if (Success != _prefixSumCalculator->computePrefixSum(_histogram->getCLMem(),_histogramScan->getCLMem(),histogramSize,PrefixSum::Exclusive,PrefixSum::UIntItems,err))
+			return Error;
+
+		//3. Sort blocks locally and scatter them
+		try
+		{
+			SET_KERNEL_ARGS((*_scatterKernel),source,destination,count,shift,digitBits,_histogramScan->getCLMem(),blocksCount);
+		}
+		catch (CLInterfaceException e)
+		{
+			err = Errata(e);
+			return Error;
+		}
+		if (Success != launchKernel(*_scatterKernel,blocksCount,err))
+			return Error;
+
+		std::swap(source,destination);
+	}
+
+	//After odd number of passes the result is in the temporary buffer
+	if (source != input)
+		return _context.enqueueCopyBuffer(source,input,num_items * itemSize,err);
+
+	return Success;
+}
+
+/**Launches one of the kernels of radix sort with a work group per block, and waits for completion
+ * @param kernel The kernel to launch - Its arguments must be already set
+ * @param blocksCount Number of blocks of input
+ * @param [out]err Error info, filled in case there is an error
+ * @return Result, that indicates whether the operation succeeded or failed
+ **/
+Result RadixSort::launchKernel(CLKernel& kernel,size_t blocksCount,Errata& err)
+{
+	CLEvent evt;
+	evt.reset();
+	CLKernelWorkDimension globalDim(1,blocksCount * _blockSize);
+	CLKernelWorkDimension localDim(1,_blockSize);
+	CLKernelExecuteParams execParams(&globalDim,&localDim,&evt);
+
+	//Execute kernel
+	if (Success != _context.enqueueKernel(kernel,execParams,err))
+		return Error;
+
+	//Flush and make sure that calculation is over before returning control
+	if (Success != _context.flushQueue(err))
+		return Error;
+
+	if (Success != evt.wait(err))
+		return Error;
+
+	return Success;
+}
@@ -0,0 +1,160 @@
+/**
+ * @file RadixSortKernels.cl
+ * @author  Timur Sizov <timorgizer@gmail.com>
+ * @version 0.6
+ *
+ * @section LICENSE
+ *
+ * Copyright (c) 2016 Timur Sizov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software 
+ * without restriction, including without limitation the rights to use, copy, modify, merge, 
+ * publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons 
+ * to whom the Software is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE 
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * @section DESCRIPTION
+ *
+ * Kernels of LSD Radix Sort - Host interface class: RadixSort
+ * The following defines are prepended to the source by the host:
+ * RADIX_BITS - Bits of key sorted per pass, RADIX_BLOCK_SIZE - Work group size, which is the number of items per block,
+ * CONFIG_USE_VALUE - Items are key/value pairs, CONFIG_64BIT_KEYS - Keys and values are 64 bit wide
+ */
+
+#ifdef CONFIG_64BIT_KEYS
+#ifdef CONFIG_USE_VALUE
+typedef ulong2 data_t;
+#else
+typedef ulong data_t;
+#endif
+#else
+#ifdef CONFIG_USE_VALUE
+typedef uint2 data_t;
+#else
+typedef uint data_t;
+#endif
+#endif
+
+#ifdef CONFIG_USE_VALUE
+#define getKey(a) ((a).x)
+#else
+#define getKey(a) (a)
+#endif
+
+#define RADIX (1 << RADIX_BITS)
+
+//Extracts digit of the key for current pass
+#define getDigit(a,shift,digitBits) ((uint)((getKey(a) >> (shift)) & ((1 << (digitBits)) - 1)))
+
+/**
+* Computes exclusive prefix sum of values of all work items in work group
+* @param value Value of current work item
+* @param scratch Local memory array of RADIX_BLOCK_SIZE items
+* @param [out] total Sum of values of all work items
+* @return Sum of values of work items with lower local index
+*/
+inline uint workGroupExclusiveScan(uint value,__local uint* scratch,uint* total)
+{
+	uint lid = get_local_id(0);
+	scratch[lid] = value;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint offset = 1; offset < RADIX_BLOCK_SIZE; offset <<= 1)
+	{
+		uint addend = lid >= offset ? scratch[lid - offset] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		scratch[lid] += addend;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	*total = scratch[RADIX_BLOCK_SIZE - 1];
+	uint result = scratch[lid] - value;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return result;
+}
+
+/*****************************************************
+ * 1. Counts digits of every block in local memory
+ *    The counts are stored digit major: histogram[digit * blocksCount + block],
+ *    so that prefix sum of the histogram gives the output offset of each digit of each block
+ ******************************************************/
+__kernel void radixHistogram(__global const data_t* input,
+							 const uint count,
+							 const uint shift,
+							 const uint digitBits,
+							 __global uint* histogram,
+							 const uint blocksCount)
+{
+	__local uint localHistogram[RADIX];
+	uint lid = get_local_id(0);
+	uint gid = get_global_id(0);
+	uint block = get_group_id(0);
+
+	if (lid < RADIX)
+		localHistogram[lid] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (gid < count)
+		atomic_inc(&localHistogram[getDigit(input[gid],shift,digitBits)]);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (lid < RADIX)
+		histogram[lid * blocksCount + block] = localHistogram[lid];
+}
+
+/*****************************************************
+ * 2. Sorts every block by digit in local memory, and scatters it to the output
+ *    histogramScan is the exclusive prefix sum of the histogram
+ ******************************************************/
+__kernel void radixScatter(__global const data_t* input,
+						   __global data_t* output,
+						   const uint count,
+						   const uint shift,
+						   const uint digitBits,
+						   __global const uint* histogramScan,
+						   const uint blocksCount)
+{
+	__local data_t items[RADIX_BLOCK_SIZE];
+	__local uint digits[RADIX_BLOCK_SIZE];
+	__local uint scratch[RADIX_BLOCK_SIZE];
+	__local uint digitStart[RADIX];
+	uint lid = get_local_id(0);
+	uint gid = get_global_id(0);
+	uint block = get_group_id(0);
+	uint blockCount = min(count - block * RADIX_BLOCK_SIZE,(uint)RADIX_BLOCK_SIZE);
+
+	//Items beyond the input get the highest digit, so stable sort keeps them at the end of the block
+	data_t item = gid < count ? input[gid] : (data_t)(0);
+	uint digit = gid < count ? getDigit(item,shift,digitBits) : (1 << digitBits) - 1;
+
+	//Stable local sort of the block, by split on each bit of the digit
+	for (uint bit = 0; bit < digitBits; bit++)
+	{
+		uint isZero = ((digit >> bit) & 1) ^ 1;
+		uint zerosCount;
+		uint zerosBefore = workGroupExclusiveScan(isZero,scratch,&zerosCount);
+		uint position = isZero ? zerosBefore : zerosCount + lid - zerosBefore;
+		items[position] = item;
+		digits[position] = digit;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		item = items[lid];
+		digit = digits[lid];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	//Digits are now consecutive in the block - Find the start of each one
+	if (lid == 0 || digits[lid - 1] != digit)
+		digitStart[digit] = lid;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (lid < blockCount)
+	{
+		output[histogramScan[digit * blocksCount + block] + lid - digitStart[digit]] = item;
+	}
+}
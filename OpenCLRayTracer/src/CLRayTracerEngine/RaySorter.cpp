@@ -0,0 +1,194 @@
+/**
+ * @file RaySorter.cpp
+ * @author  Timur Sizov <timorgizer@gmail.com>
+ * @version 0.6
+ *
+ * @section LICENSE
+ *
+ * Copyright (c) 2016 Timur Sizov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software 
+ * without restriction, including without limitation the rights to use, copy, modify, merge, 
+ * publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons 
+ * to whom the Software is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE 
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * @section DESCRIPTION
+ *
+ * class RaySorter - Implementation of host interface class for GPU reordering of ray batches
+ * 
+ */
+
+#include <Algorithms\RaySorter.h>
+#include <Algorithms\RadixSort.h>
+#include <OpenCLUtils\CLExecutionContext.h>
+#include <OpenCLUtils\CLBuffer.h>
+#include <CLData\CLStructs.h>
+#include <CLData\RTKernelUtils.h>
+#include <CLData\RayCoherence.h>
+#include <Common\Deployment.h>
+
+using namespace std;
+using namespace CLRayTracer;
+using namespace CLRayTracer::OpenCLUtils;
+using namespace CLRayTracer::Common;
+
+/**String that contains the kernel source*/
+extern const char * RaySorterKernelSource;
+
+/**Constructor*/
+RaySorter::RaySorter(const CLExecutionContext& context):_context(context)
+{
+	_deviceProcessors = 0;
+	_deviceWavefront = 0;
+	_radixSorter.reset(new RadixSort(context,true));
+}
+
+/**Initializes the instance of RaySorter
+ * @param [out]err Error info, filled in case there is an error
+ * @return Result, that indicates whether the operation succeeded or failed
+ */
+Result RaySorter::initialize(Errata& err)
+{
+	//Initialize sorter
+	if (Success != _radixSorter->initialize(err))
+		return Error;
+
+	//Create and compile CL program
+	_raySorterProgram.reset(new CLProgram(_context));
+	if (Success != _raySorterProgram->compile(RaySorterKernelSource,"-I " + Deployment::CLHeadersPath,err))
+		return Error;
+
+	CLKernel *k = NULL;
+	if (Success != _raySorterProgram->getKernel("calculateRayKeys",k,err))
+		return Error;
+	_keysKernel.reset(k);
+
+	if (Success != _raySorterProgram->getKernel("gatherRays",k,err))
+		return Error;
+	_gatherKernel.reset(k);
+
+	if (Success != _raySorterProgram->getKernel("scatterContacts",k,err))
+		return Error;
+	_scatterKernel.reset(k);
+
+	if (Success != _context.getMaximalLaunchExecParams(*_keysKernel,_deviceProcessors,_deviceWavefront,err))
+		return Error;
+
+	return Success;
+}
+
+/**Sorts the rays by coherence key, and gathers them in sorted order to the buffer returned by getSortedRays()
+ * @param rays Device array of rays (struct Ray)
+ * @param rayCount Number of rays in the array
+ * @param scene Device buffer that contains the scene - Its bounding box is used for origin quantization
+ * @param [out]err Error info, filled in case there is an error
+ * @return Result, that indicates whether the operation succeeded or failed
+ **/
+Result RaySorter::reorder(cl_mem rays,CL_UINT rayCount,cl_mem scene,Errata& err)
+{
+	//Empty batch - Buffers of zero size cannot be allocated
+	if (0 == rayCount)
+		return Success;
+
+	//Radix sort takes any number of items, so no padding keys are needed
+	CL_UINT keysCount = rayCount;
+	//Memory is allocated on first use only, since reordering is optional
+	if (_keys)
+		_keys->resize(keysCount * sizeof(CL_UINT2));
+	else
+		_keys.reset(new CLBuffer(_context,keysCount * sizeof(CL_UINT2),CLBufferFlags::ReadWrite));
+	if (_sortedRays)
+		_sortedRays->resize(rayCount * sizeof(struct Ray));
+	else
+		_sortedRays.reset(new CLBuffer(_context,rayCount * sizeof(struct Ray),CLBufferFlags::ReadWrite));
+
+	//1. Calculate keys
+	try
+	{
+		SET_KERNEL_ARGS((*_keysKernel),rays,rayCount,scene,_keys->getCLMem(),keysCount);
+	}
+	catch (CLInterfaceException e)
+	{
+		err = Errata(e);
+		return Error;
+	}
+	if (Success != launchKernel(*_keysKernel,keysCount,err))
+		return Error;
+
+	//2. Sort ray indices by keys - Only the significant bits of the keys take sorting passes
+	if (Success != _radixSorter->sort(_keys->getCLMem(),keysCount,0,RAY_KEY_BITS,err))
+		return Error;
+
+	//3. Gather the rays in sorted order
+	try
+	{
+		SET_KERNEL_ARGS((*_gatherKernel),rays,_keys->getCLMem(),rayCount,_sortedRays->getCLMem());
+	}
+	catch (CLInterfaceException e)
+	{
+		err = Errata(e);
+		return Error;
+	}
+	return launchKernel(*_gatherKernel,rayCount,err);
+}
+
+/**Scatters contacts of sorted rays back to the indices of the rays before reordering
+ * @param sortedContacts Device array of contacts (struct Contact), as generated for getSortedRays()
+ * @param contacts Device array of contacts, that will contain the contact of rays[i] at index i
+ * @param rayCount Number of rays, as passed to the last call to reorder()
+ * @param [out]err Error info, filled in case there is an error
+ * @return Result, that indicates whether the operation succeeded or failed
+ **/
+Result RaySorter::restoreOrder(cl_mem sortedContacts,cl_mem contacts,CL_UINT rayCount,Errata& err)
+{
+	if (0 == rayCount)
+		return Success;
+
+	try
+	{
+		SET_KERNEL_ARGS((*_scatterKernel),sortedContacts,_keys->getCLMem(),rayCount,contacts);
+	}
+	catch (CLInterfaceException e)
+	{
+		err = Errata(e);
+		return Error;
+	}
+	return launchKernel(*_scatterKernel,rayCount,err);
+}
+
+/**Launches one of the kernels of ray sorter with a work item per element, and waits for completion
+ * @param kernel The kernel to launch - Its arguments must be already set
+ * @param workItems Number of elements to process
+ * @param [out]err Error info, filled in case there is an error
+ * @return Result, that indicates whether the operation succeeded or failed
+ **/
+Result RaySorter::launchKernel(CLKernel& kernel,CL_UINT workItems,Errata& err)
+{
+	CLEvent evt;
+	evt.reset();
+	CLKernelWorkDimension globalDim(1,closestMultipleTo(workItems,_deviceWavefront));
+	CLKernelWorkDimension localDim(1,_deviceWavefront);
+	CLKernelExecuteParams execParams(&globalDim,&localDim,&evt);
+
+	//Execute kernel
+	if (Success != _context.enqueueKernel(kernel,execParams,err))
+		return Error;
+
+	//Flush and make sure that calculation is over before returning control
+	if (Success != _context.flushQueue(err))
+		return Error;
+
+	if (Success != evt.wait(err))
+		return Error;
+
+	return Success;
+}
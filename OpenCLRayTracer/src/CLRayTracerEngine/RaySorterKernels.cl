@@ -0,0 +1,90 @@
+/**
+ * @file RaySorterKernels.cl
+ * @author  Timur Sizov <timorgizer@gmail.com>
+ * @version 0.6
+ *
+ * @section LICENSE
+ *
+ * Copyright (c) 2016 Timur Sizov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software 
+ * without restriction, including without limitation the rights to use, copy, modify, merge, 
+ * publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons 
+ * to whom the Software is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE 
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * @section DESCRIPTION
+ *
+ * Kernel functions for reordering of ray batches by ray coherence key.
+ * 
+ * The rays are assigned keys, the key-index pairs are sorted, rays are gathered in sorted order
+ * for tracing, and the resulting contacts are scattered back to original ray indices.
+ * Key calculation is contained in file: RayCoherence.h
+ */
+
+#include "CLData\CLStructs.h"
+#include "CLData\SceneBufferParser.h"
+#include "CLData\RayCoherence.h"
+
+/*****************************************************
+ * 1. Calculates coherence key for each ray
+ *    Items beyond ray count are padded with UINT_MAX
+ ******************************************************/
+__kernel void calculateRayKeys(CL_GLOBAL const struct Ray* rays,
+							   uint rayCount,
+							   CL_GLOBAL const char* scene,
+							   CL_GLOBAL CL_UINT2* keys,
+							   uint keysCount)
+{
+	uint idx = get_global_id(0);
+	if (idx < keysCount)
+	{
+		CL_UINT2 keyValue = (CL_UINT2)(UINT_MAX,UINT_MAX);
+		if (idx < rayCount)
+		{
+			struct AABB sceneBox = SCENE_HEADER(scene)->modelsBoundingBox;
+			struct Ray ray = rays[idx];
+			keyValue.x = rayCoherenceKey(ray,sceneBox);
+			keyValue.y = idx;
+		}
+		keys[idx] = keyValue;
+	}
+}
+
+/*****************************************************
+ * 2. Gathers rays in sorted order
+ ******************************************************/
+__kernel void gatherRays(CL_GLOBAL const struct Ray* rays,
+						 CL_GLOBAL const CL_UINT2* sortedKeys,
+						 uint rayCount,
+						 CL_GLOBAL struct Ray* sortedRays)
+{
+	uint idx = get_global_id(0);
+	if (idx < rayCount)
+		sortedRays[idx] = rays[sortedKeys[idx].y];
+}
+
+/*****************************************************
+ * 3. Scatters contacts back to original ray indices
+ ******************************************************/
+__kernel void scatterContacts(CL_GLOBAL const struct Contact* sortedContacts,
+							  CL_GLOBAL const CL_UINT2* sortedKeys,
+							  uint rayCount,
+							  CL_GLOBAL struct Contact* contacts)
+{
+	uint idx = get_global_id(0);
+	if (idx < rayCount)
+	{
+		struct Contact c = sortedContacts[idx];
+		c.pixelIndex = sortedKeys[idx].y;
+		contacts[c.pixelIndex] = c;
+	}
+}
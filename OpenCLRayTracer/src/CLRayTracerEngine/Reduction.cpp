@@ -0,0 +1,152 @@
+/**
+ * @file Reduction.cpp
+ * @author  Timur Sizov <timorgizer@gmail.com>
+ * @version 0.6
+ *
+ * @section LICENSE
+ *
+ * Copyright (c) 2016 Timur Sizov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software 
+ * without restriction, including without limitation the rights to use, copy, modify, merge, 
+ * publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons 
+ * to whom the Software is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE 
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * @section DESCRIPTION
+ *
+ * class Reduction - The implementation file - Host interface class for GPU parallel reduction
+ * 
+ */
+#include <sstream>
+#include <Algorithms\Reduction.h>
+#include <OpenCLUtils\CLExecutionContext.h>
+#include <OpenCLUtils\CLBuffer.h>
+#include <CLData\Primitives\AABB.h>
+#include <CLData\RTKernelUtils.h>
+#include <Common\Deployment.h>
+
+using namespace std;
+using namespace CLRayTracer::OpenCLUtils;
+using namespace CLRayTracer::Common;
+
+/**String that contains the kernel source*/
+extern const char * ReductionKernelSource;
+
+//Maximal work group size of the reduction
+#define REDUCE_MAX_WORKGROUP_SIZE 256
+
+/**Defines, by which the kernel is compiled per operator - See ReductionKernels.cl*/
+static const char* OperatorDefines[Reduction::OperatorsCount] = {"REDUCE_MIN_FLOAT4","REDUCE_MAX_FLOAT4","REDUCE_MERGE_AABB",
+																 "REDUCE_SUM_UINT","REDUCE_SUM_FLOAT","REDUCE_COUNT_NONZERO"};
+
+/**Operators, by which partial results of the operators are reduced - Counts of items are summed*/
+static const Reduction::Operator PartialsOperators[Reduction::OperatorsCount] = {Reduction::MinFloat4,Reduction::MaxFloat4,
+																				 Reduction::MergeAABB,Reduction::SumUInt,
+																				 Reduction::SumFloat,Reduction::SumUInt};
+
+/**Constructor*/
+Reduction::Reduction(const CLExecutionContext& context):_context(context)
+{
+	_maxWorkgroupSize = 0;
+	_workgroupSize = 0;
+}
+
+/**Initializes the instance of Reduction
+ * @param [out]err Error info, filled in case there is an error
+ * @return Result, that indicates whether the operation succeeded or failed
+ */
+Result Reduction::initialize(Errata& err)
+{
+	if (Success != _context.getDevice().getWorkGroupDimensions().getMaxWorkGroupSize(_maxWorkgroupSize,err))
+		return Error;
+	_workgroupSize = largestPowerOfTwo(min(_maxWorkgroupSize,(size_t)REDUCE_MAX_WORKGROUP_SIZE));
+
+	//Create and compile CL program per operator
+	for (int op = 0; op < OperatorsCount; op++)
+	{
+		stringstream options;
+		options << "-I " << Deployment::CLHeadersPath << " -D REDUCE_WORKGROUP_SIZE=" << _workgroupSize << " -D " << OperatorDefines[op];
+		_reductionPrograms[op].reset(new CLProgram(_context));
+		if (Success != _reductionPrograms[op]->compile(ReductionKernelSource,options.str(),err))
+			return Error;
+
+		CLKernel *k = NULL;
+		if (Success != _reductionPrograms[op]->getKernel("reduce",k,err))
+			return Error;
+		_reduceKernels[op].reset(k);
+	}
+
+	//Partial result per work group of the first pass - No more groups than single group reduces in the second pass
+	_partials.reset(new CLBuffer(_context,_workgroupSize * sizeof(struct AABB),CLBufferFlags::ReadWrite));
+
+	return Success;
+}
+
+/**Reduces device array
+ * The reduction is enqueued without waiting for completion - Commands enqueued afterwards,
+ * including blocking reads, see the result
+ * @param input Device array of items of the operator type
+ * @param count Number of items in the array
+ * @param op The operator
+ * @param output Device buffer, that will contain the result
+ * @param outputOffset Offset of the result in the output buffer, in bytes - Must be aligned to the result type
+ * @param [out]err Error info, filled in case there is an error
+ * @return Result, that indicates whether the operation succeeded or failed
+ **/
+Result Reduction::reduce(cl_mem input,CL_UINT count,Operator op,cl_mem output,CL_UINT outputOffset,Errata& err)
+{
+	//Each work item accumulates items strided by the global size, so the number of groups is bounded
+	//by the size of the second pass rather than by the number of items
+	CL_UINT groups = (CL_UINT)min((count + _workgroupSize - 1) / _workgroupSize,_workgroupSize);
+
+	//Small arrays are reduced by single work group, directly into the output
+	if (groups <= 1)
+		return launchKernel(op,input,count,output,outputOffset,1,err);
+
+	if (Success != launchKernel(op,input,count,_partials->getCLMem(),0,groups,err))
+		return Error;
+
+	//The queue is in order, so the partials are complete before the second pass
+	return launchKernel(PartialsOperators[op],_partials->getCLMem(),groups,output,outputOffset,1,err);
+}
+
+/**Launches reduction kernel of an operator - Each work group writes its result at index of the group
+ * @param op The operator
+ * @param input Device array of items of the operator type
+ * @param count Number of items in the array
+ * @param output Device buffer, that will contain the results of the work groups
+ * @param outputOffset Offset of the results in the output buffer, in bytes
+ * @param groups Number of work groups to launch
+ * @param [out]err Error info, filled in case there is an error
+ * @return Result, that indicates whether the operation succeeded or failed
+ **/
+Result Reduction::launchKernel(Operator op,cl_mem input,CL_UINT count,cl_mem output,CL_UINT outputOffset,CL_UINT groups,Errata& err)
+{
+	CLKernel& kernel = *_reduceKernels[op];
+	try
+	{
+		SET_KERNEL_ARGS(kernel,input,count,output,outputOffset);
+	}
+	catch (CLInterfaceException e)
+	{
+		err = Errata(e);
+		return Error;
+	}
+
+	CLKernelWorkDimension localDim(1,_workgroupSize);
+	CLKernelWorkDimension globalDim(1,groups * _workgroupSize);
+	CLKernelExecuteParams execParams(&globalDim,&localDim,NULL);
+	if (Success != _context.enqueueKernel(kernel,execParams,err))
+		return Error;
+
+	return _context.flushQueue(err);
+}
@@ -0,0 +1,117 @@
+/**
+ * @file ReductionKernels.cl
+ * @author  Timur Sizov <timorgizer@gmail.com>
+ * @version 0.6
+ *
+ * @section LICENSE
+ *
+ * Copyright (c) 2016 Timur Sizov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software 
+ * without restriction, including without limitation the rights to use, copy, modify, merge, 
+ * publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons 
+ * to whom the Software is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE 
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * @section DESCRIPTION
+ *
+ * Kernel of parallel reduction - Host interface class: Reduction
+ * The following defines are given by the host: REDUCE_WORKGROUP_SIZE - Work group size, power of two,
+ * and one of the operators: REDUCE_MIN_FLOAT4, REDUCE_MAX_FLOAT4, REDUCE_MERGE_AABB, REDUCE_SUM_UINT,
+ * REDUCE_SUM_FLOAT, REDUCE_COUNT_NONZERO - See Reduction::Operator
+ * 
+ */
+#include "CLData\Primitives\AABB.h"
+
+#if defined(REDUCE_MIN_FLOAT4)
+typedef float4 input_t;
+typedef float4 data_t;
+#define IDENTITY ((float4)(FLT_MAX))
+#define LOAD(item) (item)
+#define COMBINE(a,b) min(a,b)
+#elif defined(REDUCE_MAX_FLOAT4)
+typedef float4 input_t;
+typedef float4 data_t;
+#define IDENTITY ((float4)(-FLT_MAX))
+#define LOAD(item) (item)
+#define COMBINE(a,b) max(a,b)
+#elif defined(REDUCE_MERGE_AABB)
+typedef struct AABB input_t;
+typedef struct AABB data_t;
+#define IDENTITY emptyAABB()
+#define LOAD(item) (item)
+#define COMBINE(a,b) merge(a,b)
+#elif defined(REDUCE_SUM_UINT)
+typedef uint input_t;
+typedef uint data_t;
+#define IDENTITY 0
+#define LOAD(item) (item)
+#define COMBINE(a,b) ((a) + (b))
+#elif defined(REDUCE_SUM_FLOAT)
+typedef float input_t;
+typedef float data_t;
+#define IDENTITY 0.0f
+#define LOAD(item) (item)
+#define COMBINE(a,b) ((a) + (b))
+#elif defined(REDUCE_COUNT_NONZERO)
+typedef uint input_t;
+typedef uint data_t;
+#define IDENTITY 0
+#define LOAD(item) ((item) != 0 ? 1 : 0)
+#define COMBINE(a,b) ((a) + (b))
+#endif
+
+/**
+* Empty box - The identity of box union
+* @return Box with min bounds at FLT_MAX and max bounds at -FLT_MAX
+*/
+inline struct AABB emptyAABB()
+{
+	struct AABB result;
+	result.bounds[0] = (float4)(FLT_MAX);
+	result.bounds[1] = (float4)(-FLT_MAX);
+	return result;
+}
+
+/**
+* Reduces an array of any size: Each work item accumulates the items strided by the global size, which keeps
+* the reads coalesced, then the work group reduces the accumulated values in local memory
+* @param input Input array
+* @param count Number of items in the array
+* @param output Output buffer - Result of the work group is stored at index of the group
+* @param outputOffset Offset of the results in the output buffer, in bytes
+*/
+__kernel void reduce(__global const input_t* input,
+					 const uint count,
+					 __global char* output,
+					 const uint outputOffset)
+{
+	__local data_t scratch[REDUCE_WORKGROUP_SIZE];
+	uint lid = get_local_id(0);
+
+	//1. Sequential reduction of the items of the work item
+	data_t acc = IDENTITY;
+	for (uint i = get_global_id(0); i < count; i += get_global_size(0))
+		acc = COMBINE(acc,LOAD(input[i]));
+	scratch[lid] = acc;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	//2. Tree reduction in local memory
+	for (uint stride = REDUCE_WORKGROUP_SIZE >> 1; stride > 0; stride >>= 1)
+	{
+		if (lid < stride)
+			scratch[lid] = COMBINE(scratch[lid],scratch[lid + stride]);
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (lid == 0)
+		((__global data_t*)(output + outputOffset))[get_group_id(0)] = scratch[0];
+}
@@ -450,8 +450,8 @@ Result Scene::load(const char* filename,Errata& err)
 */
 Result Scene::loadToGPU(const OpenCLUtils::CLExecutionContext& context,Errata& err)
 {
-	//Transferring scene buffer to GPU
-	_deviceSceneData.reset(new OpenCLUtils::CLBuffer(context,_sceneDataSize,_hostSceneData,OpenCLUtils::CLBufferFlags::ReadOnly));
+	//Transferring scene buffer to GPU - Writable, since the header bounds are recomputed on device by GPU rebuilds
+	_deviceSceneData.reset(new OpenCLUtils::CLBuffer(context,_sceneDataSize,_hostSceneData,OpenCLUtils::CLBufferFlags::ReadWrite));
 	return Success;
 }
 
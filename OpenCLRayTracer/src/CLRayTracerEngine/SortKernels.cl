@@ -199,7 +199,8 @@ __kernel void ParallelBitonic_Local_Optim(__global const data_t * in,__global da
   // Loop on sorted sequence length
   for (int length=1;length<wg;length<<=1)
   {
-    bool direction = ((i & (length<<1)) != 0); // direction of sort: 0=asc, 1=desc
+    // direction of sort: 0=asc, 1=desc - by global index, so that blocks alternate for the following global merges
+    bool direction = (((offset + i) & (length<<1)) != 0);
     // Loop on comparison distance (between keys)
     for (int inc=length;inc>0;inc>>=1)
     {
@@ -504,8 +505,8 @@ __kernel void ParallelBitonic_C4(__global data_t * data,int inc0,int dir,__local
   for (int k=0;k<4;k++) aux[(i+k*inc) & wgBits] = x[k];
   barrier(CLK_LOCAL_MEM_FENCE);
 
-  // Internal iterations, local input and output
-  for ( ;inc>1;inc>>=2)
+  // Internal iterations, local input and output - The first one follows the stages done above
+  for (inc>>=2;inc>1;inc>>=2)
   {
     low = t & (inc - 1); // low order bits (below INC)
     i = ((t - low) << 2) + low; // insert 00 at position INC
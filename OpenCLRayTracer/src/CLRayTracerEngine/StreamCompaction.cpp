@@ -0,0 +1,191 @@
+/**
+ * @file StreamCompaction.cpp
+ * @author  Timur Sizov <timorgizer@gmail.com>
+ * @version 0.6
+ *
+ * @section LICENSE
+ *
+ * Copyright (c) 2016 Timur Sizov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software 
+ * without restriction, including without limitation the rights to use, copy, modify, merge, 
+ * publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons 
+ * to whom the Software is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE 
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * @section DESCRIPTION
+ *
+ * class StreamCompaction - The implementation file - Host interface class for GPU stream compaction
+ * 
+ */
+
+#include <Algorithms\StreamCompaction.h>
+#include <Algorithms\PrefixSum.h>
+#include <OpenCLUtils\CLExecutionContext.h>
+#include <OpenCLUtils\CLBuffer.h>
+#include <CLData\CLStructs.h>
+#include <CLData\RTKernelUtils.h>
+#include <Common\Deployment.h>
+
+using namespace std;
+using namespace CLRayTracer;
+using namespace CLRayTracer::OpenCLUtils;
+using namespace CLRayTracer::Common;
+
+/**String that contains the kernel source*/
+extern const char * StreamCompactionKernelSource;
+
+/**Constructor*/
+StreamCompaction::StreamCompaction(const CLExecutionContext& context):_context(context)
+{
+	_deviceProcessors = 0;
+	_deviceWavefront = 0;
+	_prefixSumCalculator.reset(new PrefixSum(context));
+}
+
+/**Initializes the instance of StreamCompaction
+ * @param [out]err Error info, filled in case there is an error
+ * @return Result, that indicates whether the operation succeeded or failed
+ */
+Result StreamCompaction::initialize(Errata& err)
+{
+	if (Success != _prefixSumCalculator->initialize(err))
+		return Error;
+
+	//Create and compile CL program
+	_compactionProgram.reset(new CLProgram(_context));
+	if (Success != _compactionProgram->compile(StreamCompactionKernelSource,"-I " + Deployment::CLHeadersPath,err))
+		return Error;
+
+	CLKernel *k = NULL;
+	if (Success != _compactionProgram->getKernel("flagActiveRays",k,err))
+		return Error;
+	_flagActiveRaysKernel.reset(k);
+
+	if (Success != _compactionProgram->getKernel("scatterFlaggedIndices",k,err))
+		return Error;
+	_scatterKernel.reset(k);
+
+	if (Success != _context.getMaximalLaunchExecParams(*_scatterKernel,_deviceProcessors,_deviceWavefront,err))
+		return Error;
+
+	return Success;
+}
+
+/**Flags the active rays: Rays with nonempty parameter range (tMin < tMax)
+ * @param rays Device array of rays (struct Ray)
+ * @param rayCount Number of rays in the array
+ * @param flags Device array of CL_UINT flags, that will contain 1 for active rays, and 0 for the rest
+ * @param [out]err Error info, filled in case there is an error
+ * @return Result, that indicates whether the operation succeeded or failed
+ **/
+Result StreamCompaction::flagActiveRays(cl_mem rays,CL_UINT rayCount,cl_mem flags,Errata& err)
+{
+	try
+	{
+		SET_KERNEL_ARGS((*_flagActiveRaysKernel),rays,rayCount,flags);
+	}
+	catch (CLInterfaceException e)
+	{
+		err = Errata(e);
+		return Error;
+	}
+	return launchKernel(*_flagActiveRaysKernel,rayCount,err);
+}
+
+/**Compacts the indices of the flagged items
+ * @param flags Device array of CL_UINT flags - 1 for the items to keep, 0 for the rest
+ * @param count Number of flags
+ * @param indices Device array of CL_UINT, at least count long, that will contain the indices of the flagged items
+ * @param compactedCount Device CL_UINT, that will contain the number of flagged items
+ * @param [out]err Error info, filled in case there is an error
+ * @return Result, that indicates whether the operation succeeded or failed
+ **/
+Result StreamCompaction::compactIndices(cl_mem flags,CL_UINT count,cl_mem indices,cl_mem compactedCount,Errata& err)
+{
+	if (count == 0)
+	{
+		CL_UINT zero = 0;
+		return _context.enqueueFillBuffer(compactedCount,&zero,sizeof(CL_UINT),sizeof(CL_UINT),err);
+	}
+
+	if (_offsets)
+		_offsets->resize(count * sizeof(CL_UINT));
+	else
+		_offsets.reset(new CLBuffer(_context,count * sizeof(CL_UINT),CLBufferFlags::ReadWrite));
+
+	//1. Offsets of flagged items in the list
+	if (Success != _prefixSumCalculator->computePrefixSum(flags,_offsets->getCLMem(),count,PrefixSum::Exclusive,PrefixSum::UIntItems,err))
+		return Error;
+
+	//2. Scatter the indices
+	try
+	{
+		SET_KERNEL_ARGS((*_scatterKernel),flags,_offsets->getCLMem(),count,indices,compactedCount);
+	}
+	catch (CLInterfaceException e)
+	{
+		err = Errata(e);
+		return Error;
+	}
+	return launchKernel(*_scatterKernel,count,err);
+}
+
+/**Compacts the indices of the active rays - See flagActiveRays and compactIndices
+ * @param rays Device array of rays (struct Ray)
+ * @param rayCount Number of rays in the array
+ * @param indices Device array of CL_UINT, at least rayCount long, that will contain the indices of active rays
+ * @param activeRayCount Device CL_UINT, that will contain the number of active rays
+ * @param [out]err Error info, filled in case there is an error
+ * @return Result, that indicates whether the operation succeeded or failed
+ **/
+Result StreamCompaction::compactActiveRays(cl_mem rays,CL_UINT rayCount,cl_mem indices,cl_mem activeRayCount,Errata& err)
+{
+	//Memory is allocated on first use, and grows with the ray batches
+	size_t flagsSize = max(rayCount,(CL_UINT)1) * sizeof(CL_UINT);
+	if (_flags)
+		_flags->resize(flagsSize);
+	else
+		_flags.reset(new CLBuffer(_context,flagsSize,CLBufferFlags::ReadWrite));
+
+	if (rayCount > 0 && Success != flagActiveRays(rays,rayCount,_flags->getCLMem(),err))
+		return Error;
+
+	return compactIndices(_flags->getCLMem(),rayCount,indices,activeRayCount,err);
+}
+
+/**Launches one of the kernels of stream compaction with a work item per item, and waits for completion
+ * @param kernel The kernel to launch - Its arguments must be already set
+ * @param workItems Number of items to process
+ * @param [out]err Error info, filled in case there is an error
+ * @return Result, that indicates whether the operation succeeded or failed
+ **/
+Result StreamCompaction::launchKernel(CLKernel& kernel,CL_UINT workItems,Errata& err)
+{
+	CLEvent evt;
+	evt.reset();
+	CLKernelWorkDimension globalDim(1,closestMultipleTo(workItems,_deviceWavefront));
+	CLKernelWorkDimension localDim(1,_deviceWavefront);
+	CLKernelExecuteParams execParams(&globalDim,&localDim,&evt);
+
+	//Execute kernel
+	if (Success != _context.enqueueKernel(kernel,execParams,err))
+		return Error;
+
+	//Flush and make sure that calculation is over before returning control
+	if (Success != _context.flushQueue(err))
+		return Error;
+
+	if (Success != evt.wait(err))
+		return Error;
+
+	return Success;
+}
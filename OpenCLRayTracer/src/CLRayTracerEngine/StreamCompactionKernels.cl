@@ -0,0 +1,66 @@
+/**
+ * @file StreamCompactionKernels.cl
+ * @author  Timur Sizov <timorgizer@gmail.com>
+ * @version 0.6
+ *
+ * @section LICENSE
+ *
+ * Copyright (c) 2016 Timur Sizov
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software 
+ * without restriction, including without limitation the rights to use, copy, modify, merge, 
+ * publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons 
+ * to whom the Software is furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, 
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE 
+ * AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * @section DESCRIPTION
+ *
+ * Kernel functions for stream compaction: Items are flagged by a predicate, the flags are scanned by PrefixSum,
+ * and the indices of the flagged items are scattered to a dense list.
+ * 
+ */
+
+#include "CLData\CLStructs.h"
+
+/*****************************************************
+ * 1. Flags the rays with nonempty parameter range
+ ******************************************************/
+__kernel void flagActiveRays(CL_GLOBAL const struct Ray* rays,
+							 uint rayCount,
+							 CL_GLOBAL CL_UINT* flags)
+{
+	uint idx = get_global_id(0);
+	if (idx < rayCount)
+		flags[idx] = (rays[idx].tMin < rays[idx].tMax) ? 1 : 0;
+}
+
+/*****************************************************
+ * 2. Scatters indices of flagged items to their offsets
+ *    - The exclusive prefix sum of the flags.
+ *    The last item writes the number of flagged items
+ ******************************************************/
+__kernel void scatterFlaggedIndices(CL_GLOBAL const CL_UINT* flags,
+									CL_GLOBAL const CL_UINT* offsets,
+									uint count,
+									CL_GLOBAL CL_UINT* indices,
+									CL_GLOBAL CL_UINT* compactedCount)
+{
+	uint idx = get_global_id(0);
+	if (idx < count)
+	{
+		CL_UINT flag = flags[idx];
+		CL_UINT offset = offsets[idx];
+		if (flag)
+			indices[offset] = idx;
+		if (idx == count - 1)
+			*compactedCount = offset + flag;
+	}
+}
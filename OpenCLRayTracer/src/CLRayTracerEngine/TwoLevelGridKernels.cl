@@ -38,204 +38,175 @@
 
 
  /*****************************************************
- * 1. Counts top level pairs
+ * 1. Counts top level pairs per cell
  ******************************************************/
-__kernel void prepareDataKernel(CL_GLOBAL char* scene, 
+__kernel void countCellPairsKernel(CL_GLOBAL char* scene, 
 						  CL_CONSTANT struct GridData* grid,
-						  CL_GLOBAL CL_UINT* counters)
+						  CL_GLOBAL CL_UINT* counters,
+						  CL_UINT exactOverlap)
 {
 	uint currentIdx = get_global_id(0);
-	uint tris = SCENE_HEADER(scene)->totalNumberOfTriangles-1;
+	uint tris = SCENE_HEADER(scene)->totalNumberOfTriangles;
 	if (currentIdx < tris)
-		prepareGridData(scene,currentIdx,grid,counters);
+		binTriangleToCells(scene,currentIdx,grid,counters,counters,0,0,false,exactOverlap != 0);
 }
 
 /*****************************************************
- * 2. Generates top level pairs
+ * 2. Writes top level cell ranges from counts and their
+ *    prefix sum. Ranges array has an extra empty range
+ *    past the last cell
  ******************************************************/
-__kernel void writePairsKernel(CL_GLOBAL char* scene, 
-					     CL_CONSTANT struct GridData* grid,
-					     CL_GLOBAL CL_UINT* prefixSum,
-					     CL_GLOBAL CL_UINT* counters,
-					     CL_GLOBAL CL_UINT2* pairs)
+__kernel void writeCellRangesKernel(CL_GLOBAL CL_UINT* counters,
+									CL_GLOBAL CL_UINT* prefixSum,
+									CL_GLOBAL CL_UINT2* cellRanges,
+									CL_UINT cellsCount,
+									CL_UINT pairsCapacity)
 {
 	uint currentIdx = get_global_id(0);
-	uint tris = SCENE_HEADER(scene)->totalNumberOfTriangles-1;
-	if (currentIdx < tris)
-		writePairs(scene,currentIdx,grid,prefixSum,counters,pairs);
+	if (currentIdx < cellsCount)
+		writeCellRange(counters,prefixSum,cellRanges,currentIdx,pairsCapacity);
+	else if (currentIdx == cellsCount)
+		cellRanges[currentIdx] = (CL_UINT2)(0,0);
 }
 
 /*****************************************************
- * 3. Extracts ranges in sorted pairs array
+ * 3. Scatters top level pairs into cell ranges
  ******************************************************/
-__kernel void extractCellRangesKernel(CL_GLOBAL CL_UINT2* sortedPairs,
-						         CL_UINT sortedPairsCount,
-						         CL_GLOBAL CL_UINT2* cellRanges,
-								 CL_LOCAL CL_UINT2* localBuf,
-						         CL_UINT workingBlock)
+__kernel void scatterCellPairsKernel(CL_GLOBAL char* scene, 
+					     CL_CONSTANT struct GridData* grid,
+					     CL_GLOBAL CL_UINT* prefixSum,
+					     CL_GLOBAL CL_UINT* counters,
+					     CL_GLOBAL CL_UINT2* pairs,
+						 CL_UINT pairsCapacity,
+						 CL_UINT exactOverlap)
 {
-	const uint batchSize = workingBlock;
-	const uint batches = ceil((float)sortedPairsCount / (float)batchSize);
-	
-	uint maxGlobalIdx = sortedPairsCount - 1;
-	uint currentLocalIdx = get_global_id(0);
-	uint nextLocalIdx;
-	long currentGlobalIdx;
-	uint nextGlobalIdx;
-	for(int i = 0; i < batches; i++)
-	{
-		//load pairs to shared memory
-		nextLocalIdx = currentLocalIdx + 1;
-		currentGlobalIdx = i * workingBlock + currentLocalIdx;
-		nextGlobalIdx = currentGlobalIdx + 1;
-		if (currentGlobalIdx <= maxGlobalIdx)
-		{
-			localBuf[currentLocalIdx] = sortedPairs[currentGlobalIdx];
-			if (currentLocalIdx == workingBlock - 1 && nextGlobalIdx <=maxGlobalIdx) //Last thread writes additional
-				localBuf[nextLocalIdx] = sortedPairs[nextGlobalIdx];
-		}
-		//Synchronize the local memory
-		barrier(CLK_LOCAL_MEM_FENCE);
-		if (currentGlobalIdx <= maxGlobalIdx && currentLocalIdx < batchSize)
-		{
-			uint right = localBuf[nextLocalIdx].x;
-			uint thisOne = localBuf[currentLocalIdx].x;
-			if (right > thisOne)
-			{ 
-				cellRanges[thisOne].y = nextGlobalIdx;
-				cellRanges[right].x = nextGlobalIdx;
-			}
-		}
-	}
-
-	//Post-processing for last index - Closing last pair
-	if (currentGlobalIdx == maxGlobalIdx)
-	{
-		cellRanges[sortedPairs[currentGlobalIdx].x].y = currentGlobalIdx;
-	}
+	uint currentIdx = get_global_id(0);
+	uint tris = SCENE_HEADER(scene)->totalNumberOfTriangles;
+	if (currentIdx < tris)
+		binTriangleToCells(scene,currentIdx,grid,counters,prefixSum,pairs,pairsCapacity,true,exactOverlap != 0);
 }
 
 /*****************************************************
  * 4. Counts leaf cells
+ *    Counts are stored per top level cell in leafCounts
  ******************************************************/
-__kernel void countLeavesAndFillCellKernel(CL_GLOBAL CL_UINT2* range, CL_GLOBAL CL_UINT* counters,
- CL_GLOBAL struct TopLevelCell* cells, CL_UINT cellsCount,CL_CONSTANT struct GridData* grid)
+__kernel void countLeavesAndFillCellKernel(CL_GLOBAL CL_UINT2* range, CL_GLOBAL CL_UINT* leafCounts,
+ CL_GLOBAL struct TopLevelCell* cells, CL_UINT cellsCount,CL_CONSTANT struct GridData* grid,
+ CL_GLOBAL const char* scene, CL_GLOBAL const CL_UINT2* pairs, CL_GLOBAL const CL_UINT* buildCounts,
+ CL_UINT adaptive, CL_UINT leafCellsBudget)
 {
 	if (get_global_id(0) < cellsCount)
-		fillTopLevelCell(range,counters,cells,grid,get_global_id(0));
+		fillTopLevelCell(range,leafCounts,cells,grid,get_global_id(0),
+						 scene,pairs,buildCounts[BUILD_COUNT_PAIRS],adaptive != 0,leafCellsBudget);
 }
 
 
 /*****************************************************
  * 5. Update top leaf cell with beginning of its range
+ *    Cells whose leaves do not fit into leaf capacity
+ *    are redirected to the empty range past the capacity
  ******************************************************/
 __kernel void updateTopLevelCellsWithLeafRange(CL_GLOBAL struct TopLevelCell* topLevelCells,
 											   CL_GLOBAL CL_UINT* leafCountsPerCell,
-											   CL_UINT cellCount)
+											   CL_UINT cellCount,
+											   CL_UINT leafCellsCapacity)
 {
 	CL_UINT idx = get_global_id(0);
-	if (idx > 0)
-		topLevelCells[idx].firstLeafIdx = leafCountsPerCell[idx-1];
+	if (idx < cellCount)
+	{
+		struct TopLevelCell cell = topLevelCells[idx];
+		cell.firstLeafIdx = idx > 0 ? leafCountsPerCell[idx-1] : 0;
+		if (cell.firstLeafIdx + getCellCount(cell.resX,cell.resY,cell.resZ) > leafCellsCapacity)
+		{
+			cell.resX = cell.resY = cell.resZ = 1;
+			cell.firstLeafIdx = leafCellsCapacity;
+		}
+		topLevelCells[idx] = cell;
+	}
 }
 
 /*****************************************************
- * 6. Count leaf pairs
+ * 6. Count leaf pairs per leaf cell
  ******************************************************/
-__kernel void prepareGridDataForLeaves(CL_GLOBAL const char* scene, 
+__kernel void countLeafPairsKernel(CL_GLOBAL const char* scene, 
 									   CL_GLOBAL CL_UINT2* topLevelPairs,
-									   CL_UINT topLevelPairsCount,
+									   CL_UINT topLevelPairsCapacity,
 									   CL_CONSTANT struct GridData* grid,
 									   CL_GLOBAL struct TopLevelCell* topLevelCells,
-									   CL_GLOBAL CL_UINT* counters)
+									   CL_GLOBAL CL_UINT* counters,
+									   CL_GLOBAL CL_UINT* buildCounts,
+									   CL_UINT leafCellsCapacity)
 {
 	CL_UINT idx = get_global_id(0); 
-	if (idx < topLevelPairsCount)
-		counters[idx] = countLeafPairs(scene,topLevelPairs,idx,grid,topLevelCells);
-	else
-		counters[idx] = 0;
+	if (idx < min(buildCounts[BUILD_COUNT_PAIRS],topLevelPairsCapacity))
+		binPairToLeafCells(scene,topLevelPairs,idx,grid,topLevelCells,counters,counters,0,leafCellsCapacity,0,false);
 }
 
 
 /*****************************************************
- * 7. Write leaf pairs
+ * 6a. Writes beginnings of leaf cell ranges from prefix
+ *     sum of counts - Up to the count of leaf cells, and
+ *     past the empty leaf cell past the last cell
+ ******************************************************/
+__kernel void writeLeafRangesKernel(CL_GLOBAL CL_UINT* prefixSum,
+									CL_GLOBAL CL_UINT* leafRanges,
+									CL_UINT leafCellsCount,
+									CL_UINT referencesCapacity)
+{
+	uint currentIdx = get_global_id(0);
+	if (currentIdx <= leafCellsCount + 1)
+		writeLeafRange(prefixSum,leafRanges,currentIdx,referencesCapacity);
+}
+
+/*****************************************************
+ * 7. Scatter leaf pairs into leaf cell ranges
+ *    Only triangle index of a pair is stored
  ******************************************************/
-__kernel void writeLeafPairsKernel(CL_GLOBAL const char* scene,
+__kernel void scatterLeafPairsKernel(CL_GLOBAL const char* scene,
 						   CL_GLOBAL CL_UINT2* topLevelPairs,
 						   CL_GLOBAL struct TopLevelCell* topLevelCells,
 					       CL_CONSTANT struct GridData* grid,
 					       CL_GLOBAL CL_UINT* prefixSum,
 					       CL_GLOBAL CL_UINT* counters,
-					       CL_GLOBAL CL_UINT2* pairs,
-						   CL_UINT pairCount)
+					       CL_GLOBAL CL_UINT* pairs,
+						   CL_UINT topLevelPairsCapacity,
+						   CL_GLOBAL CL_UINT* buildCounts,
+						   CL_UINT leafCellsCapacity,
+						   CL_UINT pairsCapacity)
 {
 	uint idx = get_global_id(0);
-	if(idx < pairCount)
-		writeLeafPairs(scene,topLevelPairs,topLevelCells,idx,grid,prefixSum,counters,pairs);
+	if(idx < min(buildCounts[BUILD_COUNT_PAIRS],topLevelPairsCapacity))
+		binPairToLeafCells(scene,topLevelPairs,idx,grid,topLevelCells,counters,prefixSum,pairs,leafCellsCapacity,pairsCapacity,true);
 }
 
 /*****************************************************
- * 8. Extract ranges for leaf cells
+ * 7a. Store a count calculated on device - The last
+ *     element of inclusive prefix sum
  ******************************************************/
-__kernel void extractLeafCellsKernel(CL_GLOBAL CL_UINT2* sortedLeafPairs,
-						   CL_UINT sortedLeafPairsCount,
-						   CL_GLOBAL CL_UINT2* leafCellRanges,
-						   CL_LOCAL CL_UINT2* localBuf)
+__kernel void storeBuildCountKernel(CL_GLOBAL CL_UINT* prefixSum,
+									CL_UINT lastIdx,
+									CL_GLOBAL CL_UINT* buildCounts,
+									CL_UINT countIdx)
 {
-	const uint batchSize = get_local_size(0);
-	const uint batches = ceil((float)get_global_size(0) / (float)batchSize);
-	
-	uint maxGlobalIdx = sortedLeafPairsCount - 1;
-	uint currentLocalIdx = get_global_id(0);
-	uint nextLocalIdx;
-	long currentGlobalIdx;
-	uint nextGlobalIdx;
-	for(int i = 0; i < batches; i++)
-	{
-		//load pairs to shared memory
-		nextLocalIdx = currentLocalIdx + 1;
-		currentGlobalIdx = i * batchSize + currentLocalIdx;
-		nextGlobalIdx = currentGlobalIdx + 1;
-		if (currentGlobalIdx <= maxGlobalIdx)
-		{
-			localBuf[currentLocalIdx] = sortedLeafPairs[currentGlobalIdx];
-			if (currentLocalIdx == batchSize - 1 && nextGlobalIdx <=maxGlobalIdx) //Last thread writes additional
-				localBuf[nextLocalIdx] = sortedLeafPairs[nextGlobalIdx];
-		}
-		//Synchronize the local memory
-		barrier(CLK_LOCAL_MEM_FENCE);
-		if (currentGlobalIdx <= maxGlobalIdx && currentLocalIdx < batchSize)
-		{
-			uint right = localBuf[nextLocalIdx].x;
-			uint thisOne = localBuf[currentLocalIdx].x;
-			if (right > thisOne)
-			{ 
-				leafCellRanges[thisOne].y = nextGlobalIdx;
-				leafCellRanges[right].x = nextGlobalIdx;
-			}
-		}
-	}
-
-	//Post-processing for last index - Closing last pair
-	if (currentGlobalIdx == maxGlobalIdx)
-		leafCellRanges[sortedLeafPairs[currentGlobalIdx].x].y = currentGlobalIdx;
+	if (get_global_id(0) == 0)
+		buildCounts[countIdx] = prefixSum[lastIdx];
 }
 
 
 /*****************************************************
- * 9. Generate contacts for viewing rays
+ * 8. Generate contacts for viewing rays
  ******************************************************/
 __kernel __attribute__((work_group_size_hint(1, 1, 64)))
  void generateContactsKernel(CL_CONSTANT struct Camera* camera,
 									 CL_GLOBAL char* scene,
 									 CL_CONSTANT struct GridData* gridData,
 									 CL_GLOBAL struct TopLevelCell* topLevelCells,
-									 CL_GLOBAL CL_UINT2* leavesArray,
-									 CL_GLOBAL CL_UINT2* pairsRefArray,
+									 CL_GLOBAL CL_UINT* leavesArray,
+									 CL_GLOBAL CL_UINT* pairsRefArray,
 									 CL_GLOBAL struct Contact* output)
 {
-	const CL_UINT maxRays = camera->resX * camera->resY;
-	const CL_UINT myIdx = get_global_id(0);
-	if (myIdx < maxRays)
+	const CL_UINT myIdx = tiledPixelIndex(camera,get_global_id(0));
+	if (myIdx != UINT_MAX)
 	{
 			const struct Ray ray = generateRay(camera,myIdx);
 			struct Contact result = tlg_generate_contact(ray,scene,gridData,topLevelCells,leavesArray,pairsRefArray);
@@ -253,8 +224,8 @@ __kernel __attribute__((work_group_size_hint(1, 1, 64)))
 									 CL_GLOBAL char* scene,
 									 CL_CONSTANT struct GridData* gridData,
 									 CL_GLOBAL struct TopLevelCell* topLevelCells,
-									 CL_GLOBAL CL_UINT2* leavesArray,
-									 CL_GLOBAL CL_UINT2* pairsRefArray,
+									 CL_GLOBAL CL_UINT* leavesArray,
+									 CL_GLOBAL CL_UINT* pairsRefArray,
 									 CL_GLOBAL struct Contact* output)
 {
 	const CL_UINT myIdx = get_global_id(0);
@@ -266,16 +237,258 @@ __kernel __attribute__((work_group_size_hint(1, 1, 64)))
 	} 
 }
 
+/*****************************************************
+ * 9a. Generate contacts for active rays of index list
+ *     - The count is read on device
+ ******************************************************/
+__kernel __attribute__((work_group_size_hint(1, 1, 64)))
+ void generateContactsIndexedKernel(CL_GLOBAL struct Ray* rays,
+									 CL_GLOBAL const CL_UINT* activeRays,
+									 CL_GLOBAL const CL_UINT* activeRayCount,
+									 CL_GLOBAL char* scene,
+									 CL_CONSTANT struct GridData* gridData,
+									 CL_GLOBAL struct TopLevelCell* topLevelCells,
+									 CL_GLOBAL CL_UINT* leavesArray,
+									 CL_GLOBAL CL_UINT* pairsRefArray,
+									 CL_GLOBAL struct Contact* output)
+{
+	if (get_global_id(0) < *activeRayCount)
+	{
+		const CL_UINT rayIdx = activeRays[get_global_id(0)];
+		struct Contact result = tlg_generate_contact(rays[rayIdx],scene,gridData,topLevelCells,leavesArray,pairsRefArray);
+		result.pixelIndex = rayIdx;
+		output[rayIdx] = result;
+	} 
+}
 
 
+/*****************************************************
+ * Incremental update
+ * 10. Store the range of top level cells overlapped
+ *     by each triangle, after full build
+ ******************************************************/
+__kernel void storeTriangleCellRangesKernel(CL_GLOBAL const char* scene,
+											CL_CONSTANT struct GridData* grid,
+											CL_GLOBAL CL_UINT2* triangleCellRanges)
+{
+	CL_UINT idx = get_global_id(0);
+	if (idx < SCENE_HEADER(scene)->totalNumberOfTriangles)
+	{
+		CL_UINT3 triangleRef = getTriangleRefByIndex(scene,idx);
+		CL_GLOBAL char* submesh = getMeshAtIndex(triangleRef.y,getModelAtIndex(triangleRef.x,scene));
+		CL_UINT baseIndex = triangleRef.z * 3;
+		CL_UINT3 first, last;
+		getTriangleCellRange(getVertexAt(getIndexAt(baseIndex,submesh),submesh),
+							 getVertexAt(getIndexAt(baseIndex + 1,submesh),submesh),
+							 getVertexAt(getIndexAt(baseIndex + 2,submesh),submesh),
+							 grid,&first,&last);
+		triangleCellRanges[idx] = (CL_UINT2)(getCellIndex(first.x,first.y,first.z,grid->resX,grid->resY,grid->resZ),
+											 getCellIndex(last.x,last.y,last.z,grid->resX,grid->resY,grid->resZ));
+	}
+}
 
+/*****************************************************
+ * 11. Set or clear flags of changed triangles
+ ******************************************************/
+__kernel void markChangedTrianglesKernel(CL_GLOBAL const CL_UINT* changedTriangles,
+										 CL_UINT changedCount,
+										 CL_GLOBAL CL_UINT* changedFlags,
+										 CL_UINT value)
+{
+	CL_UINT idx = get_global_id(0);
+	if (idx < changedCount)
+		changedFlags[changedTriangles[idx]] = value;
+}
 
+/*****************************************************
+ * 12. Collect top level cells overlapped by old and
+ *     new bounds of changed triangles
+ ******************************************************/
+__kernel void collectAffectedCellsKernel(CL_GLOBAL const char* scene,
+										 CL_CONSTANT struct GridData* grid,
+										 CL_GLOBAL const CL_UINT* changedTriangles,
+										 CL_UINT changedCount,
+										 CL_GLOBAL CL_UINT2* triangleCellRanges,
+										 CL_GLOBAL CL_UINT* affectedFlags,
+										 CL_GLOBAL CL_UINT* affectedCells,
+										 CL_GLOBAL CL_UINT* updateCounts)
+{
+	CL_UINT idx = get_global_id(0);
+	if (idx < changedCount)
+	{
+		CL_UINT triangle = changedTriangles[idx];
+		collectAffectedCells(triangleCellRanges[triangle],grid,affectedFlags,affectedCells,updateCounts);
+		CL_UINT3 triangleRef = getTriangleRefByIndex(scene,triangle);
+		CL_GLOBAL char* submesh = getMeshAtIndex(triangleRef.y,getModelAtIndex(triangleRef.x,scene));
+		CL_UINT baseIndex = triangleRef.z * 3;
+		CL_UINT3 first, last;
+		getTriangleCellRange(getVertexAt(getIndexAt(baseIndex,submesh),submesh),
+							 getVertexAt(getIndexAt(baseIndex + 1,submesh),submesh),
+							 getVertexAt(getIndexAt(baseIndex + 2,submesh),submesh),
+							 grid,&first,&last);
+		CL_UINT2 newRange = (CL_UINT2)(getCellIndex(first.x,first.y,first.z,grid->resX,grid->resY,grid->resZ),
+									   getCellIndex(last.x,last.y,last.z,grid->resX,grid->resY,grid->resZ));
+		collectAffectedCells(newRange,grid,affectedFlags,affectedCells,updateCounts);
+		triangleCellRanges[triangle] = newRange;
+	}
+}
 
+/*****************************************************
+ * 13. Count top level pairs of changed triangles
+ ******************************************************/
+__kernel void countChangedTrianglePairsKernel(CL_GLOBAL const char* scene,
+											  CL_CONSTANT struct GridData* grid,
+											  CL_GLOBAL const CL_UINT* changedTriangles,
+											  CL_UINT changedCount,
+											  CL_GLOBAL CL_UINT* counters,
+											  CL_UINT exactOverlap)
+{
+	CL_UINT idx = get_global_id(0);
+	if (idx < changedCount)
+		binTriangleToCells(scene,changedTriangles[idx],grid,counters,counters,0,0,false,exactOverlap != 0);
+}
 
+/*****************************************************
+ * 14. Allocate new pair ranges for affected cells
+ ******************************************************/
+__kernel void reallocateAffectedCellsKernel(CL_GLOBAL const CL_UINT* affectedCells,
+											CL_GLOBAL CL_UINT* updateCounts,
+											CL_GLOBAL const CL_UINT* changedFlags,
+											CL_GLOBAL const CL_UINT* counters,
+											CL_GLOBAL CL_UINT* offsets,
+											CL_GLOBAL CL_UINT2* cellRanges,
+											CL_GLOBAL CL_UINT2* pairs,
+											CL_UINT pairsCapacity)
+{
+	CL_UINT idx = get_global_id(0);
+	if (idx < updateCounts[UPDATE_AFFECTED_CELLS])
+		reallocateAffectedCell(affectedCells[idx],changedFlags,counters,offsets,cellRanges,pairs,updateCounts,pairsCapacity);
+}
 
+/*****************************************************
+ * 15. Scatter top level pairs of changed triangles
+ ******************************************************/
+__kernel void scatterChangedTrianglePairsKernel(CL_GLOBAL const char* scene,
+												CL_CONSTANT struct GridData* grid,
+												CL_GLOBAL const CL_UINT* changedTriangles,
+												CL_UINT changedCount,
+												CL_GLOBAL CL_UINT* offsets,
+												CL_GLOBAL CL_UINT* counters,
+												CL_GLOBAL CL_UINT2* pairs,
+												CL_UINT pairsCapacity,
+												CL_UINT exactOverlap)
+{
+	CL_UINT idx = get_global_id(0);
+	if (idx < changedCount)
+		binTriangleToCells(scene,changedTriangles[idx],grid,counters,offsets,pairs,pairsCapacity,true,exactOverlap != 0);
+}
 
+/*****************************************************
+ * 16. Rebuild affected top level cells, and allocate
+ *     their leaf cells
+ ******************************************************/
+__kernel void rebuildAffectedCellsKernel(CL_GLOBAL const CL_UINT* affectedCells,
+										 CL_GLOBAL CL_UINT* updateCounts,
+										 CL_GLOBAL CL_UINT2* cellRanges,
+										 CL_GLOBAL CL_UINT* leafCounts,
+										 CL_GLOBAL struct TopLevelCell* topLevelCells,
+										 CL_CONSTANT struct GridData* grid,
+										 CL_GLOBAL const char* scene,
+										 CL_GLOBAL const CL_UINT2* pairs,
+										 CL_GLOBAL const CL_UINT* buildCounts,
+										 CL_UINT adaptive,
+										 CL_UINT leafCellsBudget,
+										 CL_UINT leafCellsCapacity)
+{
+	CL_UINT idx = get_global_id(0);
+	if (idx < updateCounts[UPDATE_AFFECTED_CELLS])
+		rebuildAffectedCell(affectedCells[idx],cellRanges,leafCounts,topLevelCells,grid,scene,pairs,
+							buildCounts[BUILD_COUNT_PAIRS],adaptive != 0,leafCellsBudget,updateCounts,leafCellsCapacity);
+}
 
+/*****************************************************
+ * 17. Count leaf pairs of appended top level pairs
+ ******************************************************/
+__kernel void countAppendedLeafPairsKernel(CL_GLOBAL const char* scene,
+										   CL_GLOBAL CL_UINT2* topLevelPairs,
+										   CL_UINT firstPair,
+										   CL_UINT pairsEnd,
+										   CL_CONSTANT struct GridData* grid,
+										   CL_GLOBAL struct TopLevelCell* topLevelCells,
+										   CL_GLOBAL CL_UINT* counters,
+										   CL_UINT leafCellsCapacity)
+{
+	CL_UINT idx = firstPair + get_global_id(0);
+	if (idx < pairsEnd)
+		binPairToLeafCells(scene,topLevelPairs,idx,grid,topLevelCells,counters,counters,0,leafCellsCapacity,0,false);
+}
 
+/*****************************************************
+ * 18. Write leaf ranges of affected cells
+ ******************************************************/
+__kernel void writeAffectedLeafRangesKernel(CL_GLOBAL const CL_UINT* affectedCells,
+											CL_GLOBAL CL_UINT* updateCounts,
+											CL_GLOBAL const struct TopLevelCell* topLevelCells,
+											CL_GLOBAL const CL_UINT* counters,
+											CL_GLOBAL CL_UINT* offsets,
+											CL_GLOBAL CL_UINT* leafRanges,
+											CL_UINT leafPairsCapacity)
+{
+	CL_UINT idx = get_global_id(0);
+	if (idx < updateCounts[UPDATE_AFFECTED_CELLS])
+		writeAffectedLeafRanges(affectedCells[idx],topLevelCells,counters,offsets,leafRanges,updateCounts,leafPairsCapacity);
+}
 
+/*****************************************************
+ * 19. Scatter leaf pairs of appended top level pairs
+ ******************************************************/
+__kernel void scatterAppendedLeafPairsKernel(CL_GLOBAL const char* scene,
+											 CL_GLOBAL CL_UINT2* topLevelPairs,
+											 CL_UINT firstPair,
+											 CL_UINT pairsEnd,
+											 CL_GLOBAL struct TopLevelCell* topLevelCells,
+											 CL_CONSTANT struct GridData* grid,
+											 CL_GLOBAL CL_UINT* offsets,
+											 CL_GLOBAL CL_UINT* counters,
+											 CL_GLOBAL CL_UINT* pairs,
+											 CL_UINT leafCellsCapacity,
+											 CL_UINT pairsCapacity)
+{
+	CL_UINT idx = firstPair + get_global_id(0);
+	if (idx < pairsEnd)
+		binPairToLeafCells(scene,topLevelPairs,idx,grid,topLevelCells,counters,offsets,pairs,leafCellsCapacity,pairsCapacity,true);
+}
 
+/*****************************************************
+ * 20. Clear flags of affected cells
+ ******************************************************/
+__kernel void releaseAffectedCellsKernel(CL_GLOBAL const CL_UINT* affectedCells,
+										 CL_GLOBAL const CL_UINT* updateCounts,
+										 CL_GLOBAL CL_UINT* affectedFlags)
+{
+	CL_UINT idx = get_global_id(0);
+	if (idx < updateCounts[UPDATE_AFFECTED_CELLS])
+		affectedFlags[affectedCells[idx]] = 0;
+}
 
+/*****************************************************
+ * 21. Calculate proximities of empty top level cells
+ *     along an axis - Run for X, Y and Z in this order.
+ *     Last axis stores the proximities in the cells
+ ******************************************************/
+__kernel void computeProximityKernel(CL_GLOBAL struct TopLevelCell* topLevelCells,
+									 CL_GLOBAL const CL_UINT* input,
+									 CL_GLOBAL CL_UINT* output,
+									 CL_CONSTANT struct GridData* grid,
+									 CL_UINT cellCount,
+									 CL_UINT axis)
+{
+	CL_UINT idx = get_global_id(0);
+	if (idx >= cellCount)
+		return;
+	CL_UINT proximity = proximityAlongAxis(topLevelCells,input,grid,idx,axis);
+	if (axis != iZ)
+		output[idx] = proximity;
+	else if (topLevelCells[idx].resX == 0)
+		topLevelCells[idx].proximityDistance = proximity;
+}
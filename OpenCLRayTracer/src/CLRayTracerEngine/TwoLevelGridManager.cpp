@@ -31,9 +31,16 @@
  */
 
 #include <math.h>
+#include <float.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <Windows.h>
+#include <boost\functional\hash.hpp>
 #include <OpenCLUtils\CLBuffer.h>
 #include <Algorithms\Sorting.h>
 #include <Algorithms\PrefixSum.h>
+#include <Algorithms\RaySorter.h>
 #include <Algorithms\TwoLevelGridManager.h>
 #include <CLData\AccelerationStructs\TwoLevelGrid.h>
 #include <CLData\SceneBufferParser.h>
@@ -56,21 +63,70 @@ using namespace CLRayTracer::AccelerationStructures;
 /**C string containing the kernel source*/
 extern const char* TwoLevelGridKernelSource;
 
+/**Readback-free construction allocates this much more than the counts of previous build, to absorb scene changes*/
+#define READBACK_FREE_CAPACITY_HEADROOM 1.25f
+
+/**With incremental updates, pair and leaf arrays are allocated this much larger than the build needs, for data appended by updates*/
+#define INCREMENTAL_UPDATE_SLACK 0.5f
+/**Updates that change larger portion of the triangles are done by full build*/
+#define INCREMENTAL_UPDATE_MAX_FRACTION 0.25f
+
+/**Candidate densities evaluated by auto-tuning*/
+static const CL_FLOAT TopLevelDensityCandidates[] = {0.5f,1.0f,2.0f,4.0f};
+static const CL_FLOAT LeafDensityCandidates[] = {1.0f,2.0f,4.0f,8.0f};
+/**Number of candidates of lowest estimated cost, that are timed when auto-tuning with sample camera*/
+#define TIMED_DENSITY_CANDIDATES 3
+/**Number of timed traces per candidate - The fastest one counts*/
+#define TIMED_TRACES 3
+/**Relative costs of the traversal cost estimate: Top level cell step, leaf cell step, fetch of the range
+*  of an occupied leaf cell, and ray-triangle intersection test*/
+#define COST_TOP_LEVEL_STEP 1.0f
+#define COST_LEAF_STEP 1.0f
+#define COST_OCCUPIED_LEAF 1.0f
+#define COST_INTERSECTION 4.0f
+
+/**Density candidate of auto-tuning*/
+struct DensityCandidate
+{
+	CL_FLOAT2 densities;
+	CL_FLOAT cost;
+	bool operator<(const DensityCandidate& other) const {return cost < other.cost;}
+};
+
 /**Constructor*/
 TwoLevelGridManager::TwoLevelGridManager(const CLExecutionContext& context,const Scene& scene):AccelerationStructureManager(context,scene)
 {
-	_bitonicSorter.reset(new BitonicSort(context,true));
 	_prefixSumCalculator.reset(new PrefixSum(context));
+	_raySorter.reset(new RaySorter(context));
+	_reorderRays = false;
 	//Default value for densities, based on paper: 
 	//Two-Level Grids for Ray Tracing on GPUs Javor Kalojanov,Markus Billeter and Philipp Slusallek
 	_topLevelDensity = 2.0f;
 	_leafDensity = 2.0f;
 	_numPrimitives = 0;
-	_numPrimitivesPowOfTwo = 0;
 	_cellsCountPowOfTwo = 0;
 	_leafCellsCount = 0;
+	_leafCellsCountPowOfTwo = 0;
 	_leafPairsCount = 0;
-	_leafPairsCountPowOfTwo = 0;
+	_pairsCapacity = 0;
+	_leafCellsCapacity = 0;
+	_leafPairsCapacity = 0;
+	_readbackFreeConstruction = false;
+	_verifyConstruction = true;
+	_pendingVerification = false;
+	_densityAutoTuning = false;
+	_adaptiveLeafResolution = false;
+	_exactTopLevelOverlap = false;
+	_incrementalUpdates = false;
+	_preparedForUpdates = false;
+	_pairsTail = 0;
+	_leafCellsTail = 0;
+	_leafPairsTail = 0;
+	_leafCellsBudget = 0;
+	_mailboxSize = 8;
+	_mortonCellOrder = false;
+	_sceneHash = 0;
+	_hashedSceneData = NULL;
 }
 
 
@@ -87,29 +143,40 @@ TwoLevelGridManager::TwoLevelGridManager(const CLExecutionContext& context,const
 Result TwoLevelGridManager::initialize(Common::Errata& err)
 {
 	//Initialization of utility classes
-	if (Success != _bitonicSorter->initialize(err))
-		return Error;
 	if (Success != _prefixSumCalculator->initialize(err))
 		return Error;
+	if (Success != _raySorter->initialize(err))
+		return Error;
 	
 	//Compilation of kernels 
+	if (_mailboxSize & (_mailboxSize - 1))
+	{
+		FILL_ERRATA(err,"Mailbox size must be a power of two: " << _mailboxSize);
+		return Error;
+	}
+	std::stringstream options;
+	options << "-I " << Deployment::CLHeadersPath << " -D TLG_MAILBOX_SIZE=" << _mailboxSize << " -D TLG_MORTON_ORDER=" << (_mortonCellOrder ? 1 : 0);
 	_tlgProgram.reset(new CLProgram(_context));
-	if (Success != _tlgProgram->compile(TwoLevelGridKernelSource,"-I " + Deployment::CLHeadersPath,err))
+	if (Success != _tlgProgram->compile(TwoLevelGridKernelSource,options.str(),err))
 		return Error;
 
 	//Retrieving kernel objects for further use
 	CLKernel *k = NULL;
-	if (Success != _tlgProgram->getKernel("prepareDataKernel",k,err))
+	if (Success != _tlgProgram->getKernel("countCellPairsKernel",k,err))
 		return Error;
-	_prepareDataKernel.reset(k);
+	_countCellPairsKernel.reset(k);
 
-	if (Success != _tlgProgram->getKernel("writePairsKernel",k,err))
+	if (Success != _tlgProgram->getKernel("writeCellRangesKernel",k,err))
 		return Error;
-	_writePairsKernel.reset(k);
+	_writeCellRangesKernel.reset(k);
 
-	if (Success != _tlgProgram->getKernel("extractCellRangesKernel",k,err))
+	if (Success != _tlgProgram->getKernel("writeLeafRangesKernel",k,err))
 		return Error;
-	_writeCellRangesKernel.reset(k);
+	_writeLeafRangesKernel.reset(k);
+
+	if (Success != _tlgProgram->getKernel("scatterCellPairsKernel",k,err))
+		return Error;
+	_scatterCellPairsKernel.reset(k);
 
 	if (Success != _tlgProgram->getKernel("countLeavesAndFillCellKernel",k,err))
 		return Error;
@@ -119,17 +186,65 @@ Result TwoLevelGridManager::initialize(Common::Errata& err)
 		return Error;
 	_updateTopLevelCellsWithLeafRangeKernel.reset(k);
 
-	if (Success != _tlgProgram->getKernel("prepareGridDataForLeaves",k,err))
+	if (Success != _tlgProgram->getKernel("countLeafPairsKernel",k,err))
 		return Error;
-	_prepareLeafDataKernel.reset(k);
+	_countLeafPairsKernel.reset(k);
 	
-	if (Success != _tlgProgram->getKernel("writeLeafPairsKernel",k,err))
+	if (Success != _tlgProgram->getKernel("scatterLeafPairsKernel",k,err))
+		return Error;
+	_scatterLeafPairsKernel.reset(k);
+
+	if (Success != _tlgProgram->getKernel("storeBuildCountKernel",k,err))
+		return Error;
+	_storeBuildCountKernel.reset(k);
+
+	if (Success != _tlgProgram->getKernel("storeTriangleCellRangesKernel",k,err))
+		return Error;
+	_storeTriangleCellRangesKernel.reset(k);
+
+	if (Success != _tlgProgram->getKernel("markChangedTrianglesKernel",k,err))
+		return Error;
+	_markChangedTrianglesKernel.reset(k);
+
+	if (Success != _tlgProgram->getKernel("collectAffectedCellsKernel",k,err))
+		return Error;
+	_collectAffectedCellsKernel.reset(k);
+
+	if (Success != _tlgProgram->getKernel("countChangedTrianglePairsKernel",k,err))
+		return Error;
+	_countChangedTrianglePairsKernel.reset(k);
+
+	if (Success != _tlgProgram->getKernel("reallocateAffectedCellsKernel",k,err))
+		return Error;
+	_reallocateAffectedCellsKernel.reset(k);
+
+	if (Success != _tlgProgram->getKernel("scatterChangedTrianglePairsKernel",k,err))
+		return Error;
+	_scatterChangedTrianglePairsKernel.reset(k);
+
+	if (Success != _tlgProgram->getKernel("rebuildAffectedCellsKernel",k,err))
+		return Error;
+	_rebuildAffectedCellsKernel.reset(k);
+
+	if (Success != _tlgProgram->getKernel("countAppendedLeafPairsKernel",k,err))
+		return Error;
+	_countAppendedLeafPairsKernel.reset(k);
+
+	if (Success != _tlgProgram->getKernel("writeAffectedLeafRangesKernel",k,err))
+		return Error;
+	_writeAffectedLeafRangesKernel.reset(k);
+
+	if (Success != _tlgProgram->getKernel("scatterAppendedLeafPairsKernel",k,err))
 		return Error;
-	_writeLeafPairsKernel.reset(k);
+	_scatterAppendedLeafPairsKernel.reset(k);
 
-	if (Success != _tlgProgram->getKernel("extractLeafCellsKernel",k,err))
+	if (Success != _tlgProgram->getKernel("releaseAffectedCellsKernel",k,err))
 		return Error;
-	_extractLeafCellsKernel.reset(k);
+	_releaseAffectedCellsKernel.reset(k);
+
+	if (Success != _tlgProgram->getKernel("computeProximityKernel",k,err))
+		return Error;
+	_computeProximityKernel.reset(k);
 
 	if (Success != _tlgProgram->getKernel("generateContactsKernel",k,err))
 		return Error;
@@ -139,15 +254,23 @@ Result TwoLevelGridManager::initialize(Common::Errata& err)
 		return Error;
 	_generateContacts2Kernel.reset(k);
 
+	if (Success != _tlgProgram->getKernel("generateContactsIndexedKernel",k,err))
+		return Error;
+	_generateContactsIndexedKernel.reset(k);
+
 	if (Success != _context.getDevice().getWorkGroupDimensions().getMaxWorkGroupSize(_maxWorkgroupSize,err))
 		return Error;
 	
 	if(Success != _context.getDevice().getMemoryInfo().getLocalMemSize(_deviceLocalMemory,err))
 		return Error;
 
-	if (Success != _context.getMaximalLaunchExecParams(*_writePairsKernel,_processors,_wavefront,err))
+	if (Success != _context.getMaximalLaunchExecParams(*_scatterCellPairsKernel,_processors,_wavefront,err))
 		return Error;
 
+	_buildCounts.reset(new CLBuffer(_context,BUILD_COUNTS * sizeof(CL_UINT),CLBufferFlags::CLBufferAccess::ReadWrite));
+	//Grid data is updated in place at each construction
+	_deviceTopLevelGrid.reset(new CLBuffer(_context,sizeof(struct GridData),CLBufferFlags::ReadOnly));
+
 	return Success;
 }
 
@@ -159,43 +282,49 @@ Result TwoLevelGridManager::initialize(Common::Errata& err)
 */
 Result TwoLevelGridManager::initializeFrame(Common::Errata& err)
 {
-	
+	//Densities are tuned once per scene
+	if (_densityAutoTuning)
+	{
+		std::map<size_t,CL_FLOAT2>::const_iterator tuned = _tunedDensities.find(getSceneHash());
+		if (tuned == _tunedDensities.end())
+			return autoTuneDensities(err);
+		_topLevelDensity = tuned->second.x;
+		_leafDensity = tuned->second.y;
+	}
+	return prepareFrame(err);
+}
+
+/**Calculates the grid data of current densities, and prepares the buffers for construction
+* @param err Error info
+* @return Result of the operation: Success or failure
+*/
+Result TwoLevelGridManager::prepareFrame(Common::Errata& err)
+{
+	//New grid data invalidates the data for incremental updates, until the grid is constructed
+	_preparedForUpdates = false;
 	calculateGridData();
-	_cellsCount = _hostGrid.resX * _hostGrid.resY * _hostGrid.resZ; 
+	_cellsCount = countCellsInOrder(_hostGrid.resX,_hostGrid.resY,_hostGrid.resZ,_mortonCellOrder);
 	_cellsCountPowOfTwo = largestPowerOfTwo(_cellsCount) << 1;
 		
 	_numPrimitives = SCENE_HEADER(_scene.getHostSceneData())->totalNumberOfTriangles;
-	_numPrimitivesPowOfTwo = (largestPowerOfTwo(_numPrimitives) << 1);
 
-	size_t countersArraySize = sizeof(CL_UINT) * max(_numPrimitivesPowOfTwo,_cellsCountPowOfTwo);
-	_counters.reset(new CLBuffer(_context,countersArraySize,CLBufferFlags::CLBufferAccess::ReadWrite));
+	//Buffers persist across frames, and grow only - Steady state frames allocate no device memory
+	//Counter per top level cell - Resized later for leaf cells. Counters are counted back down to zero by the scatter
+	//kernels, so they need clearing only when new memory is allocated
+	size_t countersArraySize = sizeof(CL_UINT) * _cellsCountPowOfTwo;
+	if (Success != reserveZeroedBuffer(_counters,countersArraySize,err))
+		return Error;
 			
-	CL_UINT prefixSumOutputArraySize = countersArraySize;
-	_prefixSumOutput.reset(new CLBuffer(_context,prefixSumOutputArraySize,CLBufferFlags::CLBufferAccess::ReadWrite));
+	//Prefix sums are overwritten by every scan, and need no initialization
+	size_t prefixSumOutputArraySize = countersArraySize;
+	reserveBuffer(_prefixSumOutput,prefixSumOutputArraySize);
 
-	CL_UINT cellRangesArraySize = _cellsCount * sizeof(CL_UINT2);
-	_cellRangesArray.reset(new CLBuffer(_context,cellRangesArraySize,CLBufferFlags::CLBufferAccess::ReadWrite));
-		
-	CL_UINT topLevelCellsArraySize = _cellsCount * sizeof(struct TopLevelCell);
-	_topLevelCellsArray.reset(new CLBuffer(_context,topLevelCellsArraySize,CLBufferFlags::CLBufferAccess::ReadWrite));
+	size_t cellRangesArraySize = (_cellsCount + 1) * sizeof(CL_UINT2);
+	reserveBuffer(_cellRangesArray,cellRangesArraySize);
 		
-	//Buffer Initialization
-	CL_UINT pattern = 0;
-	if (Success != _context.enqueueFillBuffer(_counters->getCLMem(),&pattern,_counters->getActualSize(),sizeof(CL_UINT),err))
-		return Error;
-
-	if (Success != _context.enqueueFillBuffer(_prefixSumOutput->getCLMem(),&pattern,_prefixSumOutput->getActualSize(),sizeof(CL_UINT),err))
-		return Error;
-
-	CL_UINT2 pattern2;
-	pattern2.x = pattern2.y = 0;
-	if (Success != _context.enqueueFillBuffer(_cellRangesArray->getCLMem(),&pattern2,_cellRangesArray->getActualSize(),sizeof(CL_UINT2),err))
-		return Error;
-
-	struct TopLevelCell cellPattern;
-	memset(&cellPattern,0,sizeof(struct TopLevelCell));
-	if (Success != _context.enqueueFillBuffer(_topLevelCellsArray->getCLMem(),&cellPattern,_topLevelCellsArray->getActualSize(),sizeof(struct TopLevelCell),err))
-		return Error;
+	size_t topLevelCellsArraySize = _cellsCount * sizeof(struct TopLevelCell);
+	reserveBuffer(_topLevelCellsArray,topLevelCellsArraySize);
+	//Cell ranges and top level cells are written for every cell by the build kernels, and need no initialization
 
 	return Success;
 }
@@ -206,266 +335,690 @@ Result TwoLevelGridManager::initializeFrame(Common::Errata& err)
 */
 Result TwoLevelGridManager::construct(Common::Errata& err)
 {
+	//Data for incremental updates is valid only for the build that prepared it
+	_preparedForUpdates = false;
+
 	//Load grid to GPU
-	_deviceTopLevelGrid.reset(new CLBuffer(_context,sizeof(struct GridData),&_hostGrid,CLBufferFlags::ReadOnly));
-		
-	//Prepare data prepare kernel execution
-	CL_UINT workSize = closestMultipleTo(SCENE_HEADER(_scene.getHostSceneData())->totalNumberOfTriangles,_wavefront);
-	CLEvent evt;
-	{
-		SET_KERNEL_ARGS((*_prepareDataKernel),_scene.getDeviceSceneData(),_deviceTopLevelGrid->getCLMem(),_counters->getCLMem());
-		CLKernelWorkDimension globalDim(1,workSize);
-		CLKernelWorkDimension localDim(1,_wavefront);
-	
-		CLKernelExecuteParams prepareDataKernelExecParams(&globalDim,&localDim,&evt);
+	if (Success != _context.enqueueWriteBuffer(&_hostGrid,_deviceTopLevelGrid->getCLMem(),sizeof(struct GridData),err))
+		return Error;
 
-		//Call the data prepare kernel
-		if(Success != _context.enqueueKernel(*_prepareDataKernel,prepareDataKernelExecParams,err))
+	//Incremental updates need the counts of the build
+	if (_incrementalUpdates)
+	{
+		if (Success != buildGrid(true,err))
 			return Error;
-		if (Success != _context.flushQueue(err))
+		return prepareIncrementalUpdates(err);
+	}
+
+	if (!_readbackFreeConstruction)
+		return buildGrid(true,err);
+
+	//Counts of previous unverified build are surely ready by now - Grow the capacities if it has overflown
+	if (_pendingVerification)
+	{
+		if (Success != readBuildCounts(err))
 			return Error;
-		if (Success != evt.wait(err))
+		_pendingVerification = false;
+		if (!capacitiesSuffice())
+			growCapacities();
+	}
+
+	//No counts to estimate capacities from - Build with readbacks, once
+	if (0 == _pairsCapacity)
+	{
+		if (Success != buildGrid(true,err))
 			return Error;
+		growCapacities();
+		return Success;
 	}
 
-	//Calculate the prefix sum
-	if (Success != _prefixSumCalculator->computePrefixSum(_counters->getCLMem(),_prefixSumOutput->getCLMem(),_numPrimitivesPowOfTwo,err))
+	if (Success != buildGrid(false,err))
 		return Error;
 
-	_pairsCount = 0;
+	if (!_verifyConstruction)
+	{
+		_pendingVerification = true;
+		return Success;
+	}
 
-	if (Success != _context.enqueueReadBuffer(_prefixSumOutput->getCLMem(),&_pairsCount,(_numPrimitives-1) * sizeof(CL_UINT),sizeof(CL_UINT),err))
+	//The single sync of the build: Rebuild with readbacks if any of the capacities has overflown
+	if (Success != readBuildCounts(err))
+		return Error;
+	if (capacitiesSuffice())
+		return Success;
+	if (Success != buildGrid(true,err))
 		return Error;
-	_pairsCountPowOfTwo = largestPowerOfTwo(_pairsCount) << 1;
+	growCapacities();
+	return Success;
+}
 
-	
-	//Reallocating pairs array
-	CL_UINT pairsArraySize = _pairsCountPowOfTwo * sizeof(CL_UINT2);
-	if (_pairsArray)
-		_pairsArray->resize(pairsArraySize);
+void TwoLevelGridManager::setReadbackFreeConstruction(bool enable, bool verify)
+{
+	//Capacities are estimated from a build with readbacks, when enabled
+	if (enable && !_readbackFreeConstruction)
+		_pairsCapacity = 0;
+	_readbackFreeConstruction = enable;
+	_verifyConstruction = verify;
+	_pendingVerification = false;
+}
+
+void TwoLevelGridManager::setDensityAutoTuning(bool enable, const Camera* sampleCamera)
+{
+	_densityAutoTuning = enable;
+	if (sampleCamera)
+		_tuningCamera.reset(new Camera(*sampleCamera));
 	else
-		_pairsArray.reset(new CLBuffer(_context,pairsArraySize,CLBufferFlags::ReadWrite));
-	
+		_tuningCamera.reset();
+}
 
-	CL_UINT2 pattern;
-	pattern.x = pattern.y = UINT_MAX;
-	if (Success != _context.enqueueFillBuffer(_pairsArray->getCLMem(),&pattern,_pairsArray->getActualSize(),sizeof(CL_UINT2),err))
+Result TwoLevelGridManager::setDensityCacheFile(const std::string& path, Common::Errata& err)
+{
+	_densityCacheFile = path;
+	//No file yet - Nothing was tuned
+	std::ifstream in(path.c_str());
+	if (!in.is_open())
+		return Success;
+	size_t hash;
+	CL_FLOAT2 densities;
+	while (in >> hash >> densities.x >> densities.y)
+		_tunedDensities[hash] = densities;
+	if (!in.eof())
+	{
+		FILL_ERRATA(err,"Malformed density cache file: " << path);
 		return Error;
+	}
+	return Success;
+}
 
-	//Prepare write pairs kernel execution
+/**Tunes the densities for the associated scene: The grid is built with each pair of candidate densities, and its traversal
+* cost is estimated from the counts of the build. If there's sample camera, the candidates of lowest estimate are timed
+* by tracing its primary rays. The chosen densities are prepared for construction of the frame.
+* @param err Error info
+* @return Result of the operation: Success or failure
+*/
+Result TwoLevelGridManager::autoTuneDensities(Common::Errata& err)
+{
+	std::vector<DensityCandidate> candidates;
+	for (size_t top = 0; top < sizeof(TopLevelDensityCandidates) / sizeof(CL_FLOAT); top++)
+		for (size_t leaf = 0; leaf < sizeof(LeafDensityCandidates) / sizeof(CL_FLOAT); leaf++)
+		{
+			DensityCandidate candidate;
+			candidate.densities.x = _topLevelDensity = TopLevelDensityCandidates[top];
+			candidate.densities.y = _leafDensity = LeafDensityCandidates[leaf];
+			if (Success != prepareFrame(err))
+				return Error;
+			if (Success != _context.enqueueWriteBuffer(&_hostGrid,_deviceTopLevelGrid->getCLMem(),sizeof(struct GridData),err))
+				return Error;
+			if (Success != buildGrid(true,err))
+				return Error;
+			if (Success != estimateTraversalCost(candidate.cost,err))
+				return Error;
+			candidates.push_back(candidate);
+		}
+	std::sort(candidates.begin(),candidates.end());
+
+	//The estimate only ranks the candidates for timing - Timed costs replace the estimates
+	if (_tuningCamera)
 	{
-		SET_KERNEL_ARGS((*_writePairsKernel),_scene.getDeviceSceneData(),_deviceTopLevelGrid->getCLMem(),
-			_prefixSumOutput->getCLMem(),
-			_counters->getCLMem(),
-			_pairsArray->getCLMem());
+		size_t timedCandidates = min(candidates.size(),(size_t)TIMED_DENSITY_CANDIDATES);
+		for (size_t i = 0; i < timedCandidates; i++)
+		{
+			_topLevelDensity = candidates[i].densities.x;
+			_leafDensity = candidates[i].densities.y;
+			if (Success != prepareFrame(err))
+				return Error;
+			if (Success != _context.enqueueWriteBuffer(&_hostGrid,_deviceTopLevelGrid->getCLMem(),sizeof(struct GridData),err))
+				return Error;
+			if (Success != buildGrid(true,err))
+				return Error;
+			if (Success != timeSampleTrace(candidates[i].cost,err))
+				return Error;
+		}
+		std::sort(candidates.begin(),candidates.begin() + timedCandidates);
+	}
 
-		CLKernelWorkDimension globalDim(1,workSize);
-		CLKernelWorkDimension localDim(1,_wavefront);
-		CLKernelExecuteParams writePairsKernelExecParams(&globalDim,&localDim,&evt);
+	_topLevelDensity = candidates[0].densities.x;
+	_leafDensity = candidates[0].densities.y;
+	_tunedDensities[getSceneHash()] = candidates[0].densities;
 
-		//Call the write pairs kernel
-		if(Success != _context.enqueueKernel(*_writePairsKernel,writePairsKernelExecParams,err))
-			return Error;
-		if (Success != _context.flushQueue(err))
-			return Error;
-		if (Success != evt.wait(err))
-			return Error;
-	}
+	//Capacities of readback-free construction are estimated anew, for the chosen densities
+	_pairsCapacity = 0;
+	_pendingVerification = false;
 
-	//Sorting the pairs
-	if (Success != _bitonicSorter->sort(_pairsArray->getCLMem(),_pairsCountPowOfTwo,err))
+	if (!_densityCacheFile.empty() && Success != saveTunedDensities(err))
 		return Error;
+	return prepareFrame(err);
+}
 
-	//Preparing counters array for reuse
+/**Estimates traversal cost of a ray through the last build, relatively to other builds of the same scene.
+* An isotropic ray crosses about (resX+resY+resZ)/3 cells of a grid. Leaf cells are crossed within the nonempty
+* top level cells only, and each leaf cell step costs the intersection tests with the pairs of the cell, on average.
+* The ray is assumed to not terminate, so the estimate is an upper bound. Cells are counted without the padding
+* cells of Morton order, so both cell orders are estimated alike.
+* @param [out] cost The estimated cost
+* @param err Error info
+* @return Result of the operation: Success or failure
+*/
+Result TwoLevelGridManager::estimateTraversalCost(CL_FLOAT& cost, Common::Errata& err)
+{
+	std::vector<struct TopLevelCell> cells(max(_cellsCount,1));
+	if (Success != _context.enqueueReadBuffer(_topLevelCellsArray->getCLMem(),&cells[0],_cellsCount * sizeof(struct TopLevelCell),err))
+		return Error;
+	std::vector<CL_UINT> leafRanges(_leafCellsCount + 1);
+	if (Success != _context.enqueueReadBuffer(_leafCellRangesArray->getCLMem(),&leafRanges[0],leafRanges.size() * sizeof(CL_UINT),err))
+		return Error;
+
+	//Leaf cells crossed per nonempty top level cell
+	CL_UINT nonEmptyCells = 0;
+	CL_UINT leafCellsInResolution = 0;
+	CL_FLOAT leafStepsPerCell = 0.0f;
+	for (CL_UINT i = 0; i < _cellsCount; i++)
+		if (cells[i].resX * cells[i].resY * cells[i].resZ > 0)
+		{
+			nonEmptyCells++;
+			leafCellsInResolution += cells[i].resX * cells[i].resY * cells[i].resZ;
+			leafStepsPerCell += (cells[i].resX + cells[i].resY + cells[i].resZ) / 3.0f;
+		}
+	leafStepsPerCell /= max(nonEmptyCells,1);
+
+	//Leaf occupancy histogram
+	_leafOccupancyHistogram.assign(1,0);
+	for (CL_UINT i = 0; i < _leafCellsCount; i++)
 	{
-		CL_UINT pattern = 0;
-		if (Success != _context.enqueueFillBuffer(_counters->getCLMem(),&pattern,_counters->getActualSize(),sizeof(CL_UINT),err))
-			return Error;
+		CL_UINT occupancy = leafRanges[i + 1] - leafRanges[i];
+		if (occupancy >= _leafOccupancyHistogram.size())
+			_leafOccupancyHistogram.resize(occupancy + 1,0);
+		_leafOccupancyHistogram[occupancy]++;
+	}
+	//Padding leaf cells of Morton order are empty and are not part of any resolution
+	_leafOccupancyHistogram[0] -= _leafCellsCount - leafCellsInResolution;
+	CL_FLOAT leafCells = (CL_FLOAT)max(leafCellsInResolution,1);
+	CL_FLOAT occupiedLeafFraction = (leafCellsInResolution - _leafOccupancyHistogram[0]) / leafCells;
+	CL_FLOAT testsPerLeafStep = _leafPairsCount / leafCells;
+
+	CL_FLOAT topLevelSteps = (_hostGrid.resX + _hostGrid.resY + _hostGrid.resZ) / 3.0f;
+	CL_FLOAT topLevelCells = (CL_FLOAT)_hostGrid.resX * _hostGrid.resY * _hostGrid.resZ;
+	CL_FLOAT leafSteps = topLevelSteps * nonEmptyCells / max(topLevelCells,1.0f) * leafStepsPerCell;
+	cost = COST_TOP_LEVEL_STEP * topLevelSteps +
+		   leafSteps * (COST_LEAF_STEP + COST_OCCUPIED_LEAF * occupiedLeafFraction + COST_INTERSECTION * testsPerLeafStep);
+	return Success;
+}
 
-		if (Success != _context.enqueueFillBuffer(_prefixSumOutput->getCLMem(),&pattern,_prefixSumOutput->getActualSize(),sizeof(CL_UINT),err))
+/**Times tracing of primary rays of the sample camera through the last build - Fastest of several traces
+* @param [out] time The time, in performance counter ticks
+* @param err Error info
+* @return Result of the operation: Success or failure
+*/
+Result TwoLevelGridManager::timeSampleTrace(CL_FLOAT& time, Common::Errata& err)
+{
+	time = FLT_MAX;
+	for (int i = 0; i < TIMED_TRACES; i++)
+	{
+		LARGE_INTEGER start, end;
+		QueryPerformanceCounter(&start);
+		if (Success != generateContacts(*_tuningCamera,err))
 			return Error;
+		QueryPerformanceCounter(&end);
+		time = min(time,(CL_FLOAT)(end.QuadPart - start.QuadPart));
 	}
+	return Success;
+}
 
-	//Writing cell Ranges
+/**Writes the tuned densities to the density cache file
+* @param err Error info
+* @return Result of the operation: Success or failure
+*/
+Result TwoLevelGridManager::saveTunedDensities(Common::Errata& err) const
+{
+	std::ofstream out(_densityCacheFile.c_str(),std::ios::trunc);
+	for (std::map<size_t,CL_FLOAT2>::const_iterator it = _tunedDensities.begin(); it != _tunedDensities.end(); ++it)
+		out << it->first << " " << it->second.x << " " << it->second.y << std::endl;
+	if (!out.good())
 	{
-		SET_KERNEL_ARGS((*_writeCellRangesKernel),_pairsArray->getCLMem(),_pairsCount,_cellRangesArray->getCLMem());
-		CL_UINT availableLocalArraySize = _deviceLocalMemory / sizeof(CL_UINT2);
-		CL_UINT requiredLocalArraySize = (_wavefront + 1) * sizeof(CL_UINT2);
-		if (requiredLocalArraySize > availableLocalArraySize)
-		{
-			FILL_ERRATA(err,"Not enough local memory on device!");
-			return Error;
-		}
-		CLKernelArgument localBufferArg(((CL_UINT)requiredLocalArraySize));
-		
-		CLKernelArgument workingBlockArg = _wavefront;
-		if (Success != _writeCellRangesKernel->setKernelArgument(localBufferArg,3,err))
-			return Error;
-		if (Success != _writeCellRangesKernel->setKernelArgument(_wavefront,4,err))
-			return Error;
+		FILL_ERRATA(err,"Failed writing density cache file: " << _densityCacheFile);
+		return Error;
+	}
+	return Success;
+}
 
-		CLKernelWorkDimension globalDim(1,closestMultipleTo(_pairsCount,_wavefront));
-		CLKernelWorkDimension localDim(1,_wavefront);
-		CLKernelExecuteParams writeCellRangesKernelExecParams(&globalDim,&localDim,&evt);
+/**Hashes the geometry of the associated scene - The scene buffer is hashed once, unless it was reloaded
+* @return Hash of the scene geometry
+*/
+size_t TwoLevelGridManager::getSceneHash()
+{
+	const char* scene = _scene.getHostSceneData();
+	if (scene != _hashedSceneData)
+	{
+		const char* models = MODEL_BUFFER_PTR(scene);
+		_sceneHash = boost::hash_range(models,models + SCENE_HEADER(scene)->modelBufferSize);
+		_hashedSceneData = scene;
+	}
+	return _sceneHash;
+}
 
-		//Call the write pairs kernel
-		if(Success != _context.enqueueKernel(*_writeCellRangesKernel,writeCellRangesKernelExecParams,err))
-			return Error;
-		if (Success != _context.flushQueue(err))
-			return Error;
-		if (Success != evt.wait(err))
-			return Error;
+/**Prepares the data for incremental updates of the grid that was just built: The ranges of top level cells overlapped
+* by the triangles, flags and counters that are kept zero between updates, and the used parts of the arrays
+* @param err Error info
+* @return Result of the operation: Success or failure
+*/
+Result TwoLevelGridManager::prepareIncrementalUpdates(Common::Errata& err)
+{
+	_pairsTail = _pairsCount;
+	//Past the empty leaf of cells redirected by build, and its end
+	_leafCellsTail = _leafCellsCount + 2;
+	_leafPairsTail = _leafPairsCount;
+
+	CL_UINT leafCellsAllocated = _leafCellRangesArray->getActualSize() / sizeof(CL_UINT);
+	reserveBuffer(_triangleCellRanges,max(_numPrimitives,1) * sizeof(CL_UINT2));
+	reserveBuffer(_changedFlags,max(_numPrimitives,1) * sizeof(CL_UINT));
+	reserveBuffer(_affectedFlags,_cellsCount * sizeof(CL_UINT));
+	reserveBuffer(_affectedCells,_cellsCount * sizeof(CL_UINT));
+	reserveBuffer(_updateCellCounters,_cellsCount * sizeof(CL_UINT));
+	reserveBuffer(_updateCellOffsets,_cellsCount * sizeof(CL_UINT));
+	reserveBuffer(_updateLeafCounters,leafCellsAllocated * sizeof(CL_UINT));
+	reserveBuffer(_updateLeafOffsets,leafCellsAllocated * sizeof(CL_UINT));
+	reserveBuffer(_updateCounts,UPDATE_COUNTS * sizeof(CL_UINT));
+
+	CL_UINT pattern = 0;
+	if (Success != _context.enqueueFillBuffer(_changedFlags->getCLMem(),&pattern,_changedFlags->getSize(),sizeof(CL_UINT),err))
+		return Error;
+	if (Success != _context.enqueueFillBuffer(_affectedFlags->getCLMem(),&pattern,_affectedFlags->getSize(),sizeof(CL_UINT),err))
+		return Error;
+	if (Success != _context.enqueueFillBuffer(_updateCellCounters->getCLMem(),&pattern,_updateCellCounters->getSize(),sizeof(CL_UINT),err))
+		return Error;
+	if (Success != _context.enqueueFillBuffer(_updateLeafCounters->getCLMem(),&pattern,_updateLeafCounters->getSize(),sizeof(CL_UINT),err))
+		return Error;
+
+	SET_KERNEL_ARGS((*_storeTriangleCellRangesKernel),_scene.getDeviceSceneData(),_deviceTopLevelGrid->getCLMem(),_triangleCellRanges->getCLMem());
+	if (Success != launchKernel(*_storeTriangleCellRangesKernel,_numPrimitives,err))
+		return Error;
+
+	_preparedForUpdates = true;
+	return Success;
+}
+
+Result TwoLevelGridManager::updateTriangles(const std::vector<CL_UINT2>& changedRanges, Common::Errata& err)
+{
+	if (!_incrementalUpdates)
+	{
+		FILL_ERRATA(err,"Incremental updates of the grid are not enabled");
+		return Error;
 	}
 
-	//Fill the top level cells data - Resolution and range, count leaf cells
+	//Enabling takes effect at next construct(), which prepares the data for updates
+	if (!_preparedForUpdates)
 	{
-		SET_KERNEL_ARGS((*_countLeafCellsKernel),_cellRangesArray->getCLMem(),_counters->getCLMem(),
-			_topLevelCellsArray->getCLMem(),_cellsCount,_deviceTopLevelGrid->getCLMem());
+		FILL_ERRATA(err,"The grid was not constructed with incremental updates enabled - construct() is needed before updates");
+		return Error;
+	}
 
-		CLKernelWorkDimension globalDim(1,closestMultipleTo(_cellsCount,_wavefront));
-		CLKernelWorkDimension localDim(1,_wavefront);
-		CLKernelExecuteParams countLeafCellsKernelExecParams(&globalDim,&localDim,&evt);
+	//Triangles of overlapping ranges are updated once - Duplicates would be binned twice
+	std::vector<CL_UINT> changed;
+	for (size_t i = 0; i < changedRanges.size(); i++)
+		for (CL_UINT triangle = changedRanges[i].x; triangle < min(changedRanges[i].y,_numPrimitives); triangle++)
+			changed.push_back(triangle);
+	std::sort(changed.begin(),changed.end());
+	changed.erase(std::unique(changed.begin(),changed.end()),changed.end());
+	if (changed.empty())
+		return Success;
+	if (changed.size() > _numPrimitives * INCREMENTAL_UPDATE_MAX_FRACTION)
+		return construct(err);
+
+	CL_UINT changedCount = (CL_UINT)changed.size();
+	CL_UINT pairsCapacity = _pairsArray->getActualSize() / sizeof(CL_UINT2);
+	CL_UINT leafCellsCapacity = _leafCellRangesArray->getActualSize() / sizeof(CL_UINT);
+	CL_UINT leafPairsCapacity = _leafPairsArray->getActualSize() / sizeof(CL_UINT);
+	reserveBuffer(_changedTriangles,changedCount * sizeof(CL_UINT));
+	if (Success != _context.enqueueWriteBuffer(&changed[0],_changedTriangles->getCLMem(),changedCount * sizeof(CL_UINT),err))
+		return Error;
+	CL_UINT counts[UPDATE_COUNTS] = {0,_pairsTail,_leafCellsTail,_leafPairsTail,0};
+	if (Success != _context.enqueueWriteBuffer(counts,_updateCounts->getCLMem(),sizeof(counts),err))
+		return Error;
 
-		//Call the write pairs kernel
-		if(Success != _context.enqueueKernel(*_countLeafCellsKernel,countLeafCellsKernelExecParams,err))
+	//Flag the changed triangles, and collect the cells overlapped by their old and new bounds
+	SET_KERNEL_ARGS((*_markChangedTrianglesKernel),_changedTriangles->getCLMem(),changedCount,_changedFlags->getCLMem(),(CL_UINT)1);
+	if (Success != launchKernel(*_markChangedTrianglesKernel,changedCount,err))
+		return Error;
+	SET_KERNEL_ARGS((*_collectAffectedCellsKernel),_scene.getDeviceSceneData(),_deviceTopLevelGrid->getCLMem(),_changedTriangles->getCLMem(),changedCount,
+		_triangleCellRanges->getCLMem(),_affectedFlags->getCLMem(),_affectedCells->getCLMem(),_updateCounts->getCLMem());
+	if (Success != launchKernel(*_collectAffectedCellsKernel,changedCount,err))
+		return Error;
+	if (Success != _context.enqueueReadBuffer(_updateCounts->getCLMem(),counts,sizeof(counts),err))
+		return Error;
+	CL_UINT affectedCount = counts[UPDATE_AFFECTED_CELLS];
+
+	//Rebin the affected cells: Pairs of unchanged triangles are moved to new ranges, and pairs of changed triangles are scattered into them
+	SET_KERNEL_ARGS((*_countChangedTrianglePairsKernel),_scene.getDeviceSceneData(),_deviceTopLevelGrid->getCLMem(),_changedTriangles->getCLMem(),changedCount,
+		_updateCellCounters->getCLMem(),(CL_UINT)_exactTopLevelOverlap);
+	if (Success != launchKernel(*_countChangedTrianglePairsKernel,changedCount,err))
+		return Error;
+	SET_KERNEL_ARGS((*_reallocateAffectedCellsKernel),_affectedCells->getCLMem(),_updateCounts->getCLMem(),_changedFlags->getCLMem(),
+		_updateCellCounters->getCLMem(),_updateCellOffsets->getCLMem(),_cellRangesArray->getCLMem(),_pairsArray->getCLMem(),pairsCapacity);
+	if (Success != launchKernel(*_reallocateAffectedCellsKernel,affectedCount,err))
+		return Error;
+	SET_KERNEL_ARGS((*_scatterChangedTrianglePairsKernel),_scene.getDeviceSceneData(),_deviceTopLevelGrid->getCLMem(),_changedTriangles->getCLMem(),changedCount,
+		_updateCellOffsets->getCLMem(),_updateCellCounters->getCLMem(),_pairsArray->getCLMem(),pairsCapacity,(CL_UINT)_exactTopLevelOverlap);
+	if (Success != launchKernel(*_scatterChangedTrianglePairsKernel,changedCount,err))
+		return Error;
+
+	//Rebuild the affected cells, and their leaves from the appended pairs
+	SET_KERNEL_ARGS((*_rebuildAffectedCellsKernel),_affectedCells->getCLMem(),_updateCounts->getCLMem(),_cellRangesArray->getCLMem(),
+		_updateCellOffsets->getCLMem(),_topLevelCellsArray->getCLMem(),_deviceTopLevelGrid->getCLMem(),_scene.getDeviceSceneData(),
+		_pairsArray->getCLMem(),_buildCounts->getCLMem(),(CL_UINT)_adaptiveLeafResolution,_leafCellsBudget,leafCellsCapacity);
+	if (Success != launchKernel(*_rebuildAffectedCellsKernel,affectedCount,err))
+		return Error;
+	if (Success != _context.enqueueReadBuffer(_updateCounts->getCLMem(),counts,sizeof(counts),err))
+		return Error;
+	//Out of space - The grid is compacted by full build
+	if (counts[UPDATE_OVERFLOW])
+		return construct(err);
+	CL_UINT pairsEnd = counts[UPDATE_PAIRS_TAIL];
+	SET_KERNEL_ARGS((*_countAppendedLeafPairsKernel),_scene.getDeviceSceneData(),_pairsArray->getCLMem(),_pairsTail,pairsEnd,
+		_deviceTopLevelGrid->getCLMem(),_topLevelCellsArray->getCLMem(),_updateLeafCounters->getCLMem(),leafCellsCapacity);
+	if (Success != launchKernel(*_countAppendedLeafPairsKernel,pairsEnd - _pairsTail,err))
+		return Error;
+	SET_KERNEL_ARGS((*_writeAffectedLeafRangesKernel),_affectedCells->getCLMem(),_updateCounts->getCLMem(),_topLevelCellsArray->getCLMem(),
+		_updateLeafCounters->getCLMem(),_updateLeafOffsets->getCLMem(),_leafCellRangesArray->getCLMem(),leafPairsCapacity);
+	if (Success != launchKernel(*_writeAffectedLeafRangesKernel,affectedCount,err))
+		return Error;
+	SET_KERNEL_ARGS((*_scatterAppendedLeafPairsKernel),_scene.getDeviceSceneData(),_pairsArray->getCLMem(),_pairsTail,pairsEnd,
+		_topLevelCellsArray->getCLMem(),_deviceTopLevelGrid->getCLMem(),_updateLeafOffsets->getCLMem(),_updateLeafCounters->getCLMem(),
+		_leafPairsArray->getCLMem(),leafCellsCapacity,leafPairsCapacity);
+	if (Success != launchKernel(*_scatterAppendedLeafPairsKernel,pairsEnd - _pairsTail,err))
+		return Error;
+
+	//Clear the flags for next update
+	SET_KERNEL_ARGS((*_releaseAffectedCellsKernel),_affectedCells->getCLMem(),_updateCounts->getCLMem(),_affectedFlags->getCLMem());
+	if (Success != launchKernel(*_releaseAffectedCellsKernel,affectedCount,err))
+		return Error;
+	SET_KERNEL_ARGS((*_markChangedTrianglesKernel),_changedTriangles->getCLMem(),changedCount,_changedFlags->getCLMem(),(CL_UINT)0);
+	if (Success != launchKernel(*_markChangedTrianglesKernel,changedCount,err))
+		return Error;
+
+	if (Success != _context.enqueueReadBuffer(_updateCounts->getCLMem(),counts,sizeof(counts),err))
+		return Error;
+	if (counts[UPDATE_OVERFLOW])
+		return construct(err);
+	_pairsTail = counts[UPDATE_PAIRS_TAIL];
+	_leafCellsTail = counts[UPDATE_LEAF_CELLS_TAIL];
+	_leafPairsTail = counts[UPDATE_LEAF_PAIRS_TAIL];
+
+	//Occupancy of the cells has changed
+	return computeProximity(err);
+}
+
+/**Builds the grid - Pairs are binned by counting sort over cell indices: Pairs are counted per cell, prefix sum
+* of the counts gives cell ranges, and the pairs are scattered into the ranges. First for top level, then for leaf cells.
+* @param exactSizes If true, each count is read back and the arrays are allocated exactly. Otherwise, arrays are allocated
+*                   from capacities, the counts stay on device, and the kernels are not waited for
+* @param err Error info
+* @return Result of the operation: Success or failure
+*/
+Result TwoLevelGridManager::buildGrid(bool exactSizes,Common::Errata& err)
+{
+	if (!exactSizes)
+	{
+		//Allocating all arrays upfront, so the build needs no readbacks
+		if (Success != allocateGridArray(_pairsArray,_pairsCapacity,sizeof(CL_UINT2),err))
 			return Error;
-		if (Success != _context.flushQueue(err))
+		if (Success != allocateGridArray(_leafPairsArray,_leafPairsCapacity,sizeof(CL_UINT),err))
 			return Error;
-		if (Success != evt.wait(err))
+		if (Success != allocateGridArray(_leafCellRangesArray,_leafCellsCapacity + 2,sizeof(CL_UINT),err))
 			return Error;
-
 	}
 
-	//Prefix sum to find out how many total leaf cells do we have
+	//Count pairs per top level cell
+	SET_KERNEL_ARGS((*_countCellPairsKernel),_scene.getDeviceSceneData(),_deviceTopLevelGrid->getCLMem(),_counters->getCLMem(),(CL_UINT)_exactTopLevelOverlap);
+	if (Success != launchKernel(*_countCellPairsKernel,_numPrimitives,err))
+		return Error;
+
 	//Calculate the prefix sum
 	if (Success != _prefixSumCalculator->computePrefixSum(_counters->getCLMem(),_prefixSumOutput->getCLMem(),_cellsCountPowOfTwo,err))
 		return Error;
 
-	//Get the leaf cells count
-	if (Success != _context.enqueueReadBuffer(_prefixSumOutput->getCLMem(),&_leafCellsCount,(_cellsCount-1) * sizeof(CL_UINT),sizeof(CL_UINT),err))
+	if (Success != storeBuildCount(_cellsCount - 1,BUILD_COUNT_PAIRS,err))
 		return Error;
-
 	
-	//Fill the top level cells data - The beginning of leaf range
+	//Reallocating pairs array - Exactly as many pairs as counted
+	if (exactSizes)
 	{
-		SET_KERNEL_ARGS((*_updateTopLevelCellsWithLeafRangeKernel),_topLevelCellsArray->getCLMem(),_prefixSumOutput->getCLMem(),_cellsCount);
+		if (Success != readBuildCounts(err))
+			return Error;
+		_pairsCapacity = _pairsCount;
+		if (Success != allocateGridArray(_pairsArray,_pairsCapacity,sizeof(CL_UINT2),err))
+			return Error;
+	}
 
-		CLKernelWorkDimension globalDim(1,closestMultipleTo(_cellsCount,_wavefront));
-		CLKernelWorkDimension localDim(1,_wavefront);
-		CLKernelExecuteParams updateTopLevelCellsWithLeafRangeKernelExecParams(&globalDim,&localDim,&evt);
+	//Writing cell Ranges
+	SET_KERNEL_ARGS((*_writeCellRangesKernel),_counters->getCLMem(),_prefixSumOutput->getCLMem(),_cellRangesArray->getCLMem(),_cellsCount,_pairsCapacity);
+	if (Success != launchKernel(*_writeCellRangesKernel,_cellsCount + 1,err))
+		return Error;
 
-		//Call the updating kernel
-		if(Success != _context.enqueueKernel(*_updateTopLevelCellsWithLeafRangeKernel,updateTopLevelCellsWithLeafRangeKernelExecParams,err))
-			return Error;
-		if (Success != _context.flushQueue(err))
+	//Scattering the pairs into cell ranges
+	SET_KERNEL_ARGS((*_scatterCellPairsKernel),_scene.getDeviceSceneData(),_deviceTopLevelGrid->getCLMem(),
+		_prefixSumOutput->getCLMem(),
+		_counters->getCLMem(),
+		_pairsArray->getCLMem(),
+		_pairsCapacity,
+		(CL_UINT)_exactTopLevelOverlap);
+	if (Success != launchKernel(*_scatterCellPairsKernel,_numPrimitives,err))
+		return Error;
+
+	//Fill the top level cells data - Resolution and range, count leaf cells
+	//The counts are written over the pair offsets, which are no longer needed, and scanned in place - Counters stay
+	//zeroed by the scatter for binning of leaf pairs
+	SET_KERNEL_ARGS((*_countLeafCellsKernel),_cellRangesArray->getCLMem(),_prefixSumOutput->getCLMem(),
+		_topLevelCellsArray->getCLMem(),_cellsCount,_deviceTopLevelGrid->getCLMem(),
+		_scene.getDeviceSceneData(),_pairsArray->getCLMem(),_buildCounts->getCLMem(),
+		(CL_UINT)_adaptiveLeafResolution,_leafCellsBudget);
+	if (Success != launchKernel(*_countLeafCellsKernel,_cellsCount,err))
+		return Error;
+
+	//Prefix sum to find out how many total leaf cells do we have
+	//Calculate the prefix sum - Only the counts of the cells were written
+	if (Success != _prefixSumCalculator->computePrefixSum(_prefixSumOutput->getCLMem(),_prefixSumOutput->getCLMem(),_cellsCount,err))
+		return Error;
+
+	//Get the leaf cells count
+	if (Success != storeBuildCount(_cellsCount - 1,BUILD_COUNT_LEAF_CELLS,err))
+		return Error;
+
+	//Allocating leaf cell ranges array - Beginning of range per leaf, and the ends of the last leaf and of the empty leaf past it
+	if (exactSizes)
+	{
+		if (Success != readBuildCounts(err))
 			return Error;
-		if (Success != evt.wait(err))
+		_leafCellsCapacity = _leafCellsCount;
+		if (Success != allocateGridArray(_leafCellRangesArray,_leafCellsCapacity + 2,sizeof(CL_UINT),err))
 			return Error;
 	}
+	
+	//Fill the top level cells data - The beginning of leaf range
+	SET_KERNEL_ARGS((*_updateTopLevelCellsWithLeafRangeKernel),_topLevelCellsArray->getCLMem(),_prefixSumOutput->getCLMem(),_cellsCount,_leafCellsCapacity);
+	if (Success != launchKernel(*_updateTopLevelCellsWithLeafRangeKernel,_cellsCount,err))
+		return Error;
 
+	//Leaf pairs are binned by counting sort over leaf cell indices, as top level pairs
 	//Count leaf pairs
 	{
-		//Reallocate array of counters if necessary
-		CL_ULONG requiredCounterArraySize = _pairsCountPowOfTwo * sizeof(CL_UINT);
+		//Reallocate array of counters if necessary - Counter per leaf cell
+		_leafCellsCountPowOfTwo = largestPowerOfTwo(_leafCellsCapacity) << 1;
+		CL_ULONG requiredCounterArraySize = max(_leafCellsCountPowOfTwo,_cellsCountPowOfTwo) * sizeof(CL_UINT);
 		
-		_counters->resize(requiredCounterArraySize);
-		_prefixSumOutput->resize(requiredCounterArraySize);
-		
-		SET_KERNEL_ARGS((*_prepareLeafDataKernel),_scene.getDeviceSceneData(),_pairsArray->getCLMem(),_pairsCount,_deviceTopLevelGrid->getCLMem(),_topLevelCellsArray->getCLMem(),_counters->getCLMem());
-		CL_UINT workSize = _pairsCountPowOfTwo;
-		CLKernelWorkDimension globalDim(1,workSize);
-		CLKernelWorkDimension localDim(1,_wavefront);
-		CLKernelExecuteParams prepareLeafDataKernelExecParams(&globalDim,&localDim,&evt);
-
-		//Call the counting kernel
-		if(Success != _context.enqueueKernel(*_prepareLeafDataKernel,prepareLeafDataKernelExecParams,err))
-			return Error;
-		if (Success != _context.flushQueue(err))
+		if (Success != reserveZeroedBuffer(_counters,requiredCounterArraySize,err))
 			return Error;
-		if (Success != evt.wait(err))
+		reserveBuffer(_prefixSumOutput,requiredCounterArraySize);
+		
+		SET_KERNEL_ARGS((*_countLeafPairsKernel),_scene.getDeviceSceneData(),_pairsArray->getCLMem(),_pairsCapacity,_deviceTopLevelGrid->getCLMem(),
+			_topLevelCellsArray->getCLMem(),_counters->getCLMem(),_buildCounts->getCLMem(),_leafCellsCapacity);
+		if (Success != launchKernel(*_countLeafPairsKernel,_pairsCapacity,err))
 			return Error;
 		
 		//And, do the prefix sum to calculate the amount of leaf pairs
-		if (Success != _prefixSumCalculator->computePrefixSum(_counters->getCLMem(),_prefixSumOutput->getCLMem(),workSize,err))
+		if (Success != _prefixSumCalculator->computePrefixSum(_counters->getCLMem(),_prefixSumOutput->getCLMem(),_leafCellsCountPowOfTwo,err))
 			return Error;
 
 		//Fill the leaf pairs count
-		if (Success != _context.enqueueReadBuffer(_prefixSumOutput->getCLMem(),&_leafPairsCount,_prefixSumOutput->getSize() - sizeof(CL_UINT),sizeof(CL_UINT),err))
+		if (Success != storeBuildCount(max(_leafCellsCapacity,1) - 1,BUILD_COUNT_LEAF_PAIRS,err))
 			return Error;
 	}
 
-	//Allocate Leaf Pairs
-	_leafPairsCountPowOfTwo = largestPowerOfTwo(_leafPairsCount) << 1;
-
-	//Allocating pairs array accordingly
-	size_t leafPairsArraySize = _leafPairsCountPowOfTwo * sizeof(CL_UINT2); 
-	if (_leafPairsArray)
-		_leafPairsArray->resize(leafPairsArraySize);
-	else
-		_leafPairsArray.reset(new CLBuffer(_context,leafPairsArraySize,CLBufferFlags::CLBufferAccess::ReadWrite));
-	
+	//Allocating leaf pairs array - Exactly as many pairs as counted
+	if (exactSizes)
 	{
-		CL_UINT2 pattern;
-		pattern.x = pattern.y = UINT_MAX;
-		if (Success != _context.enqueueFillBuffer(_leafPairsArray->getCLMem(),&pattern,_leafPairsArray->getActualSize(),sizeof(CL_UINT2),err))
+		if (Success != readBuildCounts(err))
+			return Error;
+		_leafPairsCapacity = _leafPairsCount;
+		if (Success != allocateGridArray(_leafPairsArray,_leafPairsCapacity,sizeof(CL_UINT),err))
 			return Error;
 	}
+
+	//Write Leaf Ranges
+	SET_KERNEL_ARGS((*_writeLeafRangesKernel),_prefixSumOutput->getCLMem(),_leafCellRangesArray->getCLMem(),_leafCellsCapacity,_leafPairsCapacity);
+	if (Success != launchKernel(*_writeLeafRangesKernel,_leafCellsCapacity + 2,err))
+		return Error;
 	
-	//write leaf pairs
+	//Scatter leaf pairs into leaf cell ranges
+	SET_KERNEL_ARGS((*_scatterLeafPairsKernel),_scene.getDeviceSceneData(),_pairsArray->getCLMem(),_topLevelCellsArray->getCLMem(),_deviceTopLevelGrid->getCLMem(),
+		_prefixSumOutput->getCLMem(),_counters->getCLMem(),_leafPairsArray->getCLMem(),_pairsCapacity,_buildCounts->getCLMem(),_leafCellsCapacity,_leafPairsCapacity);
+	if (Success != launchKernel(*_scatterLeafPairsKernel,_pairsCapacity,err))
+		return Error;
+
+	return computeProximity(err);
+}
+
+/**Calculates proximities of empty top level cells, for empty space skipping in traversal - Proximity is calculated
+* along X, Y and Z axes in turn, and stored in the cells by the last pass
+* @param err Error info
+* @return Result of the operation: Success or failure
+*/
+Result TwoLevelGridManager::computeProximity(Common::Errata& err)
+{
+	reserveBuffer(_proximityScratch[0],_cellsCount * sizeof(CL_UINT));
+	reserveBuffer(_proximityScratch[1],_cellsCount * sizeof(CL_UINT));
+	for (CL_UINT axis = iX; axis <= iZ; axis++)
 	{
-		SET_KERNEL_ARGS((*_writeLeafPairsKernel),_scene.getDeviceSceneData(),_pairsArray->getCLMem(),_topLevelCellsArray->getCLMem(),_deviceTopLevelGrid->getCLMem(),_prefixSumOutput->getCLMem(),_counters->getCLMem(),_leafPairsArray->getCLMem(),_pairsCount);
-		CLKernelWorkDimension globalDim(1,closestMultipleTo(_pairsCount,_wavefront));
-		CLKernelWorkDimension localDim(1,_wavefront);
-		CLKernelExecuteParams writeLeafPairsKernelExecParams(&globalDim,&localDim,&evt);
-		
-		//Call the write leaf pairs kernel
-		if(Success != _context.enqueueKernel(*_writeLeafPairsKernel,writeLeafPairsKernelExecParams,err))
-			return Error;
-		if (Success != _context.flushQueue(err))
-			return Error;
-		if (Success != evt.wait(err))
+		SET_KERNEL_ARGS((*_computeProximityKernel),_topLevelCellsArray->getCLMem(),_proximityScratch[(axis + 1) % 2]->getCLMem(),
+			_proximityScratch[axis % 2]->getCLMem(),_deviceTopLevelGrid->getCLMem(),_cellsCount,axis);
+		if (Success != launchKernel(*_computeProximityKernel,_cellsCount,err))
 			return Error;
 	}
+	return Success;
+}
+
+/**Launches grid construction kernel with a work item per element. Unless the construction is readback-free,
+* waits for the kernel to complete.
+* @param kernel The kernel to launch - Its arguments must be already set
+* @param workItems Number of elements to process
+* @param err Error info
+* @return Result of the operation: Success or failure
+*/
+Result TwoLevelGridManager::launchKernel(CLKernel& kernel, CL_UINT workItems, Common::Errata& err)
+{
+	if (0 == workItems)
+		return Success;
+
+	CLEvent evt;
+	CLKernelWorkDimension globalDim(1,closestMultipleTo(workItems,_wavefront));
+	CLKernelWorkDimension localDim(1,_wavefront);
+	CLKernelExecuteParams kernelExecParams(&globalDim,&localDim,&evt);
+
+	if(Success != _context.enqueueKernel(kernel,kernelExecParams,err))
+		return Error;
+	if (Success != _context.flushQueue(err))
+		return Error;
+	if (_readbackFreeConstruction)
+		return Success;
+	return evt.wait(err);
+}
 
-	//Sorting the leaf pairs
-	if (Success != _bitonicSorter->sort(_leafPairsArray->getCLMem(),_leafPairsCountPowOfTwo,err))
+/**Stores a count on device, from the last element of inclusive prefix sum - See BUILD_COUNT_PAIRS etc.
+* @param lastIdx Index of the last element of prefix sum
+* @param countIdx Index of the count to store
+* @param err Error info
+* @return Result of the operation: Success or failure
+*/
+Result TwoLevelGridManager::storeBuildCount(CL_UINT lastIdx, CL_UINT countIdx, Common::Errata& err)
+{
+	SET_KERNEL_ARGS((*_storeBuildCountKernel),_prefixSumOutput->getCLMem(),lastIdx,_buildCounts->getCLMem(),countIdx);
+	return launchKernel(*_storeBuildCountKernel,1,err);
+}
+
+/**Reads the counts calculated on device during construction - Blocks until construction commands are complete
+* @param err Error info
+* @return Result of the operation: Success or failure
+*/
+Result TwoLevelGridManager::readBuildCounts(Common::Errata& err)
+{
+	CL_UINT counts[BUILD_COUNTS];
+	if (Success != _context.enqueueReadBuffer(_buildCounts->getCLMem(),counts,sizeof(counts),err))
 		return Error;
+	_pairsCount = counts[BUILD_COUNT_PAIRS];
+	_leafCellsCount = counts[BUILD_COUNT_LEAF_CELLS];
+	_leafPairsCount = counts[BUILD_COUNT_LEAF_PAIRS];
+	return Success;
+}
 
-	//Allocating leaf cell ranges array
-	if (_leafCellRangesArray)
-		_leafCellRangesArray->resize(sizeof(CL_UINT2) * _leafCellsCount);
+/**Allocates array of the grid, growing the buffer if needed
+* @param buffer The buffer to allocate
+* @param elements Number of elements
+* @param elementSize Size of element in bytes
+* @param err Error info
+* @return Result of the operation: Success or failure
+*/
+Result TwoLevelGridManager::allocateGridArray(boost::shared_ptr<CLBuffer>& buffer, CL_UINT elements, size_t elementSize, Common::Errata& err)
+{
+	size_t size = max(elements,1) * elementSize;
+	if (_incrementalUpdates)
+		size += (size_t)(size * INCREMENTAL_UPDATE_SLACK);
+	reserveBuffer(buffer,size);
+	return Success;
+}
+
+/**Allocates read-write buffer on first use, and grows it afterwards - Memory is never released between frames
+* @param buffer The buffer to allocate
+* @param size Required size in bytes
+*/
+void TwoLevelGridManager::reserveBuffer(boost::shared_ptr<CLBuffer>& buffer, size_t size)
+{
+	if (buffer)
+		buffer->resize(size);
 	else
-		_leafCellRangesArray.reset(new CLBuffer(_context,sizeof(CL_UINT2) * _leafCellsCount,CLBufferFlags::CLBufferAccess::ReadWrite));
+		buffer.reset(new CLBuffer(_context,size,CLBufferFlags::CLBufferAccess::ReadWrite));
+}
 
-	//Extract Leaf Ranges
-	{
-		SET_KERNEL_ARGS((*_extractLeafCellsKernel),_leafPairsArray->getCLMem(),_leafPairsCount,_leafCellRangesArray->getCLMem());
-		CL_UINT availableLocalArraySize = _deviceLocalMemory / sizeof(CL_UINT2);
-		CL_UINT requiredLocalArraySize = (_wavefront + 1) * sizeof(CL_UINT2);
-		if (requiredLocalArraySize > availableLocalArraySize)
-		{
-			FILL_ERRATA(err,"Not enough local memory on device!");
-			return Error;
-		}
-		CLKernelArgument localBufferArg(((CL_UINT)requiredLocalArraySize));
-		//CLKernelArgument workingBlockArg = _wavefront;
-		if (Success != _extractLeafCellsKernel->setKernelArgument(localBufferArg,3,err))
-			return Error;
-		
-		CLKernelWorkDimension globalDim(1,closestMultipleTo(_leafPairsCount,_wavefront));
-		CLKernelWorkDimension localDim(1,_wavefront);
-		CLKernelExecuteParams extractLeafCellsKernelExecParams(&globalDim,&localDim,&evt);
+/**Allocates read-write buffer on first use, and grows it afterwards, as reserveBuffer - Newly allocated memory is
+* zeroed, and memory that is reused is left as is
+* @param buffer The buffer to allocate
+* @param size Required size in bytes
+* @param err Error info
+* @return Result of the operation: Success or failure
+*/
+Result TwoLevelGridManager::reserveZeroedBuffer(boost::shared_ptr<CLBuffer>& buffer, size_t size, Common::Errata& err)
+{
+	bool allocates = !buffer || size > buffer->getActualSize();
+	reserveBuffer(buffer,size);
+	if (!allocates)
+		return Success;
 
-		//Call the write pairs kernel
-		if(Success != _context.enqueueKernel(*_extractLeafCellsKernel,extractLeafCellsKernelExecParams,err))
-			return Error;
-		if (Success != _context.flushQueue(err))
-			return Error;
-		if (Success != evt.wait(err))
-			return Error;
-	}
+	CL_UINT pattern = 0;
+	return _context.enqueueFillBuffer(buffer->getCLMem(),&pattern,buffer->getActualSize(),sizeof(CL_UINT),err);
+}
 
-	return Success;
+/**Checks whether counts of the last build fit into capacities it was built with
+* @return True if the counts fit
+*/
+bool TwoLevelGridManager::capacitiesSuffice() const
+{
+	return _pairsCount <= _pairsCapacity && _leafCellsCount <= _leafCellsCapacity && _leafPairsCount <= _leafPairsCapacity;
+}
+
+/**Sets capacities for readback-free construction from the counts of the last build, with headroom for scene changes*/
+void TwoLevelGridManager::growCapacities()
+{
+	_pairsCapacity = max(_pairsCapacity,(CL_UINT)(_pairsCount * READBACK_FREE_CAPACITY_HEADROOM) + 1);
+	_leafCellsCapacity = max(_leafCellsCapacity,(CL_UINT)(_leafCellsCount * READBACK_FREE_CAPACITY_HEADROOM) + 1);
+	_leafPairsCapacity = max(_leafPairsCapacity,(CL_UINT)(_leafPairsCount * READBACK_FREE_CAPACITY_HEADROOM) + 1);
 }
 
 /**Generates hit data for viewing rays, from the constructed Two-Level Grid
@@ -491,7 +1044,7 @@ Result TwoLevelGridManager::generateContacts(Camera& cam,Common::Errata& err)
 
 	CLEvent evt;
 
-	cl_uint totalWorkItems = closestMultipleTo(resolution,_wavefront);
+	cl_uint totalWorkItems = closestMultipleTo(tiledPixelCount(cam.resX,cam.resY),_wavefront);
 	cl_uint workGroup = _wavefront; 
 	CLKernelWorkDimension globalDim(1,totalWorkItems);
 	CLKernelWorkDimension localDim(1,workGroup);
@@ -522,6 +1075,90 @@ Result TwoLevelGridManager::generateContacts(Camera& cam,Common::Errata& err)
 * @return Result of the operation: Success or failure
 */
 Result TwoLevelGridManager::generateContacts(CLBuffer& rays,CLBuffer& contacts, const unsigned int rayCount, Errata& err)
+{
+	if (!_reorderRays)
+		return traceRays(rays,contacts,rayCount,err);
+	//Nothing to reorder or trace in empty batch
+	if (0 == rayCount)
+		return Success;
+
+	//Tracing the rays in coherent order, then restoring the order of the contacts
+	if (Success != _raySorter->reorder(rays.getCLMem(),rayCount,_scene.getDeviceSceneData(),err))
+		return Error;
+
+	size_t contactBufSize = rayCount * sizeof(struct Contact);
+	if (_sortedContactsArray)
+		_sortedContactsArray->resize(contactBufSize);
+	else
+		_sortedContactsArray.reset(new CLBuffer(_context,contactBufSize,CLBufferFlags::ReadWrite));
+
+	if (Success != traceRays(*_raySorter->getSortedRays(),*_sortedContactsArray,rayCount,err))
+		return Error;
+
+	return _raySorter->restoreOrder(_sortedContactsArray->getCLMem(),contacts.getCLMem(),rayCount,err);
+}
+
+/**Generates contacts for the active rays of index list, and fills their entries of the contacts array
+* @param rays The rays - A device memory buffer object that contains rays as struct Ray
+* @param activeRays Device buffer of CL_UINT indices of the rays to trace, e.g. as compacted by StreamCompaction
+* @param activeRayCount Device buffer of single CL_UINT - The number of indices in activeRays
+* @param contact The target device memory - For each traced ray rays[i] the buffer will contain its contact
+*                as contacts[i]. Contacts of the other rays are not modified
+* @param maxActiveRays Upper bound of the number of active rays, by which the work items are launched
+* @param err Error info
+* @return Result of the operation: Success or failure
+*/
+Result TwoLevelGridManager::generateContacts(CLBuffer& rays,CLBuffer& activeRays,CLBuffer& activeRayCount,CLBuffer& contacts, const unsigned int maxActiveRays, Errata& err)
+{
+	if (maxActiveRays == 0)
+		return Success;
+
+	try
+	{
+		SET_KERNEL_ARGS((*_generateContactsIndexedKernel),rays.getCLMem(),
+												   activeRays.getCLMem(),
+												   activeRayCount.getCLMem(),
+												   _scene.getDeviceSceneData(),
+												   _deviceTopLevelGrid->getCLMem(),
+												   _topLevelCellsArray->getCLMem(),
+												   _leafCellRangesArray->getCLMem(),
+												   _leafPairsArray->getCLMem(),
+												   contacts.getCLMem());
+	}
+	catch (CLInterfaceException e)
+	{
+		err = Errata(e);
+		return Error;
+	}
+
+	CLEvent evt;
+	cl_uint totalWorkItems = closestMultipleTo(maxActiveRays,_wavefront);
+	CLKernelWorkDimension globalDim(1,totalWorkItems);
+	CLKernelWorkDimension localDim(1,_wavefront);
+	CLKernelExecuteParams contactsKernelExecParams(&globalDim,&localDim,&evt);
+
+	//Execute kernel
+	if (Success != _context.enqueueKernel((*_generateContactsIndexedKernel),contactsKernelExecParams,err))
+		return Error;
+
+	//Flush and make sure that calculation is over before returning control
+	if (Success != _context.flushQueue(err))
+		return Error;
+
+	if (Success != evt.wait(err))
+		return Error;
+
+	return Success;
+}
+
+/**Traces the rays in the order they are stored, and fills the contacts array - See generateContacts
+* @param rays The rays to be traced - A device memory buffer object that contains rays as struct Ray
+* @param contact The target device memory that will contain the result
+* @param rayCount The number of rays to trace
+* @param err Error info
+* @return Result of the operation: Success or failure
+*/
+Result TwoLevelGridManager::traceRays(CLBuffer& rays,CLBuffer& contacts, const unsigned int rayCount, Errata& err)
 {
 
 SET_KERNEL_ARGS((*_generateContacts2Kernel),rays.getCLMem(),
@@ -572,8 +1209,9 @@ CL_UINT3 TwoLevelGridManager::getResolution() const
 	float volume = boxVolume(bounds);
 	float prims = SCENE_HEADER(_scene.getHostSceneData())->totalNumberOfTriangles;
 	float a = pow(_topLevelDensity * prims / volume,oneThird);
+	//At least one cell along each axis, as thin axes of flat scenes get less than a cell at low densities
 	CL_UINT3 result;
-	fillVector3(result,deltaX * a,deltaY * a, deltaZ * a);
+	fillVector3(result,max((CL_UINT)(deltaX * a),1u),max((CL_UINT)(deltaY * a),1u),max((CL_UINT)(deltaZ * a),1u));
 	return result;
 }
 
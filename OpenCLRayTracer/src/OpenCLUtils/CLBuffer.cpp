@@ -69,13 +69,8 @@ CLBuffer::CLBuffer(const CLExecutionContext& context,size_t size,void* source,CL
 */
 void CLBuffer::resize(size_t newSize)
 {
-	if (newSize < _size)
-	{
-		_size = newSize;
-		return;
-	}
-
-	if (newSize > _size && newSize < _actualSize)
+	//Already allocated memory is reused for any size that fits
+	if (newSize <= _actualSize && _actualSize > 0)
 	{
 		_size = newSize;
 		return;